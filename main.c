@@ -1,15 +1,67 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "tftp_client.h"
 #include "tftp_server.h"
 
 // get
-// put 
+// put
 // block
 // quit
 
-int main(void)
+#define CMD_BLOCK_SIZE 1428 // 以太网上不分片的最大块
+
+// 命令行上直接传一个文件，本地名为"-"时可以接管道:
+//   tftp ip get filename [local|-]
+//   tftp ip put local|- [filename]
+// 环境变量TFTP_CACHE指定缓存目录时，服务器上没变的文件从缓存里取；TFTP_RESUME=1时从上次留下的部分文件继续；
+// TFTP_WINDOW=n时协商私有的aimdwindow选项按窗口发送，只有本项目的tftpd认识，默认关
+static int run_once(int argc, char** argv)
 {
+    const char* ip = argv[1];
+    const char* cmd = argv[2];
+    const char* cache = getenv("TFTP_CACHE");
+    const char* resume = getenv("TFTP_RESUME");
+    const char* window = getenv("TFTP_WINDOW");
+    int option = TFTP_OPT_BASE;
+    if (cache && cache[0])
+    {
+        tftp_set_cache_dir(cache);
+        option |= TFTP_OPT_CACHED;
+    }
+    if (resume && (strcmp(resume, "1") == 0))
+    {
+        option |= TFTP_OPT_RESUME;
+    }
+    if (window && (atoi(window) > 1))
+    {
+        tftp_set_window(atoi(window));
+        option |= TFTP_OPT_WINDOW;
+    }
+    if (strcmp(cmd, "get") == 0)
+    {
+        const char* local = (argc > 4) ? argv[4] : argv[3];
+        return tftp_get_file(ip, TFTP_DEFAULT_PORT, CMD_BLOCK_SIZE, argv[3], local, option) < 0;
+    }
+
+    if ((strcmp(cmd, "put") == 0) && ((argc > 4) || strcmp(argv[3], TFTP_STREAM_NAME)))
+    {
+        const char* filename = (argc > 4) ? argv[4] : argv[3];
+        return tftp_put_file(ip, TFTP_DEFAULT_PORT, CMD_BLOCK_SIZE, filename, argv[3], option) < 0;
+    }
+
+    fprintf(stderr, "usage: tftp ip get filename [local|-]\n       tftp ip put local|- [filename]\n");
+    return 2;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc >= 4)
+    {
+        return run_once(argc, argv);
+    }
+
     printf("(to) ");
     char ip[16] = { 0 };
     scanf("%15s", ip);
@@ -0,0 +1,266 @@
+#include "tftp_arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define ARENA_LINE 64
+#define ARENA_TABLE_SIZE (TFTP_ARENA_MAX_CHUNKS * 2)
+#define ARENA_SHIFT 21 // log2(TFTP_ARENA_CHUNK)
+
+typedef struct _arena_object_t
+{
+    struct _arena_object_t* next;
+}arena_object_t;
+
+// 每个节点每档一个空闲链表，新块从top开始切
+typedef struct _arena_node_t
+{
+    pthread_mutex_t lock;
+    arena_object_t* free_list[TFTP_ARENA_CLASSES];
+    uint8_t* top[TFTP_ARENA_CLASSES];
+    uint8_t* end[TFTP_ARENA_CLASSES];
+    int chunks;
+}arena_node_t;
+
+static arena_node_t arena_nodes[TFTP_ARENA_NODES];
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER; // 新块和块表
+static int arena_enabled;
+static int arena_chunks;
+// 块地址>>ARENA_SHIFT的开放地址哈希，值里是节点和档；只增不减，查的时候不加锁
+static uint64_t arena_table[ARENA_TABLE_SIZE];
+static tftp_arena_stats_t arena_stats;
+
+static void arena_init(void)
+{
+    for (int i = 0; i < TFTP_ARENA_NODES; i++)
+    {
+        pthread_mutex_init(&arena_nodes[i].lock, NULL);
+    }
+}
+
+// 当前CPU所在的节点，取不到时为0
+static int arena_node(void)
+{
+    unsigned cpu = 0;
+    unsigned node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0)
+    {
+        return 0;
+    }
+    return (int)(node % TFTP_ARENA_NODES);
+}
+
+// 2^shift的5/4, 6/4, 7/4, 8/4四档，再按缓存行对齐
+static int arena_class(size_t size)
+{
+    size_t s = (size <= ARENA_LINE) ? ARENA_LINE : size - 1;
+    int shift = 63 - __builtin_clzll(s);
+    int index = (shift - 6) * 4 + (int)((s >> (shift - 2)) & 3);
+    return (index < TFTP_ARENA_CLASSES) ? index : -1;
+}
+
+static size_t arena_class_size(int index)
+{
+    int shift = 6 + index / 4;
+    size_t size = (size_t)(5 + index % 4) << (shift - 2);
+    return (size + ARENA_LINE - 1) & ~(size_t)(ARENA_LINE - 1);
+}
+
+static uint32_t arena_hash(uint64_t key)
+{
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 40) % ARENA_TABLE_SIZE;
+}
+
+// 表项：高位是块号+1，低16位是节点和档
+static int arena_lookup(const void* ptr, int* node, int* index)
+{
+    uint64_t key = ((uintptr_t)ptr >> ARENA_SHIFT) + 1;
+    for (uint32_t slot = arena_hash(key); ; slot = (slot + 1) % ARENA_TABLE_SIZE)
+    {
+        uint64_t entry = __atomic_load_n(&arena_table[slot], __ATOMIC_ACQUIRE);
+        if (entry == 0)
+        {
+            return -1;
+        }
+        else if ((entry >> 16) == key)
+        {
+            *node = (int)((entry >> 8) & 0xFF);
+            *index = (int)(entry & 0xFF);
+            return 0;
+        }
+    }
+}
+
+static void arena_insert(uint8_t* chunk, int node, int index)
+{
+    uint64_t key = ((uintptr_t)chunk >> ARENA_SHIFT) + 1;
+    uint32_t slot = arena_hash(key);
+    while (arena_table[slot])
+    {
+        slot = (slot + 1) % ARENA_TABLE_SIZE;
+    }
+    __atomic_store_n(&arena_table[slot], (key << 16) | ((uint64_t)node << 8) | (uint64_t)index, __ATOMIC_RELEASE);
+}
+
+// 先要预留的大页，没有时多映射一块再截出按2M对齐的部分，让透明大页能用上
+static uint8_t* arena_map(int* huge)
+{
+    void* map = mmap(NULL, TFTP_ARENA_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (map != MAP_FAILED)
+    {
+        *huge = 1;
+        memset(map, 0, TFTP_ARENA_CHUNK);
+        return (uint8_t*)map;
+    }
+
+    *huge = 0;
+    map = mmap(NULL, TFTP_ARENA_CHUNK * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    uint8_t* start = (uint8_t*)map;
+    uint8_t* chunk = (uint8_t*)(((uintptr_t)start + TFTP_ARENA_CHUNK - 1) & ~(uintptr_t)(TFTP_ARENA_CHUNK - 1));
+    if (chunk > start)
+    {
+        munmap(start, (size_t)(chunk - start));
+    }
+    munmap(chunk + TFTP_ARENA_CHUNK, (size_t)(start + TFTP_ARENA_CHUNK * 2 - (chunk + TFTP_ARENA_CHUNK)));
+    madvise(chunk, TFTP_ARENA_CHUNK, MADV_HUGEPAGE);
+
+    // 在分配的线程里写一遍，按首次访问的策略落在这个线程所在的节点上
+    memset(chunk, 0, TFTP_ARENA_CHUNK);
+    return chunk;
+}
+
+static int arena_grow(arena_node_t* arena, int node, int index)
+{
+    pthread_mutex_lock(&arena_lock);
+    if (arena_chunks >= TFTP_ARENA_MAX_CHUNKS)
+    {
+        pthread_mutex_unlock(&arena_lock);
+        return -1;
+    }
+
+    int huge;
+    uint8_t* chunk = arena_map(&huge);
+    if (chunk == NULL)
+    {
+        pthread_mutex_unlock(&arena_lock);
+        return -1;
+    }
+
+    arena_insert(chunk, node, index);
+    arena_chunks++;
+    arena_stats.mapped += TFTP_ARENA_CHUNK;
+    arena_stats.huge += huge ? TFTP_ARENA_CHUNK : 0;
+    arena_stats.nodes += (arena->chunks++ == 0);
+    pthread_mutex_unlock(&arena_lock);
+
+    arena->top[index] = chunk;
+    arena->end[index] = chunk + TFTP_ARENA_CHUNK;
+    return 0;
+}
+
+static void arena_account(int64_t size)
+{
+    uint64_t used = __atomic_add_fetch(&arena_stats.used, (uint64_t)size, __ATOMIC_RELAXED);
+    uint64_t peak = __atomic_load_n(&arena_stats.peak, __ATOMIC_RELAXED);
+    while ((used > peak) && !__atomic_compare_exchange_n(&arena_stats.peak, &peak, used, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+void tftp_arena_enable(int enable)
+{
+    pthread_once(&arena_once, arena_init);
+    __atomic_store_n(&arena_enabled, enable, __ATOMIC_RELAXED);
+}
+
+void* tftp_arena_alloc(size_t size)
+{
+    int index = arena_class(size);
+    if (!__atomic_load_n(&arena_enabled, __ATOMIC_RELAXED) || (index < 0))
+    {
+        __atomic_add_fetch(&arena_stats.fallbacks, 1, __ATOMIC_RELAXED);
+        return malloc(size);
+    }
+
+    size_t class_size = arena_class_size(index);
+    int node = arena_node();
+    arena_node_t* arena = &arena_nodes[node];
+    pthread_mutex_lock(&arena->lock);
+    void* ptr = arena->free_list[index];
+    if (ptr)
+    {
+        arena->free_list[index] = arena->free_list[index]->next;
+    }
+    else if ((arena->end[index] - arena->top[index] >= (ptrdiff_t)class_size) || (arena_grow(arena, node, index) == 0))
+    {
+        ptr = arena->top[index];
+        arena->top[index] += class_size;
+    }
+    pthread_mutex_unlock(&arena->lock);
+
+    if (ptr == NULL)
+    {
+        __atomic_add_fetch(&arena_stats.fallbacks, 1, __ATOMIC_RELAXED);
+        return malloc(size);
+    }
+
+    __atomic_add_fetch(&arena_stats.allocs, 1, __ATOMIC_RELAXED);
+    arena_account((int64_t)class_size);
+    return ptr;
+}
+
+// 还给分配它的节点，别的线程释放时也一样
+void tftp_arena_free(void* ptr)
+{
+    int node;
+    int index;
+    if (ptr == NULL)
+    {
+        return;
+    }
+    else if (arena_lookup(ptr, &node, &index) < 0)
+    {
+        free(ptr);
+        return;
+    }
+
+    arena_node_t* arena = &arena_nodes[node];
+    arena_object_t* object = (arena_object_t*)ptr;
+    pthread_mutex_lock(&arena->lock);
+    object->next = arena->free_list[index];
+    arena->free_list[index] = object;
+    pthread_mutex_unlock(&arena->lock);
+    arena_account(-(int64_t)arena_class_size(index));
+}
+
+void tftp_arena_stats(tftp_arena_stats_t* stats)
+{
+    pthread_mutex_lock(&arena_lock);
+    stats->mapped = arena_stats.mapped;
+    stats->huge = arena_stats.huge;
+    stats->nodes = arena_stats.nodes;
+    pthread_mutex_unlock(&arena_lock);
+    stats->used = __atomic_load_n(&arena_stats.used, __ATOMIC_RELAXED);
+    stats->peak = __atomic_load_n(&arena_stats.peak, __ATOMIC_RELAXED);
+    stats->allocs = __atomic_load_n(&arena_stats.allocs, __ATOMIC_RELAXED);
+    stats->fallbacks = __atomic_load_n(&arena_stats.fallbacks, __ATOMIC_RELAXED);
+}
+
+void tftp_arena_print(const char* name)
+{
+    tftp_arena_stats_t stats;
+    tftp_arena_stats(&stats);
+    printf("%s: arena %llu KB used, %llu KB peak, %llu KB mapped (%llu KB huge pages), %d nodes, %llu allocs, %llu malloc\n",
+        name, (unsigned long long)(stats.used >> 10), (unsigned long long)(stats.peak >> 10), (unsigned long long)(stats.mapped >> 10),
+        (unsigned long long)(stats.huge >> 10), stats.nodes, (unsigned long long)stats.allocs, (unsigned long long)stats.fallbacks);
+}
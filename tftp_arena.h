@@ -0,0 +1,34 @@
+#ifndef TFTP_ARENA_H
+#define TFTP_ARENA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// 会话和窗口缓冲的分配器：2M一块向内核要内存，优先用大页，没有预留大页时用普通页加透明大页
+// 每个NUMA节点一组空闲链表，在哪个节点上的线程分配就从哪个节点的块里取，块在分配线程里第一次写入
+// 对象按缓存行对齐，大小按2的幂的1/4分档；块只增不减，释放的对象留给同一档复用
+#define TFTP_ARENA_CHUNK (2 * 1024 * 1024)
+#define TFTP_ARENA_NODES 8
+#define TFTP_ARENA_CLASSES 56 // 最大1M，再大的直接malloc
+#define TFTP_ARENA_MAX_CHUNKS 4096
+
+typedef struct _tftp_arena_stats_t
+{
+    uint64_t mapped; // 向内核要的字节
+    uint64_t huge; // 其中MAP_HUGETLB拿到的
+    uint64_t used; // 分配出去还没释放的，按档的大小算
+    uint64_t peak;
+    uint64_t allocs;
+    uint64_t fallbacks; // 没开启、太大或者块用完时malloc的次数
+    int nodes; // 有块的节点数
+}tftp_arena_stats_t;
+
+// 关闭时tftp_arena_alloc直接malloc，已经分出去的照常释放
+void tftp_arena_enable(int enable);
+void* tftp_arena_alloc(size_t size);
+// arena和malloc出来的都可以传进来，按所在的块区分
+void tftp_arena_free(void* ptr);
+void tftp_arena_stats(tftp_arena_stats_t* stats);
+void tftp_arena_print(const char* name);
+
+#endif // !TFTP_ARENA_H
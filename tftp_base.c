@@ -1,7 +1,13 @@
 #include "tftp_base.h"
+#include "tftp_zip.h"
+#include "tftp_option.h"
+#include "tftp_crc32c.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
 
 const char* tftp_error_message(uint16_t error_code)
 {
@@ -14,7 +20,9 @@ const char* tftp_error_message(uint16_t error_code)
         "Illegal TFTP operation",
         "Unknown transfer ID",
         "File already exists",
-        "No such user"
+        "No such user",
+        "Option negotiation failed",
+        "Checksum mismatch"
     };
 
     if (error_code >= TFTP_ERROR_END)
@@ -25,32 +33,14 @@ const char* tftp_error_message(uint16_t error_code)
     return msg[error_code];
 }
 
-static char* write_information(tftp_t* tftp, char* buffer, const char* information, int value)
+// 请求到第一个DATA的时间，发送方在发出时记，接收方在收到时记
+static void tftp_first_data(tftp_t* tftp, uint64_t now)
 {
-    // 计算包末端的地址
-    char* buffer_end = ((char*)&tftp->tx_packet) + sizeof(tftp_packet_t);
-    size_t len = strlen(information) + 1; // +1是因为算了'\0'
-    if (buffer + len > buffer_end)
+    if (!tftp->first_data && tftp->start_us)
     {
-        printf("tftp: send buffer too small\n");
-        return NULL;
+        tftp->first_data = 1;
+        tftp_hist_record(tftp->side, TFTP_HIST_FIRST_DATA, now - tftp->start_us);
     }
-    strcpy(buffer, information);
-    buffer += len;
-
-    if (value >= 0)
-    {
-        if (buffer + 16 >= buffer_end)
-        {
-            printf("tftp: send buffer too small\n");
-            return NULL;
-        }
-
-        sprintf(buffer, "%d", value);
-        buffer += strlen(buffer) + 1;
-    }
-
-    return buffer;
 }
 
 int tftp_send_packet(tftp_t* tftp, tftp_packet_t* pkt, int size)
@@ -63,47 +53,93 @@ int tftp_send_packet(tftp_t* tftp, tftp_packet_t* pkt, int size)
     }
 
     tftp->tx_size = size;
+    tftp_trace_packet(tftp->trace, TFTP_TRACE_SEND, pkt, (size_t)size);
+    if (pkt->opcode == htons(TFTP_PACKET_DATA))
+    {
+        tftp->data_us = tftp_time_us();
+        tftp_first_data(tftp, tftp->data_us);
+    }
     return 0;
 }
 
-int tftp_send_request(tftp_t* tftp, int is_read, const char* filename, uint32_t file_size, int option)
+int tftp_build_request(tftp_t* tftp, int is_read, const char* filename, int64_t file_size, int option)
 {
     tftp_packet_t* pkt = &tftp->tx_packet;
+    const char* end = (const char*)pkt + sizeof(tftp_packet_t);
 
     pkt->opcode = htons(is_read ? TFTP_PACKET_RRQ : TFTP_PACKET_WRQ);
-    char* buffer = (char*)pkt->req.args;
-    buffer = write_information(tftp, buffer, filename, -1);
-    if (buffer == NULL)
+    char* buffer = tftp_option_put_string((char*)pkt->req.args, end, filename, strlen(filename));
+    buffer = (option & TFTP_OPT_NETASCII) ? TFTP_OPTION_STRING(buffer, end, "netascii") : TFTP_OPTION_STRING(buffer, end, "octet");
+    if (option & TFTP_OPT_BASE)
     {
-        printf("tftp: filename too long: %s\n", filename);
-        return -1;
+        buffer = TFTP_OPTION_NUMBER(buffer, end, "blksize", tftp->block_size);
+        // 从管道上传时不知道大小，不带tsize
+        if (file_size >= 0)
+        {
+            buffer = TFTP_OPTION_NUMBER(buffer, end, "tsize", file_size);
+        }
+    }
+
+    if (option & TFTP_OPT_RANGE)
+    {
+        buffer = TFTP_OPTION_NUMBER(buffer, end, "offset", tftp->offset);
+        buffer = TFTP_OPTION_NUMBER(buffer, end, "range", tftp->range);
+        if (option & TFTP_OPT_PREFIX)
+        {
+            buffer = TFTP_OPTION_STRING(buffer, end, "prefix");
+            buffer = TFTP_OPTION_STRING(buffer, end, "crc32c");
+        }
+    }
+
+    if (option & TFTP_OPT_CHECKSUM)
+    {
+        buffer = TFTP_OPTION_STRING(buffer, end, "checksum");
+        buffer = TFTP_OPTION_STRING(buffer, end, "crc32c");
+    }
+
+    if (option & TFTP_OPT_COMPRESS)
+    {
+        buffer = TFTP_OPTION_STRING(buffer, end, "compress");
+        buffer = TFTP_OPTION_STRING(buffer, end, "zlib");
+    }
+
+    if (option & TFTP_OPT_WINDOW)
+    {
+        buffer = TFTP_OPTION_NUMBER(buffer, end, "aimdwindow", tftp->window_size);
+    }
+
+    // 没有缓存时只带ifmtime，服务器照常传输，在OACK里带上修改时间
+    if (is_read && (option & TFTP_OPT_CACHED))
+    {
+        if (tftp->cached_size >= 0)
+        {
+            buffer = TFTP_OPTION_NUMBER(buffer, end, "ifsize", tftp->cached_size);
+        }
+        buffer = TFTP_OPTION_NUMBER(buffer, end, "ifmtime", tftp->mtime);
     }
 
-    buffer = write_information(tftp, buffer, "octet", -1);
     if (buffer == NULL)
     {
         // 文件名太长导致选项没有空间了
         printf("tftp: filename too long: %s\n", filename);
         return -1;
     }
+    return (int)(buffer - (char*)pkt);
+}
 
-    if (option)
-    {
-        buffer = write_information(tftp, buffer, "blksize", tftp->block_size);
-        if (buffer == NULL)
-        {
-            return -1;
-        }
+int tftp_send_request(tftp_t* tftp, int is_read, const char* filename, int64_t file_size, int option)
+{
+    tftp_trace_set_name(tftp->trace, is_read ? "get" : "put", filename);
+    tftp->start_us = tftp_time_us();
+    tftp->first_data = 0;
 
-        buffer = write_information(tftp, buffer, "tsize", file_size);
-        if (buffer == NULL)
-        {
-            return -1;
-        }
+    int size = tftp_build_request(tftp, is_read, filename, file_size, option);
+    if (size < 0)
+    {
+        return -1;
     }
 
-    int size = (int)(buffer - (char*)pkt->req.args) + 2;
-    int error = tftp_send_packet(tftp, pkt, size);
+    int error = tftp_send_packet(tftp, &tftp->tx_packet, size);
     if (error < 0)
     {
         printf("tftp: send req failed.\n");
@@ -166,16 +202,184 @@ int tftp_send_error(tftp_t* tftp, uint16_t error_code)
 
 int tftp_resend(tftp_t* tftp)
 {
+    tftp_trace_event(tftp->trace, TFTP_TRACE_RESEND, 0, 0, 0);
+
+    // 按窗口发送时超时由拥塞控制决定重发哪些块
+    if (tftp->window)
+    {
+        return tftp_window_timeout(tftp);
+    }
+
     tftp_packet_t* pkt = &tftp->tx_packet;
     if (tftp_send_packet(tftp, pkt, tftp->tx_size))
     {
         printf("tftp: resend error\n");
         return -1;
     }
+    tftp->stats.retransmits++;
 
+    // 重发过的块收到ACK时分不清对应哪一次发送，不计往返时间
+    tftp->data_us = 0;
     return 0;
 }
 
+// 摘要OACK不是协商，按tftp_parse_oack那样重置选项会丢掉mtime带来的CACHED等
+static void tftp_parse_digest(tftp_t* tftp, size_t pkt_size)
+{
+    tftp_option_reader_t reader;
+    tftp_option_reader_init(&reader, tftp->rx_packet.oack.option, (const char*)&tftp->rx_packet + pkt_size);
+
+    tftp_option_pair_t pair;
+    while (tftp_option_next(&reader, &pair) > 0)
+    {
+        if (pair.key == TFTP_KEY_CRC32C)
+        {
+            tftp->peer_crc = (uint32_t)tftp_option_number(&pair);
+        }
+    }
+}
+
+// 检查rx_packet是不是正在等待的包：1表示是，0表示不是(必要时已经重传)，-1表示对方报错
+int tftp_check_packet(tftp_t* tftp, tftp_op_t opcode, uint16_t block_num, size_t pkt_size)
+{
+    tftp_packet_t* pkt = &tftp->rx_packet;
+    tftp_trace_packet(tftp->trace, TFTP_TRACE_RECV, pkt, pkt_size);
+
+    uint16_t _opcode = htons(pkt->opcode);
+    if (opcode == TFTP_PACKET_REQ)
+    {
+        if ((_opcode != TFTP_PACKET_RRQ) && (_opcode != TFTP_PACKET_WRQ))
+        {
+            return 0;
+        }
+    }
+    else if (opcode == TFTP_PACKET_WACK)
+    {
+        // 块号由发送窗口处理，乱序的ACK也不用重发
+        if (_opcode == TFTP_PACKET_ACK)
+        {
+            return 1;
+        }
+        else if (_opcode != TFTP_PACKET_ERROR)
+        {
+            return 0;
+        }
+    }
+    else if (opcode == TFTP_PACKET_DIGEST)
+    {
+        if (_opcode == TFTP_PACKET_OACK)
+        {
+            tftp_parse_digest(tftp, pkt_size);
+            return 1;
+        }
+        else if (_opcode != TFTP_PACKET_ERROR)
+        {
+            tftp_resend(tftp);
+            return 0;
+        }
+    }
+    else if (opcode == TFTP_PACKET_PROBE)
+    {
+        // 数据交给调用者处理，这里不记首包时间
+        if ((_opcode == TFTP_PACKET_DATA) && (htons(pkt->data.block_num) == 1))
+        {
+            return 1;
+        }
+        else if ((_opcode != TFTP_PACKET_OACK) && (_opcode != TFTP_PACKET_ERROR))
+        {
+            tftp_resend(tftp);
+            return 0;
+        }
+    }
+    else if ((_opcode != opcode) && (_opcode != TFTP_PACKET_ERROR))
+    {
+        tftp_resend(tftp);
+        return 0;
+    }
+
+    switch (_opcode)
+    {
+    case TFTP_PACKET_DATA:
+    case TFTP_PACKET_ACK:
+    {
+        if (htons(pkt->data.block_num) != block_num)
+        {
+            tftp_resend(tftp);
+            return 0;
+        }
+
+        if (_opcode == TFTP_PACKET_DATA)
+        {
+            tftp_first_data(tftp, tftp_time_us());
+        }
+        else if (tftp->data_us && (tftp->tx_packet.opcode == htons(TFTP_PACKET_DATA)) && (tftp->tx_packet.data.block_num == pkt->ack.block_num))
+        {
+            tftp_hist_record(tftp->side, TFTP_HIST_ACK_RTT, tftp_time_us() - tftp->data_us);
+            tftp->data_us = 0;
+        }
+        return 1;
+    }
+    case TFTP_PACKET_RRQ:
+    case TFTP_PACKET_WRQ:
+    {
+        return 1;
+    }
+    case TFTP_PACKET_ERROR:
+    {
+        pkt->error.error_msg[tftp->block_size - 1] = '\0';
+        printf("tftp: recv error=%d, reason: %s\n", ntohs(pkt->error.error_code), pkt->error.error_msg);
+        return -1;
+    }
+    case TFTP_PACKET_OACK:
+    {
+        tftp_parse_oack(tftp, pkt_size);
+        if (tftp->option & TFTP_OPT_WINDOW)
+        {
+            tftp_window_buffer(tftp);
+        }
+        return 1;
+    }
+
+    default:
+    {
+        tftp_resend(tftp);
+        return 0;
+    }
+    }
+}
+
+void tftp_busy_poll(tftp_t* tftp, int us)
+{
+    tftp->busy_poll_us = (us > TFTP_BUSY_POLL_MAX) ? TFTP_BUSY_POLL_MAX : (us < 0) ? 0 : us;
+    // 调大超过net.core.busy_read需要CAP_NET_ADMIN，失败时只在用户态忙等
+    setsockopt(tftp->socket, SOL_SOCKET, SO_BUSY_POLL, &tftp->busy_poll_us, sizeof(int));
+}
+
+// 局域网上包在几十微秒内就会回来，睡下去再被唤醒的时间比这长；超过预算还没有包再阻塞等待
+static ssize_t wait_recvfrom(tftp_t* tftp, tftp_packet_t* pkt)
+{
+    socklen_t len = sizeof(struct sockaddr);
+    if (tftp->busy_poll_us > 0)
+    {
+        uint64_t deadline = tftp_time_us() + (uint64_t)tftp->busy_poll_us;
+        do
+        {
+            ssize_t size = recvfrom(tftp->socket, (uint8_t*)pkt, sizeof(tftp_packet_t), MSG_DONTWAIT, &tftp->remote, &len);
+            if (size >= 0)
+            {
+                tftp->stats.spin_hits++;
+                return size;
+            }
+            else if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+            {
+                return size;
+            }
+            sched_yield();
+        } while (tftp_time_us() < deadline);
+    }
+    return recvfrom(tftp->socket, (uint8_t*)pkt, sizeof(tftp_packet_t), 0, &tftp->remote, &len);
+}
+
 int tftp_wait_packet(tftp_t* tftp, tftp_op_t opcode, uint16_t block_num, size_t* pkt_size)
 {
     tftp_packet_t* pkt = &tftp->rx_packet;
@@ -183,10 +387,14 @@ int tftp_wait_packet(tftp_t* tftp, tftp_op_t opcode, uint16_t block_num, size_t*
     tftp->tmo_retry = TFTP_MAX_RETYR;
     while (1)
     {
-        socklen_t len = sizeof(struct sockaddr);
-        ssize_t size = recvfrom(tftp->socket, (uint8_t*)pkt, sizeof(tftp_packet_t), 0, &tftp->remote, &len);
+        ssize_t size = wait_recvfrom(tftp, pkt);
         if (size < 0)
         {
+            tftp_trace_event(tftp->trace, TFTP_TRACE_TIMEOUT, 0, 0, 0);
+            if (tftp->window == NULL)
+            {
+                tftp->stats.timeouts++;
+            }
             if (--tftp->tmo_retry == 0)
             {
                 printf("tftp: wait tmo\n");
@@ -201,129 +409,426 @@ int tftp_wait_packet(tftp_t* tftp, tftp_op_t opcode, uint16_t block_num, size_t*
 
         *pkt_size = (size_t)size;
 
-        uint16_t _opcode = htons(pkt->opcode);
-        if (opcode == TFTP_PACKET_REQ)
+        int result = tftp_check_packet(tftp, opcode, block_num, (size_t)size);
+        if (result != 0)
         {
-            if ((_opcode != TFTP_PACKET_RRQ) && (_opcode != TFTP_PACKET_WRQ))
-            {
-                continue;
-            }
-        }
-        else if (_opcode != opcode)
-        {
-            tftp_resend(tftp);
-            continue;
+            return (result > 0) ? 0 : -1;
         }
+    }
+}
 
-        switch (_opcode)
+int tftp_parse_oack(tftp_t* tftp, size_t pkt_size)
+{
+    // 只读收到的部分，缓冲里后面可能还有上一个OACK剩下的选项
+    tftp_option_reader_t reader;
+    tftp_option_reader_init(&reader, tftp->rx_packet.oack.option, (const char*)&tftp->rx_packet + pkt_size);
+
+    // 只保留服务器确认过的扩展选项，传输模式不参与协商
+    tftp->option = TFTP_OPT_BASE | (tftp->option & TFTP_OPT_NETASCII);
+    tftp->not_modified = 0;
+    tftp_option_pair_t pair;
+    while (tftp_option_next(&reader, &pair) > 0)
+    {
+        switch (pair.key)
         {
-        case TFTP_PACKET_DATA:
-        case TFTP_PACKET_ACK:
+        case TFTP_KEY_BLKSIZE:
         {
-            if (htons(pkt->data.block_num) != block_num)
+            int64_t blksize = tftp_option_number(&pair);
+            if (blksize <= 0)
             {
-                tftp_resend(tftp);
-                break;
+                printf("tftp: unknown blksize \n");
+                return -1;
             }
-            return 0;
-        }
-        case TFTP_PACKET_RRQ:
-        case TFTP_PACKET_WRQ:
-        {
-            return 0;
+            else if (blksize < tftp->block_size)
+            {
+                tftp->block_size = (int)blksize;
+                printf("tftp: use new blksize %d\n", (int)blksize);
+            }
+            else if (blksize > tftp->block_size)
+            {
+                printf("tftp: block size %d\n", (int)blksize);
+                return -1;
+            }
+            break;
         }
-        case TFTP_PACKET_ERROR:
+        case TFTP_KEY_TSIZE:
+            tftp->file_size = tftp_option_number(&pair);
+            break;
+        case TFTP_KEY_OFFSET:
+            tftp->offset = tftp_option_number(&pair);
+            tftp->option |= TFTP_OPT_RANGE;
+            break;
+        case TFTP_KEY_RANGE:
+            tftp->range = tftp_option_number(&pair);
+            break;
+        case TFTP_KEY_COMPRESS:
+            if (TFTP_OPTION_IS(&pair, "zlib"))
+            {
+                tftp->option |= TFTP_OPT_COMPRESS;
+            }
+            break;
+        case TFTP_KEY_CHECKSUM:
+            if (TFTP_OPTION_IS(&pair, "crc32c"))
+            {
+                tftp->option |= TFTP_OPT_CHECKSUM;
+            }
+            break;
+        case TFTP_KEY_WINDOWSIZE:
         {
-            pkt->error.error_msg[tftp->block_size - 1] = '\0';
-            printf("tftp: recv error=%d, reason: %s\n", ntohs(pkt->error.error_code), pkt->error.error_msg);
-            return -1;
+            int64_t window_size = tftp_option_number(&pair);
+            if ((window_size > 0) && (window_size < tftp->window_size))
+            {
+                tftp->window_size = (int)window_size;
+            }
+            tftp->option |= TFTP_OPT_WINDOW;
+            break;
         }
-        case TFTP_PACKET_OACK:
+        case TFTP_KEY_MTIME:
+            tftp->mtime = tftp_option_number(&pair);
+            tftp->option |= TFTP_OPT_CACHED;
+            break;
+        case TFTP_KEY_NOTMODIFIED:
+            tftp->not_modified = (tftp_option_number(&pair) > 0);
+            break;
+        case TFTP_KEY_PREFIX:
         {
-            tftp_parse_oack(tftp);
-            return 0;
+            int64_t crc = tftp_option_number(&pair);
+            if ((crc >= 0) && (crc <= UINT32_MAX))
+            {
+                tftp->prefix_crc = (uint32_t)crc;
+                tftp->option |= TFTP_OPT_PREFIX;
+            }
+            break;
         }
-
         default:
-        {
-            tftp_resend(tftp);
             break;
         }
-        }
     }
+
+    return 0;
 }
 
-int tftp_parse_oack(tftp_t* tftp)
+// 请求包：文件名、传输模式，之后是选项
+int tftp_parse_req(const tftp_packet_t* pkt, size_t pkt_size, tftp_req_t* req)
 {
-    char* buffer = (char*)&tftp->rx_packet.oack.option;
-    char* end = (char*)&tftp->rx_packet + sizeof(tftp_packet_t);
+    req->opcode = ntohs(pkt->opcode);
+    req->option = 0;
+    req->block_size = TFTP_DEFAULT_BLOCK_SIZE;
+    req->filesize = 0;
+    req->offset = 0;
+    req->range = 0;
+    req->cached_size = -1;
+    req->cached_mtime = -1;
+    req->window_size = 1;
+
+    tftp_option_reader_t reader;
+    tftp_option_reader_init(&reader, pkt->req.args, (const char*)pkt + pkt_size);
+    size_t size;
+    const char* filename = tftp_option_string(&reader, &size);
+    if ((filename == NULL) || (size >= sizeof(req->filename)))
+    {
+        return -1;
+    }
+    memcpy(req->filename, filename, size + 1);
 
-    while ((buffer < end) && (*buffer))
+    const char* mode = tftp_option_string(&reader, &size);
+    if (mode == NULL)
     {
-        if (strcmp(buffer, "blksize") == 0)
-        {
-            buffer += (strlen(buffer) + 1);
+        return -1;
+    }
+    else if (TFTP_OPTION_EQUAL(mode, size, "netascii"))
+    {
+        req->option |= TFTP_OPT_NETASCII;
+    }
+    else if (!TFTP_OPTION_EQUAL(mode, size, "octet"))
+    {
+        return -1;
+    }
 
-            int blksize = atoi(buffer);
-            if (blksize == 0)
+    // 格式不对的选项和之后的都忽略
+    tftp_option_pair_t pair;
+    while (tftp_option_next(&reader, &pair) > 0)
+    {
+        req->option |= TFTP_OPT_BASE;
+        int64_t value = tftp_option_number(&pair);
+        switch (pair.key)
+        {
+        case TFTP_KEY_BLKSIZE:
+            if (value < 8)
             {
-                printf("tftp: unknown blksize \n");
                 return -1;
             }
-            else if (blksize < tftp->block_size)
+            req->block_size = (value > TFTP_BLOCK_SIZE) ? TFTP_BLOCK_SIZE : (int)value;
+            break;
+        case TFTP_KEY_TSIZE:
+            req->filesize = (value > 0) ? value : 0;
+            break;
+        case TFTP_KEY_COMPRESS:
+            if (TFTP_OPTION_IS(&pair, "zlib"))
             {
-                tftp->block_size = blksize;
-                printf("tftp: use new blksize %d\n", blksize);
+                req->option |= TFTP_OPT_COMPRESS;
             }
-            else if (blksize > tftp->block_size)
+            break;
+        case TFTP_KEY_CHECKSUM:
+            if (TFTP_OPTION_IS(&pair, "crc32c"))
             {
-                printf("tftp: block size %d\n", blksize);
-                return -1;
+                req->option |= TFTP_OPT_CHECKSUM;
             }
-            buffer += (strlen(buffer) + 1);
+            break;
+        case TFTP_KEY_OFFSET:
+            req->offset = (value > 0) ? value : 0;
+            req->option |= TFTP_OPT_RANGE;
+            break;
+        case TFTP_KEY_WINDOWSIZE:
+            if (value > 0)
+            {
+                req->window_size = (value > TFTP_WINDOW_MAX) ? TFTP_WINDOW_MAX : (int)value;
+                req->option |= TFTP_OPT_WINDOW;
+            }
+            break;
+        case TFTP_KEY_RANGE:
+            if (req->opcode == TFTP_PACKET_RRQ)
+            {
+                req->range = (value > 0) ? value : 0;
+                req->option |= TFTP_OPT_RANGE;
+            }
+            break;
+        case TFTP_KEY_IFSIZE:
+            if (req->opcode == TFTP_PACKET_RRQ)
+            {
+                req->cached_size = value;
+                req->option |= TFTP_OPT_CACHED;
+            }
+            break;
+        case TFTP_KEY_IFMTIME:
+            if (req->opcode == TFTP_PACKET_RRQ)
+            {
+                req->cached_mtime = value;
+                req->option |= TFTP_OPT_CACHED;
+            }
+            break;
+        case TFTP_KEY_PREFIX:
+            if (TFTP_OPTION_IS(&pair, "crc32c"))
+            {
+                req->option |= TFTP_OPT_PREFIX;
+            }
+            break;
+        default:
+            break;
         }
-        else if (strcmp(buffer, "tsize") == 0)
-        {
-            buffer += strlen(buffer) + 1;
-            tftp->file_size = atoi(buffer);
+    }
 
-            buffer += (strlen(buffer) + 1);
+    return 0;
+}
+
+int tftp_build_oack(tftp_t* tftp)
+{
+    tftp_packet_t* pkt = &tftp->tx_packet;
+    const char* end = (const char*)pkt + sizeof(tftp_packet_t);
+
+    pkt->opcode = htons(TFTP_PACKET_OACK);
+    char* buffer = TFTP_OPTION_NUMBER(pkt->oack.option, end, "blksize", tftp->block_size);
+    buffer = TFTP_OPTION_NUMBER(buffer, end, "tsize", tftp->file_size);
+    if (tftp->option & TFTP_OPT_RANGE)
+    {
+        buffer = TFTP_OPTION_NUMBER(buffer, end, "offset", tftp->offset);
+        buffer = TFTP_OPTION_NUMBER(buffer, end, "range", tftp->range);
+        if (tftp->option & TFTP_OPT_PREFIX)
+        {
+            buffer = TFTP_OPTION_NUMBER(buffer, end, "prefix", tftp->prefix_crc);
         }
-        else
+    }
+
+    if (tftp->option & TFTP_OPT_CHECKSUM)
+    {
+        buffer = TFTP_OPTION_STRING(buffer, end, "checksum");
+        buffer = TFTP_OPTION_STRING(buffer, end, "crc32c");
+    }
+
+    if (tftp->option & TFTP_OPT_COMPRESS)
+    {
+        buffer = TFTP_OPTION_STRING(buffer, end, "compress");
+        buffer = TFTP_OPTION_STRING(buffer, end, "zlib");
+    }
+
+    if (tftp->option & TFTP_OPT_WINDOW)
+    {
+        buffer = TFTP_OPTION_NUMBER(buffer, end, "aimdwindow", tftp->window_size);
+    }
+
+    // 客户端带了缓存信息时告诉它文件的修改时间，下载完可以存进缓存
+    if (tftp->option & TFTP_OPT_CACHED)
+    {
+        buffer = TFTP_OPTION_NUMBER(buffer, end, "mtime", tftp->mtime);
+        if (tftp->not_modified)
         {
-            buffer += (strlen(buffer) + 1);
+            buffer = TFTP_OPTION_NUMBER(buffer, end, "notmodified", 1);
         }
+    }
+
+    return (buffer == NULL) ? -1 : (int)(buffer - (char*)pkt);
+}
 
+int tftp_send_oack(tftp_t* tftp)
+{
+    int size = tftp_build_oack(tftp);
+    if ((size < 0) || (tftp_send_packet(tftp, &tftp->tx_packet, size) < 0))
+    {
+        printf("tftp: send oack failed\n");
+        return -1;
     }
 
     return 0;
 }
 
-int tftp_send_oack(tftp_t* tftp)
+// 发送方在最后一个块被确认后发出摘要，接收方用下一个块号确认
+int tftp_send_digest(tftp_t* tftp)
 {
     tftp_packet_t* pkt = &tftp->tx_packet;
 
     pkt->opcode = htons(TFTP_PACKET_OACK);
-    char* buffer = pkt->oack.option;
-    buffer = write_information(tftp, buffer, "blksize", tftp->block_size);
+    char* buffer = TFTP_OPTION_NUMBER(pkt->oack.option, (const char*)pkt + sizeof(tftp_packet_t), "crc32c", tftp->crc);
     if (buffer == NULL)
     {
         return -1;
     }
 
-    buffer = write_information(tftp, buffer, "tsize", tftp->file_size);
-    if (buffer == NULL)
+    if (tftp_send_packet(tftp, pkt, buffer - (char*)pkt) < 0)
     {
+        printf("tftp: send checksum failed\n");
         return -1;
     }
 
-    int error = tftp_send_packet(tftp, pkt, buffer - (char*)pkt);
-    if (error < 0)
+    return 0;
+}
+
+int tftp_send_checksum(tftp_t* tftp, uint16_t block_num)
+{
+    if (tftp_send_digest(tftp) < 0)
     {
-        
-        printf("tftp: send oack failed\n");
+        return -1;
+    }
+
+    size_t pkt_size;
+    if (tftp_wait_packet(tftp, TFTP_PACKET_ACK, block_num, &pkt_size) < 0)
+    {
+        printf("tftp: checksum %08x not confirmed\n", tftp->crc);
         return -1;
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+// 收到对方的摘要后比较，一致时用block_num确认，否则回复错误
+int tftp_check_digest(tftp_t* tftp, uint16_t block_num)
+{
+    if (tftp->peer_crc != tftp->crc)
+    {
+        printf("tftp: checksum mismatch, local %08x remote %08x\n", tftp->crc, tftp->peer_crc);
+        tftp_send_error(tftp, TFTP_ERROR_CHECKSUM);
+        return -1;
+    }
+
+    printf("tftp: checksum %08x ok\n", tftp->crc);
+    return tftp_send_ack(tftp, block_num);
+}
+
+// 接收方发完最后一个ACK后等待摘要
+int tftp_recv_checksum(tftp_t* tftp, uint16_t block_num)
+{
+    size_t pkt_size;
+    if (tftp_wait_packet(tftp, TFTP_PACKET_DIGEST, block_num, &pkt_size) < 0)
+    {
+        printf("tftp: wait checksum failed\n");
+        return -1;
+    }
+
+    return tftp_check_digest(tftp, block_num);
+}
+
+// 每个DATA包能携带的文件数据，压缩时要留出块头
+int tftp_data_size(tftp_t* tftp)
+{
+    if (tftp->option & TFTP_OPT_COMPRESS)
+    {
+        return tftp->block_size - TFTP_ZIP_HEADER_SIZE;
+    }
+    return tftp->block_size;
+}
+
+// 按传输模式读取本地文件，netascii时读出的是转换后的数据
+size_t tftp_file_read(tftp_t* tftp, FILE* file, uint8_t* buffer, size_t size)
+{
+    if (tftp->option & TFTP_OPT_NETASCII)
+    {
+        return tftp_netascii_read(&tftp->netascii, file, buffer, size);
+    }
+    return fread(buffer, 1, size, file);
+}
+
+size_t tftp_file_write(tftp_t* tftp, FILE* file, const uint8_t* buffer, size_t size)
+{
+    if (tftp->option & TFTP_OPT_NETASCII)
+    {
+        return tftp_netascii_write(&tftp->netascii, file, buffer, size);
+    }
+    return fwrite(buffer, 1, size, file);
+}
+
+// 续传起点：部分文件按块对齐后再回退一块，用于校验重叠部分
+int64_t tftp_resume_offset(int64_t partial_size, int block_size)
+{
+    int64_t offset = partial_size / block_size * block_size - block_size;
+    return offset > 0 ? offset : 0;
+}
+
+// 比较收到的数据与本地已有的数据，返回一致的字节数，不一致返回-1
+int tftp_verify_overlap(FILE* file, int64_t position, const uint8_t* data, size_t size, int64_t verify_end)
+{
+    if (position >= verify_end)
+    {
+        return 0;
+    }
+
+    size_t len = size;
+    if (verify_end - position < (int64_t)size)
+    {
+        len = (size_t)(verify_end - position);
+    }
+
+    uint8_t buffer[TFTP_BLOCK_SIZE];
+    ssize_t read_size = pread(fileno(file), buffer, len, position);
+    if ((read_size != (ssize_t)len) || (memcmp(buffer, data, len) != 0))
+    {
+        printf("tftp: resume data mismatch at %lld\n", (long long)position);
+        return -1;
+    }
+
+    return (int)len;
+}
+
+int tftp_prefix_crc(FILE* file, int fd, int64_t size, uint32_t* crc)
+{
+    if (file && (fseek(file, 0, SEEK_SET) < 0))
+    {
+        return -1;
+    }
+
+    uint8_t buffer[65536];
+    uint32_t value = 0;
+    int64_t position = 0;
+    while (position < size)
+    {
+        size_t len = (size - position < (int64_t)sizeof(buffer)) ? (size_t)(size - position) : sizeof(buffer);
+        ssize_t read_size = file ? (ssize_t)fread(buffer, 1, len, file) : pread(fd, buffer, len, position);
+        if (read_size <= 0)
+        {
+            return -1;
+        }
+        value = tftp_crc32c(value, buffer, (size_t)read_size);
+        position += read_size;
+    }
+
+    *crc = value;
+    return 0;
+}
@@ -8,12 +8,18 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 
+#include "tftp_netascii.h"
+#include "tftp_window.h"
+#include "tftp_trace.h"
+#include "tftp_hist.h"
+
 
 #define TFTP_BLOCK_SIZE 8192
 #define TFTP_DEFAULT_BLOCK_SIZE 512
 #define TFTP_DEFAULT_PORT 69
 #define TFTP_MAX_RETYR 10
 #define TFTP_TMO_SEC 10
+#define TFTP_BUSY_POLL_MAX 10000 // 忙等预算的上限，微秒
 
 typedef enum _tftp_error_t
 {
@@ -25,6 +31,8 @@ typedef enum _tftp_error_t
     TFTP_ERROR_UNKNOWN_TID,
     TFTP_ERROR_FILE_EXIST,
     TFTP_ERROR_USER,
+    TFTP_ERROR_OPTION,
+    TFTP_ERROR_CHECKSUM, // 扩展：传输结束时CRC32C不一致
 
     TFTP_ERROR_END,
 }tftp_error_t;
@@ -39,6 +47,9 @@ typedef enum _tftp_op_t
     TFTP_PACKET_OACK,
 
     TFTP_PACKET_REQ,
+    TFTP_PACKET_WACK, // 按窗口发送时等待任意块号的ACK
+    TFTP_PACKET_PROBE, // 带选项的RRQ之后等OACK，对方不认识选项时会直接回DATA块1
+    TFTP_PACKET_DIGEST, // 传输结束后等对方的摘要OACK，只读crc32c，不动协商好的选项
 }tftp_op_t;
 
 #pragma pack(1)
@@ -74,9 +85,18 @@ typedef  struct _tftp_packet_t
     };
 
 }tftp_packet_t;
-#pragma pack(1)
-
-
+#pragma pack()
+
+// 选项位，tftp_send_request/tftp_send_oack根据这些位写入对应的选项
+#define TFTP_OPT_BASE   (1 << 0) // blksize + tsize
+#define TFTP_OPT_RANGE  (1 << 1) // offset + range，按字节范围读取文件；WRQ中表示续传
+#define TFTP_OPT_RESUME (1 << 2) // 客户端本地选项：检测到部分文件时续传
+#define TFTP_OPT_COMPRESS (1 << 3) // compress=zlib，DATA包数据逐块压缩
+#define TFTP_OPT_CHECKSUM (1 << 4) // checksum=crc32c，传输结束后用OACK交换摘要
+#define TFTP_OPT_NETASCII (1 << 5) // 传输模式为netascii
+#define TFTP_OPT_WINDOW (1 << 6) // 私有选项aimdwindow，发送方按AIMD拥塞窗口连续发送，接收方逐块确认；语义和RFC 7440的windowsize不同，不能用那个名字
+#define TFTP_OPT_CACHED (1 << 7) // ifsize + ifmtime，客户端有缓存；文件没变时OACK带notmodified，不传数据
+#define TFTP_OPT_PREFIX (1 << 8) // prefix=crc32c，续传时OACK带上服务器文件[0, offset)的CRC32C，客户端和本地的比较
 
 typedef struct _tftp_t
 {
@@ -85,10 +105,29 @@ typedef struct _tftp_t
 
     int tmo_sec; // 最长等待数据包的时间
     int tmo_retry; // 重传次数
+    int busy_poll_us; // >0: 阻塞接收前先用非阻塞接收忙等这么久，微秒
 
     int tx_size; // 数据包的有效空间
     int block_size;
-    int file_size;
+    int64_t file_size;
+    int option; // 已协商的选项
+    int64_t offset; // 传输的起始偏移
+    int64_t range; // 传输的字节数，0表示到文件末尾
+    int64_t cached_size; // 客户端缓存的大小，请求中的ifsize
+    int64_t mtime; // 文件的修改时间，秒；客户端发请求前是缓存的，收到OACK后是服务器的
+    int not_modified; // OACK中有notmodified，文件和客户端缓存的一样
+    uint32_t crc; // 本次传输的文件数据的CRC32C
+    uint32_t peer_crc; // 对方发来的CRC32C
+    uint32_t prefix_crc; // 续传: 服务器文件[0, offset)的CRC32C
+    tftp_netascii_t netascii;
+    int window_size; // 协商的aimdwindow
+    tftp_window_t* window; // 发送窗口，不按窗口发送时为NULL
+    tftp_stats_t stats;
+    tftp_trace_t* trace; // 事件记录，没有开启时为NULL
+    int side; // 记到哪一边的延迟直方图
+    int first_data; // 已经发出或收到过DATA
+    uint64_t start_us; // 发出或收到请求的时间
+    uint64_t data_us; // 最近一次发出DATA的时间，重发后清零，用来算ACK的往返时间
     tftp_packet_t rx_packet; // 接收
     tftp_packet_t tx_packet; // 发送
 }tftp_t;
@@ -101,19 +140,57 @@ typedef struct _tftp_req_t
     tftp_op_t opcode;
     int option;
     int block_size;
-    int filesize;
+    int64_t filesize; // WRQ的tsize
+    int64_t offset;
+    int64_t range;
+    int64_t cached_size; // ifsize，没有时为-1
+    int64_t cached_mtime; // ifmtime，没有时为-1
+    int window_size;
     char filename[TFTP_NAME_SIZE];
 }tftp_req_t;
 
-int tftp_send_request(tftp_t* tftp, int is_read, const char* filename, uint32_t file_size, int option);
+int tftp_send_packet(tftp_t* tftp, tftp_packet_t* pkt, int size);
+// 只在tx_packet中组包，返回包长；send版本组包后发出。file_size小于0表示大小未知，不带tsize
+int tftp_build_request(tftp_t* tftp, int is_read, const char* filename, int64_t file_size, int option);
+int tftp_build_oack(tftp_t* tftp);
+int tftp_send_request(tftp_t* tftp, int is_read, const char* filename, int64_t file_size, int option);
 int tftp_send_ack(tftp_t* tftp, uint16_t block_num);
 int tftp_send_data(tftp_t* tftp, uint16_t block_num, size_t size);
 int tftp_send_error(tftp_t* tftp, uint16_t error_code);
+int tftp_resend(tftp_t* tftp);
 
 int tftp_wait_packet(tftp_t* tftp, tftp_op_t, uint16_t block_num, size_t* pkt_size);
-int tftp_parse_oack(tftp_t* tftp);
+// 设置忙等预算，同时给套接字设SO_BUSY_POLL，网卡驱动支持时内核在收包时也轮询；0关闭
+void tftp_busy_poll(tftp_t* tftp, int us);
+int tftp_check_packet(tftp_t* tftp, tftp_op_t opcode, uint16_t block_num, size_t pkt_size);
+int tftp_parse_oack(tftp_t* tftp, size_t pkt_size);
+// 解析请求包，不认识的传输模式或者文件名太长返回-1
+int tftp_parse_req(const tftp_packet_t* pkt, size_t pkt_size, tftp_req_t* req);
 int tftp_send_oack(tftp_t* tftp);
 
+int tftp_send_checksum(tftp_t* tftp, uint16_t block_num);
+int tftp_recv_checksum(tftp_t* tftp, uint16_t block_num);
+int tftp_send_digest(tftp_t* tftp);
+int tftp_check_digest(tftp_t* tftp, uint16_t block_num);
+
+int tftp_data_size(tftp_t* tftp);
+size_t tftp_file_read(tftp_t* tftp, FILE* file, uint8_t* buffer, size_t size);
+size_t tftp_file_write(tftp_t* tftp, FILE* file, const uint8_t* buffer, size_t size);
+int64_t tftp_resume_offset(int64_t partial_size, int block_size);
+int tftp_verify_overlap(FILE* file, int64_t position, const uint8_t* data, size_t size, int64_t verify_end);
+// 文件开头size字节的CRC32C：file不为NULL时从头读这个FILE，之后的位置不确定；否则用pread读fd。读不够返回-1
+int tftp_prefix_crc(FILE* file, int fd, int64_t size, uint32_t* crc);
+
+void tftp_window_buffer(tftp_t* tftp);
+int tftp_window_start(tftp_t* tftp, tftp_window_t* window);
+// tftp_window_start按这个窗口和块大小分配的字节数
+size_t tftp_window_memory(int size, int block_size);
+void tftp_window_stop(tftp_t* tftp);
+int tftp_window_send(tftp_t* tftp, tftp_produce_t produce, void* arg);
+int tftp_window_ack(tftp_t* tftp, uint16_t block_num);
+int tftp_window_timeout(tftp_t* tftp);
+void tftp_print_stats(tftp_t* tftp, const char* name);
+
 
 
 
@@ -0,0 +1,2098 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+
+#include "tftp_base.h"
+#include "tftp_netascii.h"
+#include "tftp_fcache.h"
+#include "tftp_pack.h"
+#include "tftp_server.h"
+#include "tftp_client.h"
+#include "tftp_trace.h"
+#include "tftp_option.h"
+#include <strings.h>
+
+// tftp_bench: 性能测试工具
+// usage: tftp_bench <test> [args...]
+
+typedef size_t (*netascii_encode_t)(const uint8_t*, size_t, size_t*, uint8_t*, size_t, int*);
+typedef size_t (*netascii_decode_t)(const uint8_t*, size_t, uint8_t*, int*);
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 目录下所有文件实际占的磁盘字节，remove非0时顺便删掉
+static uint64_t bench_dir_walk(const char* path, int remove)
+{
+    struct stat st;
+    if (lstat(path, &st) < 0)
+    {
+        return 0;
+    }
+
+    uint64_t disk = (uint64_t)st.st_blocks * 512;
+    DIR* dir = S_ISDIR(st.st_mode) ? opendir(path) : NULL;
+    struct dirent* entry;
+    while ((dir != NULL) && ((entry = readdir(dir)) != NULL))
+    {
+        if ((strcmp(entry->d_name, ".") != 0) && (strcmp(entry->d_name, "..") != 0))
+        {
+            char child[512];
+            snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+            disk += bench_dir_walk(child, remove);
+        }
+    }
+    if (dir != NULL)
+    {
+        closedir(dir);
+    }
+    if (remove)
+    {
+        S_ISDIR(st.st_mode) ? rmdir(path) : unlink(path);
+    }
+    return disk;
+}
+
+#define BENCH_TEMP_DIR "/tmp/tftp_bench_XXXXXX"
+
+// 测试用的文件: dir还是BENCH_TEMP_DIR模板时先建出目录，再写一个内容按位置循环0..255的文件；
+// name为NULL时只建目录。失败时整个目录已经删掉，调用者直接返回
+static int bench_fixture(char* dir, const char* name, int64_t size)
+{
+    size_t len = strlen(dir);
+    if ((len >= 6) && (strcmp(dir + len - 6, "XXXXXX") == 0) && (mkdtemp(dir) == NULL))
+    {
+        printf("bench: mkdtemp %s failed\n", dir);
+        return -1;
+    }
+    if (name == NULL)
+    {
+        return 0;
+    }
+
+    static uint8_t pattern[64 * 1024];
+    for (size_t i = 0; i < sizeof(pattern); i++)
+    {
+        pattern[i] = (uint8_t)i;
+    }
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE* file = fopen(path, "wb");
+    int error = (file == NULL) ? -1 : 0;
+    for (int64_t done = 0; (error == 0) && (done < size); done += sizeof(pattern))
+    {
+        size_t chunk = (size - done < (int64_t)sizeof(pattern)) ? (size_t)(size - done) : sizeof(pattern);
+        error = (fwrite(pattern, 1, chunk, file) == chunk) ? 0 : -1;
+    }
+    if ((file != NULL) && (fclose(file) != 0))
+    {
+        error = -1;
+    }
+    if (error < 0)
+    {
+        printf("bench: create %s failed\n", path);
+        bench_dir_walk(dir, 1);
+        return -1;
+    }
+    return 0;
+}
+
+// 删掉bench_fixture建的目录和测试中留在里面的所有文件
+static void bench_cleanup(const char* dir)
+{
+    bench_dir_walk(dir, 1);
+}
+
+// 按块编码整个缓冲区，模拟发送方每次填满一个DATA包
+static size_t bench_encode(netascii_encode_t encode, const uint8_t* in, size_t size, uint8_t* out)
+{
+    size_t used_total = 0;
+    size_t out_total = 0;
+    int pending = -1;
+    while (1)
+    {
+        size_t used = 0;
+        size_t n = encode(in + used_total, size - used_total, &used, out + out_total, TFTP_BLOCK_SIZE, &pending);
+        used_total += used;
+        out_total += n;
+        if (n < TFTP_BLOCK_SIZE)
+        {
+            break;
+        }
+    }
+    return out_total;
+}
+
+static size_t bench_decode(netascii_decode_t decode, const uint8_t* in, size_t size, uint8_t* out)
+{
+    size_t out_total = 0;
+    int cr = 0;
+    for (size_t pos = 0; pos < size; pos += TFTP_BLOCK_SIZE)
+    {
+        size_t len = (size - pos < TFTP_BLOCK_SIZE) ? size - pos : TFTP_BLOCK_SIZE;
+        out_total += decode(in + pos, len, out + out_total, &cr);
+    }
+    return out_total;
+}
+
+static int bench_netascii(int argc, char** argv)
+{
+    size_t size = (size_t)(argc > 0 ? atoi(argv[0]) : 64) * 1024 * 1024;
+    int rounds = 5;
+
+    // 类似日志/配置文件的文本，平均每行60字节左右
+    uint8_t* text = (uint8_t*)malloc(size);
+    uint8_t* wire = (uint8_t*)malloc(size * 2 + TFTP_BLOCK_SIZE);
+    uint8_t* back = (uint8_t*)malloc(size + TFTP_BLOCK_SIZE);
+    if (!text || !wire || !back)
+    {
+        printf("bench: no memory\n");
+        return -1;
+    }
+
+    srand(1);
+    for (size_t i = 0; i < size; i++)
+    {
+        text[i] = (rand() % 60 == 0) ? '\n' : (uint8_t)('a' + rand() % 26);
+    }
+
+    struct
+    {
+        const char* name;
+        netascii_encode_t encode;
+        netascii_decode_t decode;
+    }impl[] =
+    {
+        { "scalar", tftp_netascii_encode_scalar, tftp_netascii_decode_scalar },
+        { "simd", tftp_netascii_encode, tftp_netascii_decode },
+    };
+
+    printf("netascii: %zu MB text, %d rounds, block %d\n", size >> 20, rounds, TFTP_BLOCK_SIZE);
+    for (int k = 0; k < 2; k++)
+    {
+        size_t wire_size = 0;
+        size_t back_size = 0;
+        double start = bench_now();
+        for (int r = 0; r < rounds; r++)
+        {
+            wire_size = bench_encode(impl[k].encode, text, size, wire);
+        }
+        double encode_time = bench_now() - start;
+
+        start = bench_now();
+        for (int r = 0; r < rounds; r++)
+        {
+            back_size = bench_decode(impl[k].decode, wire, wire_size, back);
+        }
+        double decode_time = bench_now() - start;
+
+        int ok = (back_size == size) && (memcmp(back, text, size) == 0);
+        printf("  %-8s encode %8.1f MB/s  decode %8.1f MB/s  %s\n", impl[k].name,
+            size * rounds / encode_time / 1e6, wire_size * rounds / decode_time / 1e6, ok ? "ok" : "MISMATCH");
+    }
+
+    free(text);
+    free(wire);
+    free(back);
+    return 0;
+}
+
+// 每个RRQ都要拿到文件大小：原来的fopen/fseek/ftell/fclose和缓存比较
+static int bench_fcache(int argc, char** argv)
+{
+    int files = argc > 0 ? atoi(argv[0]) : 16;
+    int rounds = argc > 1 ? atoi(argv[1]) : 100000;
+    if ((files < 1) || (files > TFTP_FCACHE_ENTRIES))
+    {
+        printf("bench: bad args\n");
+        return -1;
+    }
+
+    char dir[] = BENCH_TEMP_DIR;
+    char path[TFTP_FCACHE_PATH_SIZE];
+    for (int i = 0; i < files; i++)
+    {
+        snprintf(path, sizeof(path), "file%d.bin", i);
+        if (bench_fixture(dir, path, 1000 + i) < 0)
+        {
+            return -1;
+        }
+    }
+
+    printf("fcache: %d files, %d requests\n", files, rounds);
+    int64_t sum = 0;
+    int64_t open_sum = 0;
+    double start = bench_now();
+    for (int r = 0; r < rounds; r++)
+    {
+        snprintf(path, sizeof(path), "%s/file%d.bin", dir, r % files);
+        FILE* file = fopen(path, "rb");
+        fseek(file, 0, SEEK_END);
+        sum += ftell(file);
+        open_sum = sum;
+        fseek(file, 0, SEEK_SET);
+        fclose(file);
+    }
+    double open_time = bench_now() - start;
+
+    start = bench_now();
+    for (int r = 0; r < rounds; r++)
+    {
+        int error;
+        snprintf(path, sizeof(path), "%s/file%d.bin", dir, r % files);
+        tftp_fcache_t* cache = tftp_fcache_open(path, &error);
+        sum -= tftp_fcache_size(cache);
+        tftp_fcache_close(cache);
+    }
+    double cache_time = bench_now() - start;
+
+    char pack_path[TFTP_FCACHE_PATH_SIZE];
+    snprintf(pack_path, sizeof(pack_path), "%s.pack", dir);
+    tftp_pack_t* pack = (tftp_pack_build(dir, pack_path) == 0) ? tftp_pack_open(pack_path) : NULL;
+    if (pack == NULL)
+    {
+        return -1;
+    }
+
+    int64_t pack_sum = 0;
+    start = bench_now();
+    for (int r = 0; r < rounds; r++)
+    {
+        tftp_pack_file_t file;
+        snprintf(path, sizeof(path), "file%d.bin", r % files);
+        if (tftp_pack_find(pack, path, &file) == 0)
+        {
+            pack_sum += file.size;
+        }
+    }
+    double pack_time = bench_now() - start;
+    tftp_pack_close(pack);
+    unlink(pack_path);
+
+    uint64_t hits;
+    uint64_t misses;
+    tftp_fcache_stats(&hits, &misses);
+    printf("  %-8s %8.2f us/req\n", "fopen", open_time / rounds * 1e6);
+    printf("  %-8s %8.2f us/req  %llu hits, %llu misses  %s\n", "fcache", cache_time / rounds * 1e6,
+        (unsigned long long)hits, (unsigned long long)misses, (sum == 0) ? "ok" : "MISMATCH");
+    printf("  %-8s %8.2f us/req  %s\n", "pack", pack_time / rounds * 1e6, (pack_sum == open_sum) ? "ok" : "MISMATCH");
+
+    for (int i = 0; i < files; i++)
+    {
+        snprintf(path, sizeof(path), "%s/file%d.bin", dir, i);
+        tftp_fcache_invalidate(path);
+    }
+    bench_cleanup(dir);
+    return 0;
+}
+
+#define BENCH_PORT 10169
+#define BENCH_FILE_SIZE (32 * 1024)
+#define BENCH_STALL_MS 2000
+
+// 一个模拟的客户端，按步发送ACK
+typedef struct _bench_client_t
+{
+    int fd;
+    uint16_t expect;
+    double last;
+    struct sockaddr_in server;
+}bench_client_t;
+
+static int bench_count_fds(void)
+{
+    int count = 0;
+    DIR* dir = opendir("/proc/self/fd");
+    if (dir)
+    {
+        while (readdir(dir))
+        {
+            count++;
+        }
+        closedir(dir);
+    }
+    return count - 3; // . .. 和opendir自己的
+}
+
+// /proc/net/sockstat中UDP的套接字数和缓冲区占用的页数
+static void bench_udp_stat(long* inuse, long* pages)
+{
+    char line[256];
+    *inuse = 0;
+    *pages = 0;
+    FILE* file = fopen("/proc/net/sockstat", "r");
+    while (file && fgets(line, sizeof(line), file))
+    {
+        if (sscanf(line, "UDP: inuse %ld mem %ld", inuse, pages) == 2)
+        {
+            break;
+        }
+    }
+    if (file)
+    {
+        fclose(file);
+    }
+}
+
+static long bench_rss_kb(void)
+{
+    long pages = 0;
+    long rss = 0;
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (file)
+    {
+        if (fscanf(file, "%ld %ld", &pages, &rss) != 2)
+        {
+            rss = 0;
+        }
+        fclose(file);
+    }
+    return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int bench_client_start(bench_client_t* client, int epoll_fd)
+{
+    if (client->fd >= 0)
+    {
+        close(client->fd);
+    }
+
+    client->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+    if (client->fd < 0)
+    {
+        return -1;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = client;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->fd, &event);
+
+    uint8_t request[64];
+    request[0] = 0;
+    request[1] = TFTP_PACKET_RRQ;
+    int size = 2 + sprintf((char*)request + 2, "bench.bin") + 1;
+    size += sprintf((char*)request + size, "octet") + 1;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(BENCH_PORT);
+    client->expect = 1;
+    client->last = bench_now();
+    return (sendto(client->fd, request, size, 0, (const struct sockaddr*)&addr, sizeof(addr)) == size) ? 0 : -1;
+}
+
+// 大量客户端同时下载小文件，比较每个会话一个套接字和共享套接字时服务器的fd数、内存和包速率
+static int bench_sessions(int argc, char** argv)
+{
+    int clients = argc > 0 ? atoi(argv[0]) : 500;
+    int seconds = argc > 1 ? atoi(argv[1]) : 5;
+    int demux = argc > 2 ? atoi(argv[2]) : 0;
+    int trace = argc > 3 ? atoi(argv[3]) : 0;
+    int arena = argc > 4 ? atoi(argv[4]) : 0;
+
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    char dir[] = BENCH_TEMP_DIR;
+    if (clients < 1)
+    {
+        printf("bench: bad args\n");
+        return -1;
+    }
+    if (bench_fixture(dir, "bench.bin", BENCH_FILE_SIZE) < 0)
+    {
+        return -1;
+    }
+
+    long base_inuse;
+    long base_pages;
+    bench_udp_stat(&base_inuse, &base_pages);
+    int base_fds = bench_count_fds();
+    long base_rss = bench_rss_kb();
+
+    // 服务器每个请求都会打印，测试期间把输出丢掉
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    tftpd_config_t config;
+    tftpd_config_init(&config);
+    config.dir = dir;
+    config.port = BENCH_PORT;
+    config.event_loop = 1;
+    config.demux_sockets = demux;
+    config.arena = arena;
+    tftp_trace_enable(trace);
+    tftp_hist_reset();
+    if (tftpd_start_config(&config) < 0)
+    {
+        dup2(saved_stdout, STDOUT_FILENO);
+        printf("bench: start server failed\n");
+        bench_cleanup(dir);
+        return -1;
+    }
+    usleep(200000);
+    int server_fds = bench_count_fds() - base_fds;
+
+    int epoll_fd = epoll_create1(0);
+    bench_client_t* list = (bench_client_t*)calloc(clients, sizeof(bench_client_t));
+    if ((epoll_fd < 0) || (list == NULL))
+    {
+        dup2(saved_stdout, STDOUT_FILENO);
+        printf("bench: no memory\n");
+        bench_cleanup(dir);
+        return -1;
+    }
+    for (int i = 0; i < clients; i++)
+    {
+        list[i].fd = -1;
+        bench_client_start(list + i, epoll_fd);
+    }
+
+    uint64_t packets = 0;
+    uint64_t transfers = 0;
+    uint64_t stalls = 0;
+    int peak_fds = 0;
+    long peak_inuse = 0;
+    long peak_pages = 0;
+    long peak_rss = 0;
+    double start = bench_now();
+    double next_sample = start + 0.5;
+    double now = start;
+    struct epoll_event events[256];
+    while (now - start < seconds)
+    {
+        int count = epoll_wait(epoll_fd, events, 256, 100);
+        for (int i = 0; i < count; i++)
+        {
+            bench_client_t* client = (bench_client_t*)events[i].data.ptr;
+            tftp_packet_t packet;
+            struct sockaddr_in from;
+            socklen_t len = sizeof(from);
+            ssize_t size;
+            while ((size = recvfrom(client->fd, &packet, sizeof(packet), 0, (struct sockaddr*)&from, &len)) >= 4)
+            {
+                if ((ntohs(packet.opcode) != TFTP_PACKET_DATA) || (ntohs(packet.data.block_num) != client->expect))
+                {
+                    continue;
+                }
+
+                packets++;
+                client->last = bench_now();
+                uint16_t ack[2] = { htons(TFTP_PACKET_ACK), packet.data.block_num };
+                sendto(client->fd, ack, sizeof(ack), 0, (const struct sockaddr*)&from, len);
+                client->expect++;
+                if (size < 4 + TFTP_DEFAULT_BLOCK_SIZE)
+                {
+                    transfers++;
+                    bench_client_start(client, epoll_fd);
+                    break;
+                }
+            }
+        }
+
+        now = bench_now();
+        if (now >= next_sample)
+        {
+            long inuse;
+            long pages;
+            bench_udp_stat(&inuse, &pages);
+            int fds = bench_count_fds() - base_fds - clients - 1;
+            long rss = bench_rss_kb() - base_rss;
+            peak_fds = (fds > peak_fds) ? fds : peak_fds;
+            peak_inuse = (inuse - base_inuse - clients > peak_inuse) ? inuse - base_inuse - clients : peak_inuse;
+            peak_pages = (pages - base_pages > peak_pages) ? pages - base_pages : peak_pages;
+            peak_rss = (rss > peak_rss) ? rss : peak_rss;
+            next_sample = now + 0.5;
+
+            // 丢了包的客户端换一个端口重新请求，服务器的会话自己超时
+            for (int i = 0; i < clients; i++)
+            {
+                if (now - list[i].last > BENCH_STALL_MS / 1000.0)
+                {
+                    stalls++;
+                    bench_client_start(list + i, epoll_fd);
+                }
+            }
+        }
+    }
+    double elapsed = bench_now() - start;
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    printf("sessions: %d clients, %d s, %s%s%s\n", clients, seconds, demux ? "shared sockets" : "socket per session",
+        trace ? ", tracing" : "", arena ? ", arena" : "");
+    if (demux)
+    {
+        printf("  demux sockets   %d\n", demux);
+    }
+    printf("  server fds      %d idle, %d peak\n", server_fds, peak_fds);
+    printf("  udp sockets     %ld peak (server side)\n", peak_inuse);
+    printf("  udp buffers     %ld KB peak\n", peak_pages * (sysconf(_SC_PAGESIZE) / 1024));
+    printf("  rss growth      %ld KB peak\n", peak_rss);
+    printf("  data packets    %.0f /s\n", packets / elapsed);
+    printf("  transfers       %.0f /s, %llu stalls\n", transfers / elapsed, (unsigned long long)stalls);
+    tftp_hist_print(TFTP_HIST_SERVER, "  tftpd");
+    tftp_arena_print("  tftpd");
+
+    bench_cleanup(dir);
+    return 0;
+}
+
+// 改写前的选项编解码：每个字段反复strlen/strcmp/sprintf/atoi，只用来对比
+static char* legacy_write_information(tftp_t* tftp, char* buffer, const char* information, int64_t value)
+{
+    char* buffer_end = ((char*)&tftp->tx_packet) + sizeof(tftp_packet_t);
+    size_t len = strlen(information) + 1;
+    if (buffer + len > buffer_end)
+    {
+        return NULL;
+    }
+    strcpy(buffer, information);
+    buffer += len;
+
+    if (value >= 0)
+    {
+        if (buffer + 24 >= buffer_end)
+        {
+            return NULL;
+        }
+        sprintf(buffer, "%lld", (long long)value);
+        buffer += strlen(buffer) + 1;
+    }
+    return buffer;
+}
+
+#define LEGACY_WRITE(buffer, info, value) \
+    if ((buffer = legacy_write_information(tftp, buffer, info, value)) == NULL) return -1
+
+static int legacy_build_request(tftp_t* tftp, const char* filename, int64_t file_size, int option)
+{
+    tftp_packet_t* pkt = &tftp->tx_packet;
+    pkt->opcode = htons(TFTP_PACKET_RRQ);
+    char* buffer = (char*)pkt->req.args;
+    LEGACY_WRITE(buffer, filename, -1);
+    LEGACY_WRITE(buffer, (option & TFTP_OPT_NETASCII) ? "netascii" : "octet", -1);
+    if (option & TFTP_OPT_BASE)
+    {
+        LEGACY_WRITE(buffer, "blksize", tftp->block_size);
+        LEGACY_WRITE(buffer, "tsize", file_size);
+    }
+    if (option & TFTP_OPT_RANGE)
+    {
+        LEGACY_WRITE(buffer, "offset", tftp->offset);
+        LEGACY_WRITE(buffer, "range", tftp->range);
+    }
+    if (option & TFTP_OPT_CHECKSUM)
+    {
+        LEGACY_WRITE(buffer, "checksum", -1);
+        LEGACY_WRITE(buffer, "crc32c", -1);
+    }
+    if (option & TFTP_OPT_COMPRESS)
+    {
+        LEGACY_WRITE(buffer, "compress", -1);
+        LEGACY_WRITE(buffer, "zlib", -1);
+    }
+    if (option & TFTP_OPT_WINDOW)
+    {
+        LEGACY_WRITE(buffer, "aimdwindow", tftp->window_size);
+    }
+    return (int)(buffer - (char*)pkt);
+}
+
+static int legacy_build_oack(tftp_t* tftp)
+{
+    tftp_packet_t* pkt = &tftp->tx_packet;
+    pkt->opcode = htons(TFTP_PACKET_OACK);
+    char* buffer = pkt->oack.option;
+    LEGACY_WRITE(buffer, "blksize", tftp->block_size);
+    LEGACY_WRITE(buffer, "tsize", tftp->file_size);
+    if (tftp->option & TFTP_OPT_RANGE)
+    {
+        LEGACY_WRITE(buffer, "offset", tftp->offset);
+        LEGACY_WRITE(buffer, "range", tftp->range);
+    }
+    if (tftp->option & TFTP_OPT_CHECKSUM)
+    {
+        LEGACY_WRITE(buffer, "checksum", -1);
+        LEGACY_WRITE(buffer, "crc32c", -1);
+    }
+    if (tftp->option & TFTP_OPT_COMPRESS)
+    {
+        LEGACY_WRITE(buffer, "compress", -1);
+        LEGACY_WRITE(buffer, "zlib", -1);
+    }
+    if (tftp->option & TFTP_OPT_WINDOW)
+    {
+        LEGACY_WRITE(buffer, "aimdwindow", tftp->window_size);
+    }
+    return (int)(buffer - (char*)pkt);
+}
+
+// 跳过当前字符串，不认识的选项只跳过名字
+#define LEGACY_SKIP(buffer) buffer += strlen(buffer) + 1
+
+static int legacy_parse_oack(tftp_t* tftp)
+{
+    char* buffer = (char*)&tftp->rx_packet.oack.option;
+    char* end = (char*)&tftp->rx_packet + sizeof(tftp_packet_t);
+    tftp->option = TFTP_OPT_BASE | (tftp->option & TFTP_OPT_NETASCII);
+    while ((buffer < end) && (*buffer))
+    {
+        if (strcmp(buffer, "blksize") == 0)
+        {
+            LEGACY_SKIP(buffer);
+            int blksize = atoi(buffer);
+            if ((blksize == 0) || (blksize > tftp->block_size))
+            {
+                return -1;
+            }
+            tftp->block_size = blksize;
+        }
+        else if (strcmp(buffer, "tsize") == 0)
+        {
+            LEGACY_SKIP(buffer);
+            tftp->file_size = strtoll(buffer, NULL, 10);
+        }
+        else if (strcmp(buffer, "offset") == 0)
+        {
+            LEGACY_SKIP(buffer);
+            tftp->offset = strtoll(buffer, NULL, 10);
+            tftp->option |= TFTP_OPT_RANGE;
+        }
+        else if (strcmp(buffer, "range") == 0)
+        {
+            LEGACY_SKIP(buffer);
+            tftp->range = strtoll(buffer, NULL, 10);
+        }
+        else if (strcmp(buffer, "compress") == 0)
+        {
+            LEGACY_SKIP(buffer);
+            tftp->option |= (strcmp(buffer, "zlib") == 0) ? TFTP_OPT_COMPRESS : 0;
+        }
+        else if (strcmp(buffer, "checksum") == 0)
+        {
+            LEGACY_SKIP(buffer);
+            tftp->option |= (strcmp(buffer, "crc32c") == 0) ? TFTP_OPT_CHECKSUM : 0;
+        }
+        else if (strcmp(buffer, "aimdwindow") == 0)
+        {
+            LEGACY_SKIP(buffer);
+            int window_size = atoi(buffer);
+            if ((window_size > 0) && (window_size < tftp->window_size))
+            {
+                tftp->window_size = window_size;
+            }
+            tftp->option |= TFTP_OPT_WINDOW;
+        }
+        else if (strcmp(buffer, "crc32c") == 0)
+        {
+            LEGACY_SKIP(buffer);
+            tftp->peer_crc = (uint32_t)strtoul(buffer, NULL, 10);
+            tftp->option |= TFTP_OPT_CHECKSUM;
+        }
+        LEGACY_SKIP(buffer);
+    }
+    return 0;
+}
+
+static int legacy_parse_req(const tftp_packet_t* pkt, size_t pkt_size, tftp_req_t* req)
+{
+    req->opcode = ntohs(pkt->opcode);
+    req->option = 0;
+    req->block_size = TFTP_DEFAULT_BLOCK_SIZE;
+    req->filesize = 0;
+    req->offset = 0;
+    req->range = 0;
+    req->window_size = 1;
+    memset(req->filename, 0, sizeof(req->filename));
+
+    char* buffer = (char*)pkt->req.args;
+    char* end = (char*)pkt + pkt_size;
+    strncpy(req->filename, buffer, sizeof(req->filename));
+    buffer += strlen(req->filename) + 1;
+    if (strcasecmp(buffer, "netascii") == 0)
+    {
+        req->option |= TFTP_OPT_NETASCII;
+    }
+    else if (strcasecmp(buffer, "octet") != 0)
+    {
+        return -1;
+    }
+    LEGACY_SKIP(buffer);
+
+    while ((buffer < end) && (*buffer))
+    {
+        req->option |= TFTP_OPT_BASE;
+        if (strcmp(buffer, "blksize") == 0)
+        {
+            LEGACY_SKIP(buffer);
+            int size = atoi(buffer);
+            if (size < 0)
+            {
+                return -1;
+            }
+            req->block_size = (size > TFTP_BLOCK_SIZE) ? TFTP_BLOCK_SIZE : size;
+        }
+        else if (strcmp(buffer, "tsize") == 0)
+        {
+            LEGACY_SKIP(buffer);
+            req->filesize = atoi(buffer);
+        }
+        else if (strcmp(buffer, "compress") == 0)
+        {
+            LEGACY_SKIP(buffer);
+            req->option |= (strcmp(buffer, "zlib") == 0) ? TFTP_OPT_COMPRESS : 0;
+        }
+        else if (strcmp(buffer, "checksum") == 0)
+        {
+            LEGACY_SKIP(buffer);
+            req->option |= (strcmp(buffer, "crc32c") == 0) ? TFTP_OPT_CHECKSUM : 0;
+        }
+        else if (strcmp(buffer, "offset") == 0)
+        {
+            LEGACY_SKIP(buffer);
+            req->offset = strtoll(buffer, NULL, 10);
+            req->option |= TFTP_OPT_RANGE;
+        }
+        else if (strcmp(buffer, "aimdwindow") == 0)
+        {
+            LEGACY_SKIP(buffer);
+            req->window_size = atoi(buffer);
+            if (req->window_size > TFTP_WINDOW_MAX)
+            {
+                req->window_size = TFTP_WINDOW_MAX;
+            }
+            req->option |= (req->window_size > 0) ? TFTP_OPT_WINDOW : 0;
+        }
+        else if ((strcmp(buffer, "range") == 0) && (req->opcode == TFTP_PACKET_RRQ))
+        {
+            LEGACY_SKIP(buffer);
+            req->range = strtoll(buffer, NULL, 10);
+            req->option |= TFTP_OPT_RANGE;
+        }
+        LEGACY_SKIP(buffer);
+    }
+    return 0;
+}
+
+// 每个请求都要走的编解码路径，改写前后各跑一遍，结果必须一样
+static int bench_options(int argc, char** argv)
+{
+    int rounds = argc > 0 ? atoi(argv[0]) : 2000000;
+    if (rounds < 1)
+    {
+        printf("bench: bad args\n");
+        return -1;
+    }
+
+    static tftp_t tftp;
+    static tftp_req_t req;
+    const char* filename = "images/boot/vmlinuz-6.1.0-amd64";
+    int option = TFTP_OPT_BASE | TFTP_OPT_RANGE | TFTP_OPT_CHECKSUM | TFTP_OPT_WINDOW;
+    tftp.block_size = 1428;
+    tftp.window_size = 16;
+    tftp.offset = 1048576;
+    tftp.range = 4194304;
+    tftp.file_size = 73400320;
+    tftp.option = option;
+    tftp.socket = -1;
+
+    // 同一个请求包和OACK包作为解析的输入
+    tftp_packet_t request;
+    tftp_packet_t oack;
+    int request_size = tftp_build_request(&tftp, 1, filename, 0, option);
+    memcpy(&request, &tftp.tx_packet, (size_t)request_size);
+    int oack_size = tftp_build_oack(&tftp);
+    memcpy(&oack, &tftp.tx_packet, (size_t)oack_size);
+    int ok = (legacy_build_request(&tftp, filename, 0, option) == request_size)
+        && (memcmp(&request, &tftp.tx_packet, (size_t)request_size) == 0)
+        && (legacy_build_oack(&tftp) == oack_size) && (memcmp(&oack, &tftp.tx_packet, (size_t)oack_size) == 0);
+
+    printf("options: %d rounds, request %d bytes, oack %d bytes, encoders %s\n", rounds, request_size, oack_size, ok ? "match" : "MISMATCH");
+    printf("  %-18s %10s %10s\n", "ns/op", "legacy", "single");
+    for (int test = 0; test < 5; test++)
+    {
+        static const char* names[] = { "write option", "build request", "build oack", "parse oack", "parse request" };
+        double elapsed[2];
+        for (int impl = 0; impl < 2; impl++)
+        {
+            double start = bench_now();
+            for (int n = 0; n < rounds; n++)
+            {
+                switch (test)
+                {
+                case 0:
+                    if (impl == 0)
+                    {
+                        legacy_write_information(&tftp, tftp.tx_packet.oack.option, "blksize", 1428 + (n & 7));
+                    }
+                    else
+                    {
+                        TFTP_OPTION_NUMBER(tftp.tx_packet.oack.option, (const char*)(&tftp.tx_packet + 1), "blksize", 1428 + (n & 7));
+                    }
+                    break;
+                case 1:
+                    (impl == 0) ? legacy_build_request(&tftp, filename, n, option) : tftp_build_request(&tftp, 1, filename, n, option);
+                    break;
+                case 2:
+                    (impl == 0) ? legacy_build_oack(&tftp) : tftp_build_oack(&tftp);
+                    break;
+                case 3:
+                    memcpy(&tftp.rx_packet, &oack, (size_t)oack_size);
+                    ((char*)&tftp.rx_packet)[oack_size] = '\0';
+                    tftp.option = option;
+                    (impl == 0) ? legacy_parse_oack(&tftp) : tftp_parse_oack(&tftp, (size_t)oack_size);
+                    break;
+                default:
+                    (impl == 0) ? legacy_parse_req(&request, (size_t)request_size, &req) : tftp_parse_req(&request, (size_t)request_size, &req);
+                    break;
+                }
+                __asm__ volatile("" ::: "memory");
+            }
+            elapsed[impl] = (bench_now() - start) * 1e9 / rounds;
+        }
+        printf("  %-18s %10.1f %10.1f\n", names[test], elapsed[0], elapsed[1]);
+    }
+    return ok ? 0 : -1;
+}
+
+// 每个包记录一次事件的开销：关闭时只是判断NULL，开启时写一个16字节的槽
+static int bench_trace(int argc, char** argv)
+{
+    int events = argc > 0 ? atoi(argv[0]) : TFTP_TRACE_EVENTS;
+    int rounds = argc > 1 ? atoi(argv[1]) : 10000000;
+    if ((events < 1) || (rounds < 1))
+    {
+        printf("bench: bad args\n");
+        return -1;
+    }
+
+    tftp_packet_t packet;
+    packet.opcode = htons(TFTP_PACKET_DATA);
+    tftp_trace_t* traces[2] = { NULL, NULL };
+    tftp_trace_enable(events);
+    traces[1] = tftp_trace_start();
+    tftp_trace_enable(0);
+
+    printf("trace: %d events per session, %d packets\n", events, rounds);
+    for (int i = 0; i < 2; i++)
+    {
+        double start = bench_now();
+        for (int n = 0; n < rounds; n++)
+        {
+            packet.data.block_num = htons((uint16_t)n);
+            tftp_trace_packet(traces[i], TFTP_TRACE_SEND, &packet, 516);
+            __asm__ volatile("" ::: "memory");
+        }
+        double elapsed = bench_now() - start;
+        printf("  %-8s %.1f ns/event\n", i ? "on" : "off", elapsed * 1e9 / rounds);
+    }
+    printf("  memory   %zu bytes per session\n", sizeof(tftp_trace_t) + (traces[1]->mask + 1) * sizeof(tftp_trace_event_t));
+
+    tftp_trace_finish(traces[1]);
+    return 0;
+}
+
+#define BENCH_HOT_FILE (1024 * 1024)
+
+// 文件在页缓存中的字节数，用mincore按页统计
+static int64_t bench_resident(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if ((fd < 0) || (fstat(fd, &st) < 0) || (st.st_size == 0))
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return 0;
+    }
+
+    long page = sysconf(_SC_PAGESIZE);
+    size_t pages = (size_t)((st.st_size + page - 1) / page);
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    unsigned char* vec = (unsigned char*)malloc(pages);
+    int64_t resident = 0;
+    if ((map != MAP_FAILED) && vec && (mincore(map, (size_t)st.st_size, vec) == 0))
+    {
+        for (size_t i = 0; i < pages; i++)
+        {
+            resident += vec[i] & 1;
+        }
+    }
+
+    free(vec);
+    if (map != MAP_FAILED)
+    {
+        munmap(map, (size_t)st.st_size);
+    }
+    close(fd);
+    return resident * page;
+}
+
+static void bench_evict(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0)
+    {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+static void bench_touch(const char* path)
+{
+    char buffer[65536];
+    int fd = open(path, O_RDONLY);
+    while ((fd >= 0) && (read(fd, buffer, sizeof(buffer)) > 0))
+    {
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+// 子进程里启动服务器：先把小文件读两遍进活跃链表，下载一次大文件，再看小文件还剩多少在页缓存里
+static int bench_pagecache_run(const char* dir, int hot_files, int64_t drop_cache_size, uint16_t port)
+{
+    char path[256];
+    for (int i = 0; i < hot_files; i++)
+    {
+        snprintf(path, sizeof(path), "%s/hot%d.bin", dir, i);
+        bench_evict(path);
+        bench_touch(path);
+        bench_touch(path);
+    }
+    snprintf(path, sizeof(path), "%s/big.bin", dir);
+    bench_evict(path);
+
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    tftpd_config_t config;
+    tftpd_config_init(&config);
+    config.dir = dir;
+    config.port = port;
+    config.event_loop = 1;
+    config.drop_cache_size = drop_cache_size;
+    int error = tftpd_start_config(&config);
+    usleep(200000);
+
+    double start = bench_now();
+    if (error == 0)
+    {
+        error = tftp_get_file("127.0.0.1", port, TFTP_BLOCK_SIZE, "big.bin", "/dev/null", TFTP_OPT_BASE | TFTP_OPT_WINDOW);
+    }
+    double elapsed = bench_now() - start;
+    usleep(200000);
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    if (error < 0)
+    {
+        printf("bench: transfer failed\n");
+        return -1;
+    }
+
+    int64_t hot_resident = 0;
+    for (int i = 0; i < hot_files; i++)
+    {
+        snprintf(path, sizeof(path), "%s/hot%d.bin", dir, i);
+        hot_resident += bench_resident(path);
+    }
+    snprintf(path, sizeof(path), "%s/big.bin", dir);
+    int64_t big_resident = bench_resident(path);
+
+    tftpd_stats_t stats;
+    tftpd_get_stats(&stats);
+    printf("  %-6s %8.1f MB/s %8.1f MB %8.1f MB %9.1f%%\n", drop_cache_size ? "drop" : "keep",
+        (double)stats.bytes / elapsed / 1e6, big_resident / 1048576.0, stats.cache_dropped / 1048576.0,
+        100.0 * (double)hot_resident / ((double)hot_files * BENCH_HOT_FILE));
+    return 0;
+}
+
+// 下载一个大文件之后小文件的页缓存命中率，大文件读过的部分留在缓存里 vs 边读边丢
+// 没有内存压力时小文件不会被挤掉，要在限制了内存的cgroup里运行才能看出差别
+static int bench_pagecache(int argc, char** argv)
+{
+    int big_mb = argc > 0 ? atoi(argv[0]) : 512;
+    int hot_files = argc > 1 ? atoi(argv[1]) : 64;
+    if ((big_mb < 1) || (hot_files < 1))
+    {
+        printf("bench: bad args\n");
+        return -1;
+    }
+
+    char dir[] = BENCH_TEMP_DIR;
+    char name[32];
+    for (int i = 0; i < hot_files; i++)
+    {
+        snprintf(name, sizeof(name), "hot%d.bin", i);
+        if (bench_fixture(dir, name, BENCH_HOT_FILE) < 0)
+        {
+            return -1;
+        }
+    }
+    if (bench_fixture(dir, "big.bin", (int64_t)big_mb * BENCH_HOT_FILE) < 0)
+    {
+        return -1;
+    }
+
+    int error = 0;
+
+    printf("pagecache: %d MB file, %d hot files of 1 MB, threshold %d MB\n", big_mb, hot_files, TFTPD_DROP_CACHE_SIZE >> 20);
+    printf("  mode       transfer   big cached    dropped  hot hit rate\n");
+    // 服务器的配置启动后不能改，每种方式在一个新的子进程里跑
+    for (int mode = 0; (error == 0) && (mode < 2); mode++)
+    {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            int result = bench_pagecache_run(dir, hot_files, mode ? TFTPD_DROP_CACHE_SIZE : 0, (uint16_t)(BENCH_PORT + 1 + mode));
+            fflush(stdout);
+            _exit(result < 0);
+        }
+
+        int status = 1;
+        if ((pid < 0) || (waitpid(pid, &status, 0) < 0) || (status != 0))
+        {
+            error = -1;
+        }
+    }
+
+    bench_cleanup(dir);
+    return error;
+}
+
+#define BENCH_RTT_BLOCK 512
+
+static double bench_cpu_seconds(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void bench_rtt_print(const char* name, int side, double cpu, int blocks)
+{
+    tftp_hist_t* hist = (tftp_hist_t*)malloc(sizeof(tftp_hist_t));
+    if (hist == NULL)
+    {
+        return;
+    }
+
+    tftp_hist_read(side, TFTP_HIST_ACK_RTT, hist);
+    printf("  %-12s %8llu %8llu %8llu %8llu %10.1f\n", name, (unsigned long long)(hist->total ? hist->sum / hist->total : 0),
+        (unsigned long long)tftp_hist_percentile(hist, 50), (unsigned long long)tftp_hist_percentile(hist, 99),
+        (unsigned long long)tftp_hist_percentile(hist, 99.9), cpu / blocks * 1e6);
+    free(hist);
+}
+
+// 子进程里启动服务器，下载再上传同一个文件，都是停等：下载时服务器量ACK的往返时间，上传时客户端量
+static int bench_rtt_run(const char* dir, int busy_poll_us, int event_loop, int blocks, uint16_t port)
+{
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    tftpd_config_t config;
+    tftpd_config_init(&config);
+    config.dir = dir;
+    config.port = port;
+    config.event_loop = event_loop;
+    config.busy_poll_us = busy_poll_us;
+    tftp_set_busy_poll(busy_poll_us);
+    int error = tftpd_start_config(&config);
+    usleep(200000);
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/rtt.bin", dir);
+    tftp_hist_reset();
+    double cpu = bench_cpu_seconds();
+    if (error == 0)
+    {
+        error = tftp_get_file("127.0.0.1", port, BENCH_RTT_BLOCK, "rtt.bin", "/dev/null", TFTP_OPT_BASE);
+    }
+    usleep(100000);
+    double get_cpu = bench_cpu_seconds() - cpu;
+
+    cpu = bench_cpu_seconds();
+    if (error == 0)
+    {
+        error = tftp_put_file("127.0.0.1", port, BENCH_RTT_BLOCK, "rtt_up.bin", path, TFTP_OPT_BASE);
+    }
+    usleep(100000);
+    double put_cpu = bench_cpu_seconds() - cpu;
+
+    tftp_stats_t stats;
+    tftp_last_stats(&stats);
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    if (error < 0)
+    {
+        printf("bench: transfer failed\n");
+        return -1;
+    }
+
+    printf(" busy poll %d us, %s server, client spin hits %u/%d\n", busy_poll_us, event_loop ? "event" : "thread", stats.spin_hits, blocks);
+    bench_rtt_print("get (tftpd)", TFTP_HIST_SERVER, get_cpu, blocks);
+    bench_rtt_print("put (tftp)", TFTP_HIST_CLIENT, put_cpu, blocks);
+    return 0;
+}
+
+// 停等传输中每块ACK的往返时间，阻塞接收 vs 先忙等
+static int bench_rtt(int argc, char** argv)
+{
+    int busy_poll_us = argc > 0 ? atoi(argv[0]) : 50;
+    int blocks = argc > 1 ? atoi(argv[1]) : 20000;
+    int event_loop = (argc > 2) && (strcmp(argv[2], "event") == 0);
+    if ((busy_poll_us < 1) || (blocks < 1))
+    {
+        printf("bench: bad args\n");
+        return -1;
+    }
+
+    char dir[] = BENCH_TEMP_DIR;
+    if (bench_fixture(dir, "rtt.bin", (int64_t)blocks * BENCH_RTT_BLOCK) < 0)
+    {
+        return -1;
+    }
+
+    printf("rtt: %d blocks of %d bytes, lock-step, %ld cpus\n", blocks, BENCH_RTT_BLOCK, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("  ack rtt us       mean      p50      p99    p99.9  cpu us/blk\n");
+    int error = 0;
+    for (int mode = 0; (error == 0) && (mode < 2); mode++)
+    {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            int result = bench_rtt_run(dir, mode ? busy_poll_us : 0, event_loop, blocks, (uint16_t)(BENCH_PORT + 3 + mode));
+            fflush(stdout);
+            _exit(result < 0);
+        }
+
+        int status = 1;
+        if ((pid < 0) || (waitpid(pid, &status, 0) < 0) || (status != 0))
+        {
+            error = -1;
+        }
+    }
+
+    bench_cleanup(dir);
+    return error;
+}
+
+#define BENCH_RESTART_PORT (BENCH_PORT + 5)
+#define BENCH_RESTART_AT_MS 300 // 大文件开始下载后这么久重启
+#define BENCH_RESTART_GETS_MS 2000 // 小文件请求持续的时间
+#define BENCH_RESTART_SLOW_MS 100
+#define BENCH_RESTART_WAIT_MS 5000 // 之后最多再等大文件这么久
+
+static void bench_null_stdout(void)
+{
+    fflush(stdout);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+}
+
+// 子进程里的服务器，结果写到out：旧进程交出监听套接字后等会话结束再退出，冷重启时等着被杀掉
+// 新进程报告从启动到处理完第一个请求的时间，然后一直运行
+static void bench_restart_server(const char* dir, const char* handoff_path, int is_new, int out)
+{
+    double start = bench_now();
+    bench_null_stdout();
+
+    tftpd_config_t config;
+    tftpd_config_init(&config);
+    config.dir = dir;
+    config.port = BENCH_RESTART_PORT;
+    config.event_loop = 1;
+    config.handoff_path = handoff_path;
+    if (tftpd_start_config(&config) < 0)
+    {
+        dprintf(out, "bench: start server failed\n");
+        _exit(1);
+    }
+
+    tftpd_stats_t stats;
+    if (!is_new)
+    {
+        while ((handoff_path == NULL) || (tftpd_wait_drained(-1) < 0))
+        {
+            pause();
+        }
+        tftpd_get_stats(&stats);
+        dprintf(out, "  old process: drained and exited, %llu sessions, %llu failed\n",
+            (unsigned long long)stats.sessions, (unsigned long long)stats.failures);
+        _exit(0);
+    }
+
+    do
+    {
+        usleep(100);
+        tftpd_get_stats(&stats);
+    } while ((stats.sessions == 0) && (bench_now() - start < 30));
+    dprintf(out, "  new process: first request served %.1f ms after start\n", (bench_now() - start) * 1000);
+    while (1)
+    {
+        pause();
+    }
+}
+
+// 一边下载一个停等的大文件，一边连续请求小文件；中途启动新进程，比较交接和杀掉旧进程再绑定
+static int bench_restart_run(const char* dir, int handoff, int out)
+{
+    char handoff_path[256];
+    snprintf(handoff_path, sizeof(handoff_path), "%s/handoff.sock", dir);
+    const char* path = handoff ? handoff_path : NULL;
+    dprintf(out, " %s:\n", handoff ? "handoff" : "kill and rebind");
+
+    pid_t old_pid = fork();
+    if (old_pid == 0)
+    {
+        bench_restart_server(dir, path, 0, out);
+    }
+    usleep(200000);
+
+    pid_t big_pid = fork();
+    if (big_pid == 0)
+    {
+        bench_null_stdout();
+        double start = bench_now();
+        int error = tftp_get_file("127.0.0.1", BENCH_RESTART_PORT, BENCH_RTT_BLOCK, "big.bin", "/dev/null", TFTP_OPT_BASE);
+        dprintf(out, "  in-flight download: %s after %.2f s\n", (error < 0) ? "FAILED" : "completed", bench_now() - start);
+        _exit(error < 0);
+    }
+
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    bench_null_stdout();
+    pid_t new_pid = -1;
+    int gets = 0;
+    int failures = 0;
+    int slow = 0;
+    double max_ms = 0;
+    double start = bench_now();
+    while ((bench_now() - start) * 1000 < BENCH_RESTART_GETS_MS)
+    {
+        if ((new_pid < 0) && ((bench_now() - start) * 1000 >= BENCH_RESTART_AT_MS))
+        {
+            if (!handoff)
+            {
+                kill(old_pid, SIGKILL);
+                waitpid(old_pid, NULL, 0);
+                old_pid = -1;
+            }
+            new_pid = fork();
+            if (new_pid == 0)
+            {
+                bench_restart_server(dir, path, 1, out);
+            }
+        }
+
+        double get_start = bench_now();
+        failures += (tftp_get_file("127.0.0.1", BENCH_RESTART_PORT, TFTP_DEFAULT_BLOCK_SIZE, "small.bin", "/dev/null", TFTP_OPT_BASE) < 0);
+        double ms = (bench_now() - get_start) * 1000;
+        max_ms = (ms > max_ms) ? ms : max_ms;
+        slow += (ms > BENCH_RESTART_SLOW_MS);
+        gets++;
+    }
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    // 冷重启时大文件的会话跟着旧进程没了，客户端要重试很久才放弃
+    int status = 1;
+    double deadline = bench_now() + BENCH_RESTART_WAIT_MS / 1000.0;
+    while ((waitpid(big_pid, &status, WNOHANG) == 0) && (bench_now() < deadline))
+    {
+        usleep(10000);
+    }
+    if (bench_now() >= deadline)
+    {
+        kill(big_pid, SIGKILL);
+        waitpid(big_pid, NULL, 0);
+        dprintf(out, "  in-flight download: STALLED, killed\n");
+    }
+    if (old_pid > 0)
+    {
+        waitpid(old_pid, NULL, 0);
+    }
+    kill(new_pid, SIGKILL);
+    waitpid(new_pid, NULL, 0);
+
+    dprintf(out, "  %d gets during restart, %d failed, %d over %d ms, max %.1f ms\n", gets, failures, slow, BENCH_RESTART_SLOW_MS, max_ms);
+    return 0;
+}
+
+// 平滑重启：新进程接过监听套接字，旧进程处理完进行中的传输再退出
+static int bench_restart(int argc, char** argv)
+{
+    int big_mb = argc > 0 ? atoi(argv[0]) : 16;
+    if (big_mb < 1)
+    {
+        printf("bench: bad args\n");
+        return -1;
+    }
+
+    char dir[] = BENCH_TEMP_DIR;
+    if ((bench_fixture(dir, "big.bin", (int64_t)big_mb << 20) < 0) || (bench_fixture(dir, "small.bin", 1000) < 0))
+    {
+        return -1;
+    }
+
+    int error = 0;
+
+    printf("restart: %d MB lock-step download in flight, small gets for %d ms, restart at %d ms\n",
+        big_mb, BENCH_RESTART_GETS_MS, BENCH_RESTART_AT_MS);
+    fflush(stdout);
+    int out = dup(STDOUT_FILENO);
+    for (int handoff = 0; (error == 0) && (handoff < 2); handoff++)
+    {
+        error = bench_restart_run(dir, handoff, out);
+    }
+    close(out);
+
+    bench_cleanup(dir);
+    return error;
+}
+
+#define BENCH_BUDGET_PORT (BENCH_PORT + 6)
+#define BENCH_BUDGET_FILE (256 * 1024 * 1024)
+#define BENCH_BUDGET_WINDOW 64
+
+// 按块确认的客户端，请求最大的blksize和aimdwindow
+typedef struct _bench_budget_client_t
+{
+    int fd;
+    int block_size; // OACK中协商的
+    int window_size;
+    uint16_t expect;
+    int state; // 0: 等OACK; 1: 接收; -1: 被拒绝
+}bench_budget_client_t;
+
+static int bench_budget_request(bench_budget_client_t* client, int epoll_fd)
+{
+    client->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+    if (client->fd < 0)
+    {
+        return -1;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = client;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->fd, &event);
+
+    char request[128];
+    const char* end = request + sizeof(request);
+    request[0] = 0;
+    request[1] = TFTP_PACKET_RRQ;
+    char* buffer = TFTP_OPTION_STRING(request + 2, end, "budget.bin");
+    buffer = TFTP_OPTION_STRING(buffer, end, "octet");
+    buffer = TFTP_OPTION_NUMBER(buffer, end, "blksize", TFTP_BLOCK_SIZE);
+    buffer = TFTP_OPTION_NUMBER(buffer, end, "aimdwindow", BENCH_BUDGET_WINDOW);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(BENCH_BUDGET_PORT);
+    client->state = 0;
+    return (sendto(client->fd, request, buffer - request, 0, (const struct sockaddr*)&addr, sizeof(addr)) == buffer - request) ? 0 : -1;
+}
+
+static void bench_budget_input(bench_budget_client_t* client, uint64_t* bytes)
+{
+    tftp_packet_t packet;
+    struct sockaddr_in from;
+    socklen_t len = sizeof(from);
+    ssize_t size;
+    while ((size = recvfrom(client->fd, &packet, sizeof(packet), 0, (struct sockaddr*)&from, &len)) >= 4)
+    {
+        uint16_t opcode = ntohs(packet.opcode);
+        uint16_t block_num = 0;
+        if ((opcode == TFTP_PACKET_ERROR) && (client->state == 0))
+        {
+            client->state = -1;
+            continue;
+        }
+        else if ((opcode == TFTP_PACKET_OACK) && (client->state == 0))
+        {
+            tftp_option_reader_t reader;
+            tftp_option_pair_t pair;
+            tftp_option_reader_init(&reader, packet.oack.option, (const char*)&packet + size);
+            while (tftp_option_next(&reader, &pair) > 0)
+            {
+                if (pair.key == TFTP_KEY_BLKSIZE)
+                {
+                    client->block_size = (int)tftp_option_number(&pair);
+                }
+                else if (pair.key == TFTP_KEY_WINDOWSIZE)
+                {
+                    client->window_size = (int)tftp_option_number(&pair);
+                }
+            }
+            client->state = 1;
+            client->expect = 1;
+        }
+        else if ((opcode == TFTP_PACKET_DATA) && (client->state == 1) && (ntohs(packet.data.block_num) == client->expect))
+        {
+            block_num = client->expect++;
+            *bytes += (uint64_t)(size - 4);
+        }
+        else
+        {
+            continue;
+        }
+
+        uint16_t ack[2] = { htons(TFTP_PACKET_ACK), htons(block_num) };
+        sendto(client->fd, ack, sizeof(ack), 0, (const struct sockaddr*)&from, len);
+    }
+}
+
+// 子进程里启动服务器，所有客户端同时请求，下载一段时间后看会话记账的内存、RSS和吞吐
+static int bench_budget_run(const char* dir, int clients, int64_t budget, int seconds)
+{
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    bench_null_stdout();
+
+    long base_rss = bench_rss_kb();
+    tftpd_config_t config;
+    tftpd_config_init(&config);
+    config.dir = dir;
+    config.port = BENCH_BUDGET_PORT;
+    config.event_loop = 1;
+    config.memory_budget = budget;
+    int error = tftpd_start_config(&config);
+    usleep(200000);
+
+    int epoll_fd = epoll_create1(0);
+    bench_budget_client_t* list = (bench_budget_client_t*)calloc(clients, sizeof(bench_budget_client_t));
+    for (int i = 0; (error == 0) && (list != NULL) && (i < clients); i++)
+    {
+        error = bench_budget_request(list + i, epoll_fd);
+    }
+
+    uint64_t bytes = 0;
+    long peak_rss = 0;
+    double start = bench_now();
+    double next_sample = start;
+    struct epoll_event events[256];
+    while ((error == 0) && (list != NULL) && (bench_now() - start < seconds))
+    {
+        int count = epoll_wait(epoll_fd, events, 256, 100);
+        for (int i = 0; i < count; i++)
+        {
+            bench_budget_input((bench_budget_client_t*)events[i].data.ptr, &bytes);
+        }
+
+        if (bench_now() >= next_sample)
+        {
+            long rss = bench_rss_kb() - base_rss;
+            peak_rss = (rss > peak_rss) ? rss : peak_rss;
+            next_sample = bench_now() + 0.1;
+        }
+    }
+    double elapsed = bench_now() - start;
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    if ((error < 0) || (list == NULL))
+    {
+        printf("bench: start failed\n");
+        return -1;
+    }
+
+    int64_t window_blocks = 0;
+    int accepted = 0;
+    for (int i = 0; i < clients; i++)
+    {
+        if (list[i].state == 1)
+        {
+            accepted++;
+            window_blocks += (int64_t)list[i].window_size * list[i].block_size;
+        }
+    }
+
+    tftpd_stats_t stats;
+    tftpd_get_stats(&stats);
+    printf("  %-9s %8d %8llu %8llu %8lld %10.1f MB %9.1f MB %9.1f MB/s\n", budget ? "budget" : "unlimited", accepted,
+        (unsigned long long)stats.downgraded, (unsigned long long)stats.rejected, accepted ? (long long)(window_blocks / accepted) : 0LL,
+        stats.memory_peak / 1048576.0, peak_rss / 1024.0, bytes / elapsed / 1e6);
+    return 0;
+}
+
+// 一批请求最大blksize和aimdwindow的下载，不限内存 vs 内存预算：记账的峰值、RSS增长和吞吐
+static int bench_budget(int argc, char** argv)
+{
+    int clients = argc > 0 ? atoi(argv[0]) : 64;
+    int budget_mb = argc > 1 ? atoi(argv[1]) : 8;
+    int seconds = argc > 2 ? atoi(argv[2]) : 3;
+    if ((clients < 1) || (budget_mb < 1) || (seconds < 1))
+    {
+        printf("bench: bad args\n");
+        return -1;
+    }
+
+    // 稀疏文件，读出来都是0，下载期间不会结束
+    char dir[] = BENCH_TEMP_DIR;
+    if (bench_fixture(dir, NULL, 0) < 0)
+    {
+        return -1;
+    }
+    char path[256];
+    snprintf(path, sizeof(path), "%s/budget.bin", dir);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if ((fd < 0) || (ftruncate(fd, BENCH_BUDGET_FILE) < 0))
+    {
+        printf("bench: create %s failed\n", path);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        bench_cleanup(dir);
+        return -1;
+    }
+    close(fd);
+
+    printf("budget: %d clients asking blksize %d aimdwindow %d, budget %d MB, %d s\n",
+        clients, TFTP_BLOCK_SIZE, BENCH_BUDGET_WINDOW, budget_mb, seconds);
+    printf("  mode      accepted downgrade rejected window B  memory peak  rss growth    throughput\n");
+    int error = 0;
+    for (int mode = 0; (error == 0) && (mode < 2); mode++)
+    {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            int result = bench_budget_run(dir, clients, mode ? (int64_t)budget_mb << 20 : 0, seconds);
+            fflush(stdout);
+            _exit(result < 0);
+        }
+
+        int status = 1;
+        if ((pid < 0) || (waitpid(pid, &status, 0) < 0) || (status != 0))
+        {
+            error = -1;
+        }
+    }
+
+    bench_cleanup(dir);
+    return error;
+}
+
+#define BENCH_FLOOD_PORT (BENCH_PORT + 7)
+#define BENCH_FLOOD_SOURCE "127.0.0.2" // 洪水从另一个回环地址发，和正常请求分开限速
+#define BENCH_FLOOD_RATE 20 // 开过滤器时每个源地址每秒的请求数
+#define BENCH_FLOOD_BATCH 64 // 发这么多包看一次时间
+#define BENCH_FLOOD_SETTLE_MS 200
+#define BENCH_FLOOD_GET_MS 100 // 正常客户端每隔这么久请求一次，不超过限速
+
+// 子进程里的服务器，事件循环只有一个线程，进程的CPU时间就是分发线程的；洪水期间的CPU和统计写到out
+static void bench_flood_server(const char* dir, int filter, int seconds, int out)
+{
+    bench_null_stdout();
+    tftpd_config_t config;
+    tftpd_config_init(&config);
+    config.dir = dir;
+    config.port = BENCH_FLOOD_PORT;
+    config.event_loop = 1;
+    config.request_filter = filter;
+    config.request_rate = filter ? BENCH_FLOOD_RATE : 0;
+    if (tftpd_start_config(&config) < 0)
+    {
+        dprintf(out, "bench: start server failed\n");
+        _exit(1);
+    }
+
+    usleep(BENCH_FLOOD_SETTLE_MS * 1000);
+    double cpu = bench_cpu_seconds();
+    usleep(seconds * 1000000 + BENCH_FLOOD_SETTLE_MS * 1000);
+    cpu = bench_cpu_seconds() - cpu;
+
+    tftpd_stats_t stats;
+    tftpd_get_stats(&stats);
+    dprintf(out, "%.3f %llu %llu %llu\n", cpu, (unsigned long long)stats.sessions,
+        (unsigned long long)stats.filtered, (unsigned long long)stats.rate_limited);
+    _exit(0);
+}
+
+// 按pps轮流发四种包：乱码、DATA、ACK和请求不存在文件的RRQ，前三种都不该进分发线程
+static void bench_flood_send(int seconds, int pps, int out)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(BENCH_FLOOD_SOURCE);
+    if ((fd < 0) || (bind(fd, (const struct sockaddr*)&addr, sizeof(addr)) < 0))
+    {
+        dprintf(out, "bench: bind %s failed\n", BENCH_FLOOD_SOURCE);
+        _exit(1);
+    }
+
+    tftp_packet_t packets[4];
+    int sizes[4];
+    memset(packets, 0x5A, sizeof(packets));
+    packets[0].opcode = htons(0x5A5A);
+    sizes[0] = 48;
+    packets[1].opcode = htons(TFTP_PACKET_DATA);
+    packets[1].data.block_num = htons(1);
+    sizes[1] = 4 + TFTP_DEFAULT_BLOCK_SIZE;
+    packets[2].opcode = htons(TFTP_PACKET_ACK);
+    packets[2].ack.block_num = htons(1);
+    sizes[2] = 4;
+    char* end = (char*)(packets + 4);
+    char* buffer = TFTP_OPTION_STRING((char*)packets[3].req.args, end, "missing.bin");
+    buffer = TFTP_OPTION_STRING(buffer, end, "octet");
+    packets[3].opcode = htons(TFTP_PACKET_RRQ);
+    sizes[3] = (int)(buffer - (char*)(packets + 3));
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(BENCH_FLOOD_PORT);
+    int64_t sent = 0;
+    double start = bench_now();
+    double elapsed = 0;
+    while (elapsed < seconds)
+    {
+        if (sent > elapsed * pps)
+        {
+            usleep(1000);
+            elapsed = bench_now() - start;
+            continue;
+        }
+        for (int i = 0; i < BENCH_FLOOD_BATCH; i++, sent++)
+        {
+            sendto(fd, packets + (sent & 3), sizes[sent & 3], 0, (const struct sockaddr*)&addr, sizeof(addr));
+        }
+        elapsed = bench_now() - start;
+    }
+    _exit(0);
+}
+
+// 服务器、洪水各一个子进程，这个进程在洪水期间按固定间隔请求小文件
+static int bench_flood_run(const char* dir, int filter, int seconds, int pps, int out)
+{
+    fflush(stdout);
+    pid_t server_pid = fork();
+    if (server_pid == 0)
+    {
+        bench_flood_server(dir, filter, seconds, out);
+    }
+    usleep(BENCH_FLOOD_SETTLE_MS * 1000);
+
+    pid_t flood_pid = fork();
+    if (flood_pid == 0)
+    {
+        bench_flood_send(seconds, pps, out);
+    }
+
+    int saved_stdout = dup(STDOUT_FILENO);
+    bench_null_stdout();
+    int gets = 0;
+    int failures = 0;
+    double max_ms = 0;
+    double start = bench_now();
+    while (bench_now() - start < seconds)
+    {
+        double get_start = bench_now();
+        failures += (tftp_get_file("127.0.0.1", BENCH_FLOOD_PORT, TFTP_DEFAULT_BLOCK_SIZE, "small.bin", "/dev/null", TFTP_OPT_BASE) < 0);
+        double ms = (bench_now() - get_start) * 1000;
+        max_ms = (ms > max_ms) ? ms : max_ms;
+        gets++;
+        if (ms < BENCH_FLOOD_GET_MS)
+        {
+            usleep((useconds_t)((BENCH_FLOOD_GET_MS - ms) * 1000));
+        }
+    }
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    int status = 1;
+    waitpid(flood_pid, NULL, 0);
+    waitpid(server_pid, &status, 0);
+    printf(" %6s %5d %6d %7.1f  ", filter ? "on" : "off", gets, failures, max_ms);
+    fflush(stdout);
+    return (status == 0) ? 0 : -1;
+}
+
+// 监听端口上的垃圾包和同一个源的请求洪水：分发线程的CPU，正常客户端能不能拿到文件
+static int bench_flood(int argc, char** argv)
+{
+    int seconds = argc > 0 ? atoi(argv[0]) : 3;
+    int pps = argc > 1 ? atoi(argv[1]) : 20000;
+    if ((seconds < 1) || (pps < BENCH_FLOOD_BATCH))
+    {
+        printf("bench: bad args\n");
+        return -1;
+    }
+
+    char dir[] = BENCH_TEMP_DIR;
+    if (bench_fixture(dir, "small.bin", 1000) < 0)
+    {
+        return -1;
+    }
+
+    printf("flood: %d pps from %s for %d s, 3/4 junk/DATA/ACK and 1/4 RRQ, filter limit %d req/s per source\n",
+        pps, BENCH_FLOOD_SOURCE, seconds, BENCH_FLOOD_RATE);
+    printf(" filter  gets failed  max ms   server cpu  us/packet sessions filtered  limited\n");
+    int error = 0;
+    for (int filter = 0; (error == 0) && (filter < 2); filter++)
+    {
+        int fds[2];
+        if (pipe(fds) < 0)
+        {
+            error = -1;
+            break;
+        }
+        error = bench_flood_run(dir, filter, seconds, pps, fds[1]);
+        close(fds[1]);
+
+        char line[256];
+        ssize_t size = read(fds[0], line, sizeof(line) - 1);
+        close(fds[0]);
+        line[(size > 0) ? size : 0] = 0;
+        double cpu = 0;
+        unsigned long long sessions = 0;
+        unsigned long long filtered = 0;
+        unsigned long long limited = 0;
+        if ((error < 0) || (sscanf(line, "%lf %llu %llu %llu", &cpu, &sessions, &filtered, &limited) != 4))
+        {
+            printf("%s", line);
+            error = -1;
+            break;
+        }
+        printf("%8.3f s %10.2f %8llu %8llu %8llu\n", cpu, cpu / ((double)pps * seconds) * 1e6, sessions, filtered, limited);
+    }
+
+    bench_cleanup(dir);
+    return error;
+}
+
+#define BENCH_DEDUP_PORT (BENCH_PORT + 8)
+#define BENCH_DEDUP_BLOCK 1428
+#define BENCH_DEDUP_EDITS 16 // 每台设备改掉的地方：序列号、配置、校准数据
+#define BENCH_DEDUP_EDIT_SIZE 64
+#define BENCH_DEDUP_INSERT 300 // 再在随机位置插入一段，后面的内容整体错开
+
+
+// 同一个固件镜像的第index台设备的版本
+static int bench_dedup_variant(const uint8_t* image, int64_t size, int index, const char* path)
+{
+    uint8_t* data = (uint8_t*)malloc(size + BENCH_DEDUP_INSERT);
+    if (data == NULL)
+    {
+        return -1;
+    }
+
+    srand(index + 1);
+    int64_t insert_pos = (int64_t)(((double)rand() / RAND_MAX) * size);
+    memcpy(data, image, insert_pos);
+    for (int i = 0; i < BENCH_DEDUP_INSERT; i++)
+    {
+        data[insert_pos + i] = (uint8_t)rand();
+    }
+    memcpy(data + insert_pos + BENCH_DEDUP_INSERT, image + insert_pos, size - insert_pos);
+    for (int edit = 0; edit < BENCH_DEDUP_EDITS; edit++)
+    {
+        int64_t pos = (int64_t)(((double)rand() / RAND_MAX) * (size - BENCH_DEDUP_EDIT_SIZE));
+        for (int i = 0; i < BENCH_DEDUP_EDIT_SIZE; i++)
+        {
+            data[pos + i] = (uint8_t)rand();
+        }
+    }
+
+    FILE* file = fopen(path, "wb");
+    int error = ((file == NULL) || (fwrite(data, 1, size + BENCH_DEDUP_INSERT, file) != (size_t)(size + BENCH_DEDUP_INSERT))) ? -1 : 0;
+    if ((file != NULL) && (fclose(file) != 0))
+    {
+        error = -1;
+    }
+    free(data);
+    return error;
+}
+
+static int bench_same_file(const char* path1, const char* path2)
+{
+    FILE* file1 = fopen(path1, "rb");
+    FILE* file2 = fopen(path2, "rb");
+    int same = (file1 != NULL) && (file2 != NULL);
+    char buffer1[65536];
+    char buffer2[65536];
+    while (same)
+    {
+        size_t size1 = fread(buffer1, 1, sizeof(buffer1), file1);
+        size_t size2 = fread(buffer2, 1, sizeof(buffer2), file2);
+        same = (size1 == size2) && (memcmp(buffer1, buffer2, size1) == 0);
+        if (size1 == 0)
+        {
+            break;
+        }
+    }
+    if (file1 != NULL)
+    {
+        fclose(file1);
+    }
+    if (file2 != NULL)
+    {
+        fclose(file2);
+    }
+    return same;
+}
+
+// 子进程里起服务器，上传全部版本，量服务器目录(和仓库)的磁盘占用，再逐个下载回来比对
+static int bench_dedup_run(const char* dir, int devices, int dedup)
+{
+    char serve_dir[256];
+    char store_dir[256];
+    snprintf(serve_dir, sizeof(serve_dir), "%s/%s", dir, dedup ? "dedup" : "plain");
+    snprintf(store_dir, sizeof(store_dir), "%s/store", dir);
+    mkdir(serve_dir, 0755);
+
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    bench_null_stdout();
+
+    tftpd_config_t config;
+    tftpd_config_init(&config);
+    config.dir = serve_dir;
+    config.port = BENCH_DEDUP_PORT;
+    config.event_loop = 1;
+    config.dedup_dir = dedup ? store_dir : NULL;
+    int error = tftpd_start_config(&config);
+    usleep(200000);
+
+    char local[256];
+    char remote[64];
+    uint64_t bytes = 0;
+    double start = bench_now();
+    for (int i = 0; (error == 0) && (i < devices); i++)
+    {
+        struct stat st;
+        snprintf(local, sizeof(local), "%s/device%d.bin", dir, i);
+        snprintf(remote, sizeof(remote), "device%d.bin", i);
+        error = tftp_put_file("127.0.0.1", BENCH_DEDUP_PORT, BENCH_DEDUP_BLOCK, remote, local, TFTP_OPT_BASE);
+        bytes += (stat(local, &st) == 0) ? st.st_size : 0;
+    }
+    double put_time = bench_now() - start;
+
+    uint64_t disk = bench_dir_walk(serve_dir, 0) + (dedup ? bench_dir_walk(store_dir, 0) : 0);
+
+    char back[256];
+    snprintf(back, sizeof(back), "%s/back.bin", dir);
+    int same = 0;
+    start = bench_now();
+    for (int i = 0; (error == 0) && (i < devices); i++)
+    {
+        snprintf(local, sizeof(local), "%s/device%d.bin", dir, i);
+        snprintf(remote, sizeof(remote), "device%d.bin", i);
+        error = tftp_get_file("127.0.0.1", BENCH_DEDUP_PORT, BENCH_DEDUP_BLOCK, remote, back, TFTP_OPT_BASE);
+        same += (error == 0) && bench_same_file(local, back);
+    }
+    double get_time = bench_now() - start;
+    unlink(back);
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    if (error < 0)
+    {
+        printf("bench: transfer failed\n");
+        return -1;
+    }
+
+    tftpd_stats_t stats;
+    tftpd_get_stats(&stats);
+    char chunks[32] = "-";
+    char hash[32] = "-";
+    if (dedup)
+    {
+        uint64_t blocks = (stats.dedup.bytes + BENCH_DEDUP_BLOCK - 1) / BENCH_DEDUP_BLOCK;
+        snprintf(chunks, sizeof(chunks), "%llu/%llu", (unsigned long long)stats.dedup.new_chunks, (unsigned long long)stats.dedup.chunks);
+        snprintf(hash, sizeof(hash), "%.0f", blocks ? (double)stats.dedup.hash_ns / blocks : 0.0);
+    }
+    printf("  %-6s %9.1f MB %9.1f MB %6.1f%% %13s %11s %8.1f MB/s %8.1f MB/s %6d/%d\n", dedup ? "dedup" : "plain",
+        bytes / 1048576.0, disk / 1048576.0, bytes ? 100.0 * (1.0 - (double)disk / bytes) : 0.0,
+        chunks, hash, bytes / put_time / 1e6, bytes / get_time / 1e6, same, devices);
+    return (same == devices) ? 0 : -1;
+}
+
+// 一批设备上传同一个固件的各自版本，普通写盘 vs 去重仓库：磁盘占用、每块的哈希开销、上传下载吞吐
+static int bench_dedup(int argc, char** argv)
+{
+    int devices = argc > 0 ? atoi(argv[0]) : 16;
+    int image_mb = argc > 1 ? atoi(argv[1]) : 8;
+    if ((devices < 1) || (image_mb < 1))
+    {
+        printf("bench: bad args\n");
+        return -1;
+    }
+
+    // 每台设备的镜像都不一样，不用bench_fixture的文件
+    char dir[] = BENCH_TEMP_DIR;
+    if (bench_fixture(dir, NULL, 0) < 0)
+    {
+        return -1;
+    }
+
+    int64_t size = (int64_t)image_mb << 20;
+    uint8_t* image = (uint8_t*)malloc(size);
+    int error = (image == NULL) ? -1 : 0;
+    srand(0);
+    for (int64_t i = 0; (error == 0) && (i < size); i++)
+    {
+        image[i] = (uint8_t)rand();
+    }
+    for (int i = 0; (error == 0) && (i < devices); i++)
+    {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/device%d.bin", dir, i);
+        error = bench_dedup_variant(image, size, i, path);
+    }
+    free(image);
+    if (error < 0)
+    {
+        printf("bench: create images failed\n");
+        bench_cleanup(dir);
+        return -1;
+    }
+
+    printf("dedup: %d devices uploading a %d MB image with %d x %d byte edits and a %d byte insert each, blksize %d, sha256 %s\n",
+        devices, image_mb, BENCH_DEDUP_EDITS, BENCH_DEDUP_EDIT_SIZE, BENCH_DEDUP_INSERT, BENCH_DEDUP_BLOCK,
+        tftp_sha256_hw_enabled() ? "hardware" : "software");
+    printf("  mode      uploaded         disk  saved  new/chunks  hash ns/blk          put          get  verify\n");
+    for (int mode = 0; (error == 0) && (mode < 2); mode++)
+    {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            int result = bench_dedup_run(dir, devices, mode);
+            fflush(stdout);
+            _exit(result < 0);
+        }
+
+        int status = 1;
+        if ((pid < 0) || (waitpid(pid, &status, 0) < 0) || (status != 0))
+        {
+            error = -1;
+        }
+    }
+
+    bench_cleanup(dir);
+    return error;
+}
+
+static void bench_usage(void)
+{
+    printf("usage: tftp_bench <test> [args...]\n");
+    printf("    netascii [size_mb]         -- netascii translation, scalar vs simd\n");
+    printf("    fcache [files] [requests]  -- per-request open/size lookup, fopen vs fd cache vs pack\n");
+    printf("    sessions [clients] [seconds] [demux] [trace] [arena] -- concurrent gets, socket per session vs shared sockets\n");
+    printf("    trace [events] [packets]   -- cost of recording one event, tracing off vs on\n");
+    printf("    options [rounds]           -- request/oack encode and parse, legacy vs single pass\n");
+    printf("    pagecache [big_mb] [hot]   -- hot file cache hit rate after a big download, keep vs drop behind\n");
+    printf("    rtt [us] [blocks] [event]  -- lock-step ack round trip, blocking recv vs busy poll\n");
+    printf("    restart [big_mb]           -- requests and transfers across a restart, kill and rebind vs socket handoff\n");
+    printf("    budget [clients] [mb] [s]  -- burst of max blksize/aimdwindow downloads, unlimited vs memory budget\n");
+    printf("    flood [s] [pps]            -- junk and request flood on the listening port, no filter vs kernel filter\n");
+    printf("    dedup [devices] [mb]       -- per-device variants of one image uploaded, plain files vs dedup store\n");
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        bench_usage();
+        return 1;
+    }
+
+    if (strcmp(argv[1], "netascii") == 0)
+    {
+        return bench_netascii(argc - 2, argv + 2) < 0;
+    }
+    else if (strcmp(argv[1], "fcache") == 0)
+    {
+        return bench_fcache(argc - 2, argv + 2) < 0;
+    }
+    else if (strcmp(argv[1], "sessions") == 0)
+    {
+        return bench_sessions(argc - 2, argv + 2) < 0;
+    }
+    else if (strcmp(argv[1], "options") == 0)
+    {
+        return bench_options(argc - 2, argv + 2) < 0;
+    }
+    else if (strcmp(argv[1], "trace") == 0)
+    {
+        return bench_trace(argc - 2, argv + 2) < 0;
+    }
+    else if (strcmp(argv[1], "pagecache") == 0)
+    {
+        return bench_pagecache(argc - 2, argv + 2) < 0;
+    }
+    else if (strcmp(argv[1], "rtt") == 0)
+    {
+        return bench_rtt(argc - 2, argv + 2) < 0;
+    }
+    else if (strcmp(argv[1], "restart") == 0)
+    {
+        return bench_restart(argc - 2, argv + 2) < 0;
+    }
+    else if (strcmp(argv[1], "budget") == 0)
+    {
+        return bench_budget(argc - 2, argv + 2) < 0;
+    }
+    else if (strcmp(argv[1], "flood") == 0)
+    {
+        return bench_flood(argc - 2, argv + 2) < 0;
+    }
+    else if (strcmp(argv[1], "dedup") == 0)
+    {
+        return bench_dedup(argc - 2, argv + 2) < 0;
+    }
+
+    bench_usage();
+    return 1;
+}
@@ -1,14 +1,23 @@
 #include <stdio.h>
 #include <string.h>
 #include "tftp_client.h"
+#include "tftp_zip.h"
+#include "tftp_crc32c.h"
+#include "tftp_arena.h"
 #include <unistd.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 
 
 static tftp_t tftp;
+static int window_size = TFTP_DEFAULT_WINDOW;
+static int busy_poll_us;
+static char cache_dir[TFTP_CACHE_DIR_SIZE]; // 空表示不用缓存
 
-static int tftp_open(const char* ip, uint16_t port, int block_size)
+static int tftp_open(tftp_t* tftp, const char* ip, uint16_t port, int block_size)
 {
     int sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     if (sockfd < 0)
@@ -17,31 +26,260 @@ static int tftp_open(const char* ip, uint16_t port, int block_size)
         return -1;
     }
 
-    tftp.socket = sockfd;
-    tftp.block_size = block_size;
-    tftp.file_size = 0;
-    tftp.tmo_retry = TFTP_MAX_RETYR;
-    tftp.tmo_sec = TFTP_TMO_SEC;
+    tftp->socket = sockfd;
+    tftp->block_size = block_size;
+    tftp->file_size = 0;
+    tftp->tmo_retry = TFTP_MAX_RETYR;
+    tftp->tmo_sec = TFTP_TMO_SEC;
+    tftp->option = 0;
+    tftp->offset = 0;
+    tftp->range = 0;
+    tftp->cached_size = -1;
+    tftp->mtime = 0;
+    tftp->not_modified = 0;
+    tftp->crc = 0;
+    tftp->peer_crc = 0;
+    tftp->window_size = window_size;
+    tftp->window = NULL;
+    tftp->busy_poll_us = 0;
+    if (busy_poll_us > 0)
+    {
+        tftp_busy_poll(tftp, busy_poll_us);
+    }
+    memset(&tftp->stats, 0, sizeof(tftp->stats));
+    tftp->trace = tftp_trace_start();
+    tftp->side = TFTP_HIST_CLIENT;
+    tftp->first_data = 0;
+    tftp->start_us = 0;
+    tftp->data_us = 0;
+    tftp->rx_packet.opcode = 0;
 
-    struct sockaddr_in* sockaddr = (struct sockaddr_in*)&tftp.remote;
+    struct sockaddr_in* sockaddr = (struct sockaddr_in*)&tftp->remote;
     memset(sockaddr, 0, sizeof(struct sockaddr_in));
     sockaddr->sin_family = AF_INET;
     sockaddr->sin_addr.s_addr = inet_addr(ip);
     sockaddr->sin_port = htons(port);
 
     struct timeval tmo;
-    tmo.tv_sec = tftp.tmo_sec;
+    tmo.tv_sec = tftp->tmo_sec;
     tmo.tv_usec = 0;
-    setsockopt(tftp.socket, SOL_SOCKET, SO_RCVTIMEO, (const void*)&tmo, sizeof(tmo));
+    setsockopt(tftp->socket, SOL_SOCKET, SO_RCVTIMEO, (const void*)&tmo, sizeof(tmo));
+    return 0;
+}
+static void tftp_close(tftp_t* tftp)
+{
+    close(tftp->socket);
+    tftp_trace_finish(tftp->trace);
+    tftp->trace = NULL;
+}
+// 最后一次收到的是服务器拒绝续传的错误
+static int tftp_resume_refused(tftp_t* tftp)
+{
+    if (ntohs(tftp->rx_packet.opcode) != TFTP_PACKET_ERROR)
+    {
+        return 0;
+    }
+
+    uint16_t code = ntohs(tftp->rx_packet.error.error_code);
+    return (code == TFTP_ERROR_OPTION) || (code == TFTP_ERROR_FILE_EXIST);
+}
+
+// 续传从offset开始，前面的部分不再传：OACK里服务器文件[0, offset)的CRC32C和本地的一样才能留着，
+// 同样大小的文件只是开头改过时只比较重叠的一块发现不了
+static int tftp_resume_prefix_match(tftp_t* tftp, FILE* file)
+{
+    uint32_t crc;
+    return (tftp->option & TFTP_OPT_PREFIX) && (tftp_prefix_crc(NULL, fileno(file), tftp->offset, &crc) == 0)
+        && (crc == tftp->prefix_crc);
+}
+
+// 本地名为"-"时下载写到stdout，上传读stdin，都不能seek，不续传
+static FILE* client_stream;
+static int client_stdout = -1;
+
+static int is_stream(const char* local)
+{
+    return strcmp(local, TFTP_STREAM_NAME) == 0;
+}
+
+// 数据写到原来的stdout，传输期间提示信息改到stderr，不和数据混在一起
+static FILE* stream_open(int is_get)
+{
+    fflush(stdout);
+    int fd = dup(is_get ? STDOUT_FILENO : STDIN_FILENO);
+    FILE* file = (fd < 0) ? NULL : fdopen(fd, is_get ? "wb" : "rb");
+    if (file == NULL)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    // 管道一次只能读写几十K，大的缓冲减少系统调用
+    setvbuf(file, NULL, _IOFBF, TFTP_STREAM_BUFFER);
+    if (is_get)
+    {
+        client_stdout = fd;
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+    client_stream = file;
+    return file;
+}
+
+static int stream_close(void)
+{
+    int error = 0;
+    if (client_stdout >= 0)
+    {
+        error = fflush(client_stream);
+        fflush(stdout);
+        dup2(client_stdout, STDOUT_FILENO);
+        client_stdout = -1;
+    }
+
+    if (fclose(client_stream) != 0)
+    {
+        error = -1;
+    }
+    client_stream = NULL;
+    return error;
+}
+
+static void local_close(FILE* file)
+{
+    if (file != client_stream)
+    {
+        fclose(file);
+    }
+}
+
+// 上传的大小：重定向进来的普通文件从当前位置到末尾，管道和终端返回-1
+static int64_t stream_size(FILE* file)
+{
+    struct stat st;
+    if ((fstat(fileno(file), &st) < 0) || !S_ISREG(st.st_mode))
+    {
+        return -1;
+    }
+
+    off_t position = lseek(fileno(file), 0, SEEK_CUR);
+    return (position < 0) ? -1 : (int64_t)(st.st_size - position);
+}
+
+// 缓存目录里按服务器和远端文件名放一份，名字中的'/'换成'#'
+static int cache_path(char* path, size_t size, const char* ip, uint16_t port, const char* filename)
+{
+    int length = snprintf(path, size, "%s/%s_%u_%s", cache_dir, ip, port, filename);
+    if ((length < 0) || ((size_t)length >= size))
+    {
+        return -1;
+    }
+
+    for (char* name = path + strlen(cache_dir) + 1; *name; name++)
+    {
+        *name = (*name == '/') ? '#' : *name;
+    }
+    return 0;
+}
+
+// 缓存文件的修改时间设成服务器上的，下次请求时带上大小和它
+static int cache_lookup(tftp_t* tftp, const char* path)
+{
+    struct stat st;
+    if ((stat(path, &st) < 0) || !S_ISREG(st.st_mode) || (st.st_mtime < 0))
+    {
+        return -1;
+    }
+
+    tftp->cached_size = st.st_size;
+    tftp->mtime = st.st_mtime;
+    return 0;
+}
+
+static int cache_copy(FILE* from, FILE* to)
+{
+    uint8_t buffer[64 * 1024];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), from)) > 0)
+    {
+        if (fwrite(buffer, 1, size, to) != size)
+        {
+            return -1;
+        }
+    }
+    return ferror(from) ? -1 : 0;
+}
+
+// 服务器回答没变时把缓存的内容写到本地文件，本地原来的内容不要了
+static int cache_load(const char* path, FILE* file)
+{
+    FILE* cache = fopen(path, "rb");
+    if (cache == NULL)
+    {
+        return -1;
+    }
 
+    if (file != client_stream)
+    {
+        fseek(file, 0, SEEK_SET);
+    }
+    int error = cache_copy(cache, file);
+    fclose(cache);
+    if ((error == 0) && (file != client_stream))
+    {
+        error = fflush(file);
+        ftruncate(fileno(file), ftell(file));
+    }
+    return error;
 }
-static void tftp_close(void)
+
+// 下载完成后复制进缓存，先写临时文件再改名，其他进程不会读到一半的
+static void cache_store(const char* path, const char* local, int64_t mtime)
 {
-    close(tftp.socket);
+    char temp[TFTP_CACHE_PATH_SIZE + 16];
+    snprintf(temp, sizeof(temp), "%s.%d", path, (int)getpid());
+    FILE* from = fopen(local, "rb");
+    FILE* to = from ? fopen(temp, "wb") : NULL;
+    int error = (to == NULL) ? -1 : cache_copy(from, to);
+    if (to && (fflush(to) != 0))
+    {
+        error = -1;
+    }
+
+    if (error == 0)
+    {
+        struct timespec times[2];
+        times[0].tv_sec = mtime;
+        times[0].tv_nsec = 0;
+        times[1] = times[0];
+        error = futimens(fileno(to), times);
+    }
+
+    if (from)
+    {
+        fclose(from);
+    }
+    if (to)
+    {
+        fclose(to);
+        if ((error < 0) || (rename(temp, path) < 0))
+        {
+            printf("tftp: update cache %s failed\n", path);
+            unlink(temp);
+        }
+    }
 }
-static int do_tftp_get(int block_size, const char* ip, uint16_t port, const char* filename, int option)
+
+static int do_tftp_get(int block_size, const char* ip, uint16_t port, const char* filename, const char* local, int option)
 {
-    if (tftp_open(ip, port, block_size) < 0)
+    if (!(option & TFTP_OPT_BASE))
+    {
+        block_size = TFTP_DEFAULT_BLOCK_SIZE;
+    }
+
+    if (tftp_open(&tftp, ip, port, block_size) < 0)
     {
         printf("tftp connect failed.\n");
         return -1;
@@ -49,20 +287,64 @@ static int do_tftp_get(int block_size, const char* ip, uint16_t port, const char
 
     printf("tftp: try to get file: %s\n", filename);
 
-    FILE* file = fopen(filename, "wb");
+    // netascii的偏移和文件中的偏移对不上，不能续传
+    if (option & TFTP_OPT_NETASCII)
+    {
+        option &= ~TFTP_OPT_RESUME;
+        tftp.option = TFTP_OPT_NETASCII;
+        tftp_netascii_init(&tftp.netascii);
+    }
+
+    // 缓存里有时带上大小和修改时间；没有时也请求，让服务器在OACK里告诉修改时间，下载完存进缓存
+    char cache[TFTP_CACHE_PATH_SIZE];
+    if (!cache_dir[0] || !(option & TFTP_OPT_BASE) || (option & TFTP_OPT_NETASCII) || (cache_path(cache, sizeof(cache), ip, port, filename) < 0))
+    {
+        option &= ~TFTP_OPT_CACHED;
+    }
+    else if (cache_lookup(&tftp, cache) == 0)
+    {
+        printf("tftp: cached %s %lld bytes\n", cache, (long long)tftp.cached_size);
+    }
+
+    // 续传时不截断本地已有的部分文件
+    int error = -1;
+    int64_t partial_size = 0;
+    FILE* file = client_stream;
+    if ((file == NULL) && (option & TFTP_OPT_RESUME))
+    {
+        file = fopen(local, "r+b");
+        if (file)
+        {
+            fseek(file, 0, SEEK_END);
+            partial_size = ftell(file);
+        }
+    }
+
     if (file == NULL)
     {
-        printf("tftp: create local file failed: %s\n", filename);
+        file = fopen(local, "wb");
+    }
+
+    if (file == NULL)
+    {
+        printf("tftp: create local file failed: %s\n", local);
         goto get_error;
     }
 
-    int error = tftp_send_request(&tftp, 1, filename, 0, option);
+    int request_option = option & ~TFTP_OPT_RESUME;
+    if (partial_size > 0)
+    {
+        tftp.offset = tftp_resume_offset(partial_size, block_size);
+        request_option |= TFTP_OPT_RANGE | TFTP_OPT_PREFIX;
+    }
+
+    error = tftp_send_request(&tftp, 1, filename, 0, request_option);
     if (error < 0)
     {
         printf("tftf: send tftf rrq failed.\n");
         goto get_error;
     }
-    if (option)
+    if (option & TFTP_OPT_BASE)
     {
         size_t recv_size = 0;
         error = tftp_wait_packet(&tftp, TFTP_PACKET_OACK, 0, &recv_size);
@@ -72,6 +354,32 @@ static int do_tftp_get(int block_size, const char* ip, uint16_t port, const char
             goto get_error;
         }
 
+        // 服务器上的文件没变，不用ACK，服务器那边已经结束了
+        if (tftp.not_modified)
+        {
+            printf("tftp: %s not modified, copy from cache\n", filename);
+            error = cache_load(cache, file);
+            local_close(file);
+            tftp_close(&tftp);
+            if (error < 0)
+            {
+                printf("tftp: read cache %s failed, download again\n", cache);
+                unlink(cache);
+                return do_tftp_get(block_size, ip, port, filename, local, option & ~TFTP_OPT_CACHED);
+            }
+            return 0;
+        }
+
+        // 服务器上的文件换过了，或者服务器不会比较前缀，本地的部分文件不能用
+        if ((partial_size > 0) && (tftp.option & TFTP_OPT_RANGE) && (tftp.offset > 0) && !tftp_resume_prefix_match(&tftp, file))
+        {
+            printf("tftp: %s differs from local prefix, restart\n", filename);
+            tftp_send_error(&tftp, TFTP_ERROR_FILE_EXIST);
+            fclose(file);
+            tftp_close(&tftp);
+            return do_tftp_get(block_size, ip, port, filename, local, option & ~TFTP_OPT_RESUME);
+        }
+
         error = tftp_send_ack(&tftp, 0);
         if (error < 0)
         {
@@ -79,7 +387,18 @@ static int do_tftp_get(int block_size, const char* ip, uint16_t port, const char
             goto get_error;
         }
 
-        printf("tftp: file size %d bytes\n", tftp.file_size);
+        printf("tftp: file size %lld bytes\n", (long long)tftp.file_size);
+    }
+
+    // 服务器不支持offset时从头开始，重叠校验同样适用
+    int64_t position = (tftp.option & TFTP_OPT_RANGE) ? tftp.offset : 0;
+    if (position > 0)
+    {
+        printf("tftp: resume from %lld bytes\n", (long long)position);
+    }
+    if (file != client_stream)
+    {
+        fseek(file, position, SEEK_SET);
     }
 
     uint16_t next_block = 1;
@@ -92,19 +411,59 @@ static int do_tftp_get(int block_size, const char* ip, uint16_t port, const char
         error = tftp_wait_packet(&tftp, TFTP_PACKET_DATA, next_block, &recv_size);
         if (error < 0)
         {
-            printf("tftp: wait error, block %d file: %s", 0, filename);
+            printf("tftp: wait error, block %d file: %s\n", next_block, filename);
             goto get_error;
         }
-        size_t block_size = recv_size - 4;
-        if (block_size)
+        size_t data_size = recv_size - 4;
+        uint8_t* data = tftp.rx_packet.data.data;
+        uint8_t raw[TFTP_BLOCK_SIZE];
+        if (tftp.option & TFTP_OPT_COMPRESS)
+        {
+            int raw_size = tftp_zip_decode(raw, tftp_data_size(&tftp), data, data_size);
+            if (raw_size < 0)
+            {
+                printf("tftp: bad compressed block %d\n", next_block);
+                tftp_send_error(&tftp, TFTP_ERROR_OP);
+                error = -1;
+                goto get_error;
+            }
+            data = raw;
+            data_size = raw_size;
+        }
+
+        if (tftp.option & TFTP_OPT_CHECKSUM)
+        {
+            tftp.crc = tftp_crc32c(tftp.crc, data, data_size);
+        }
+
+        if (data_size)
         {
-            size_t size = fwrite(tftp.rx_packet.data.data, 1, block_size, file);
-            if (size < block_size)
+            int verified = tftp_verify_overlap(file, position, data, data_size, partial_size);
+            if (verified < 0)
+            {
+                // 本地文件和服务器上的不一致，清空后重新下载
+                tftp_send_error(&tftp, TFTP_ERROR_FILE_EXIST);
+                fclose(file);
+                tftp_close(&tftp);
+                return do_tftp_get(block_size, ip, port, filename, local, option & ~TFTP_OPT_RESUME);
+            }
+            else if (verified > 0)
+            {
+                fseek(file, position + verified, SEEK_SET);
+            }
+
+            uint64_t io_us = tftp_time_us();
+            tftp_trace_event(tftp.trace, TFTP_TRACE_WRITE_BEGIN, 0, 0, data_size - verified);
+            size_t size = tftp_file_write(&tftp, file, data + verified, data_size - verified);
+            tftp_trace_event(tftp.trace, TFTP_TRACE_WRITE_END, 0, 0, (uint32_t)size);
+            tftp_hist_record(TFTP_HIST_CLIENT, TFTP_HIST_FILE_IO, tftp_time_us() - io_us);
+            if (size < data_size - verified)
             {
                 printf("tftp: write file failed %s\n", filename);
                 goto get_error;
             }
         }
+        position += data_size;
 
         error = tftp_send_ack(&tftp, next_block);
         if (error < 0)
@@ -113,52 +472,425 @@ static int do_tftp_get(int block_size, const char* ip, uint16_t port, const char
             goto get_error;
         }
         next_block++;
-        total_block += (uint32_t)block_size;
+        total_size += (uint32_t)data_size;
         if (++total_block % 0x40 == 0)
         {
             printf(".");
             fflush(stdout);
         }
-        if (block_size < tftp.block_size)
+        if (data_size < (size_t)tftp_data_size(&tftp))
         {
             error = 0;
             break;
         }
     }
 
+    if ((tftp.option & TFTP_OPT_NETASCII) && (tftp_netascii_finish(&tftp.netascii, file) < 0))
+    {
+        printf("tftp: write file failed %s\n", filename);
+        error = -1;
+        goto get_error;
+    }
+
+    // 本地原来的文件可能更长
+    if (file != client_stream)
+    {
+        fflush(file);
+        ftruncate(fileno(file), ftell(file));
+    }
+
+    if (tftp.option & TFTP_OPT_CHECKSUM)
+    {
+        error = tftp_recv_checksum(&tftp, next_block);
+        if (error < 0)
+        {
+            goto get_error;
+        }
+    }
+
     printf("\n tftp: total recv: %d bytes, %d\n", total_size, total_block);
-    fclose(file);
-    tftp_close();
+    tftp_hist_transfer(TFTP_HIST_CLIENT, position, tftp_time_us() - tftp.start_us);
+    local_close(file);
+    tftp_close(&tftp);
+    // 写到stdout的没有本地文件可以复制，只在命中时用缓存
+    if ((option & TFTP_OPT_CACHED) && (tftp.option & TFTP_OPT_CACHED) && (file != client_stream))
+    {
+        cache_store(cache, local, tftp.mtime);
+    }
     return 0;
 
 get_error:
     if (file)
-        fclose(file);
-    tftp_close();
+        local_close(file);
+    tftp_close(&tftp);
+    if ((partial_size > 0) && tftp_resume_refused(&tftp))
+    {
+        printf("tftp: resume refused, restart %s\n", filename);
+        return do_tftp_get(block_size, ip, port, filename, local, option & ~TFTP_OPT_RESUME);
+    }
     return error;
 }
 int tftp_get(const char* ip, uint16_t port, int block_size, const char* filename, int option)
 {
+    return tftp_get_file(ip, port, block_size, filename, filename, option);
+}
+
+int tftp_get_file(const char* ip, uint16_t port, int block_size, const char* filename, const char* local, int option)
+{
+    // 先把提示信息改到stderr再打印
+    if (is_stream(local))
+    {
+        if (stream_open(1) == NULL)
+        {
+            printf("tftp: open stdout failed\n");
+            return -1;
+        }
+        option &= ~TFTP_OPT_RESUME;
+    }
+
     printf("Try to get file %s from %s\n", filename, ip);
+    if (block_size > TFTP_BLOCK_SIZE)
+    {
+        block_size = TFTP_BLOCK_SIZE;
+    }
+
+    // 超时失败后从已经收到的位置继续
+    int error = do_tftp_get(block_size, ip, port, filename, local, option);
+    for (int retry = 0; (error < 0) && (option & TFTP_OPT_RESUME) && (tftp.tmo_retry == 0) && (retry < TFTP_RESUME_RETRY); retry++)
+    {
+        printf("tftp: transfer timeout, resume %s\n", filename);
+        error = do_tftp_get(block_size, ip, port, filename, local, option);
+    }
+
+    if (client_stream && (stream_close() < 0))
+    {
+        printf("tftp: write stdout failed\n");
+        error = -1;
+    }
+    return error;
+}
+
+// 并行下载时每个线程负责文件中的一段
+typedef struct _tftp_stripe_t
+{
+    tftp_t tftp;
+    const char* ip;
+    uint16_t port;
+    int block_size;
+    const char* filename;
+    int fd;
+    int64_t offset;
+    int64_t range;
+    int error;
+}tftp_stripe_t;
+
+static int do_tftp_get_range(tftp_stripe_t* stripe)
+{
+    tftp_t* tftp = &stripe->tftp;
+    if (tftp_open(tftp, stripe->ip, stripe->port, stripe->block_size) < 0)
+    {
+        printf("tftp connect failed.\n");
+        return -1;
+    }
+
+    tftp->offset = stripe->offset;
+    tftp->range = stripe->range;
+    int error = tftp_send_request(tftp, 1, stripe->filename, 0, TFTP_OPT_BASE | TFTP_OPT_RANGE);
+    if (error < 0)
+    {
+        printf("tftp: send tftp rrq failed.\n");
+        goto range_error;
+    }
+
+    size_t recv_size = 0;
+    error = tftp_wait_packet(tftp, TFTP_PACKET_OACK, 0, &recv_size);
+    if (error < 0)
+    {
+        printf("tftp: wait oack error, file:%s\n", stripe->filename);
+        goto range_error;
+    }
+
+    if (!(tftp->option & TFTP_OPT_RANGE) || (tftp->offset != stripe->offset))
+    {
+        printf("tftp: server does not support range, file: %s\n", stripe->filename);
+        tftp_send_error(tftp, TFTP_ERROR_OPTION);
+        error = -1;
+        goto range_error;
+    }
+
+    error = tftp_send_ack(tftp, 0);
+    if (error < 0)
+    {
+        printf("tftp: send ack failed. file: %s\n", stripe->filename);
+        goto range_error;
+    }
+
+    uint16_t next_block = 1;
+    int64_t total_size = 0;
+    while (1)
+    {
+        error = tftp_wait_packet(tftp, TFTP_PACKET_DATA, next_block, &recv_size);
+        if (error < 0)
+        {
+            printf("tftp: wait error, block %d file: %s\n", next_block, stripe->filename);
+            goto range_error;
+        }
+
+        size_t block_size = recv_size - 4;
+        if (block_size)
+        {
+            uint64_t io_us = tftp_time_us();
+            tftp_trace_event(tftp->trace, TFTP_TRACE_WRITE_BEGIN, 0, 0, (uint32_t)block_size);
+            ssize_t size = pwrite(stripe->fd, tftp->rx_packet.data.data, block_size, stripe->offset + total_size);
+            tftp_trace_event(tftp->trace, TFTP_TRACE_WRITE_END, 0, 0, (size > 0) ? (uint32_t)size : 0);
+            tftp_hist_record(TFTP_HIST_CLIENT, TFTP_HIST_FILE_IO, tftp_time_us() - io_us);
+            if (size < (ssize_t)block_size)
+            {
+                printf("tftp: write file failed %s\n", stripe->filename);
+                tftp_send_error(tftp, TFTP_ERROR_DISK_FULL);
+                error = -1;
+                goto range_error;
+            }
+        }
+
+        error = tftp_send_ack(tftp, next_block++);
+        if (error < 0)
+        {
+            printf("tftp: send ack failed! ack block = %d\n", next_block - 1);
+            goto range_error;
+        }
+
+        total_size += block_size;
+        if (block_size < (size_t)tftp->block_size)
+        {
+            break;
+        }
+    }
+
+    if (total_size != tftp->range)
+    {
+        printf("tftp: range %lld+%lld short, recv %lld bytes\n",
+            (long long)stripe->offset, (long long)tftp->range, (long long)total_size);
+        error = -1;
+    }
+
+range_error:
+    tftp_close(tftp);
+    return error;
+}
+
+static void* tftp_stripe_thread(void* arg)
+{
+    tftp_stripe_t* stripe = (tftp_stripe_t*)arg;
+    stripe->error = do_tftp_get_range(stripe);
+    return NULL;
+}
+
+// 通过选项协商拿到文件大小，然后放弃这次传输；返回1表示服务器不认识选项，直接回了数据
+static int tftp_probe_size(int block_size, const char* ip, uint16_t port, const char* filename, int64_t* file_size)
+{
+    if (tftp_open(&tftp, ip, port, block_size) < 0)
+    {
+        printf("tftp connect failed.\n");
+        return -1;
+    }
+
+    int error = tftp_send_request(&tftp, 1, filename, 0, TFTP_OPT_BASE);
+    if (error == 0)
+    {
+        size_t recv_size = 0;
+        error = tftp_wait_packet(&tftp, TFTP_PACKET_PROBE, 0, &recv_size);
+    }
+
+    if (error == 0)
+    {
+        // 不认识选项的服务器已经开始发文件了，中止它，告诉调用者只能不带选项下载
+        if (tftp.rx_packet.opcode == htons(TFTP_PACKET_DATA))
+        {
+            error = 1;
+        }
+        *file_size = tftp.file_size;
+        tftp_send_error(&tftp, TFTP_ERROR_OPTION);
+    }
+
+    tftp_close(&tftp);
+    return error;
+}
+
+int tftp_get_striped(const char* ip, uint16_t port, int block_size, const char* filename, int stripes)
+{
+    printf("Try to get file %s from %s with %d stripes\n", filename, ip, stripes);
+    uint64_t start_us = tftp_time_us();
 
     if (block_size > TFTP_BLOCK_SIZE)
     {
         block_size = TFTP_BLOCK_SIZE;
     }
 
-    return do_tftp_get(block_size, ip, port, filename, option);
+    if (stripes > TFTP_MAX_STRIPES)
+    {
+        stripes = TFTP_MAX_STRIPES;
+    }
+
+    int64_t file_size = 0;
+    int probe = tftp_probe_size(block_size, ip, port, filename, &file_size);
+    if (probe < 0)
+    {
+        printf("tftp: get size of %s failed\n", filename);
+        return -1;
+    }
+
+    // 服务器不支持选项也就不支持range，只能按512字节的块单流下载
+    if (probe > 0)
+    {
+        printf("tftp: server ignores options, get %s in one stream\n", filename);
+        return do_tftp_get(block_size, ip, port, filename, filename, 0);
+    }
+
+    // 文件太小就没必要分段了
+    if ((stripes <= 1) || (file_size < (int64_t)stripes * block_size))
+    {
+        return do_tftp_get(block_size, ip, port, filename, filename, TFTP_OPT_BASE);
+    }
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        printf("tftp: create local file failed: %s\n", filename);
+        return -1;
+    }
+
+    if (ftruncate(fd, file_size) < 0)
+    {
+        printf("tftp: resize local file failed: %s\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    tftp_stripe_t* stripe_list = (tftp_stripe_t*)calloc(stripes, sizeof(tftp_stripe_t));
+    pthread_t* thread_list = (pthread_t*)calloc(stripes, sizeof(pthread_t));
+    if ((stripe_list == NULL) || (thread_list == NULL))
+    {
+        printf("tftp: no memory for stripes\n");
+        free(stripe_list);
+        free(thread_list);
+        close(fd);
+        return -1;
+    }
+
+    // 每段按块大小对齐
+    int64_t chunk = (file_size + stripes - 1) / stripes;
+    chunk = (chunk + block_size - 1) / block_size * block_size;
+
+    int error = 0;
+    int started = 0;
+    for (int i = 0; i < stripes; i++)
+    {
+        tftp_stripe_t* stripe = stripe_list + i;
+        stripe->ip = ip;
+        stripe->port = port;
+        stripe->block_size = block_size;
+        stripe->filename = filename;
+        stripe->fd = fd;
+        stripe->offset = chunk * i;
+        if (stripe->offset >= file_size)
+        {
+            break;
+        }
+
+        stripe->range = file_size - stripe->offset;
+        if (stripe->range > chunk)
+        {
+            stripe->range = chunk;
+        }
+
+        if (pthread_create(thread_list + i, NULL, tftp_stripe_thread, (void*)stripe) != 0)
+        {
+            printf("tftp: create stripe thread failed.\n");
+            error = -1;
+            break;
+        }
+        started++;
+    }
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(thread_list[i], NULL);
+        if (stripe_list[i].error < 0)
+        {
+            printf("tftp: stripe %d (%lld+%lld) failed\n", i,
+                (long long)stripe_list[i].offset, (long long)stripe_list[i].range);
+            error = -1;
+        }
+    }
+
+    printf("\n tftp: total recv: %lld bytes, %d stripes\n", (long long)file_size, started);
+    if (error == 0)
+    {
+        tftp_hist_transfer(TFTP_HIST_CLIENT, file_size, tftp_time_us() - start_us);
+    }
+    free(stripe_list);
+    free(thread_list);
+    close(fd);
+    return error;
+}
+
+// 上传时读取本地文件生成DATA块
+typedef struct _tftp_put_source_t
+{
+    FILE* file;
+    int chunk;
+    uint32_t total_size;
+    uint32_t total_block;
+}tftp_put_source_t;
+
+static int put_produce(void* arg, uint8_t* out, int* last)
+{
+    tftp_put_source_t* source = (tftp_put_source_t*)arg;
+    uint8_t raw[TFTP_BLOCK_SIZE];
+    uint8_t* data = (tftp.option & TFTP_OPT_COMPRESS) ? raw : out;
+    uint64_t io_us = tftp_time_us();
+    tftp_trace_event(tftp.trace, TFTP_TRACE_READ_BEGIN, 0, 0, (uint32_t)source->chunk);
+    size_t block_size = tftp_file_read(&tftp, source->file, data, source->chunk);
+    tftp_trace_event(tftp.trace, TFTP_TRACE_READ_END, 0, 0, (uint32_t)block_size);
+    tftp_hist_record(TFTP_HIST_CLIENT, TFTP_HIST_FILE_IO, tftp_time_us() - io_us);
+    if (ferror(source->file))
+    {
+        return -1;
+    }
+
+    if (tftp.option & TFTP_OPT_CHECKSUM)
+    {
+        tftp.crc = tftp_crc32c(tftp.crc, data, block_size);
+    }
+
+    int send_size = (int)block_size;
+    if (tftp.option & TFTP_OPT_COMPRESS)
+    {
+        send_size = tftp_zip_encode(out, tftp.block_size, raw, block_size);
+    }
+
+    source->total_size += (uint32_t)block_size;
+    if (++source->total_block % 0x40 == 0)
+    {
+        printf(".");
+        fflush(stdout);
+    }
+
+    *last = block_size < (size_t)source->chunk;
+    return send_size;
 }
 
-static int do_tftp_put(int block_size, const char* ip, uint16_t port, const char* filename, int option)
+static int do_tftp_put(int block_size, const char* ip, uint16_t port, const char* filename, const char* local, int option)
 {
-    if (!option)
+    if (!(option & TFTP_OPT_BASE))
     {
         block_size = TFTP_DEFAULT_BLOCK_SIZE;
     }
 
 
 
-    if (tftp_open(ip, port, block_size) < 0)
+    if (tftp_open(&tftp, ip, port, block_size) < 0)
     {
         printf("tftp: connect failed\n");
         return -1;
@@ -166,18 +898,42 @@ static int do_tftp_put(int block_size, const char* ip, uint16_t port, const char
 
     printf("tftp: Try to put file: %s\n", filename);
 
-    FILE* file = fopen(filename, "rb");
+    if (option & TFTP_OPT_NETASCII)
+    {
+        option &= ~TFTP_OPT_RESUME;
+        tftp.option = TFTP_OPT_NETASCII;
+        tftp_netascii_init(&tftp.netascii);
+    }
+
+    int error = -1;
+    int64_t filesize = -1;
+    FILE* file = client_stream ? client_stream : fopen(local, "rb");
     if (file == NULL)
     {
-        printf("tftp: create local file failed: %s\n", filename);
+        printf("tftp: create local file failed: %s\n", local);
         goto put_error;
     }
 
-    fseek(file, 0, SEEK_END);
-    long filesize = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    if (file == client_stream)
+    {
+        filesize = stream_size(file);
+    }
+    else
+    {
+        fseek(file, 0, SEEK_END);
+        filesize = ftell(file);
+        fseek(file, 0, SEEK_SET);
+    }
+
+    // 续传时由服务器根据已收到的部分决定起始位置
+    int request_option = option & ~TFTP_OPT_RESUME;
+    if (option & TFTP_OPT_RESUME)
+    {
+        tftp.offset = filesize;
+        request_option |= TFTP_OPT_RANGE | TFTP_OPT_PREFIX;
+    }
 
-    int error = tftp_send_request(&tftp, 0, filename, filesize, option);
+    error = tftp_send_request(&tftp, 0, filename, filesize, request_option);
     if (error < 0)
     {
         printf("tftp: send tftp wrq failed\n");
@@ -185,34 +941,88 @@ static int do_tftp_put(int block_size, const char* ip, uint16_t port, const char
     }
 
     size_t recv_size;
-    error = tftp_wait_packet(&tftp, option ? TFTP_PACKET_OACK : TFTP_PACKET_ACK, 0, &recv_size);
+    error = tftp_wait_packet(&tftp, (option & TFTP_OPT_BASE) ? TFTP_PACKET_OACK : TFTP_PACKET_ACK, 0, &recv_size);
     if (error < 0)
     {
         printf("tftp: wait error, block %d file: %s\n", 0, filename);
         goto put_error;
     }
 
+    if ((tftp.option & TFTP_OPT_RANGE) && (tftp.offset > 0))
+    {
+        // 服务器上保留的部分不是这个文件的开头，从头上传，服务器会截断原来的文件
+        if (!tftp_resume_prefix_match(&tftp, file))
+        {
+            printf("tftp: server copy of %s differs, restart\n", filename);
+            tftp_send_error(&tftp, TFTP_ERROR_FILE_EXIST);
+            local_close(file);
+            tftp_close(&tftp);
+            return do_tftp_put(block_size, ip, port, filename, local, option & ~TFTP_OPT_RESUME);
+        }
+        printf("tftp: resume from %lld bytes\n", (long long)tftp.offset);
+        fseek(file, tftp.offset, SEEK_SET);
+    }
+
+    tftp_put_source_t source;
+    source.file = file;
+    source.chunk = tftp_data_size(&tftp);
+    source.total_size = 0;
+    source.total_block = 0;
+
     uint16_t current_block = 1;
-    uint16_t total_block = 0;
-    uint16_t total_size = 0;
-    while (1)
+    if (tftp.option & TFTP_OPT_WINDOW)
+    {
+        // 按拥塞窗口连续发送，服务器逐块累计确认
+        tftp_window_t window;
+        error = tftp_window_start(&tftp, &window);
+        if (error == 0)
+        {
+            error = tftp_window_send(&tftp, put_produce, &source);
+        }
+
+        while (error == 0)
+        {
+            error = tftp_wait_packet(&tftp, TFTP_PACKET_WACK, 0, &recv_size);
+            if (error < 0)
+            {
+                printf("tftp: wait error. block=%d file: %s\n", (int)window.base, filename);
+                break;
+            }
+
+            if (tftp_window_ack(&tftp, ntohs(tftp.rx_packet.ack.block_num)))
+            {
+                current_block = (uint16_t)(window.last + 1);
+                break;
+            }
+            error = tftp_window_send(&tftp, put_produce, &source);
+        }
+
+        tftp_window_stop(&tftp);
+        if (error < 0)
+        {
+            goto put_error;
+        }
+    }
+
+    while (!(tftp.option & TFTP_OPT_WINDOW))
     {
-        size_t block_size = fread(&tftp.tx_packet.data.data, 1, tftp.block_size, file);
-        if (!feof(file) && (block_size != tftp.block_size))
+        int last;
+        int send_size = put_produce(&source, tftp.tx_packet.data.data, &last);
+        if (send_size < 0)
         {
             error = -1;
             printf("tftp: read file failed %s\n", filename);
             goto put_error;
         }
 
-        error = tftp_send_data(&tftp, current_block, block_size);
+        error = tftp_send_data(&tftp, current_block, send_size);
         if (error < 0)
         {
             printf("tftp: send data failed. block=%d\n", current_block);
             goto put_error;
         }
 
-        tftp_wait_packet(&tftp, TFTP_PACKET_ACK, current_block, &recv_size);
+        error = tftp_wait_packet(&tftp, TFTP_PACKET_ACK, current_block, &recv_size);
         if (error < 0)
         {
             printf("tftp: wait error. block=%d file: %s\n", current_block, filename);
@@ -220,15 +1030,7 @@ static int do_tftp_put(int block_size, const char* ip, uint16_t port, const char
         }
 
         current_block++;
-
-        total_size += (uint32_t)block_size;
-        if (++total_block % 0x40 == 0)
-        {
-            printf(".");
-            fflush(stdout);
-        }
-
-        if (block_size < tftp.block_size)
+        if (last)
         {
             error = 0;
             break;
@@ -236,20 +1038,61 @@ static int do_tftp_put(int block_size, const char* ip, uint16_t port, const char
 
     }
 
-    printf("\n tftp: total send: %d bytes, %d block\n", total_size, total_block);
-    fclose(file);
-    tftp_close();
+    if (tftp.option & TFTP_OPT_CHECKSUM)
+    {
+        error = tftp_send_checksum(&tftp, current_block);
+        if (error < 0)
+        {
+            goto put_error;
+        }
+    }
+
+    printf("\n tftp: total send: %d bytes, %d block\n", source.total_size, source.total_block);
+    tftp_print_stats(&tftp, "tftp");
+    tftp_hist_transfer(TFTP_HIST_CLIENT, source.total_size, tftp_time_us() - tftp.start_us);
+    local_close(file);
+    tftp_close(&tftp);
     return 0;
 
 put_error:
     if (file)
-        fclose(file);
-    tftp_close();
+        local_close(file);
+    tftp_close(&tftp);
+    if ((option & TFTP_OPT_RESUME) && tftp_resume_refused(&tftp))
+    {
+        printf("tftp: resume refused, restart %s\n", filename);
+        return do_tftp_put(block_size, ip, port, filename, local, option & ~TFTP_OPT_RESUME);
+    }
     printf("\n tftp: send failed\n");
     return error;
 }
 
+void tftp_last_stats(tftp_stats_t* stats)
+{
+    *stats = tftp.stats;
+}
+
+void tftp_set_window(int size)
+{
+    window_size = (size > TFTP_WINDOW_MAX) ? TFTP_WINDOW_MAX : size;
+}
+
+void tftp_set_cache_dir(const char* dir)
+{
+    snprintf(cache_dir, sizeof(cache_dir), "%s", dir ? dir : "");
+}
+
+void tftp_set_busy_poll(int us)
+{
+    busy_poll_us = (us > TFTP_BUSY_POLL_MAX) ? TFTP_BUSY_POLL_MAX : (us < 0) ? 0 : us;
+}
+
 int tftp_put(const char* ip, uint16_t port, int block_size, const char* filename, int option)
+{
+    return tftp_put_file(ip, port, block_size, filename, filename, option);
+}
+
+int tftp_put_file(const char* ip, uint16_t port, int block_size, const char* filename, const char* local, int option)
 {
     printf("Try to put file %s from %s\n", filename, ip);
     if (block_size > TFTP_BLOCK_SIZE)
@@ -257,21 +1100,71 @@ int tftp_put(const char* ip, uint16_t port, int block_size, const char* filename
         block_size = TFTP_BLOCK_SIZE;
     }
 
-    return do_tftp_put(block_size, ip, port, filename, option);
+    // 读过的数据没法退回，失败后不能续传
+    if (is_stream(local))
+    {
+        if (stream_open(0) == NULL)
+        {
+            printf("tftp: open stdin failed\n");
+            return -1;
+        }
+        option &= ~TFTP_OPT_RESUME;
+    }
+
+    int error = do_tftp_put(block_size, ip, port, filename, local, option);
+    for (int retry = 0; (error < 0) && (option & TFTP_OPT_RESUME) && (tftp.tmo_retry == 0) && (retry < TFTP_RESUME_RETRY); retry++)
+    {
+        printf("tftp: transfer timeout, resume %s\n", filename);
+        error = do_tftp_put(block_size, ip, port, filename, local, option);
+    }
+
+    if (client_stream)
+    {
+        stream_close();
+    }
+    return error;
+}
+
+// on/off开关类的命令，不带参数时打开
+static int switch_option(int option, int flag, const char* name, const char* onoff)
+{
+    if (onoff && (strcmp(onoff, "off") == 0))
+    {
+        option &= ~flag;
+    }
+    else
+    {
+        option |= flag;
+    }
+
+    printf("%s %s\n", name, (option & flag) ? "on" : "off");
+    return option;
 }
 
 void show_cmd_list(void)
 {
     printf("usage: cmd arg0 arg1...\n");
-    printf("    get filename               -- download file from server\n");
-    printf("    gut filename               -- download file from server\n");
+    printf("    get filename [local|-]     -- download file from server, - writes to stdout\n");
+    printf("    put local|- [filename]     -- upload file to server, - reads stdin\n");
+    printf("    pget filename [stripes]    -- download file from server in parallel stripes\n");
     printf("    block                      -- set block size\n");
+    printf("    mode octet|netascii        -- set transfer mode\n");
+    printf("    compress on|off            -- compress data blocks with zlib\n");
+    printf("    checksum on|off            -- verify transfers with crc32c\n");
+    printf("    resume on|off              -- continue from a partial file left by an earlier transfer\n");
+    printf("    window size                -- send up to size blocks per ack (private aimdwindow option), 1 for lock-step\n");
+    printf("    busypoll us|off            -- spin up to us microseconds before sleeping in recv\n");
+    printf("    cache dir|off              -- keep downloads in dir, skip files the server has not changed\n");
+    printf("    trace on [events]|off      -- record per-session events in a ring of events\n");
+    printf("    trace dump file            -- write recent sessions as chrome trace json\n");
+    printf("    stats [reset]              -- latency percentiles of client and server transfers\n");
     printf("    quit                       -- quit tftp client\n");
 }
 
 int tftp_start(const char* ip, uint16_t port)
 {
     int block_size = TFTP_DEFAULT_BLOCK_SIZE;
+    int option = TFTP_OPT_BASE;
     char buffer[TFTP_CMD_BUFFER_SIZE];
     if (port == 0)
         port = TFTP_DEFAULT_PORT;
@@ -310,9 +1203,10 @@ int tftp_start(const char* ip, uint16_t port)
             if (strcmp(cmd, "get") == 0)
             {
                 char* filename = strtok(NULL, split);
+                char* local = strtok(NULL, split);
                 if (filename)
                 {
-                    do_tftp_get(block_size, ip, port, filename, 1);
+                    tftp_get_file(ip, port, block_size, filename, local ? local : filename, option);
                 }
                 else
                 {
@@ -320,11 +1214,26 @@ int tftp_start(const char* ip, uint16_t port)
                 }
             }
             else if (strcmp(cmd, "put") == 0)
+            {
+                char* local = strtok(NULL, split);
+                char* filename = strtok(NULL, split);
+                if (local && (filename || strcmp(local, TFTP_STREAM_NAME)))
+                {
+                    tftp_put_file(ip, port, block_size, filename ? filename : local, local, option);
+                }
+                else
+                {
+                    printf("error: no file\n");
+                }
+            }
+            else if (strcmp(cmd, "pget") == 0)
             {
                 char* filename = strtok(NULL, split);
+                char* count = strtok(NULL, split);
                 if (filename)
                 {
-                    do_tftp_put(block_size, ip, port, filename, 1);
+                    int stripes = count ? atoi(count) : TFTP_DEFAULT_STRIPES;
+                    tftp_get_striped(ip, port, block_size, filename, stripes);
                 }
                 else
                 {
@@ -357,6 +1266,101 @@ int tftp_start(const char* ip, uint16_t port)
                     printf("error: no size\n");
                 }
             }
+            else if (strcmp(cmd, "mode") == 0)
+            {
+                char* mode = strtok(NULL, split);
+                if (mode && (strcmp(mode, "netascii") == 0))
+                {
+                    option |= TFTP_OPT_NETASCII;
+                }
+                else if (mode && (strcmp(mode, "octet") == 0))
+                {
+                    option &= ~TFTP_OPT_NETASCII;
+                }
+                printf("mode %s\n", (option & TFTP_OPT_NETASCII) ? "netascii" : "octet");
+            }
+            else if (strcmp(cmd, "compress") == 0)
+            {
+                option = switch_option(option, TFTP_OPT_COMPRESS, cmd, strtok(NULL, split));
+            }
+            else if (strcmp(cmd, "checksum") == 0)
+            {
+                option = switch_option(option, TFTP_OPT_CHECKSUM, cmd, strtok(NULL, split));
+            }
+            else if (strcmp(cmd, "resume") == 0)
+            {
+                option = switch_option(option, TFTP_OPT_RESUME, cmd, strtok(NULL, split));
+            }
+            else if (strcmp(cmd, "window") == 0)
+            {
+                char* size = strtok(NULL, split);
+                if (size && (atoi(size) > 1))
+                {
+                    tftp_set_window(atoi(size));
+                    option |= TFTP_OPT_WINDOW;
+                }
+                else if (size)
+                {
+                    option &= ~TFTP_OPT_WINDOW;
+                }
+                printf("window %d\n", (option & TFTP_OPT_WINDOW) ? window_size : 1);
+            }
+            else if (strcmp(cmd, "busypoll") == 0)
+            {
+                char* us = strtok(NULL, split);
+                if (us)
+                {
+                    tftp_set_busy_poll((strcmp(us, "off") == 0) ? 0 : atoi(us));
+                }
+                printf("busypoll %d us\n", busy_poll_us);
+            }
+            else if (strcmp(cmd, "cache") == 0)
+            {
+                char* dir = strtok(NULL, split);
+                if (dir)
+                {
+                    int off = (strcmp(dir, "off") == 0);
+                    tftp_set_cache_dir(off ? NULL : dir);
+                    option = off ? (option & ~TFTP_OPT_CACHED) : (option | TFTP_OPT_CACHED);
+                }
+                printf("cache %s\n", (option & TFTP_OPT_CACHED) ? cache_dir : "off");
+            }
+            else if (strcmp(cmd, "trace") == 0)
+            {
+                // 客户端和同一进程里的服务器共用一份记录
+                char* arg = strtok(NULL, split);
+                char* value = strtok(NULL, split);
+                if (arg && (strcmp(arg, "on") == 0))
+                {
+                    tftp_trace_enable(value ? atoi(value) : TFTP_TRACE_EVENTS);
+                }
+                else if (arg && (strcmp(arg, "off") == 0))
+                {
+                    tftp_trace_enable(0);
+                }
+                else if (arg && (strcmp(arg, "dump") == 0) && value)
+                {
+                    tftp_trace_dump(value);
+                }
+                else
+                {
+                    printf("error: trace on [events]|off|dump file\n");
+                }
+            }
+            else if (strcmp(cmd, "stats") == 0)
+            {
+                char* arg = strtok(NULL, split);
+                if (arg && (strcmp(arg, "reset") == 0))
+                {
+                    tftp_hist_reset();
+                }
+                else
+                {
+                    tftp_hist_print(TFTP_HIST_CLIENT, "tftp");
+                    tftp_hist_print(TFTP_HIST_SERVER, "tftpd");
+                    tftp_arena_print("tftpd");
+                }
+            }
             else if (strcmp(cmd, "quit") == 0)
             {
                 printf("quit tftp client!\n");
@@ -4,10 +4,28 @@
 #include "tftp_base.h"
 
 #define TFTP_CMD_BUFFER_SIZE 128
+#define TFTP_DEFAULT_STRIPES 4
+#define TFTP_MAX_STRIPES 16
+#define TFTP_RESUME_RETRY 3
+#define TFTP_STREAM_NAME "-" // 本地名，下载写到stdout，上传读stdin
+#define TFTP_STREAM_BUFFER (1024 * 1024)
+#define TFTP_CACHE_DIR_SIZE 256
+#define TFTP_CACHE_PATH_SIZE (TFTP_CACHE_DIR_SIZE + TFTP_NAME_SIZE + 32) // 目录/ip_端口_远端文件名
 
 // gethostbyname :域名转换
 int tftp_get(const char* ip, uint16_t port, int block_size, const char* filename, int option);
 int tftp_put(const char* ip, uint16_t port, int block_size, const char* filename, int option);
+// 本地文件名和远端不同；local为"-"时用stdin/stdout，不续传，上传大小未知时不带tsize
+int tftp_get_file(const char* ip, uint16_t port, int block_size, const char* filename, const char* local, int option);
+int tftp_put_file(const char* ip, uint16_t port, int block_size, const char* filename, const char* local, int option);
+void tftp_set_window(int size);
+// 带TFTP_OPT_CACHED下载时用的缓存目录，目录要已经存在；NULL关闭
+void tftp_set_cache_dir(const char* dir);
+// 等待服务器的包时先忙等这么多微秒再睡眠，0关闭
+void tftp_set_busy_poll(int us);
+// 最近一次get/put的统计(分段下载不算)
+void tftp_last_stats(tftp_stats_t* stats);
+int tftp_get_striped(const char* ip, uint16_t port, int block_size, const char* filename, int stripes);
 
 int tftp_start(const char* ip, uint16_t port);
 #endif // !TFTP_CLIENT_H
\ No newline at end of file
@@ -0,0 +1,170 @@
+#include "tftp_crc32c.h"
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define CRC32C_X86 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78 // 反射后的多项式
+#define CRC32C_LANE 256 // 硬件版本三路并行时每路的字节数
+
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_k1; // x^(8 * LANE - 33) mod P
+static uint32_t crc32c_k2; // x^(16 * LANE - 33) mod P
+static int crc32c_hw;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+// 反射表示下x^n mod P，最高位表示x^0
+static uint32_t crc32c_xpow(uint32_t n)
+{
+    uint32_t value = 0x80000000;
+    while (n--)
+    {
+        value = (value >> 1) ^ ((value & 1) ? CRC32C_POLY : 0);
+    }
+    return value;
+}
+
+static void crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++)
+        {
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+        }
+        crc32c_table[0][i] = crc;
+    }
+
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        for (int j = 1; j < 8; j++)
+        {
+            uint32_t crc = crc32c_table[j - 1][i];
+            crc32c_table[j][i] = (crc >> 8) ^ crc32c_table[0][crc & 0xFF];
+        }
+    }
+
+    crc32c_k1 = crc32c_xpow(8 * CRC32C_LANE - 33);
+    crc32c_k2 = crc32c_xpow(16 * CRC32C_LANE - 33);
+
+#ifdef CRC32C_X86
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    {
+        crc32c_hw = (ecx & bit_SSE4_2) && (ecx & bit_PCLMUL);
+    }
+#endif
+}
+
+// slice-by-8，crc为未取反的寄存器值
+static uint32_t crc32c_sw_update(uint32_t crc, const uint8_t* data, size_t size)
+{
+    while (size && ((uintptr_t)data & 7))
+    {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data++) & 0xFF];
+        size--;
+    }
+
+    while (size >= 8)
+    {
+        uint32_t low;
+        uint32_t high;
+        memcpy(&low, data, 4);
+        memcpy(&high, data + 4, 4);
+        low ^= crc;
+        crc = crc32c_table[7][low & 0xFF] ^ crc32c_table[6][(low >> 8) & 0xFF] ^
+            crc32c_table[5][(low >> 16) & 0xFF] ^ crc32c_table[4][low >> 24] ^
+            crc32c_table[3][high & 0xFF] ^ crc32c_table[2][(high >> 8) & 0xFF] ^
+            crc32c_table[1][(high >> 16) & 0xFF] ^ crc32c_table[0][high >> 24];
+        data += 8;
+        size -= 8;
+    }
+
+    while (size--)
+    {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+#ifdef CRC32C_X86
+// crc32指令有3个周期的延迟，分成三路交替计算，最后用pclmul把前两路移位后合并
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_hw_update(uint32_t crc, const uint8_t* data, size_t size)
+{
+    uint64_t value;
+    while (size && ((uintptr_t)data & 7))
+    {
+        crc = _mm_crc32_u8(crc, *data++);
+        size--;
+    }
+
+    uint64_t crc0 = crc;
+    while (size >= 3 * CRC32C_LANE)
+    {
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        for (int i = 0; i < CRC32C_LANE; i += 8)
+        {
+            memcpy(&value, data + i, 8);
+            crc0 = _mm_crc32_u64(crc0, value);
+            memcpy(&value, data + CRC32C_LANE + i, 8);
+            crc1 = _mm_crc32_u64(crc1, value);
+            memcpy(&value, data + 2 * CRC32C_LANE + i, 8);
+            crc2 = _mm_crc32_u64(crc2, value);
+        }
+
+        __m128i shift0 = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int)crc0), _mm_cvtsi32_si128((int)crc32c_k2), 0);
+        __m128i shift1 = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int)crc1), _mm_cvtsi32_si128((int)crc32c_k1), 0);
+        crc0 = crc2 ^ _mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(shift0)) ^
+            _mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(shift1));
+
+        data += 3 * CRC32C_LANE;
+        size -= 3 * CRC32C_LANE;
+    }
+
+    while (size >= 8)
+    {
+        memcpy(&value, data, 8);
+        crc0 = _mm_crc32_u64(crc0, value);
+        data += 8;
+        size -= 8;
+    }
+
+    crc = (uint32_t)crc0;
+    while (size--)
+    {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+uint32_t tftp_crc32c_sw(uint32_t crc, const void* data, size_t size)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_sw_update(~crc, (const uint8_t*)data, size);
+}
+
+uint32_t tftp_crc32c(uint32_t crc, const void* data, size_t size)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+#ifdef CRC32C_X86
+    if (crc32c_hw)
+    {
+        return ~crc32c_hw_update(~crc, (const uint8_t*)data, size);
+    }
+#endif
+    return ~crc32c_sw_update(~crc, (const uint8_t*)data, size);
+}
+
+int tftp_crc32c_hw_enabled(void)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_hw;
+}
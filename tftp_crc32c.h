@@ -0,0 +1,12 @@
+#ifndef TFTP_CRC32C_H
+#define TFTP_CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// CRC32C(Castagnoli)，crc传入上一次的结果，第一次传0
+uint32_t tftp_crc32c(uint32_t crc, const void* data, size_t size);
+uint32_t tftp_crc32c_sw(uint32_t crc, const void* data, size_t size);
+int tftp_crc32c_hw_enabled(void);
+
+#endif // !TFTP_CRC32C_H
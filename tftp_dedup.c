@@ -0,0 +1,453 @@
+#define _GNU_SOURCE // fopencookie
+#include "tftp_dedup.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define DEDUP_MASK ((((uint64_t)1 << TFTP_DEDUP_AVG_BITS) - 1) << (64 - TFTP_DEDUP_AVG_BITS)) // 高位才和最近64个字节都有关
+#define DEDUP_GEAR_SEED 0x7466747064656475ULL // 换了种子以后的上传就和仓库里的块对不上了
+
+struct _tftp_dedup_writer_t
+{
+    FILE* file;
+    char path[TFTP_DEDUP_PATH_SIZE];
+    uint64_t gear; // 滚动哈希
+    size_t used; // chunk里攒着的还没到边界的数据
+    tftp_dedup_entry_t* entries;
+    uint32_t count;
+    uint32_t capacity;
+    uint64_t size;
+    int commit;
+    int error;
+    uint8_t chunk[TFTP_DEDUP_MAX_CHUNK];
+};
+
+typedef struct _dedup_reader_t
+{
+    tftp_dedup_entry_t* entries;
+    int64_t* offsets; // 每块在原文件中的起点，最后多一项是文件大小
+    uint32_t count;
+    uint32_t index; // fd打开的块
+    int fd;
+    int64_t pos;
+}dedup_reader_t;
+
+static char dedup_store[TFTP_DEDUP_PATH_SIZE - 2 * TFTP_SHA256_SIZE - 2]; // 后面要放下"/xx/"和62个字符的块名
+static uint64_t dedup_gear[256];
+static pthread_once_t dedup_once = PTHREAD_ONCE_INIT;
+static uint32_t dedup_seq; // 临时文件名
+static tftp_dedup_stats_t dedup_totals;
+
+// splitmix64生成固定的表，进程重启后边界不变
+static void dedup_gear_init(void)
+{
+    uint64_t state = DEDUP_GEAR_SEED;
+    for (int i = 0; i < 256; i++)
+    {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        dedup_gear[i] = z ^ (z >> 31);
+    }
+}
+
+static uint64_t dedup_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void dedup_chunk_path(const uint8_t* digest, char* path, size_t size)
+{
+    static const char digits[] = "0123456789abcdef";
+    char name[2 * TFTP_SHA256_SIZE + 1];
+    for (int i = 0; i < TFTP_SHA256_SIZE; i++)
+    {
+        name[2 * i] = digits[digest[i] >> 4];
+        name[2 * i + 1] = digits[digest[i] & 0xF];
+    }
+    name[2 * TFTP_SHA256_SIZE] = 0;
+    snprintf(path, size, "%s/%.2s/%s", dedup_store, name, name + 2);
+}
+
+// 先写临时文件再改名，同一块被两个上传同时写时谁后改名都一样
+static int dedup_write_file(const char* path, const void* data1, size_t size1, const void* data2, size_t size2)
+{
+    char temp[TFTP_DEDUP_PATH_SIZE + 32];
+    snprintf(temp, sizeof(temp), "%s.%d.%u", path, (int)getpid(), __atomic_add_fetch(&dedup_seq, 1, __ATOMIC_RELAXED));
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    int error = ((write(fd, data1, size1) != (ssize_t)size1) || (write(fd, data2, size2) != (ssize_t)size2)) ? -1 : 0;
+    if ((close(fd) < 0) || (error < 0) || (rename(temp, path) < 0))
+    {
+        unlink(temp);
+        return -1;
+    }
+    return 0;
+}
+
+// 攒够一块：算摘要，仓库里没有时存进去，记到清单里
+static int dedup_emit(tftp_dedup_writer_t* writer)
+{
+    if (writer->count == writer->capacity)
+    {
+        uint32_t capacity = writer->capacity ? writer->capacity * 2 : 64;
+        tftp_dedup_entry_t* entries = (tftp_dedup_entry_t*)realloc(writer->entries, capacity * sizeof(tftp_dedup_entry_t));
+        if (entries == NULL)
+        {
+            return -1;
+        }
+        writer->entries = entries;
+        writer->capacity = capacity;
+    }
+
+    tftp_dedup_entry_t* entry = writer->entries + writer->count++;
+    uint64_t start = dedup_now_ns();
+    tftp_sha256(writer->chunk, writer->used, entry->digest);
+    __atomic_add_fetch(&dedup_totals.hash_ns, dedup_now_ns() - start, __ATOMIC_RELAXED);
+    entry->size = (uint32_t)writer->used;
+
+    char path[TFTP_DEDUP_PATH_SIZE];
+    struct stat st;
+    dedup_chunk_path(entry->digest, path, sizeof(path));
+    __atomic_add_fetch(&dedup_totals.chunks, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&dedup_totals.bytes, writer->used, __ATOMIC_RELAXED);
+    if ((stat(path, &st) < 0) || (st.st_size != (off_t)writer->used))
+    {
+        if (dedup_write_file(path, writer->chunk, writer->used, NULL, 0) < 0)
+        {
+            printf("tftp: write chunk %s failed\n", path);
+            return -1;
+        }
+        __atomic_add_fetch(&dedup_totals.new_chunks, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&dedup_totals.stored, writer->used, __ATOMIC_RELAXED);
+    }
+
+    writer->used = 0;
+    writer->gear = 0;
+    return 0;
+}
+
+// 边找边界边拷进块缓冲，找到了就存一块；不拷两遍，也不回头重新扫
+static ssize_t dedup_write(void* cookie, const char* buf, size_t size)
+{
+    tftp_dedup_writer_t* writer = (tftp_dedup_writer_t*)cookie;
+    const uint8_t* data = (const uint8_t*)buf;
+    size_t done = 0;
+    while ((done < size) && !writer->error)
+    {
+        uint64_t start = dedup_now_ns();
+        uint64_t gear = writer->gear;
+        size_t used = writer->used;
+        size_t take = size - done;
+        int cut = 0;
+        for (size_t i = 0; i < size - done; i++)
+        {
+            gear = (gear << 1) + dedup_gear[data[done + i]];
+            if ((used + i + 1 >= TFTP_DEDUP_MAX_CHUNK) || ((used + i + 1 >= TFTP_DEDUP_MIN_CHUNK) && !(gear & DEDUP_MASK)))
+            {
+                take = i + 1;
+                cut = 1;
+                break;
+            }
+        }
+        __atomic_add_fetch(&dedup_totals.hash_ns, dedup_now_ns() - start, __ATOMIC_RELAXED);
+
+        memcpy(writer->chunk + used, data + done, take);
+        writer->used = used + take;
+        writer->gear = gear;
+        writer->size += take;
+        done += take;
+        if (cut && (dedup_emit(writer) < 0))
+        {
+            writer->error = 1;
+        }
+    }
+
+    if (writer->error)
+    {
+        errno = EIO;
+        return 0;
+    }
+    return (ssize_t)size;
+}
+
+// 只能写，ftell要用当前位置
+static int dedup_writer_seek(void* cookie, off64_t* offset, int whence)
+{
+    tftp_dedup_writer_t* writer = (tftp_dedup_writer_t*)cookie;
+    if ((whence == SEEK_CUR) && (*offset == 0))
+    {
+        *offset = (off64_t)writer->size;
+        return 0;
+    }
+    errno = ESPIPE;
+    return -1;
+}
+
+static int dedup_writer_close(void* cookie)
+{
+    tftp_dedup_writer_t* writer = (tftp_dedup_writer_t*)cookie;
+    int error = writer->error ? -1 : 0;
+    if (writer->commit && (error == 0))
+    {
+        if (writer->used && (dedup_emit(writer) < 0))
+        {
+            error = -1;
+        }
+
+        tftp_dedup_header_t header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, TFTP_DEDUP_MAGIC, sizeof(header.magic));
+        header.count = writer->count;
+        header.size = writer->size;
+        size_t entries_size = writer->count * sizeof(tftp_dedup_entry_t);
+        if ((error == 0) && (dedup_write_file(writer->path, &header, sizeof(header), writer->entries, entries_size) == 0))
+        {
+            __atomic_add_fetch(&dedup_totals.files, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&dedup_totals.stored, sizeof(header) + entries_size, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            printf("tftp: write manifest %s failed\n", writer->path);
+            error = -1;
+        }
+    }
+
+    free(writer->entries);
+    free(writer);
+    return error;
+}
+
+static ssize_t dedup_read(void* cookie, char* buf, size_t size)
+{
+    dedup_reader_t* reader = (dedup_reader_t*)cookie;
+    size_t total = 0;
+    while ((total < size) && (reader->pos < reader->offsets[reader->count]))
+    {
+        // 跳到pos所在的块，seek之后或者读完一块时换
+        while (reader->pos >= reader->offsets[reader->index + 1])
+        {
+            reader->index++;
+            if (reader->fd >= 0)
+            {
+                close(reader->fd);
+                reader->fd = -1;
+            }
+        }
+
+        const tftp_dedup_entry_t* entry = reader->entries + reader->index;
+        char path[TFTP_DEDUP_PATH_SIZE];
+        if (reader->fd < 0)
+        {
+            dedup_chunk_path(entry->digest, path, sizeof(path));
+            reader->fd = open(path, O_RDONLY | O_CLOEXEC);
+        }
+
+        int64_t offset = reader->pos - reader->offsets[reader->index];
+        size_t want = size - total;
+        if ((int64_t)want > entry->size - offset)
+        {
+            want = (size_t)(entry->size - offset);
+        }
+        ssize_t read_size = (reader->fd < 0) ? -1 : pread(reader->fd, buf + total, want, offset);
+        if (read_size <= 0)
+        {
+            dedup_chunk_path(entry->digest, path, sizeof(path));
+            printf("tftp: chunk %s missing or truncated\n", path);
+            return -1;
+        }
+        total += (size_t)read_size;
+        reader->pos += read_size;
+    }
+    return (ssize_t)total;
+}
+
+static int dedup_reader_seek(void* cookie, off64_t* offset, int whence)
+{
+    dedup_reader_t* reader = (dedup_reader_t*)cookie;
+    int64_t base = (whence == SEEK_SET) ? 0 : (whence == SEEK_CUR) ? reader->pos : reader->offsets[reader->count];
+    int64_t pos = base + *offset;
+    if ((pos < 0) || (pos > reader->offsets[reader->count]))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // 最后一个起点不大于pos的块，pos在文件末尾时是最后一块
+    uint32_t low = 0;
+    uint32_t high = reader->count;
+    while (high - low > 1)
+    {
+        uint32_t mid = (low + high) / 2;
+        if (reader->offsets[mid] <= pos)
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    if ((low != reader->index) && (reader->fd >= 0))
+    {
+        close(reader->fd);
+        reader->fd = -1;
+    }
+    reader->index = low;
+    reader->pos = pos;
+    *offset = (off64_t)pos;
+    return 0;
+}
+
+static int dedup_reader_close(void* cookie)
+{
+    dedup_reader_t* reader = (dedup_reader_t*)cookie;
+    if (reader->fd >= 0)
+    {
+        close(reader->fd);
+    }
+    free(reader->entries);
+    free(reader->offsets);
+    free(reader);
+    return 0;
+}
+
+int tftp_dedup_init(const char* store)
+{
+    pthread_once(&dedup_once, dedup_gear_init);
+    if (strlen(store) >= sizeof(dedup_store))
+    {
+        printf("tftp: dedup store path too long: %s\n", store);
+        return -1;
+    }
+    strcpy(dedup_store, store);
+
+    char path[TFTP_DEDUP_PATH_SIZE];
+    for (int i = -1; i < 256; i++)
+    {
+        if (i >= 0)
+        {
+            snprintf(path, sizeof(path), "%s/%02x", store, i);
+        }
+        if ((mkdir((i < 0) ? store : path, 0755) < 0) && (errno != EEXIST))
+        {
+            printf("tftp: create dedup store %s failed\n", (i < 0) ? store : path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+tftp_dedup_writer_t* tftp_dedup_create(const char* path)
+{
+    tftp_dedup_writer_t* writer = (tftp_dedup_writer_t*)malloc(sizeof(tftp_dedup_writer_t));
+    if ((writer == NULL) || (strlen(path) >= sizeof(writer->path)))
+    {
+        free(writer);
+        return NULL;
+    }
+
+    strcpy(writer->path, path);
+    writer->gear = 0;
+    writer->used = 0;
+    writer->entries = NULL;
+    writer->count = 0;
+    writer->capacity = 0;
+    writer->size = 0;
+    writer->commit = 0;
+    writer->error = 0;
+
+    cookie_io_functions_t io = { NULL, dedup_write, dedup_writer_seek, dedup_writer_close };
+    writer->file = fopencookie(writer, "wb", io);
+    if (writer->file == NULL)
+    {
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+FILE* tftp_dedup_file(tftp_dedup_writer_t* writer)
+{
+    return writer->file;
+}
+
+int tftp_dedup_close(tftp_dedup_writer_t* writer, int commit)
+{
+    writer->commit = commit;
+    return fclose(writer->file);
+}
+
+FILE* tftp_dedup_open(int fd, int64_t* size)
+{
+    tftp_dedup_header_t header;
+    struct stat st;
+    if ((pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header))
+        || (memcmp(header.magic, TFTP_DEDUP_MAGIC, sizeof(header.magic)) != 0) || (fstat(fd, &st) < 0)
+        || ((uint64_t)st.st_size != sizeof(header) + (uint64_t)header.count * sizeof(tftp_dedup_entry_t)))
+    {
+        return NULL;
+    }
+
+    dedup_reader_t* reader = (dedup_reader_t*)calloc(1, sizeof(dedup_reader_t));
+    size_t entries_size = header.count * sizeof(tftp_dedup_entry_t);
+    if (reader)
+    {
+        reader->entries = (tftp_dedup_entry_t*)malloc(entries_size ? entries_size : 1);
+        reader->offsets = (int64_t*)malloc((header.count + 1) * sizeof(int64_t));
+        reader->count = header.count;
+        reader->fd = -1;
+    }
+    if ((reader == NULL) || (reader->entries == NULL) || (reader->offsets == NULL)
+        || (pread(fd, reader->entries, entries_size, sizeof(header)) != (ssize_t)entries_size))
+    {
+        if (reader)
+        {
+            dedup_reader_close(reader);
+        }
+        return NULL;
+    }
+
+    reader->offsets[0] = 0;
+    for (uint32_t i = 0; i < header.count; i++)
+    {
+        reader->offsets[i + 1] = reader->offsets[i] + reader->entries[i].size;
+    }
+    if (reader->offsets[header.count] != (int64_t)header.size)
+    {
+        dedup_reader_close(reader);
+        return NULL;
+    }
+
+    cookie_io_functions_t io = { dedup_read, NULL, dedup_reader_seek, dedup_reader_close };
+    FILE* file = fopencookie(reader, "rb", io);
+    if (file == NULL)
+    {
+        dedup_reader_close(reader);
+        return NULL;
+    }
+    *size = (int64_t)header.size;
+    return file;
+}
+
+void tftp_dedup_stats(tftp_dedup_stats_t* stats)
+{
+    stats->files = __atomic_load_n(&dedup_totals.files, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&dedup_totals.bytes, __ATOMIC_RELAXED);
+    stats->chunks = __atomic_load_n(&dedup_totals.chunks, __ATOMIC_RELAXED);
+    stats->new_chunks = __atomic_load_n(&dedup_totals.new_chunks, __ATOMIC_RELAXED);
+    stats->stored = __atomic_load_n(&dedup_totals.stored, __ATOMIC_RELAXED);
+    stats->hash_ns = __atomic_load_n(&dedup_totals.hash_ns, __ATOMIC_RELAXED);
+}
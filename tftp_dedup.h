@@ -0,0 +1,60 @@
+#ifndef TFTP_DEDUP_H
+#define TFTP_DEDUP_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "tftp_sha256.h"
+
+// 上传去重：收到的数据按内容切块，每块以SHA-256命名在仓库里只存一份，上传的文件只写一个清单；
+// 下载时按清单把块拼回来。两边对会话都是普通的FILE，netascii、range、压缩照常工作
+// 块的边界由gear滚动哈希决定，只和附近的几十个字节有关，前面插入或删掉数据后后面的块还能对上
+#define TFTP_DEDUP_MIN_CHUNK (2 * 1024)
+#define TFTP_DEDUP_AVG_BITS 13 // 平均块长8K
+#define TFTP_DEDUP_MAX_CHUNK (64 * 1024)
+#define TFTP_DEDUP_PATH_SIZE 256
+#define TFTP_DEDUP_MAGIC "TFTPDDM1" // 清单文件的开头
+
+// 清单的布局: 头 | 按文件中的顺序排列的块
+typedef struct _tftp_dedup_header_t
+{
+    char magic[8];
+    uint32_t count; // 块数
+    uint32_t reserved;
+    uint64_t size; // 原文件的大小
+}tftp_dedup_header_t;
+
+typedef struct _tftp_dedup_entry_t
+{
+    uint8_t digest[TFTP_SHA256_SIZE]; // 仓库里的文件名是它的十六进制，前两个字符是子目录
+    uint32_t size;
+}tftp_dedup_entry_t;
+
+typedef struct _tftp_dedup_writer_t tftp_dedup_writer_t;
+
+// 服务器启动以来的合计
+typedef struct _tftp_dedup_stats_t
+{
+    uint64_t files; // 提交了清单的上传
+    uint64_t bytes; // 切过块的上传数据，含失败的上传
+    uint64_t chunks;
+    uint64_t new_chunks; // 仓库里原来没有的块
+    uint64_t stored; // 新块和清单实际写到磁盘的字节
+    uint64_t hash_ns; // 找边界和算摘要的时间，不含写盘
+}tftp_dedup_stats_t;
+
+// 仓库目录和256个子目录，不存在时创建；服务器启动时调用一次
+int tftp_dedup_init(const char* store);
+
+// 写：往tftp_dedup_file返回的FILE里写，数据切块进仓库；
+// tftp_dedup_close的commit非0时把清单原子地换到path上，否则path上原来的文件不动
+tftp_dedup_writer_t* tftp_dedup_create(const char* path);
+FILE* tftp_dedup_file(tftp_dedup_writer_t* writer);
+int tftp_dedup_close(tftp_dedup_writer_t* writer, int commit);
+
+// 读：fd指向的文件是清单时返回拼回来的只读FILE(可以fseek)，*size为原文件的大小；不是清单返回NULL
+FILE* tftp_dedup_open(int fd, int64_t* size);
+
+void tftp_dedup_stats(tftp_dedup_stats_t* stats);
+
+#endif // !TFTP_DEDUP_H
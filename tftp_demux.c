@@ -0,0 +1,133 @@
+#include "tftp_demux.h"
+#include <stdlib.h>
+
+static uint32_t peer_index(uint64_t key, uint32_t bits)
+{
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> (64 - bits));
+}
+
+uint64_t tftp_peer_key(const struct sockaddr_in* addr, int index)
+{
+    return ((uint64_t)addr->sin_addr.s_addr << 32) | ((uint64_t)addr->sin_port << 16) | (uint16_t)index;
+}
+
+static int peer_alloc(tftp_peer_table_t* table, uint32_t bits)
+{
+    table->slots = (tftp_peer_slot_t*)calloc((size_t)1 << bits, sizeof(tftp_peer_slot_t));
+    table->bits = bits;
+    table->count = 0;
+    return table->slots ? 0 : -1;
+}
+
+int tftp_peer_init(tftp_peer_table_t* table)
+{
+    uint32_t bits = 0;
+    while ((1u << bits) < TFTP_PEER_TABLE_INIT)
+    {
+        bits++;
+    }
+    return peer_alloc(table, bits);
+}
+
+void tftp_peer_free(tftp_peer_table_t* table)
+{
+    free(table->slots);
+    table->slots = NULL;
+    table->count = 0;
+}
+
+// 负载超过一半时翻倍，保持探测序列很短
+static int peer_grow(tftp_peer_table_t* table)
+{
+    tftp_peer_table_t old = *table;
+    if (peer_alloc(table, old.bits + 1) < 0)
+    {
+        *table = old;
+        return -1;
+    }
+
+    uint32_t mask = (1u << table->bits) - 1;
+    for (uint32_t i = 0; i < (1u << old.bits); i++)
+    {
+        if (old.slots[i].key)
+        {
+            uint32_t pos = peer_index(old.slots[i].key, table->bits);
+            while (table->slots[pos].key)
+            {
+                pos = (pos + 1) & mask;
+            }
+            table->slots[pos] = old.slots[i];
+            table->count++;
+        }
+    }
+    free(old.slots);
+    return 0;
+}
+
+int tftp_peer_insert(tftp_peer_table_t* table, uint64_t key, void* value)
+{
+    if (((table->count + 1) * 2 > (1u << table->bits)) && (peer_grow(table) < 0))
+    {
+        return -1;
+    }
+
+    uint32_t mask = (1u << table->bits) - 1;
+    uint32_t pos = peer_index(key, table->bits);
+    while (table->slots[pos].key)
+    {
+        if (table->slots[pos].key == key)
+        {
+            return -1;
+        }
+        pos = (pos + 1) & mask;
+    }
+
+    table->slots[pos].key = key;
+    table->slots[pos].value = value;
+    table->count++;
+    return 0;
+}
+
+void* tftp_peer_find(const tftp_peer_table_t* table, uint64_t key)
+{
+    uint32_t mask = (1u << table->bits) - 1;
+    uint32_t pos = peer_index(key, table->bits);
+    while (table->slots[pos].key)
+    {
+        if (table->slots[pos].key == key)
+        {
+            return table->slots[pos].value;
+        }
+        pos = (pos + 1) & mask;
+    }
+    return NULL;
+}
+
+void tftp_peer_remove(tftp_peer_table_t* table, uint64_t key)
+{
+    uint32_t mask = (1u << table->bits) - 1;
+    uint32_t pos = peer_index(key, table->bits);
+    while (table->slots[pos].key != key)
+    {
+        if (table->slots[pos].key == 0)
+        {
+            return;
+        }
+        pos = (pos + 1) & mask;
+    }
+
+    // 后面同一探测链上的项往前移，填上空位
+    uint32_t hole = pos;
+    for (uint32_t next = (pos + 1) & mask; table->slots[next].key; next = (next + 1) & mask)
+    {
+        uint32_t home = peer_index(table->slots[next].key, table->bits);
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            table->slots[hole] = table->slots[next];
+            hole = next;
+        }
+    }
+    table->slots[hole].key = 0;
+    table->slots[hole].value = NULL;
+    table->count--;
+}
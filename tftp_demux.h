@@ -0,0 +1,32 @@
+#ifndef TFTP_DEMUX_H
+#define TFTP_DEMUX_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define TFTP_PEER_TABLE_INIT 64 // 初始容量，2的幂
+
+// 共享套接字上按对端分发会话：开放寻址 + 线性探测，删除时后移不留墓碑
+// 键为对端地址、端口和本地套接字的序号(即服务器这一侧的TID)，0表示空位
+typedef struct _tftp_peer_slot_t
+{
+    uint64_t key;
+    void* value;
+}tftp_peer_slot_t;
+
+typedef struct _tftp_peer_table_t
+{
+    tftp_peer_slot_t* slots;
+    uint32_t bits;
+    uint32_t count;
+}tftp_peer_table_t;
+
+uint64_t tftp_peer_key(const struct sockaddr_in* addr, int index);
+int tftp_peer_init(tftp_peer_table_t* table);
+void tftp_peer_free(tftp_peer_table_t* table);
+// 已经存在或者内存不够时返回-1
+int tftp_peer_insert(tftp_peer_table_t* table, uint64_t key, void* value);
+void* tftp_peer_find(const tftp_peer_table_t* table, uint64_t key);
+void tftp_peer_remove(tftp_peer_table_t* table, uint64_t key);
+
+#endif // !TFTP_DEMUX_H
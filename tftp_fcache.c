@@ -0,0 +1,327 @@
+#include "tftp_fcache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#define FCACHE_WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF)
+
+typedef enum _fcache_state_t
+{
+    FCACHE_FREE = 0,
+    FCACHE_VALID,
+    FCACHE_STALE, // 已经作废，还有会话在读，最后一个引用释放时关闭
+    FCACHE_PRIVATE, // 缓存满了，单独打开，不进缓存
+}fcache_state_t;
+
+struct _tftp_fcache_t
+{
+    fcache_state_t state;
+    char path[TFTP_FCACHE_PATH_SIZE];
+    uint32_t hash;
+    int fd;
+    int wd; // inotify的watch，-1表示靠stat检查
+    int64_t size;
+    int64_t mtime;
+    int64_t mtime_ns;
+    uint64_t ino;
+    int ref;
+    uint64_t last_use;
+};
+
+static tftp_fcache_t fcache_list[TFTP_FCACHE_ENTRIES];
+static pthread_mutex_t fcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t fcache_clock;
+static int fcache_notify = -2; // -2: 还没初始化，-1: 不可用
+static uint64_t fcache_hits;
+static uint64_t fcache_misses;
+
+static uint32_t fcache_hash(const char* path)
+{
+    uint32_t hash = 2166136261u;
+    while (*path)
+    {
+        hash = (hash ^ (uint8_t)*path++) * 16777619u;
+    }
+    return hash;
+}
+
+// 硬链接的多个路径共用同一个watch，最后一个作废时才删除
+static void fcache_unwatch(tftp_fcache_t* cache)
+{
+    int wd = cache->wd;
+    cache->wd = -1;
+    if (wd < 0)
+    {
+        return;
+    }
+
+    for (int i = 0; i < TFTP_FCACHE_ENTRIES; i++)
+    {
+        if ((fcache_list[i].state == FCACHE_VALID) && (fcache_list[i].wd == wd))
+        {
+            return;
+        }
+    }
+    inotify_rm_watch(fcache_notify, wd);
+}
+
+static void fcache_release(tftp_fcache_t* cache)
+{
+    cache->state = FCACHE_STALE;
+    fcache_unwatch(cache);
+
+    if (cache->ref == 0)
+    {
+        close(cache->fd);
+        cache->fd = -1;
+        cache->state = FCACHE_FREE;
+    }
+}
+
+// 处理积累的inotify通知，不阻塞
+static void fcache_sync(void)
+{
+    if (fcache_notify == -2)
+    {
+        fcache_notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+    if (fcache_notify < 0)
+    {
+        return;
+    }
+
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t size;
+    while ((size = read(fcache_notify, buffer, sizeof(buffer))) > 0)
+    {
+        for (char* ptr = buffer; ptr < buffer + size; ptr += sizeof(struct inotify_event) + ((struct inotify_event*)ptr)->len)
+        {
+            const struct inotify_event* event = (const struct inotify_event*)ptr;
+            for (int i = 0; i < TFTP_FCACHE_ENTRIES; i++)
+            {
+                tftp_fcache_t* cache = fcache_list + i;
+                if ((cache->state == FCACHE_VALID) && (cache->wd == event->wd))
+                {
+                    fcache_release(cache);
+                }
+            }
+        }
+    }
+}
+
+// 没有inotify时用stat比较，同一个路径换了文件或者内容变了都算失效
+static int fcache_check(tftp_fcache_t* cache)
+{
+    if (cache->wd >= 0)
+    {
+        return 1;
+    }
+
+    struct stat file_stat;
+    if (stat(cache->path, &file_stat) < 0)
+    {
+        return 0;
+    }
+
+    return ((uint64_t)file_stat.st_ino == cache->ino) && (file_stat.st_size == cache->size)
+        && ((int64_t)file_stat.st_mtim.tv_sec * 1000000000 + file_stat.st_mtim.tv_nsec == cache->mtime_ns);
+}
+
+static tftp_fcache_t* fcache_find(const char* path, uint32_t hash)
+{
+    for (int i = 0; i < TFTP_FCACHE_ENTRIES; i++)
+    {
+        tftp_fcache_t* cache = fcache_list + i;
+        if ((cache->state == FCACHE_VALID) && (cache->hash == hash) && (strcmp(cache->path, path) == 0))
+        {
+            return cache;
+        }
+    }
+    return NULL;
+}
+
+// 找一个空闲的位置，或者淘汰最久没用过的
+static tftp_fcache_t* fcache_evict(void)
+{
+    tftp_fcache_t* victim = NULL;
+    for (int i = 0; i < TFTP_FCACHE_ENTRIES; i++)
+    {
+        tftp_fcache_t* cache = fcache_list + i;
+        if (cache->state == FCACHE_FREE)
+        {
+            return cache;
+        }
+
+        if ((cache->state != FCACHE_VALID) || cache->ref)
+        {
+            continue;
+        }
+
+        if ((victim == NULL) || (cache->last_use < victim->last_use))
+        {
+            victim = cache;
+        }
+    }
+
+    if (victim)
+    {
+        fcache_release(victim);
+    }
+    return victim;
+}
+
+// 先加watch再打开，打开之后的修改一定会收到通知
+static int fcache_load(tftp_fcache_t* cache, const char* path, uint32_t hash, int watch)
+{
+    cache->wd = (watch && (fcache_notify >= 0)) ? inotify_add_watch(fcache_notify, path, FCACHE_WATCH_MASK) : -1;
+    cache->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (cache->fd < 0)
+    {
+        int error = errno;
+        fcache_unwatch(cache);
+        return error;
+    }
+
+    struct stat file_stat;
+    if ((fstat(cache->fd, &file_stat) < 0) || !S_ISREG(file_stat.st_mode))
+    {
+        close(cache->fd);
+        cache->fd = -1;
+        fcache_unwatch(cache);
+        return EISDIR;
+    }
+
+    strcpy(cache->path, path);
+    cache->hash = hash;
+    cache->size = file_stat.st_size;
+    cache->mtime = file_stat.st_mtime;
+    cache->mtime_ns = (int64_t)file_stat.st_mtim.tv_sec * 1000000000 + file_stat.st_mtim.tv_nsec;
+    cache->ino = file_stat.st_ino;
+    cache->ref = 1;
+    cache->last_use = fcache_clock;
+    return 0;
+}
+
+tftp_fcache_t* tftp_fcache_open(const char* path, int* error)
+{
+    if (strlen(path) >= TFTP_FCACHE_PATH_SIZE)
+    {
+        *error = ENAMETOOLONG;
+        return NULL;
+    }
+
+    uint32_t hash = fcache_hash(path);
+    pthread_mutex_lock(&fcache_lock);
+    fcache_clock++;
+    fcache_sync();
+
+    tftp_fcache_t* found = fcache_find(path, hash);
+    if (found && !fcache_check(found))
+    {
+        fcache_release(found);
+        found = NULL;
+    }
+
+    if (found)
+    {
+        found->ref++;
+        found->last_use = fcache_clock;
+        fcache_hits++;
+        pthread_mutex_unlock(&fcache_lock);
+        return found;
+    }
+
+    fcache_misses++;
+    found = fcache_evict();
+    if (found)
+    {
+        *error = fcache_load(found, path, hash, 1);
+        if (*error == 0)
+        {
+            found->state = FCACHE_VALID;
+        }
+        else
+        {
+            found->state = FCACHE_FREE;
+            found = NULL;
+        }
+        pthread_mutex_unlock(&fcache_lock);
+        return found;
+    }
+    pthread_mutex_unlock(&fcache_lock);
+
+    // 所有的项都在用，这次单独打开
+    found = (tftp_fcache_t*)malloc(sizeof(tftp_fcache_t));
+    if (found == NULL)
+    {
+        *error = ENOMEM;
+        return NULL;
+    }
+
+    *error = fcache_load(found, path, hash, 0);
+    if (*error)
+    {
+        free(found);
+        return NULL;
+    }
+    found->state = FCACHE_PRIVATE;
+    return found;
+}
+
+void tftp_fcache_close(tftp_fcache_t* cache)
+{
+    if (cache->state == FCACHE_PRIVATE)
+    {
+        close(cache->fd);
+        free(cache);
+        return;
+    }
+
+    pthread_mutex_lock(&fcache_lock);
+    if ((--cache->ref == 0) && (cache->state == FCACHE_STALE))
+    {
+        fcache_release(cache);
+    }
+    pthread_mutex_unlock(&fcache_lock);
+}
+
+void tftp_fcache_invalidate(const char* path)
+{
+    uint32_t hash = fcache_hash(path);
+    pthread_mutex_lock(&fcache_lock);
+    tftp_fcache_t* cache = fcache_find(path, hash);
+    if (cache)
+    {
+        fcache_release(cache);
+    }
+    pthread_mutex_unlock(&fcache_lock);
+}
+
+int tftp_fcache_fd(tftp_fcache_t* cache)
+{
+    return cache->fd;
+}
+
+int64_t tftp_fcache_size(tftp_fcache_t* cache)
+{
+    return cache->size;
+}
+
+int64_t tftp_fcache_mtime(tftp_fcache_t* cache)
+{
+    return cache->mtime;
+}
+
+void tftp_fcache_stats(uint64_t* hits, uint64_t* misses)
+{
+    pthread_mutex_lock(&fcache_lock);
+    *hits = fcache_hits;
+    *misses = fcache_misses;
+    pthread_mutex_unlock(&fcache_lock);
+}
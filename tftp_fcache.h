@@ -0,0 +1,25 @@
+#ifndef TFTP_FCACHE_H
+#define TFTP_FCACHE_H
+
+#include <stdint.h>
+
+#define TFTP_FCACHE_ENTRIES 64 // 缓存的打开文件数
+#define TFTP_FCACHE_PATH_SIZE 256
+
+// 只读文件的描述符和大小/修改时间缓存，键为拼好的路径
+// 有inotify时文件被修改、删除、改名后收到通知作废，否则每次命中时stat比较
+typedef struct _tftp_fcache_t tftp_fcache_t;
+
+// 返回的项持有引用，用完调用tftp_fcache_close；文件不存在或不是普通文件返回NULL，*error为errno
+tftp_fcache_t* tftp_fcache_open(const char* path, int* error);
+void tftp_fcache_close(tftp_fcache_t* cache);
+// 文件被本进程改写前主动作废
+void tftp_fcache_invalidate(const char* path);
+
+int tftp_fcache_fd(tftp_fcache_t* cache);
+int64_t tftp_fcache_size(tftp_fcache_t* cache);
+int64_t tftp_fcache_mtime(tftp_fcache_t* cache);
+
+void tftp_fcache_stats(uint64_t* hits, uint64_t* misses);
+
+#endif // !TFTP_FCACHE_H
@@ -0,0 +1,221 @@
+#include "tftp_filter.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
+
+#define FILTER_UDP_HDR 8 // 套接字过滤器看到的包从UDP头开始
+#define FILTER_SOURCE_OFF (SKF_NET_OFF + 12) // IPv4头里的源地址
+#define FILTER_MALFORMED 0
+#define FILTER_LIMITED 1
+#define FILTER_COUNTERS 2
+#define FILTER_LOG_SIZE 4096
+
+#define FILTER_INSN(c, d, s, o, i) { .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) }
+#define FILTER_IMM64(d, s, v) \
+    FILTER_INSN(BPF_LD | BPF_DW | BPF_IMM, d, s, 0, (int32_t)(uint32_t)(v)), \
+    FILTER_INSN(0, 0, 0, 0, (int32_t)(uint32_t)((uint64_t)(v) >> 32))
+
+static int filter_bpf(int cmd, union bpf_attr* attr)
+{
+    return (int)syscall(SYS_bpf, cmd, attr, sizeof(union bpf_attr));
+}
+
+static int filter_map(int type, int key_size, int value_size, int entries)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = type;
+    attr.key_size = key_size;
+    attr.value_size = value_size;
+    attr.max_entries = entries;
+    return filter_bpf(BPF_MAP_CREATE, &attr);
+}
+
+// 限速用GCRA，每个源地址只存一个时间：tat是按速率排下去的下一个请求的时间，
+// 比现在晚出burst个间隔就丢掉。多个CPU同时收同一个源的包时更新会互相覆盖，限速是近似的
+static int filter_load(const tftp_filter_t* filter, int rate)
+{
+    uint64_t interval = rate ? 1000000000ull / (uint64_t)rate : 0;
+    uint64_t tau = rate ? (uint64_t)(rate - 1) * interval : 0;
+    struct bpf_insn prog[] =
+    {
+        // 格式：长度够、操作码是RRQ/WRQ、最后一个字节是字符串结尾的0
+        /* 0*/ FILTER_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+        /* 1*/ FILTER_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_6, offsetof(struct __sk_buff, len), 0),
+        /* 2*/ FILTER_INSN(BPF_JMP | BPF_JLT | BPF_K, BPF_REG_0, 0, 45, FILTER_UDP_HDR + TFTP_FILTER_MIN_REQ), // -> 48
+        /* 3*/ FILTER_INSN(BPF_LD | BPF_ABS | BPF_H, 0, 0, 0, FILTER_UDP_HDR),
+        /* 4*/ FILTER_INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 1, 1), // -> 6
+        /* 5*/ FILTER_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 42, 2), // -> 48
+        /* 6*/ FILTER_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_7, BPF_REG_6, offsetof(struct __sk_buff, len), 0),
+        /* 7*/ FILTER_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_7, 0, 0, -1),
+        /* 8*/ FILTER_INSN(BPF_LD | BPF_IND | BPF_B, 0, BPF_REG_7, 0, 0),
+        /* 9*/ FILTER_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 38, 0), // -> 48
+        /*10*/ FILTER_INSN(BPF_JMP | (rate ? BPF_JNE : BPF_JEQ) | BPF_K, BPF_REG_0, 0, 35, 0), // 这里r0是0，不限速时跳 -> 46
+
+        // 限速：tat = max(tat, now)，tat - now > tau时丢掉，否则tat += interval
+        /*11*/ FILTER_INSN(BPF_LD | BPF_ABS | BPF_W, 0, 0, 0, FILTER_SOURCE_OFF),
+        /*12*/ FILTER_INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_0, -4, 0),
+        /*13*/ FILTER_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_ktime_get_ns),
+        /*14*/ FILTER_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_7, BPF_REG_0, 0, 0),
+        /*15*/ FILTER_IMM64(BPF_REG_1, BPF_PSEUDO_MAP_FD, filter->sources_fd),
+        /*17*/ FILTER_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+        /*18*/ FILTER_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -4),
+        /*19*/ FILTER_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+        /*20*/ FILTER_INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 13, 0), // 新的源 -> 34
+        /*21*/ FILTER_INSN(BPF_LDX | BPF_MEM | BPF_DW, BPF_REG_1, BPF_REG_0, 0, 0),
+        /*22*/ FILTER_INSN(BPF_JMP | BPF_JGE | BPF_X, BPF_REG_1, BPF_REG_7, 1, 0), // -> 24
+        /*23*/ FILTER_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_7, 0, 0),
+        /*24*/ FILTER_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_1, 0, 0),
+        /*25*/ FILTER_INSN(BPF_ALU64 | BPF_SUB | BPF_X, BPF_REG_2, BPF_REG_7, 0, 0),
+        /*26*/ FILTER_IMM64(BPF_REG_3, 0, tau),
+        /*28*/ FILTER_INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_2, BPF_REG_3, 21, 0), // -> 50
+        /*29*/ FILTER_IMM64(BPF_REG_3, 0, interval),
+        /*31*/ FILTER_INSN(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_1, BPF_REG_3, 0, 0),
+        /*32*/ FILTER_INSN(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_0, BPF_REG_1, 0, 0),
+        /*33*/ FILTER_INSN(BPF_JMP | BPF_JA, 0, 0, 12, 0), // -> 46
+        /*34*/ FILTER_IMM64(BPF_REG_1, 0, interval),
+        /*36*/ FILTER_INSN(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_1, BPF_REG_7, 0, 0),
+        /*37*/ FILTER_INSN(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_1, -16, 0),
+        /*38*/ FILTER_IMM64(BPF_REG_1, BPF_PSEUDO_MAP_FD, filter->sources_fd),
+        /*40*/ FILTER_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+        /*41*/ FILTER_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -4),
+        /*42*/ FILTER_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+        /*43*/ FILTER_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -16),
+        /*44*/ FILTER_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, BPF_ANY),
+        /*45*/ FILTER_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_update_elem),
+
+        // 收下整个包
+        /*46*/ FILTER_INSN(BPF_ALU | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, -1),
+        /*47*/ FILTER_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+
+        // 丢掉，按原因计数
+        /*48*/ FILTER_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_8, 0, 0, FILTER_MALFORMED),
+        /*49*/ FILTER_INSN(BPF_JMP | BPF_JA, 0, 0, 1, 0), // -> 51
+        /*50*/ FILTER_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_8, 0, 0, FILTER_LIMITED),
+        /*51*/ FILTER_INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_8, -8, 0),
+        /*52*/ FILTER_IMM64(BPF_REG_1, BPF_PSEUDO_MAP_FD, filter->counters_fd),
+        /*54*/ FILTER_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+        /*55*/ FILTER_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8),
+        /*56*/ FILTER_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+        /*57*/ FILTER_INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 2, 0), // -> 60
+        /*58*/ FILTER_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_1, 0, 0, 1),
+        /*59*/ FILTER_INSN(BPF_STX | BPF_ATOMIC | BPF_DW, BPF_REG_0, BPF_REG_1, 0, BPF_ADD),
+        /*60*/ FILTER_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0),
+        /*61*/ FILTER_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+
+    static char log[FILTER_LOG_SIZE];
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+    attr.insns = (uint64_t)(uintptr_t)prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = (uint64_t)(uintptr_t)"GPL";
+    attr.log_buf = (uint64_t)(uintptr_t)log;
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    log[0] = 0;
+    int prog_fd = filter_bpf(BPF_PROG_LOAD, &attr);
+    if ((prog_fd < 0) && (errno != EPERM))
+    {
+        printf("tftp: load ebpf filter failed: %s\n%s", strerror(errno), log);
+    }
+    return prog_fd;
+}
+
+static int filter_attach_ebpf(tftp_filter_t* filter, int sockfd, int rate)
+{
+    filter->sources_fd = filter_map(BPF_MAP_TYPE_LRU_HASH, sizeof(uint32_t), sizeof(uint64_t), TFTP_FILTER_SOURCES);
+    filter->counters_fd = filter_map(BPF_MAP_TYPE_ARRAY, sizeof(uint32_t), sizeof(uint64_t), FILTER_COUNTERS);
+    int prog_fd = ((filter->sources_fd < 0) || (filter->counters_fd < 0)) ? -1 : filter_load(filter, rate);
+    int error = (prog_fd < 0) ? -1 : setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_BPF, &prog_fd, sizeof(prog_fd));
+
+    // 套接字上挂着程序，程序引用着两个表，只留下读计数用的描述符
+    if (prog_fd >= 0)
+    {
+        close(prog_fd);
+    }
+    if (filter->sources_fd >= 0)
+    {
+        close(filter->sources_fd);
+        filter->sources_fd = -1;
+    }
+    if ((error < 0) && (filter->counters_fd >= 0))
+    {
+        close(filter->counters_fd);
+        filter->counters_fd = -1;
+    }
+    return error;
+}
+
+static int filter_attach_classic(int sockfd)
+{
+    struct sock_filter code[] =
+    {
+        /* 0*/ BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+        /* 1*/ BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, FILTER_UDP_HDR + TFTP_FILTER_MIN_REQ, 0, 9), // -> 11
+        /* 2*/ BPF_STMT(BPF_LD | BPF_H | BPF_ABS, FILTER_UDP_HDR),
+        /* 3*/ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 1, 1, 0), // -> 5
+        /* 4*/ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 2, 0, 6), // -> 11
+        /* 5*/ BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+        /* 6*/ BPF_STMT(BPF_ALU | BPF_SUB | BPF_K, 1),
+        /* 7*/ BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        /* 8*/ BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),
+        /* 9*/ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1), // -> 11
+        /*10*/ BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+        /*11*/ BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog prog;
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+int tftp_filter_attach(tftp_filter_t* filter, int sockfd, int rate)
+{
+    filter->type = TFTP_FILTER_NONE;
+    filter->sources_fd = -1;
+    filter->counters_fd = -1;
+    if (filter_attach_ebpf(filter, sockfd, rate) == 0)
+    {
+        filter->type = TFTP_FILTER_EBPF;
+    }
+    else if (filter_attach_classic(sockfd) == 0)
+    {
+        filter->type = TFTP_FILTER_CLASSIC;
+    }
+    else
+    {
+        return -1;
+    }
+    return filter->type;
+}
+
+void tftp_filter_detach(int sockfd)
+{
+    // 内核先检查长度，参数不用也要给一个int
+    int unused = 0;
+    setsockopt(sockfd, SOL_SOCKET, SO_DETACH_FILTER, &unused, sizeof(unused));
+}
+
+void tftp_filter_counts(const tftp_filter_t* filter, uint64_t* malformed, uint64_t* limited)
+{
+    uint64_t values[FILTER_COUNTERS] = { 0, 0 };
+    for (uint32_t key = 0; (filter->counters_fd >= 0) && (key < FILTER_COUNTERS); key++)
+    {
+        union bpf_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = filter->counters_fd;
+        attr.key = (uint64_t)(uintptr_t)&key;
+        attr.value = (uint64_t)(uintptr_t)(values + key);
+        filter_bpf(BPF_MAP_LOOKUP_ELEM, &attr);
+    }
+    *malformed = values[FILTER_MALFORMED];
+    *limited = values[FILTER_LIMITED];
+}
@@ -0,0 +1,31 @@
+#ifndef TFTP_FILTER_H
+#define TFTP_FILTER_H
+
+#include <stdint.h>
+
+// 监听套接字上的内核过滤：不像RRQ/WRQ的包在进接收队列之前就丢掉，不用唤醒分发线程
+// eBPF可以用时同一源地址的请求再按令牌桶限速，丢掉的包按原因计数；
+// 加载不了eBPF(没有权限)时退回经典BPF，只检查格式，不限速也不计数
+#define TFTP_FILTER_SOURCES 4096 // 限速记录的源地址数，满了淘汰最久没来请求的
+#define TFTP_FILTER_MIN_REQ 10 // 最短的请求：操作码、一个字符的文件名、"octet"，各带结尾的0
+
+#define TFTP_FILTER_NONE 0
+#define TFTP_FILTER_CLASSIC 1
+#define TFTP_FILTER_EBPF 2
+
+typedef struct _tftp_filter_t
+{
+    int type; // TFTP_FILTER_*
+    int sources_fd; // eBPF: 源地址 -> 下一个请求最早可以到的时间(GCRA)
+    int counters_fd; // eBPF: 格式不对和超速丢掉的包数
+}tftp_filter_t;
+
+// 挂到sockfd上，已经有过滤器(比如旧进程交接过来的)时替换掉；rate为每个源地址每秒的请求数，0表示不限
+// 返回挂上的类型，失败返回-1
+int tftp_filter_attach(tftp_filter_t* filter, int sockfd, int rate);
+// 从sockfd上拿掉过滤器，没有时什么也不做
+void tftp_filter_detach(int sockfd);
+// eBPF过滤器在内核里丢掉的包数，其他类型都是0
+void tftp_filter_counts(const tftp_filter_t* filter, uint64_t* malformed, uint64_t* limited);
+
+#endif // !TFTP_FILTER_H
@@ -0,0 +1,137 @@
+#include "tftp_handoff.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+static int handoff_addr(const char* path, struct sockaddr_un* addr)
+{
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+        printf("tftpd: handoff path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int tftp_handoff_recv(const char* path, uint16_t port)
+{
+    struct sockaddr_un addr;
+    int fd = (handoff_addr(path, &addr) < 0) ? -1 : socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    // 没有旧进程时连接直接失败；旧进程卡住时不一直等
+    struct timeval tmo;
+    tmo.tv_sec = TFTP_HANDOFF_TMO_MS / 1000;
+    tmo.tv_usec = (TFTP_HANDOFF_TMO_MS % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const void*)&tmo, sizeof(tmo));
+    if (connect(fd, (const struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    char byte;
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    union
+    {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    }control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    ssize_t size = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    close(fd);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if ((size != 1) || (cmsg == NULL) || (cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS)
+        || (cmsg->cmsg_len != CMSG_LEN(sizeof(int))))
+    {
+        printf("tftpd: no socket from %s\n", path);
+        return -1;
+    }
+
+    int sockfd;
+    memcpy(&sockfd, CMSG_DATA(cmsg), sizeof(int));
+
+    // 旧进程换了端口配置时不能接着用
+    struct sockaddr_in local;
+    socklen_t len = sizeof(local);
+    if ((getsockname(sockfd, (struct sockaddr*)&local, &len) < 0) || (local.sin_family != AF_INET) || (ntohs(local.sin_port) != port))
+    {
+        printf("tftpd: socket from %s is not bound to port %d\n", path, port);
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+int tftp_handoff_listen(const char* path)
+{
+    struct sockaddr_un addr;
+    int fd = (handoff_addr(path, &addr) < 0) ? -1 : socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    // 旧进程的还在监听，删掉名字它就收不到新的连接了，它交接完自己关掉
+    unlink(path);
+    if ((bind(fd, (const struct sockaddr*)&addr, sizeof(addr)) < 0) || (listen(fd, 1) < 0))
+    {
+        printf("tftpd: listen on %s failed\n", path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int tftp_handoff_send(int listen_fd, int sockfd)
+{
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    char byte = 0;
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    union
+    {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    }control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &sockfd, sizeof(int));
+
+    ssize_t size = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    close(fd);
+    return (size == 1) ? 0 : -1;
+}
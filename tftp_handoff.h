@@ -0,0 +1,17 @@
+#ifndef TFTP_HANDOFF_H
+#define TFTP_HANDOFF_H
+
+#include <stdint.h>
+
+// 重启时把监听套接字交给新进程：旧进程在一个Unix套接字上等，新进程连上来用SCM_RIGHTS取走描述符
+// 两个进程拿到的是同一个套接字，交接期间到达的请求留在它的接收队列里，谁接着读都不会丢
+#define TFTP_HANDOFF_TMO_MS 1000 // 新进程等旧进程回应的时间
+
+// 新进程：连上path取监听套接字，检查绑定的是port；没有旧进程或者失败时返回-1
+int tftp_handoff_recv(const char* path, uint16_t port);
+// 在path上等下一个新进程，已经有这个文件时先删掉，返回非阻塞的监听描述符
+int tftp_handoff_listen(const char* path);
+// 旧进程：listen_fd可读时接受一个连接，把sockfd发过去
+int tftp_handoff_send(int listen_fd, int sockfd);
+
+#endif // !TFTP_HANDOFF_H
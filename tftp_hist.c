@@ -0,0 +1,220 @@
+#include "tftp_hist.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// 每个线程一组，记录时只有所属线程写；读的时候按relaxed读，计数之间可以有很小的不一致
+typedef struct _hist_block_t
+{
+    struct _hist_block_t* next;
+    int in_use;
+    tftp_hist_t hist[TFTP_HIST_SIDES][TFTP_HIST_COUNT];
+}hist_block_t;
+
+static pthread_mutex_t hist_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t hist_once = PTHREAD_ONCE_INIT;
+static pthread_key_t hist_key;
+static hist_block_t* hist_blocks; // 所有分配过的，只增不减
+static tftp_hist_t hist_base[TFTP_HIST_SIDES][TFTP_HIST_COUNT]; // reset时的合计
+static __thread hist_block_t* hist_local;
+
+static const char* hist_names[TFTP_HIST_COUNT] =
+{
+    "first data", "ack rtt", "file io", "xfer <1M", "xfer <16M", "xfer <256M", "xfer big",
+};
+
+// 线程退出后计数保留，下一个线程接着用
+static void hist_release(void* arg)
+{
+    hist_block_t* block = (hist_block_t*)arg;
+    pthread_mutex_lock(&hist_lock);
+    block->in_use = 0;
+    pthread_mutex_unlock(&hist_lock);
+}
+
+static void hist_init(void)
+{
+    pthread_key_create(&hist_key, hist_release);
+}
+
+static hist_block_t* hist_acquire(void)
+{
+    pthread_once(&hist_once, hist_init);
+    pthread_mutex_lock(&hist_lock);
+    hist_block_t* block = hist_blocks;
+    while (block && block->in_use)
+    {
+        block = block->next;
+    }
+
+    if (block == NULL)
+    {
+        block = (hist_block_t*)calloc(1, sizeof(hist_block_t));
+        if (block == NULL)
+        {
+            pthread_mutex_unlock(&hist_lock);
+            return NULL;
+        }
+        block->next = hist_blocks;
+        hist_blocks = block;
+    }
+    block->in_use = 1;
+    pthread_mutex_unlock(&hist_lock);
+
+    hist_local = block;
+    pthread_setspecific(hist_key, block);
+    return block;
+}
+
+// 小于2^(SUB_BITS+1)的值每个值一个桶，之后每翻一倍多SUB_COUNT个桶
+static int hist_index(uint64_t value)
+{
+    int shift = 63 - __builtin_clzll(value | 1) - TFTP_HIST_SUB_BITS;
+    if (shift < 0)
+    {
+        shift = 0;
+    }
+    else if (shift > TFTP_HIST_MAX_SHIFT)
+    {
+        return TFTP_HIST_BUCKETS - 1;
+    }
+    return (shift << TFTP_HIST_SUB_BITS) + (int)(value >> shift);
+}
+
+static uint64_t hist_upper(int index)
+{
+    if (index < 2 * TFTP_HIST_SUB_COUNT)
+    {
+        return (uint64_t)index;
+    }
+
+    int shift = (index >> TFTP_HIST_SUB_BITS) - 1;
+    uint64_t top = (uint64_t)(index - (shift << TFTP_HIST_SUB_BITS));
+    return ((top + 1) << shift) - 1;
+}
+
+static void hist_add(uint64_t* counter, uint64_t value)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+void tftp_hist_record(int side, int id, uint64_t value)
+{
+    hist_block_t* block = hist_local ? hist_local : hist_acquire();
+    if (block == NULL)
+    {
+        return;
+    }
+
+    tftp_hist_t* hist = &block->hist[side][id];
+    hist_add(&hist->counts[hist_index(value)], 1);
+    hist_add(&hist->sum, value);
+    hist_add(&hist->total, 1);
+}
+
+void tftp_hist_transfer(int side, int64_t size, uint64_t value)
+{
+    int id = (size < (1 << 20)) ? TFTP_HIST_TRANSFER : (size < (16 << 20)) ? TFTP_HIST_TRANSFER_1M
+        : (size < (256 << 20)) ? TFTP_HIST_TRANSFER_16M : TFTP_HIST_TRANSFER_BIG;
+    tftp_hist_record(side, id, value);
+}
+
+static void hist_merge(int side, int id, tftp_hist_t* hist)
+{
+    memset(hist, 0, sizeof(tftp_hist_t));
+    for (hist_block_t* block = hist_blocks; block; block = block->next)
+    {
+        const tftp_hist_t* local = &block->hist[side][id];
+        hist->total += __atomic_load_n(&local->total, __ATOMIC_RELAXED);
+        hist->sum += __atomic_load_n(&local->sum, __ATOMIC_RELAXED);
+        for (int i = 0; i < TFTP_HIST_BUCKETS; i++)
+        {
+            hist->counts[i] += __atomic_load_n(&local->counts[i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void tftp_hist_read(int side, int id, tftp_hist_t* hist)
+{
+    pthread_mutex_lock(&hist_lock);
+    hist_merge(side, id, hist);
+    const tftp_hist_t* base = &hist_base[side][id];
+    hist->total -= base->total;
+    hist->sum -= base->sum;
+    for (int i = 0; i < TFTP_HIST_BUCKETS; i++)
+    {
+        hist->counts[i] -= base->counts[i];
+    }
+    pthread_mutex_unlock(&hist_lock);
+}
+
+// 写线程的计数不能从外面清零，记下当前的合计，之后读的时候减掉
+void tftp_hist_reset(void)
+{
+    pthread_mutex_lock(&hist_lock);
+    for (int side = 0; side < TFTP_HIST_SIDES; side++)
+    {
+        for (int id = 0; id < TFTP_HIST_COUNT; id++)
+        {
+            hist_merge(side, id, &hist_base[side][id]);
+        }
+    }
+    pthread_mutex_unlock(&hist_lock);
+}
+
+uint64_t tftp_hist_percentile(const tftp_hist_t* hist, double p)
+{
+    if (hist->total == 0)
+    {
+        return 0;
+    }
+
+    uint64_t target = (uint64_t)(p / 100.0 * (double)hist->total + 0.5);
+    if (target < 1)
+    {
+        target = 1;
+    }
+
+    uint64_t count = 0;
+    int last = 0;
+    for (int i = 0; i < TFTP_HIST_BUCKETS; i++)
+    {
+        if (hist->counts[i] == 0)
+        {
+            continue;
+        }
+        count += hist->counts[i];
+        last = i;
+        if (count >= target)
+        {
+            break;
+        }
+    }
+    return hist_upper(last);
+}
+
+void tftp_hist_print(int side, const char* name)
+{
+    tftp_hist_t* hist = (tftp_hist_t*)malloc(sizeof(tftp_hist_t));
+    if (hist == NULL)
+    {
+        return;
+    }
+
+    printf("%s: latency us       count      mean       p50       p90       p99     p99.9       max\n", name);
+    for (int id = 0; id < TFTP_HIST_COUNT; id++)
+    {
+        tftp_hist_read(side, id, hist);
+        if (hist->total == 0)
+        {
+            continue;
+        }
+        printf("  %-16s %9llu %9llu %9llu %9llu %9llu %9llu %9llu\n", hist_names[id],
+            (unsigned long long)hist->total, (unsigned long long)(hist->sum / hist->total),
+            (unsigned long long)tftp_hist_percentile(hist, 50), (unsigned long long)tftp_hist_percentile(hist, 90),
+            (unsigned long long)tftp_hist_percentile(hist, 99), (unsigned long long)tftp_hist_percentile(hist, 99.9),
+            (unsigned long long)tftp_hist_percentile(hist, 100));
+    }
+    free(hist);
+}
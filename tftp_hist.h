@@ -0,0 +1,52 @@
+#ifndef TFTP_HIST_H
+#define TFTP_HIST_H
+
+#include <stdint.h>
+
+// 对数-线性直方图(HDR风格)：每个2的幂区间再等分成2^SUB_BITS个桶，相对误差不超过1/32
+#define TFTP_HIST_SUB_BITS 5
+#define TFTP_HIST_SUB_COUNT (1 << TFTP_HIST_SUB_BITS)
+#define TFTP_HIST_MAX_SHIFT 26 // 超过2^32微秒(约71分钟)的值记在最后一个桶
+#define TFTP_HIST_BUCKETS ((TFTP_HIST_MAX_SHIFT + 2) * TFTP_HIST_SUB_COUNT)
+
+typedef enum _tftp_hist_side_t
+{
+    TFTP_HIST_SERVER = 0,
+    TFTP_HIST_CLIENT,
+
+    TFTP_HIST_SIDES,
+}tftp_hist_side_t;
+
+typedef enum _tftp_hist_id_t
+{
+    TFTP_HIST_FIRST_DATA = 0, // 请求到第一个DATA(发出或收到)
+    TFTP_HIST_ACK_RTT, // 发出DATA到收到它的ACK，重发过的块不算
+    TFTP_HIST_FILE_IO, // 每块的文件读写
+    TFTP_HIST_TRANSFER, // 整个传输，按文件大小分档：小于1M
+    TFTP_HIST_TRANSFER_1M, // 1M到16M
+    TFTP_HIST_TRANSFER_16M, // 16M到256M
+    TFTP_HIST_TRANSFER_BIG,
+
+    TFTP_HIST_COUNT,
+}tftp_hist_id_t;
+
+// 单位都是微秒
+typedef struct _tftp_hist_t
+{
+    uint64_t total;
+    uint64_t sum;
+    uint64_t counts[TFTP_HIST_BUCKETS];
+}tftp_hist_t;
+
+// 只写当前线程自己的直方图，不加锁；线程第一次记录时分配，退出后留给新线程复用
+void tftp_hist_record(int side, int id, uint64_t value);
+void tftp_hist_transfer(int side, int64_t size, uint64_t value);
+
+// 合并所有线程的直方图，减去上次reset时的值
+void tftp_hist_read(int side, int id, tftp_hist_t* hist);
+void tftp_hist_reset(void);
+// p为0到100，返回所在桶的上界
+uint64_t tftp_hist_percentile(const tftp_hist_t* hist, double p);
+void tftp_hist_print(int side, const char* name);
+
+#endif // !TFTP_HIST_H
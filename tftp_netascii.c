@@ -0,0 +1,263 @@
+#include "tftp_netascii.h"
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define NETASCII_SSE2 1
+#endif
+
+#define NETASCII_CR '\r'
+#define NETASCII_LF '\n'
+
+size_t tftp_netascii_encode_scalar(const uint8_t* in, size_t in_size, size_t* in_used, uint8_t* out, size_t out_size, int* pending)
+{
+    size_t i = 0;
+    size_t o = 0;
+    if ((*pending >= 0) && (o < out_size))
+    {
+        out[o++] = (uint8_t)*pending;
+        *pending = -1;
+    }
+
+    while ((i < in_size) && (o < out_size) && (*pending < 0))
+    {
+        uint8_t c = in[i++];
+        if ((c != NETASCII_LF) && (c != NETASCII_CR))
+        {
+            out[o++] = c;
+            continue;
+        }
+
+        // 展开成两个字节，第二个放不下就留到下一块
+        int second = (c == NETASCII_LF) ? NETASCII_LF : 0;
+        out[o++] = NETASCII_CR;
+        if (o < out_size)
+        {
+            out[o++] = (uint8_t)second;
+        }
+        else
+        {
+            *pending = second;
+        }
+    }
+
+    *in_used = i;
+    return o;
+}
+
+size_t tftp_netascii_decode_scalar(const uint8_t* in, size_t in_size, uint8_t* out, int* cr)
+{
+    size_t o = 0;
+    for (size_t i = 0; i < in_size; i++)
+    {
+        uint8_t c = in[i];
+        if (*cr)
+        {
+            *cr = 0;
+            if (c == NETASCII_LF)
+            {
+                out[o++] = NETASCII_LF;
+                continue;
+            }
+            else if (c == 0)
+            {
+                out[o++] = NETASCII_CR;
+                continue;
+            }
+
+            // 不规范的CR，原样保留
+            out[o++] = NETASCII_CR;
+        }
+
+        if (c == NETASCII_CR)
+        {
+            *cr = 1;
+        }
+        else
+        {
+            out[o++] = c;
+        }
+    }
+
+    return o;
+}
+
+#ifdef NETASCII_SSE2
+// 每次检查16字节，没有CR/LF时整段复制，否则复制到第一个特殊字符为止再单独处理
+size_t tftp_netascii_encode(const uint8_t* in, size_t in_size, size_t* in_used, uint8_t* out, size_t out_size, int* pending)
+{
+    size_t i = 0;
+    size_t o = 0;
+    if ((*pending >= 0) && (o < out_size))
+    {
+        out[o++] = (uint8_t)*pending;
+        *pending = -1;
+    }
+
+    const __m128i cr = _mm_set1_epi8(NETASCII_CR);
+    const __m128i lf = _mm_set1_epi8(NETASCII_LF);
+    while ((i + 16 <= in_size) && (o + 16 <= out_size))
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+        _mm_storeu_si128((__m128i*)(out + o), v);
+        if (mask == 0)
+        {
+            i += 16;
+            o += 16;
+            continue;
+        }
+
+        int n = __builtin_ctz(mask);
+        i += n;
+        o += n;
+        if (o + 2 > out_size)
+        {
+            break;
+        }
+
+        out[o++] = NETASCII_CR;
+        out[o++] = (in[i++] == NETASCII_LF) ? NETASCII_LF : 0;
+    }
+
+    size_t used = 0;
+    o += tftp_netascii_encode_scalar(in + i, in_size - i, &used, out + o, out_size - o, pending);
+    *in_used = i + used;
+    return o;
+}
+
+size_t tftp_netascii_decode(const uint8_t* in, size_t in_size, uint8_t* out, int* cr)
+{
+    size_t i = 0;
+    size_t o = 0;
+    // 上一段以CR结尾：一个字节一个字节地处理到状态清掉为止，开头是"\r\r"时第一个CR又会留下状态，向量部分不看这个状态
+    while (*cr && (i < in_size))
+    {
+        o += tftp_netascii_decode_scalar(in + i, 1, out + o, cr);
+        i++;
+    }
+
+    const __m128i vcr = _mm_set1_epi8(NETASCII_CR);
+    while (i + 16 <= in_size)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, vcr));
+        _mm_storeu_si128((__m128i*)(out + o), v);
+        if (mask == 0)
+        {
+            i += 16;
+            o += 16;
+            continue;
+        }
+
+        // CR在块尾时交给下一块
+        int n = __builtin_ctz(mask);
+        i += n;
+        o += n;
+        if (i + 1 >= in_size)
+        {
+            break;
+        }
+
+        uint8_t next = in[i + 1];
+        if (next == NETASCII_LF)
+        {
+            out[o++] = NETASCII_LF;
+            i += 2;
+        }
+        else if (next == 0)
+        {
+            out[o++] = NETASCII_CR;
+            i += 2;
+        }
+        else
+        {
+            out[o++] = NETASCII_CR;
+            i += 1;
+        }
+    }
+
+    o += tftp_netascii_decode_scalar(in + i, in_size - i, out + o, cr);
+    return o;
+}
+#else
+size_t tftp_netascii_encode(const uint8_t* in, size_t in_size, size_t* in_used, uint8_t* out, size_t out_size, int* pending)
+{
+    return tftp_netascii_encode_scalar(in, in_size, in_used, out, out_size, pending);
+}
+
+size_t tftp_netascii_decode(const uint8_t* in, size_t in_size, uint8_t* out, int* cr)
+{
+    return tftp_netascii_decode_scalar(in, in_size, out, cr);
+}
+#endif
+
+void tftp_netascii_init(tftp_netascii_t* netascii)
+{
+    netascii->pending = -1;
+    netascii->cr = 0;
+    netascii->in_pos = 0;
+    netascii->in_size = 0;
+}
+
+// 读满size字节，只有文件结束时才会不足
+size_t tftp_netascii_read(tftp_netascii_t* netascii, FILE* file, uint8_t* out, size_t size)
+{
+    size_t o = 0;
+    while (o < size)
+    {
+        if ((netascii->in_pos == netascii->in_size) && (netascii->pending < 0))
+        {
+            netascii->in_pos = 0;
+            netascii->in_size = fread(netascii->in, 1, sizeof(netascii->in), file);
+            if (netascii->in_size == 0)
+            {
+                break;
+            }
+        }
+
+        size_t used = 0;
+        o += tftp_netascii_encode(netascii->in + netascii->in_pos, netascii->in_size - netascii->in_pos,
+            &used, out + o, size - o, &netascii->pending);
+        netascii->in_pos += used;
+    }
+
+    return o;
+}
+
+size_t tftp_netascii_write(tftp_netascii_t* netascii, FILE* file, const uint8_t* in, size_t size)
+{
+    uint8_t out[TFTP_NETASCII_BUFFER + 1];
+    size_t done = 0;
+    while (done < size)
+    {
+        size_t len = size - done;
+        if (len > TFTP_NETASCII_BUFFER)
+        {
+            len = TFTP_NETASCII_BUFFER;
+        }
+
+        size_t out_size = tftp_netascii_decode(in + done, len, out, &netascii->cr);
+        if (fwrite(out, 1, out_size, file) < out_size)
+        {
+            break;
+        }
+        done += len;
+    }
+
+    return done;
+}
+
+// 最后一个字节是CR时补上
+int tftp_netascii_finish(tftp_netascii_t* netascii, FILE* file)
+{
+    if (netascii->cr)
+    {
+        netascii->cr = 0;
+        if (fputc(NETASCII_CR, file) == EOF)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
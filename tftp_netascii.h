@@ -0,0 +1,33 @@
+#ifndef TFTP_NETASCII_H
+#define TFTP_NETASCII_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define TFTP_NETASCII_BUFFER 4096
+
+// netascii转换的状态，跨块保存
+typedef struct _tftp_netascii_t
+{
+    int pending; // 发送: 上一块放不下的字节，-1表示没有
+    int cr; // 接收: 上一块以CR结尾
+    size_t in_pos;
+    size_t in_size;
+    uint8_t in[TFTP_NETASCII_BUFFER];
+}tftp_netascii_t;
+
+// 本地 -> 网络: LF -> CR LF, CR -> CR NUL
+size_t tftp_netascii_encode(const uint8_t* in, size_t in_size, size_t* in_used, uint8_t* out, size_t out_size, int* pending);
+size_t tftp_netascii_encode_scalar(const uint8_t* in, size_t in_size, size_t* in_used, uint8_t* out, size_t out_size, int* pending);
+
+// 网络 -> 本地: CR LF -> LF, CR NUL -> CR，out至少要in_size + 1字节
+size_t tftp_netascii_decode(const uint8_t* in, size_t in_size, uint8_t* out, int* cr);
+size_t tftp_netascii_decode_scalar(const uint8_t* in, size_t in_size, uint8_t* out, int* cr);
+
+void tftp_netascii_init(tftp_netascii_t* netascii);
+size_t tftp_netascii_read(tftp_netascii_t* netascii, FILE* file, uint8_t* out, size_t size);
+size_t tftp_netascii_write(tftp_netascii_t* netascii, FILE* file, const uint8_t* in, size_t size);
+int tftp_netascii_finish(tftp_netascii_t* netascii, FILE* file);
+
+#endif // !TFTP_NETASCII_H
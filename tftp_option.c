@@ -0,0 +1,162 @@
+#include "tftp_option.h"
+#include <string.h>
+
+void tftp_option_reader_init(tftp_option_reader_t* reader, const void* buffer, const void* end)
+{
+    reader->ptr = (const char*)buffer;
+    reader->end = (const char*)end;
+}
+
+const char* tftp_option_string(tftp_option_reader_t* reader, size_t* size)
+{
+    if (reader->ptr >= reader->end)
+    {
+        return NULL;
+    }
+
+    const char* text = reader->ptr;
+    const char* zero = (const char*)memchr(text, '\0', (size_t)(reader->end - text));
+    if (zero == NULL)
+    {
+        return NULL;
+    }
+
+    *size = (size_t)(zero - text);
+    reader->ptr = zero + 1;
+    return text;
+}
+
+// lower是小写的字面量，选项名都很短，不调用strncasecmp
+static int option_equal(const char* text, const char* lower, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        char c = text[i];
+        if ((c >= 'A') && (c <= 'Z'))
+        {
+            c += 'a' - 'A';
+        }
+        if (c != lower[i])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// 先按长度分，再比较整个名字
+static int option_key(const char* name, size_t size)
+{
+    switch (size)
+    {
+    case 5:
+        return option_equal(name, "tsize", 5) ? TFTP_KEY_TSIZE
+            : option_equal(name, "range", 5) ? TFTP_KEY_RANGE
+            : option_equal(name, "mtime", 5) ? TFTP_KEY_MTIME : TFTP_KEY_UNKNOWN;
+    case 6:
+        return option_equal(name, "offset", 6) ? TFTP_KEY_OFFSET
+            : option_equal(name, "crc32c", 6) ? TFTP_KEY_CRC32C
+            : option_equal(name, "ifsize", 6) ? TFTP_KEY_IFSIZE
+            : option_equal(name, "prefix", 6) ? TFTP_KEY_PREFIX : TFTP_KEY_UNKNOWN;
+    case 7:
+        return option_equal(name, "blksize", 7) ? TFTP_KEY_BLKSIZE
+            : option_equal(name, "ifmtime", 7) ? TFTP_KEY_IFMTIME : TFTP_KEY_UNKNOWN;
+    case 8:
+        return option_equal(name, "compress", 8) ? TFTP_KEY_COMPRESS
+            : option_equal(name, "checksum", 8) ? TFTP_KEY_CHECKSUM : TFTP_KEY_UNKNOWN;
+    case 10:
+        return option_equal(name, "aimdwindow", 10) ? TFTP_KEY_WINDOWSIZE : TFTP_KEY_UNKNOWN;
+    case 11:
+        return option_equal(name, "notmodified", 11) ? TFTP_KEY_NOTMODIFIED : TFTP_KEY_UNKNOWN;
+    default:
+        return TFTP_KEY_UNKNOWN;
+    }
+}
+
+int tftp_option_next(tftp_option_reader_t* reader, tftp_option_pair_t* pair)
+{
+    if ((reader->ptr >= reader->end) || (*reader->ptr == '\0'))
+    {
+        return 0;
+    }
+
+    size_t name_size;
+    pair->name = tftp_option_string(reader, &name_size);
+    if (pair->name == NULL)
+    {
+        return -1;
+    }
+
+    pair->value = tftp_option_string(reader, &pair->value_size);
+    if (pair->value == NULL)
+    {
+        return -1;
+    }
+
+    pair->key = option_key(pair->name, name_size);
+    return 1;
+}
+
+int64_t tftp_option_number(const tftp_option_pair_t* pair)
+{
+    if ((pair->value_size == 0) || (pair->value_size > 18))
+    {
+        return -1;
+    }
+
+    int64_t value = 0;
+    for (size_t i = 0; i < pair->value_size; i++)
+    {
+        unsigned digit = (unsigned)(pair->value[i] - '0');
+        if (digit > 9)
+        {
+            return -1;
+        }
+        value = value * 10 + digit;
+    }
+    return value;
+}
+
+int tftp_option_equal(const char* text, size_t size, const char* lower, size_t lower_size)
+{
+    return (size == lower_size) && option_equal(text, lower, size);
+}
+
+char* tftp_option_put_string(char* buffer, const char* end, const char* text, size_t size)
+{
+    if ((buffer == NULL) || (size + 1 > (size_t)(end - buffer)))
+    {
+        return NULL;
+    }
+
+    memcpy(buffer, text, size);
+    buffer[size] = '\0';
+    return buffer + size + 1;
+}
+
+char* tftp_option_put_number(char* buffer, const char* end, const char* key, size_t key_size, int64_t value)
+{
+    // 只写键不写值时对方会把下一个键当成值，负数和没有空间一样处理，由调用者决定不带这个选项
+    if (value < 0)
+    {
+        return NULL;
+    }
+
+    buffer = tftp_option_put_string(buffer, end, key, key_size);
+    if (buffer == NULL)
+    {
+        return NULL;
+    }
+
+    // 从后往前写出数字
+    char digits[20];
+    char* ptr = digits + sizeof(digits);
+    uint64_t rest = (uint64_t)value;
+    do
+    {
+        *--ptr = (char)('0' + rest % 10);
+        rest /= 10;
+    } while (rest);
+
+    return tftp_option_put_string(buffer, end, ptr, (size_t)(digits + sizeof(digits) - ptr));
+}
@@ -0,0 +1,60 @@
+#ifndef TFTP_OPTION_H
+#define TFTP_OPTION_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// 请求和OACK中的"名字\0值\0"序列：读的时候每个字节只扫一遍，不会越过包的末尾
+typedef enum _tftp_option_key_t
+{
+    TFTP_KEY_UNKNOWN = 0,
+    TFTP_KEY_BLKSIZE,
+    TFTP_KEY_TSIZE,
+    TFTP_KEY_OFFSET,
+    TFTP_KEY_RANGE,
+    TFTP_KEY_COMPRESS,
+    TFTP_KEY_CHECKSUM,
+    TFTP_KEY_WINDOWSIZE,
+    TFTP_KEY_CRC32C, // 传输结束后交换摘要时用
+    TFTP_KEY_IFSIZE, // 条件下载：客户端缓存的大小
+    TFTP_KEY_IFMTIME, // 条件下载：客户端缓存的修改时间
+    TFTP_KEY_MTIME,
+    TFTP_KEY_NOTMODIFIED,
+    TFTP_KEY_PREFIX, // 续传：保留的前缀的CRC32C
+}tftp_option_key_t;
+
+typedef struct _tftp_option_reader_t
+{
+    const char* ptr;
+    const char* end;
+}tftp_option_reader_t;
+
+typedef struct _tftp_option_pair_t
+{
+    int key; // tftp_option_key_t，名字不区分大小写
+    const char* name;
+    const char* value;
+    size_t value_size;
+}tftp_option_pair_t;
+
+void tftp_option_reader_init(tftp_option_reader_t* reader, const void* buffer, const void* end);
+// 取一个以'\0'结尾的字符串，缺少'\0'时返回NULL
+const char* tftp_option_string(tftp_option_reader_t* reader, size_t* size);
+// 1: 取到一对; 0: 结束(空的名字或者到了末尾); -1: 缺少值或者'\0'
+int tftp_option_next(tftp_option_reader_t* reader, tftp_option_pair_t* pair);
+// 十进制非负整数，不是数字或者溢出返回-1
+int64_t tftp_option_number(const tftp_option_pair_t* pair);
+// 不区分大小写，lower是小写
+int tftp_option_equal(const char* text, size_t size, const char* lower, size_t lower_size);
+
+// 写入以'\0'结尾的字符串；空间不够返回NULL，传入NULL时直接返回NULL，可以连着写最后检查一次
+char* tftp_option_put_string(char* buffer, const char* end, const char* text, size_t size);
+// 写入名字和十进制的值
+char* tftp_option_put_number(char* buffer, const char* end, const char* key, size_t key_size, int64_t value);
+
+#define TFTP_OPTION_EQUAL(text, size, lower) tftp_option_equal(text, size, lower, sizeof(lower) - 1)
+#define TFTP_OPTION_IS(pair, lower) TFTP_OPTION_EQUAL((pair)->value, (pair)->value_size, lower)
+#define TFTP_OPTION_STRING(buffer, end, text) tftp_option_put_string(buffer, end, text, sizeof(text) - 1)
+#define TFTP_OPTION_NUMBER(buffer, end, key, value) tftp_option_put_number(buffer, end, key, sizeof(key) - 1, value)
+
+#endif // !TFTP_OPTION_H
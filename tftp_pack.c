@@ -0,0 +1,546 @@
+#include "tftp_pack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PACK_MAX_DEPTH 16
+#define PACK_MAX_SEED (1 << 24)
+#define PACK_MAX_BUCKET 64
+#define PACK_ALIGN_UP(x, a) (((x) + (a) - 1) / (a) * (a))
+
+struct _tftp_pack_t
+{
+    uint8_t* map;
+    size_t map_size;
+    const tftp_pack_header_t* header;
+    const uint32_t* seeds;
+    const tftp_pack_entry_t* entries;
+    const char* names;
+};
+
+// 打包时收集的文件
+typedef struct _pack_source_t
+{
+    char* name;
+    char* path;
+    int64_t size;
+    int64_t mtime;
+    uint64_t hash;
+    uint32_t bucket;
+}pack_source_t;
+
+typedef struct _pack_list_t
+{
+    pack_source_t* items;
+    uint32_t count;
+    uint32_t capacity;
+}pack_list_t;
+
+static uint64_t pack_hash(const char* name)
+{
+    uint64_t hash = 14695981039346656037ull;
+    while (*name)
+    {
+        hash = (hash ^ (uint8_t)*name++) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// 同一个名字的哈希配不同的种子得到互相独立的值
+static uint32_t pack_mix(uint64_t hash, uint32_t seed)
+{
+    uint64_t x = hash ^ ((uint64_t)seed * 0x9E3779B97F4A7C15ull);
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDull;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ull;
+    x ^= x >> 33;
+    return (uint32_t)x;
+}
+
+static int pack_check(tftp_pack_t* pack)
+{
+    const tftp_pack_header_t* header = (const tftp_pack_header_t*)pack->map;
+    if ((pack->map_size < sizeof(*header)) || (memcmp(header->magic, TFTP_PACK_MAGIC, sizeof(header->magic)) != 0))
+    {
+        return -1;
+    }
+
+    uint64_t size = pack->map_size;
+    if ((header->version != TFTP_PACK_VERSION) || (header->total_size != size) || (header->count > TFTP_PACK_MAX_FILES)
+        || ((header->count > 0) && (header->bucket_count == 0)) || (header->bucket_count > header->count)
+        || (header->seeds_offset % 8) || (header->entries_offset % 8)
+        || (header->seeds_offset > size) || ((uint64_t)header->bucket_count * sizeof(uint32_t) > size - header->seeds_offset)
+        || (header->entries_offset > size) || ((uint64_t)header->count * sizeof(tftp_pack_entry_t) > size - header->entries_offset)
+        || (header->names_offset > size) || (header->names_size > size - header->names_offset))
+    {
+        return -1;
+    }
+
+    pack->header = header;
+    pack->seeds = (const uint32_t*)(pack->map + header->seeds_offset);
+    pack->entries = (const tftp_pack_entry_t*)(pack->map + header->entries_offset);
+    pack->names = (const char*)(pack->map + header->names_offset);
+
+    for (uint32_t i = 0; i < header->count; i++)
+    {
+        const tftp_pack_entry_t* entry = pack->entries + i;
+        if (((uint64_t)entry->name_offset + entry->name_size >= header->names_size)
+            || (pack->names[entry->name_offset + entry->name_size] != '\0')
+            || (entry->data_offset > size) || (entry->size > size - entry->data_offset))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+tftp_pack_t* tftp_pack_open(const char* path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        printf("tftp: open pack %s failed\n", path);
+        return NULL;
+    }
+
+    struct stat file_stat;
+    if ((fstat(fd, &file_stat) < 0) || (file_stat.st_size < (off_t)sizeof(tftp_pack_header_t)))
+    {
+        printf("tftp: bad pack %s\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    tftp_pack_t* pack = (tftp_pack_t*)calloc(1, sizeof(tftp_pack_t));
+    if (pack == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    pack->map_size = (size_t)file_stat.st_size;
+    pack->map = (uint8_t*)mmap(NULL, pack->map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (pack->map == MAP_FAILED)
+    {
+        printf("tftp: map pack %s failed\n", path);
+        free(pack);
+        return NULL;
+    }
+
+    if (pack_check(pack) < 0)
+    {
+        printf("tftp: bad pack %s\n", path);
+        tftp_pack_close(pack);
+        return NULL;
+    }
+    return pack;
+}
+
+void tftp_pack_close(tftp_pack_t* pack)
+{
+    munmap(pack->map, pack->map_size);
+    free(pack);
+}
+
+int tftp_pack_find(tftp_pack_t* pack, const char* name, tftp_pack_file_t* file)
+{
+    const tftp_pack_header_t* header = pack->header;
+    while (*name == '/')
+    {
+        name++;
+    }
+
+    if (header->count == 0)
+    {
+        return -1;
+    }
+
+    // 完美哈希只保证包里的名字不冲突，不在包里的名字要比较一次
+    uint64_t hash = pack_hash(name);
+    uint32_t seed = pack->seeds[pack_mix(hash, 0) % header->bucket_count];
+    const tftp_pack_entry_t* entry = pack->entries + pack_mix(hash, seed) % header->count;
+    if (strcmp(pack->names + entry->name_offset, name) != 0)
+    {
+        return -1;
+    }
+
+    file->data = pack->map + entry->data_offset;
+    file->size = (int64_t)entry->size;
+    file->mtime = entry->mtime;
+    return 0;
+}
+
+uint32_t tftp_pack_count(tftp_pack_t* pack)
+{
+    return pack->header->count;
+}
+
+const char* tftp_pack_name(tftp_pack_t* pack, uint32_t index, tftp_pack_file_t* file)
+{
+    const tftp_pack_entry_t* entry = pack->entries + index;
+    file->data = pack->map + entry->data_offset;
+    file->size = (int64_t)entry->size;
+    file->mtime = entry->mtime;
+    return pack->names + entry->name_offset;
+}
+
+static int pack_list_add(pack_list_t* list, const char* name, const char* path, const struct stat* file_stat)
+{
+    if (list->count == TFTP_PACK_MAX_FILES)
+    {
+        printf("tftp_pack: too many files\n");
+        return -1;
+    }
+
+    if (list->count == list->capacity)
+    {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 64;
+        pack_source_t* items = (pack_source_t*)realloc(list->items, capacity * sizeof(pack_source_t));
+        if (items == NULL)
+        {
+            return -1;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    pack_source_t* source = list->items + list->count;
+    source->name = strdup(name);
+    source->path = strdup(path);
+    if ((source->name == NULL) || (source->path == NULL))
+    {
+        free(source->name);
+        free(source->path);
+        return -1;
+    }
+    source->size = file_stat->st_size;
+    source->mtime = file_stat->st_mtime;
+    list->count++;
+    return 0;
+}
+
+static int pack_scan(pack_list_t* list, const char* dir, const char* prefix, int depth)
+{
+    if (depth > PACK_MAX_DEPTH)
+    {
+        printf("tftp_pack: %s is too deep\n", dir);
+        return -1;
+    }
+
+    DIR* handle = opendir(dir);
+    if (handle == NULL)
+    {
+        printf("tftp_pack: open dir %s failed\n", dir);
+        return -1;
+    }
+
+    int error = 0;
+    struct dirent* item;
+    while ((error == 0) && ((item = readdir(handle)) != NULL))
+    {
+        if ((strcmp(item->d_name, ".") == 0) || (strcmp(item->d_name, "..") == 0))
+        {
+            continue;
+        }
+
+        char path[4096];
+        char name[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, item->d_name);
+        snprintf(name, sizeof(name), "%s%s", prefix, item->d_name);
+
+        struct stat file_stat;
+        if (stat(path, &file_stat) < 0)
+        {
+            continue;
+        }
+
+        if (S_ISDIR(file_stat.st_mode))
+        {
+            snprintf(name, sizeof(name), "%s%s/", prefix, item->d_name);
+            error = pack_scan(list, path, name, depth + 1);
+        }
+        else if (S_ISREG(file_stat.st_mode))
+        {
+            error = pack_list_add(list, name, path, &file_stat);
+        }
+    }
+
+    closedir(handle);
+    return error;
+}
+
+// 高32位是桶的大小，从大到小排
+static int pack_bucket_compare(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x < y) - (x > y);
+}
+
+// 哈希加位移(hash and displace)：按桶从大到小，给每个桶找一个种子，让桶里的名字都落到空位上
+static int pack_place(pack_list_t* list, uint32_t bucket_count, uint32_t* seeds, uint32_t* slots)
+{
+    uint32_t count = list->count;
+    uint32_t* bucket_size = (uint32_t*)calloc(bucket_count, sizeof(uint32_t));
+    uint32_t* bucket_first = (uint32_t*)malloc(bucket_count * sizeof(uint32_t));
+    uint32_t* order = (uint32_t*)malloc(count * sizeof(uint32_t));
+    uint64_t* sorted = (uint64_t*)malloc(bucket_count * sizeof(uint64_t));
+    uint8_t* used = (uint8_t*)calloc(count, 1);
+    uint32_t tries[PACK_MAX_BUCKET];
+    int error = -1;
+    if (!bucket_size || !bucket_first || !order || !sorted || !used)
+    {
+        goto out;
+    }
+
+    // 按桶分组
+    for (uint32_t i = 0; i < count; i++)
+    {
+        list->items[i].bucket = pack_mix(list->items[i].hash, 0) % bucket_count;
+        bucket_size[list->items[i].bucket]++;
+    }
+    for (uint32_t b = 0, sum = 0; b < bucket_count; b++)
+    {
+        bucket_first[b] = sum;
+        sum += bucket_size[b];
+        sorted[b] = ((uint64_t)bucket_size[b] << 32) | b;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        order[bucket_first[list->items[i].bucket]++] = i;
+    }
+    for (uint32_t b = 0; b < bucket_count; b++)
+    {
+        bucket_first[b] -= bucket_size[b];
+    }
+    qsort(sorted, bucket_count, sizeof(uint64_t), pack_bucket_compare);
+
+    for (uint32_t k = 0; k < bucket_count; k++)
+    {
+        uint32_t b = (uint32_t)sorted[k];
+        uint32_t size = bucket_size[b];
+        if (size == 0)
+        {
+            seeds[b] = 1;
+            continue;
+        }
+        if (size > PACK_MAX_BUCKET)
+        {
+            printf("tftp_pack: hash bucket too large\n");
+            goto out;
+        }
+
+        uint32_t seed;
+        for (seed = 1; seed < PACK_MAX_SEED; seed++)
+        {
+            uint32_t n;
+            for (n = 0; n < size; n++)
+            {
+                uint32_t slot = pack_mix(list->items[order[bucket_first[b] + n]].hash, seed) % count;
+                if (used[slot])
+                {
+                    break;
+                }
+                used[slot] = 1;
+                tries[n] = slot;
+            }
+
+            if (n == size)
+            {
+                break;
+            }
+            while (n > 0)
+            {
+                used[tries[--n]] = 0;
+            }
+        }
+
+        if (seed == PACK_MAX_SEED)
+        {
+            printf("tftp_pack: no perfect hash found\n");
+            goto out;
+        }
+
+        seeds[b] = seed;
+        for (uint32_t n = 0; n < size; n++)
+        {
+            slots[order[bucket_first[b] + n]] = tries[n];
+        }
+    }
+    error = 0;
+
+out:
+    free(bucket_size);
+    free(bucket_first);
+    free(order);
+    free(sorted);
+    free(used);
+    return error;
+}
+
+static int pack_pad(FILE* out, uint64_t offset)
+{
+    static const uint8_t zero[TFTP_PACK_ALIGN];
+    long pos = ftell(out);
+    if ((pos < 0) || ((uint64_t)pos > offset))
+    {
+        return -1;
+    }
+    return (fwrite(zero, 1, (size_t)(offset - (uint64_t)pos), out) == offset - (uint64_t)pos) ? 0 : -1;
+}
+
+static int pack_copy(FILE* out, const pack_source_t* source)
+{
+    FILE* in = fopen(source->path, "rb");
+    if (in == NULL)
+    {
+        printf("tftp_pack: open %s failed\n", source->path);
+        return -1;
+    }
+
+    uint8_t buffer[65536];
+    int64_t remain = source->size;
+    while (remain > 0)
+    {
+        size_t size = fread(buffer, 1, (remain < (int64_t)sizeof(buffer)) ? (size_t)remain : sizeof(buffer), in);
+        if ((size == 0) || (fwrite(buffer, 1, size, out) != size))
+        {
+            printf("tftp_pack: copy %s failed\n", source->path);
+            fclose(in);
+            return -1;
+        }
+        remain -= (int64_t)size;
+    }
+
+    fclose(in);
+    return 0;
+}
+
+static int pack_write(pack_list_t* list, uint32_t bucket_count, const uint32_t* seeds, const uint32_t* slots, const char* output)
+{
+    uint32_t count = list->count;
+    tftp_pack_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TFTP_PACK_MAGIC, sizeof(header.magic));
+    header.version = TFTP_PACK_VERSION;
+    header.count = count;
+    header.bucket_count = bucket_count;
+    header.seeds_offset = sizeof(header);
+    header.entries_offset = PACK_ALIGN_UP(header.seeds_offset + bucket_count * sizeof(uint32_t), 8);
+    header.names_offset = header.entries_offset + count * sizeof(tftp_pack_entry_t);
+
+    tftp_pack_entry_t* entries = (tftp_pack_entry_t*)calloc(count ? count : 1, sizeof(tftp_pack_entry_t));
+    if (entries == NULL)
+    {
+        return -1;
+    }
+
+    uint64_t name_offset = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        name_offset += strlen(list->items[i].name) + 1;
+    }
+    header.names_size = name_offset;
+
+    uint64_t data_offset = PACK_ALIGN_UP(header.names_offset + header.names_size, TFTP_PACK_ALIGN);
+    name_offset = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        tftp_pack_entry_t* entry = entries + slots[i];
+        entry->name_offset = (uint32_t)name_offset;
+        entry->name_size = (uint32_t)strlen(list->items[i].name);
+        entry->data_offset = data_offset;
+        entry->size = (uint64_t)list->items[i].size;
+        entry->mtime = list->items[i].mtime;
+        name_offset += entry->name_size + 1;
+        data_offset = PACK_ALIGN_UP(data_offset + entry->size, TFTP_PACK_ALIGN);
+    }
+    header.total_size = (count > 0) ? entries[slots[count - 1]].data_offset + entries[slots[count - 1]].size : header.names_offset + header.names_size;
+
+    FILE* out = fopen(output, "wb");
+    if (out == NULL)
+    {
+        printf("tftp_pack: create %s failed\n", output);
+        free(entries);
+        return -1;
+    }
+
+    int error = (fwrite(&header, sizeof(header), 1, out) == 1) ? 0 : -1;
+    if ((error == 0) && bucket_count && (fwrite(seeds, sizeof(uint32_t), bucket_count, out) != bucket_count))
+    {
+        error = -1;
+    }
+    if ((error == 0) && ((pack_pad(out, header.entries_offset) < 0) || (count && (fwrite(entries, sizeof(tftp_pack_entry_t), count, out) != count))))
+    {
+        error = -1;
+    }
+    for (uint32_t i = 0; (error == 0) && (i < count); i++)
+    {
+        const char* name = list->items[i].name;
+        if (fwrite(name, 1, strlen(name) + 1, out) != strlen(name) + 1)
+        {
+            error = -1;
+        }
+    }
+    for (uint32_t i = 0; (error == 0) && (i < count); i++)
+    {
+        if ((pack_pad(out, entries[slots[i]].data_offset) < 0) || (pack_copy(out, list->items + i) < 0))
+        {
+            error = -1;
+        }
+    }
+
+    if ((fclose(out) != 0) || error)
+    {
+        printf("tftp_pack: write %s failed\n", output);
+        unlink(output);
+        error = -1;
+    }
+    free(entries);
+    return error;
+}
+
+int tftp_pack_build(const char* dir, const char* output)
+{
+    pack_list_t list;
+    memset(&list, 0, sizeof(list));
+
+    int error = pack_scan(&list, dir, "", 0);
+    uint32_t bucket_count = (list.count + TFTP_PACK_BUCKET_KEYS - 1) / TFTP_PACK_BUCKET_KEYS;
+    uint32_t* seeds = (uint32_t*)calloc(bucket_count ? bucket_count : 1, sizeof(uint32_t));
+    uint32_t* slots = (uint32_t*)calloc(list.count ? list.count : 1, sizeof(uint32_t));
+    if ((seeds == NULL) || (slots == NULL))
+    {
+        error = -1;
+    }
+
+    for (uint32_t i = 0; (error == 0) && (i < list.count); i++)
+    {
+        list.items[i].hash = pack_hash(list.items[i].name);
+    }
+    if ((error == 0) && list.count)
+    {
+        error = pack_place(&list, bucket_count, seeds, slots);
+    }
+    if (error == 0)
+    {
+        error = pack_write(&list, bucket_count, seeds, slots, output);
+    }
+
+    for (uint32_t i = 0; i < list.count; i++)
+    {
+        free(list.items[i].name);
+        free(list.items[i].path);
+    }
+    free(list.items);
+    free(seeds);
+    free(slots);
+    return error;
+}
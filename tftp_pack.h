@@ -0,0 +1,57 @@
+#ifndef TFTP_PACK_H
+#define TFTP_PACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TFTP_PACK_MAGIC "TFTPPACK"
+#define TFTP_PACK_VERSION 1
+#define TFTP_PACK_ALIGN 4096 // 每个文件的数据按页对齐，直接从映射中发送
+#define TFTP_PACK_BUCKET_KEYS 4 // 完美哈希每个桶平均的文件数
+#define TFTP_PACK_MAX_FILES (1 << 20)
+
+// 打包文件的布局: 头 | 桶的种子 | 文件表(按完美哈希的位置排列) | 文件名 | 按页对齐的数据
+typedef struct _tftp_pack_header_t
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t count; // 文件数，也是文件表的大小
+    uint32_t bucket_count;
+    uint32_t reserved;
+    uint64_t seeds_offset;
+    uint64_t entries_offset;
+    uint64_t names_offset;
+    uint64_t names_size;
+    uint64_t total_size;
+}tftp_pack_header_t;
+
+typedef struct _tftp_pack_entry_t
+{
+    uint64_t data_offset;
+    uint64_t size;
+    int64_t mtime;
+    uint32_t name_offset; // 相对文件名区，以'\0'结尾
+    uint32_t name_size;
+}tftp_pack_entry_t;
+
+typedef struct _tftp_pack_t tftp_pack_t;
+
+typedef struct _tftp_pack_file_t
+{
+    const uint8_t* data;
+    int64_t size;
+    int64_t mtime;
+}tftp_pack_file_t;
+
+// 启动时映射整个文件并检查索引，之后查找不需要系统调用
+tftp_pack_t* tftp_pack_open(const char* path);
+void tftp_pack_close(tftp_pack_t* pack);
+// 文件名开头的'/'忽略，找不到返回-1
+int tftp_pack_find(tftp_pack_t* pack, const char* name, tftp_pack_file_t* file);
+uint32_t tftp_pack_count(tftp_pack_t* pack);
+const char* tftp_pack_name(tftp_pack_t* pack, uint32_t index, tftp_pack_file_t* file);
+
+// 把目录下的所有普通文件(包括子目录，名字为相对路径)打成一个包
+int tftp_pack_build(const char* dir, const char* output);
+
+#endif // !TFTP_PACK_H
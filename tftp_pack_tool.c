@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "tftp_pack.h"
+
+// tftp_pack: 把启动镜像目录打成服务器可以直接映射的包
+// usage: tftp_pack <dir> <output>
+//        tftp_pack -l <pack>
+
+static int pack_list(const char* path)
+{
+    tftp_pack_t* pack = tftp_pack_open(path);
+    if (pack == NULL)
+    {
+        return -1;
+    }
+
+    uint32_t count = tftp_pack_count(pack);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        tftp_pack_file_t file;
+        const char* name = tftp_pack_name(pack, i, &file);
+        printf("%12lld  %s\n", (long long)file.size, name);
+    }
+    printf("%u files\n", count);
+    tftp_pack_close(pack);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if ((argc == 3) && (strcmp(argv[1], "-l") == 0))
+    {
+        return pack_list(argv[2]) < 0;
+    }
+    else if (argc == 3)
+    {
+        return tftp_pack_build(argv[1], argv[2]) < 0;
+    }
+
+    printf("usage: tftp_pack <dir> <output>\n");
+    printf("       tftp_pack -l <pack>\n");
+    return 1;
+}
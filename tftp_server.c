@@ -2,359 +2,1804 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <poll.h>
 
 #include "tftp_server.h"
+#include "tftp_zip.h"
+#include "tftp_crc32c.h"
+#include "tftp_timer.h"
+#include "tftp_shaper.h"
+#include "tftp_fcache.h"
+#include "tftp_pack.h"
+#include "tftp_demux.h"
+#include "tftp_arena.h"
+#include "tftp_handoff.h"
+#include "tftp_filter.h"
 
 
+static tftpd_config_t server_config;
 static const char* server_path;
+static tftp_pack_t* server_pack; // dir是打包文件时从映射中发送，只读
 static uint16_t server_port;
+static tftpd_stats_t server_stats;
+static int server_active; // 分配了还没释放的会话，交出监听套接字后等它变成0
+static int server_handoff_fd = -1; // 等新进程来取监听套接字的Unix套接字
+static int server_retired; // 监听套接字已经交给新进程，不再接受请求
+static int64_t server_memory; // 进行中的会话的估算内存
+static int64_t server_memory_peak;
+static tftp_filter_t server_filter = { TFTP_FILTER_NONE, -1, -1 };
 
 static tftp_t tftp;
 
-static int do_recv_file(tftp_req_t* req)
+#define SESSION_TRANSFER 0
+#define SESSION_CHECKSUM 1 // 数据已经传完，交换摘要
+#define SESSION_PATH_SIZE (TFTP_NAME_SIZE + 128) // 服务目录/请求的文件名；更长的请求回NO_FILE
+
+#define SHAPER_IDLE 0
+#define SHAPER_QUEUED 1 // 在加权公平队列中等待调度
+#define SHAPER_PARKED 2 // 客户端的令牌不够，等定时器到了再排队
+
+// 每个客户端地址一个令牌桶，没有会话时释放
+typedef struct _tftpd_client_t
+{
+    struct _tftpd_client_t* next;
+    uint32_t addr;
+    int refs;
+    tftp_bucket_t bucket;
+}tftpd_client_t;
+
+// 一次传输的全部状态，每个请求一个线程和事件循环两种方式共用同一套处理函数
+typedef struct _tftpd_session_t
+{
+    tftp_req_t req;
+    char path[SESSION_PATH_SIZE];
+    FILE* file; // 接收和netascii发送时使用，发送去重上传的文件时也用
+    tftp_dedup_writer_t* dedup; // 接收: 去重时file写到这里，成功结束才提交清单
+    tftp_fcache_t* fcache; // 二进制发送: 缓存的只读描述符，各会话用pread按自己的位置读
+    const uint8_t* image; // 二进制发送: 打包文件映射中的数据
+    int64_t read_pos;
+    int64_t drop_pos; // 二进制发送: 大文件在这之前的部分已经从页缓存丢掉，-1表示不丢
+    int64_t mtime;
+    int state;
+    tftp_op_t wait_op; // 正在等待的包
+    uint16_t wait_block;
+    uint16_t curr_blk; // 最后发送/收到的数据块
+    int last; // 发送: 最后一块已经发出
+    int64_t remain; // 发送: 还要发送的字节数
+    int chunk; // 发送: 每块携带的文件数据
+    tftp_zcache_t* zcache;
+    uint32_t zcache_index;
+    int64_t position; // 接收: 写入位置
+    int64_t partial_size; // 接收: 续传时需要校验的部分文件长度
+    tftp_window_t window; // 发送: 协商了aimdwindow时的发送窗口
+    int total_size;
+    int total_block;
+    tftp_timer_t timer; // 事件循环: 重传定时器，排队等令牌时用来唤醒
+    tftpd_client_t* client;
+    int weight;
+    int queued;
+    size_t pending_size; // 排队时已经收到还没处理的包
+    tftp_wfq_item_t wfq;
+    int demux; // 共享套接字的序号，-1表示会话有自己的套接字
+    int64_t memory; // 接受请求时按协商的参数记到预算里的字节
+}tftpd_session_t;
+
+// 线程模式下会话在工作线程里释放，计数用原子操作
+static tftpd_session_t* session_alloc(void)
+{
+    tftpd_session_t* sess = (tftpd_session_t*)tftp_arena_alloc(sizeof(tftpd_session_t));
+    if (sess)
+    {
+        sess->memory = 0;
+        __atomic_add_fetch(&server_active, 1, __ATOMIC_RELAXED);
+    }
+    return sess;
+}
+
+static void session_free(tftpd_session_t* sess)
+{
+    __atomic_sub_fetch(&server_memory, sess->memory, __ATOMIC_RELAXED);
+    tftp_arena_free(sess);
+    __atomic_sub_fetch(&server_active, 1, __ATOMIC_RELEASE);
+}
+
+// 会话的内存随协商的参数变化：会话本身(含收发两个包)，发送窗口的环，
+// 接收窗口时放大的套接字接收缓冲，写文件和netascii读文件时stdio的缓冲
+static int64_t session_memory(const tftp_req_t* req)
+{
+    int64_t size = sizeof(tftpd_session_t);
+    if ((req->option & TFTP_OPT_WINDOW) && (req->opcode == TFTP_PACKET_RRQ))
+    {
+        size += (int64_t)tftp_window_memory(req->window_size, req->block_size);
+    }
+    else if (req->option & TFTP_OPT_WINDOW)
+    {
+        size += (int64_t)req->window_size * (4 + req->block_size) * 2;
+    }
+
+    if ((req->opcode == TFTP_PACKET_WRQ) || (req->option & TFTP_OPT_NETASCII))
+    {
+        size += BUFSIZ;
+    }
+    if ((req->opcode == TFTP_PACKET_WRQ) && server_config.dedup_dir)
+    {
+        size += TFTP_DEDUP_MAX_CHUNK;
+    }
+    return size;
+}
+
+// 先把窗口减半，到1之后再把块减半，最小到协议默认的512
+static int session_shrink(tftp_req_t* req)
+{
+    if ((req->option & TFTP_OPT_WINDOW) && (req->window_size > 1))
+    {
+        req->window_size /= 2;
+        return 1;
+    }
+    else if (req->block_size > TFTP_DEFAULT_BLOCK_SIZE)
+    {
+        req->block_size = (req->block_size / 2 > TFTP_DEFAULT_BLOCK_SIZE) ? req->block_size / 2 : TFTP_DEFAULT_BLOCK_SIZE;
+        return 1;
+    }
+    return 0;
+}
+
+// 接受请求前按预算记账，放不下时缩小协商的参数，最小的也放不下时回DISK_FULL
+// 线程模式下会话在工作线程里结束，用CAS预留
+static int session_budget(tftpd_session_t* sess, tftp_t* listen)
+{
+    tftp_req_t* req = &sess->req;
+    int64_t budget = server_config.memory_budget;
+    int64_t size = session_memory(req);
+    int downgraded = 0;
+    int64_t used = __atomic_load_n(&server_memory, __ATOMIC_RELAXED);
+    do
+    {
+        while (budget && (used + size > budget) && session_shrink(req))
+        {
+            size = session_memory(req);
+            downgraded = 1;
+        }
+
+        if (budget && (used + size > budget))
+        {
+            printf("tftpd: memory budget exceeded, %lld of %lld bytes in use\n", (long long)used, (long long)budget);
+            __atomic_add_fetch(&server_stats.rejected, 1, __ATOMIC_RELAXED);
+            tftp_send_error(listen, TFTP_ERROR_DISK_FULL);
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&server_memory, &used, used + size, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    int64_t peak = __atomic_load_n(&server_memory_peak, __ATOMIC_RELAXED);
+    while ((used + size > peak) && !__atomic_compare_exchange_n(&server_memory_peak, &peak, used + size, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+
+    if (downgraded)
+    {
+        printf("tftpd: memory budget, use blksize %d aimdwindow %d\n", req->block_size, req->window_size);
+        __atomic_add_fetch(&server_stats.downgraded, 1, __ATOMIC_RELAXED);
+    }
+    sess->memory = size;
+    return 0;
+}
+
+static pthread_mutex_t shaper_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int shaper_enabled;
+static tftp_bucket_t shaper_bucket;
+static tftp_wfq_t shaper_queue;
+static tftpd_client_t* shaper_clients[TFTPD_CLIENT_HASH];
+static struct
+{
+    uint32_t addr;
+    uint32_t mask;
+}shaper_subnets[TFTPD_MAX_CLASSES];
+
+static int shaper_parse_subnet(const char* subnet, uint32_t* addr, uint32_t* mask)
+{
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%s", subnet);
+
+    int prefix = 32;
+    char* slash = strchr(buffer, '/');
+    if (slash)
+    {
+        *slash = '\0';
+        prefix = atoi(slash + 1);
+    }
+
+    struct in_addr in;
+    if ((inet_aton(buffer, &in) == 0) || (prefix < 0) || (prefix > 32))
+    {
+        return -1;
+    }
+
+    *mask = prefix ? htonl(0xFFFFFFFFu << (32 - prefix)) : 0;
+    *addr = in.s_addr & *mask;
+    return 0;
+}
+
+static int shaper_init(void)
+{
+    if (server_config.class_count > TFTPD_MAX_CLASSES)
+    {
+        server_config.class_count = TFTPD_MAX_CLASSES;
+    }
+
+    for (int i = 0; i < server_config.class_count; i++)
+    {
+        const char* subnet = server_config.classes[i].subnet;
+        shaper_subnets[i].addr = 0;
+        shaper_subnets[i].mask = 0;
+        if (subnet && (shaper_parse_subnet(subnet, &shaper_subnets[i].addr, &shaper_subnets[i].mask) < 0))
+        {
+            printf("tftpd: bad subnet %s\n", subnet);
+            return -1;
+        }
+    }
+
+    tftp_bucket_init(&shaper_bucket, server_config.rate_limit, tftp_time_us());
+    tftp_wfq_init(&shaper_queue);
+    shaper_enabled = server_config.rate_limit || server_config.client_rate_limit || server_config.class_count;
+    return 0;
+}
+
+static int shaper_classify(tftpd_session_t* sess)
+{
+    struct sockaddr_in* addr = (struct sockaddr_in*)&sess->req.tftp.remote;
+    for (int i = 0; i < server_config.class_count; i++)
+    {
+        const tftpd_class_t* cls = &server_config.classes[i];
+        if (cls->pattern && (fnmatch(cls->pattern, sess->req.filename, 0) != 0))
+        {
+            continue;
+        }
+        if ((addr->sin_addr.s_addr & shaper_subnets[i].mask) != shaper_subnets[i].addr)
+        {
+            continue;
+        }
+        return cls->weight;
+    }
+    return 1;
+}
+
+static void shaper_attach(tftpd_session_t* sess)
+{
+    sess->client = NULL;
+    sess->weight = 1;
+    sess->queued = SHAPER_IDLE;
+    tftp_wfq_item_init(&sess->wfq);
+    if (!shaper_enabled)
+    {
+        return;
+    }
+
+    sess->weight = shaper_classify(sess);
+    if (server_config.client_rate_limit <= 0)
+    {
+        return;
+    }
+
+    uint32_t addr = ((struct sockaddr_in*)&sess->req.tftp.remote)->sin_addr.s_addr;
+    int hash = (int)((ntohl(addr) * 2654435761u) % TFTPD_CLIENT_HASH);
+    pthread_mutex_lock(&shaper_mutex);
+    tftpd_client_t* client = shaper_clients[hash];
+    while (client && (client->addr != addr))
+    {
+        client = client->next;
+    }
+
+    if (client == NULL)
+    {
+        client = (tftpd_client_t*)malloc(sizeof(tftpd_client_t));
+        if (client)
+        {
+            client->addr = addr;
+            client->refs = 0;
+            tftp_bucket_init(&client->bucket, server_config.client_rate_limit, tftp_time_us());
+            client->next = shaper_clients[hash];
+            shaper_clients[hash] = client;
+        }
+    }
+
+    if (client)
+    {
+        client->refs++;
+    }
+    sess->client = client;
+    pthread_mutex_unlock(&shaper_mutex);
+}
+
+static void shaper_detach(tftpd_session_t* sess)
+{
+    tftpd_client_t* client = sess->client;
+    if (client == NULL)
+    {
+        return;
+    }
+
+    sess->client = NULL;
+    pthread_mutex_lock(&shaper_mutex);
+    if (--client->refs == 0)
+    {
+        tftpd_client_t** pp = &shaper_clients[(ntohl(client->addr) * 2654435761u) % TFTPD_CLIENT_HASH];
+        while (*pp != client)
+        {
+            pp = &(*pp)->next;
+        }
+        *pp = client->next;
+        free(client);
+    }
+    pthread_mutex_unlock(&shaper_mutex);
+}
+
+// 先检查客户端的桶再检查全局的桶，都够时扣除令牌返回0，否则返回要等待的微秒数
+static int64_t shaper_take(tftpd_session_t* sess, int cost, uint64_t now_us, int* client_limited)
+{
+    pthread_mutex_lock(&shaper_mutex);
+    int64_t wait = sess->client ? tftp_bucket_wait(&sess->client->bucket, cost, now_us) : 0;
+    *client_limited = wait > 0;
+    if (wait == 0)
+    {
+        wait = tftp_bucket_wait(&shaper_bucket, cost, now_us);
+        if (wait == 0)
+        {
+            tftp_bucket_take(&shaper_bucket, cost);
+            if (sess->client)
+            {
+                tftp_bucket_take(&sess->client->bucket, cost);
+            }
+        }
+    }
+    pthread_mutex_unlock(&shaper_mutex);
+    return wait;
+}
+
+// 处理收到的包会引起的流量：发送方是下一个DATA块，接收方是刚收到的块(延迟ACK来限速)
+static int session_cost(tftpd_session_t* sess, size_t pkt_size)
+{
+    if (sess->req.opcode == TFTP_PACKET_WRQ)
+    {
+        return (pkt_size > 4) ? (int)pkt_size - 4 : 0;
+    }
+    return sess->req.tftp.block_size;
+}
+
+static int recv_start(tftpd_session_t* sess)
+{
+    tftp_req_t* req = &sess->req;
+    tftp_t* tftp = &req->tftp;
+
+    if (server_pack)
+    {
+        printf("tftpd: %s is read-only\n", server_path);
+        tftp_send_error(tftp, TFTP_ERROR_ACCESS_AIOLATION);
+        return -1;
+    }
+    tftp_fcache_invalidate(sess->path);
+
+    // 去重：数据切块进仓库，传完才把清单换到文件名上；清单不能接着写，续传时也从头开始
+    if (server_config.dedup_dir)
+    {
+        tftp->option &= ~(TFTP_OPT_RANGE | TFTP_OPT_PREFIX);
+        sess->dedup = tftp_dedup_create(sess->path);
+        sess->file = sess->dedup ? tftp_dedup_file(sess->dedup) : NULL;
+    }
+    // 续传：已有的部分文件保留，客户端从重叠的位置开始发送；
+    // 客户端要能用prefix核对保留的部分是不是它的文件的开头，不会核对的客户端从头上传
+    else if ((tftp->option & TFTP_OPT_RANGE) && (tftp->option & TFTP_OPT_PREFIX))
+    {
+        sess->file = fopen(sess->path, "r+b");
+        if (sess->file)
+        {
+            fseek(sess->file, 0, SEEK_END);
+            sess->partial_size = ftell(sess->file);
+            if (sess->partial_size > tftp->offset)
+            {
+                sess->partial_size = tftp->offset;
+            }
+        }
+    }
+
+    if ((sess->file == NULL) && !server_config.dedup_dir)
+    {
+        sess->file = fopen(sess->path, "wb");
+    }
+
+    if (sess->file == NULL)
+    {
+        printf("tftpd: create %s failed\n", sess->path);
+        tftp_send_error(tftp, TFTP_ERROR_DISK_FULL);
+        return -1;
+    }
+
+    tftp->offset = tftp_resume_offset(sess->partial_size, tftp->block_size);
+    tftp->range = 0;
+    sess->position = tftp->offset;
+    if ((tftp->option & TFTP_OPT_PREFIX) && (tftp_prefix_crc(NULL, fileno(sess->file), tftp->offset, &tftp->prefix_crc) < 0))
+    {
+        printf("tftpd: read %s failed\n", sess->path);
+        tftp_send_error(tftp, TFTP_ERROR_ACCESS_AIOLATION);
+        return -1;
+    }
+    fseek(sess->file, sess->position, SEEK_SET);
+
+    if (sess->position > 0)
+    {
+        printf("tftpd: resume recv file %s from %lld ...\n", sess->path, (long long)sess->position);
+    }
+    else
+    {
+        printf("tftpd: recv file %s ...\n", sess->path);
+    }
+
+    int error = (req->option & TFTP_OPT_BASE) ? tftp_send_oack(tftp) : tftp_send_ack(tftp, 0);
+    if (error < 0)
+    {
+        printf("tftpd: send ack failed\n");
+        return -1;
+    }
+
+    sess->wait_op = TFTP_PACKET_DATA;
+    sess->wait_block = 1;
+    return 0;
+}
+
+// 去重：剩下不满一块的数据切进仓库，清单换到文件名上。要在最后的确认之前做完，写不进去时客户端才知道上传失败
+static int recv_commit(tftpd_session_t* sess)
+{
+    int error = tftp_dedup_close(sess->dedup, 1);
+    sess->dedup = NULL;
+    sess->file = NULL;
+    tftp_fcache_invalidate(sess->path);
+    if (error < 0)
+    {
+        printf("tftpd: commit %s failed\n", sess->path);
+        tftp_send_error(&sess->req.tftp, TFTP_ERROR_DISK_FULL);
+    }
+    return error;
+}
+
+// 收到了等待的DATA(或最后的摘要)，返回0继续等待，1完成，-1失败
+static int recv_input(tftpd_session_t* sess, size_t pkt_size)
+{
+    tftp_t* tftp = &sess->req.tftp;
+    FILE* file = sess->file;
+    if (sess->state == SESSION_CHECKSUM)
+    {
+        // 摘要对上了才提交，提交完再确认
+        if (sess->dedup && (tftp->peer_crc == tftp->crc) && (recv_commit(sess) < 0))
+        {
+            return -1;
+        }
+        return (tftp_check_digest(tftp, sess->wait_block) < 0) ? -1 : 1;
+    }
+
+    size_t block_size = pkt_size - 4;
+    uint8_t* data = tftp->rx_packet.data.data;
+    uint8_t raw[TFTP_BLOCK_SIZE];
+    if (tftp->option & TFTP_OPT_COMPRESS)
+    {
+        int raw_size = tftp_zip_decode(raw, tftp_data_size(tftp), data, block_size);
+        if (raw_size < 0)
+        {
+            tftp_send_error(tftp, TFTP_ERROR_OP);
+            return -1;
+        }
+        data = raw;
+        block_size = raw_size;
+    }
+
+    if (tftp->option & TFTP_OPT_CHECKSUM)
+    {
+        tftp->crc = tftp_crc32c(tftp->crc, data, block_size);
+    }
+
+    // 重叠部分只做比较，不一致说明不是同一个文件，清空后让客户端重新上传
+    int verified = tftp_verify_overlap(file, sess->position, data, block_size, sess->partial_size);
+    if (verified < 0)
+    {
+        tftp_send_error(tftp, TFTP_ERROR_FILE_EXIST);
+        fflush(file);
+        ftruncate(fileno(file), 0);
+        return -1;
+    }
+    else if (verified > 0)
+    {
+        fseek(file, sess->position + verified, SEEK_SET);
+    }
+
+    uint64_t io_us = tftp_time_us();
+    tftp_trace_event(tftp->trace, TFTP_TRACE_WRITE_BEGIN, 0, 0, (uint32_t)(block_size - verified));
+    size_t size = tftp_file_write(tftp, file, data + verified, block_size - verified);
+    tftp_trace_event(tftp->trace, TFTP_TRACE_WRITE_END, 0, 0, (uint32_t)size);
+    tftp_hist_record(TFTP_HIST_SERVER, TFTP_HIST_FILE_IO, tftp_time_us() - io_us);
+    if (size < block_size - verified)
+    {
+        printf("tftpd: write file %s failed\n", sess->path);
+        tftp_send_error(tftp, TFTP_ERROR_ACCESS_AIOLATION);
+        return -1;
+    }
+    sess->position += block_size;
+
+    // 最后一块：netascii留着的CR先写出去；去重时不带校验就在最后的ACK之前提交
+    int last = (block_size < (size_t)tftp_data_size(tftp));
+    if (last && (tftp->option & TFTP_OPT_NETASCII) && (tftp_netascii_finish(&tftp->netascii, file) < 0))
+    {
+        printf("tftpd: write file %s failed\n", sess->path);
+        tftp_send_error(tftp, TFTP_ERROR_DISK_FULL);
+        return -1;
+    }
+    if (last && sess->dedup && !(tftp->option & TFTP_OPT_CHECKSUM) && (recv_commit(sess) < 0))
+    {
+        return -1;
+    }
+
+    sess->curr_blk = sess->wait_block;
+    if (tftp_send_ack(tftp, sess->curr_blk) < 0)
+    {
+        printf("tftpd: send ack block failed\n");
+        return -1;
+    }
+
+    sess->total_size += (int)block_size;
+    sess->total_block++;
+    if (!last)
+    {
+        sess->wait_block++;
+        return 0;
+    }
+
+    // 原来的文件可能比新文件长；去重时没有这个文件，清单已经或者会在摘要之后整个换上去
+    if (sess->file && (sess->dedup == NULL))
+    {
+        fflush(file);
+        ftruncate(fileno(file), ftell(file));
+    }
+
+    if (tftp->option & TFTP_OPT_CHECKSUM)
+    {
+        sess->state = SESSION_CHECKSUM;
+        sess->wait_op = TFTP_PACKET_DIGEST;
+        sess->wait_block = sess->curr_blk + 1;
+        return 0;
+    }
+    return 1;
+}
+
+// 发送过的数据在窗口的缓冲区里，重传不再读文件，读过的部分可以丢掉
+// 页缓存的一页可能是按大小对齐的大页，只有整页落在范围里才会丢，所以范围的起点按最大的页对齐
+static void send_drop_cache(tftpd_session_t* sess, int64_t step)
+{
+    if ((sess->drop_pos < 0) || (sess->read_pos - sess->drop_pos < step))
+    {
+        return;
+    }
+
+    // step为0时会话结束，丢到文件末尾
+    int64_t end = step ? (sess->read_pos & ~(int64_t)(TFTPD_DROP_CACHE_ALIGN - 1)) : sess->read_pos;
+    if (end <= sess->drop_pos)
+    {
+        return;
+    }
+
+    if (posix_fadvise(tftp_fcache_fd(sess->fcache), sess->drop_pos, step ? end - sess->drop_pos : 0, POSIX_FADV_DONTNEED) == 0)
+    {
+        __atomic_add_fetch(&server_stats.cache_dropped, (uint64_t)(end - sess->drop_pos), __ATOMIC_RELAXED);
+    }
+    sess->drop_pos = end;
+}
+
+static ssize_t send_read_file(tftpd_session_t* sess, uint8_t* data, size_t size)
+{
+    if (sess->image)
+    {
+        tftp_t* tftp = &sess->req.tftp;
+        if (size > (size_t)(tftp->file_size - sess->read_pos))
+        {
+            size = (size_t)(tftp->file_size - sess->read_pos);
+        }
+        memcpy(data, sess->image + sess->read_pos, size);
+        sess->read_pos += (int64_t)size;
+        return (ssize_t)size;
+    }
+    else if (sess->fcache == NULL)
+    {
+        size_t read_size = tftp_file_read(&sess->req.tftp, sess->file, data, size);
+        return ferror(sess->file) ? -1 : (ssize_t)read_size;
+    }
+
+    size_t total = 0;
+    while (total < size)
+    {
+        ssize_t read_size = pread(tftp_fcache_fd(sess->fcache), data + total, size - total, sess->read_pos + total);
+        if ((read_size < 0) && (errno == EINTR))
+        {
+            continue;
+        }
+        else if (read_size < 0)
+        {
+            return -1;
+        }
+        else if (read_size == 0)
+        {
+            break;
+        }
+        total += (size_t)read_size;
+    }
+    sess->read_pos += total;
+    send_drop_cache(sess, TFTPD_DROP_CACHE_STEP);
+    return (ssize_t)total;
+}
+
+static ssize_t send_read(tftpd_session_t* sess, uint8_t* data, size_t size)
+{
+    tftp_trace_t* trace = sess->req.tftp.trace;
+    uint64_t io_us = tftp_time_us();
+    tftp_trace_event(trace, TFTP_TRACE_READ_BEGIN, 0, 0, (uint32_t)size);
+    ssize_t read_size = send_read_file(sess, data, size);
+    tftp_trace_event(trace, TFTP_TRACE_READ_END, 0, 0, (read_size > 0) ? (uint32_t)read_size : 0);
+    tftp_hist_record(TFTP_HIST_SERVER, TFTP_HIST_FILE_IO, tftp_time_us() - io_us);
+    return read_size;
+}
+
+// 读出下一块的数据，按窗口发送时直接写到发送窗口的环里
+static int send_produce(void* arg, uint8_t* data, int* last)
+{
+    tftpd_session_t* sess = (tftpd_session_t*)arg;
+    tftp_t* tftp = &sess->req.tftp;
+    int chunk = sess->chunk;
+
+    size_t read_size = chunk;
+    if (sess->remain < chunk)
+    {
+        read_size = (size_t)sess->remain;
+    }
+
+    ssize_t size = (ssize_t)read_size;
+    int send_size;
+    if (sess->zcache && tftp_zcache_ready(sess->zcache))
+    {
+        send_size = tftp_zcache_read(sess->zcache, sess->zcache_index++, data, tftp->block_size);
+    }
+    else if (tftp->option & TFTP_OPT_COMPRESS)
+    {
+        uint8_t raw[TFTP_BLOCK_SIZE];
+        size = send_read(sess, raw, read_size);
+        if (size < 0)
+        {
+            size = 0;
+            send_size = -1;
+        }
+        else
+        {
+            tftp->crc = tftp_crc32c(tftp->crc, raw, size);
+            send_size = tftp_zip_encode(data, tftp->block_size, raw, size);
+        }
+        if (sess->zcache && (send_size >= 0) && (tftp_zcache_append(sess->zcache, data, send_size) < 0))
+        {
+            tftp_zcache_close(sess->zcache, 0);
+            sess->zcache = NULL;
+        }
+    }
+    else
+    {
+        size = send_read(sess, data, read_size);
+        send_size = (int)size;
+        if ((size > 0) && (tftp->option & TFTP_OPT_CHECKSUM))
+        {
+            tftp->crc = tftp_crc32c(tftp->crc, data, size);
+        }
+    }
+
+    if (send_size < 0)
+    {
+        printf("tftpd: read file %s failed\n", sess->path);
+        tftp_send_error(tftp, TFTP_ERROR_ACCESS_AIOLATION);
+        return -1;
+    }
+
+    sess->total_size += (int)size;
+    sess->total_block++;
+    sess->remain -= size;
+    sess->last = size < (ssize_t)chunk;
+    *last = sess->last;
+    return send_size;
+}
+
+// 读出下一块并发送，等待这一块的ACK
+static int send_block(tftpd_session_t* sess)
+{
+    tftp_t* tftp = &sess->req.tftp;
+    int last;
+    int send_size = send_produce(sess, tftp->tx_packet.data.data, &last);
+    if (send_size < 0)
+    {
+        return -1;
+    }
+
+    sess->curr_blk++;
+    if (tftp_send_data(tftp, sess->curr_blk, send_size) < 0)
+    {
+        printf("tftpd: send data block failed\n");
+        return -1;
+    }
+
+    sess->wait_op = TFTP_PACKET_ACK;
+    sess->wait_block = sess->curr_blk;
+    return 0;
+}
+
+// 协商了aimdwindow时按拥塞窗口连续发送，接收任意块号的累计确认
+static int send_window(tftpd_session_t* sess)
+{
+    tftp_t* tftp = &sess->req.tftp;
+    if ((tftp->window == NULL) && (tftp_window_start(tftp, &sess->window) < 0))
+    {
+        tftp_send_error(tftp, TFTP_ERROR_DISK_FULL);
+        return -1;
+    }
+
+    if (tftp_window_send(tftp, send_produce, sess) < 0)
+    {
+        printf("tftpd: send data block failed\n");
+        return -1;
+    }
+
+    sess->wait_op = TFTP_PACKET_WACK;
+    sess->wait_block = (uint16_t)(sess->window.base - 1);
+    return 0;
+}
+
+static int send_start(tftpd_session_t* sess)
+{
+    tftp_req_t* req = &sess->req;
+    tftp_t* tftp = &req->tftp;
+
+    // 打包文件按名字查完美哈希，不经过文件系统
+    if (server_pack)
+    {
+        tftp_pack_file_t image;
+        if (tftp_pack_find(server_pack, req->filename, &image) < 0)
+        {
+            printf("tftpd: file %s does not exist\n", sess->path);
+            tftp_send_error(tftp, TFTP_ERROR_NO_FILE);
+            return -1;
+        }
+        sess->image = image.data;
+        tftp->file_size = image.size;
+        sess->mtime = image.mtime;
+    }
+    else
+    {
+        // 已经打开过的文件直接用缓存的描述符和大小，不用每个请求都open/seek
+        int error;
+        sess->fcache = tftp_fcache_open(sess->path, &error);
+        if (sess->fcache == NULL)
+        {
+            printf("tftpd: file %s does not exist\n", sess->path);
+            tftp_send_error(tftp, (error == ENOENT) ? TFTP_ERROR_NO_FILE : TFTP_ERROR_ACCESS_AIOLATION);
+            return -1;
+        }
+        tftp->file_size = tftp_fcache_size(sess->fcache);
+        sess->mtime = tftp_fcache_mtime(sess->fcache);
+
+        // 去重上传的文件是清单，按清单从仓库里读块，大小是原文件的
+        sess->file = server_config.dedup_dir ? tftp_dedup_open(tftp_fcache_fd(sess->fcache), &tftp->file_size) : NULL;
+        if (sess->file)
+        {
+            tftp_fcache_close(sess->fcache);
+            sess->fcache = NULL;
+        }
+    }
+    sess->read_pos = 0;
+
+    // 客户端缓存的大小和修改时间都和文件一样时只回OACK，不传数据，客户端收到后直接结束
+    // 修改时间只精确到秒，这一秒内改过的文件可能还会再改成同样大小，不算没变
+    // 1970年以前的修改时间写不进选项，这种文件不做条件下载
+    if (sess->mtime < 0)
+    {
+        tftp->option &= ~TFTP_OPT_CACHED;
+    }
+    if (tftp->option & TFTP_OPT_CACHED)
+    {
+        tftp->mtime = sess->mtime;
+        tftp->not_modified = (req->cached_size == tftp->file_size) && (req->cached_mtime == sess->mtime)
+            && (sess->mtime < (int64_t)time(NULL));
+        if (tftp->not_modified)
+        {
+            printf("tftpd: file %s not modified\n", sess->path);
+            return (tftp_send_oack(tftp) < 0) ? -1 : 1;
+        }
+    }
+
+    // netascii的转换要经过stdio，单独打开
+    if (tftp->option & TFTP_OPT_NETASCII)
+    {
+        if (sess->image)
+        {
+            sess->file = tftp->file_size ? fmemopen((void*)sess->image, (size_t)tftp->file_size, "rb") : fopen("/dev/null", "rb");
+            sess->image = NULL;
+        }
+        else if (sess->file == NULL)
+        {
+            sess->file = fopen(sess->path, "rb");
+            tftp_fcache_close(sess->fcache);
+            sess->fcache = NULL;
+        }
+
+        if (sess->file == NULL)
+        {
+            printf("tftpd: file %s does not exist\n", sess->path);
+            tftp_send_error(tftp, TFTP_ERROR_NO_FILE);
+            return -1;
+        }
+    }
+
+    printf("tftpd: sending file %s....\n", sess->path);
+
+    // 只发送[offset, offset + range)这一段，netascii转换后的长度未知
+    sess->remain = (tftp->option & TFTP_OPT_NETASCII) ? INT64_MAX : tftp->file_size;
+    if (tftp->option & TFTP_OPT_RANGE)
+    {
+        if ((tftp->offset < 0) || (tftp->offset > tftp->file_size) || (tftp->range < 0))
+        {
+            printf("tftpd: bad range %lld+%lld of %s\n", (long long)tftp->offset, (long long)tftp->range, sess->path);
+            tftp_send_error(tftp, TFTP_ERROR_OPTION);
+            return -1;
+        }
+
+        sess->remain = tftp->file_size - tftp->offset;
+        if (tftp->range && (tftp->range < sess->remain))
+        {
+            sess->remain = tftp->range;
+        }
+        tftp->range = sess->remain;
+        sess->read_pos = tftp->offset;
+
+        // 客户端续传：告诉它[0, offset)的CRC32C，它比较自己保留的部分，对不上时从头下载
+        int error = 0;
+        if ((tftp->option & TFTP_OPT_PREFIX) && sess->image)
+        {
+            tftp->prefix_crc = tftp_crc32c(0, sess->image, (size_t)tftp->offset);
+        }
+        else if (tftp->option & TFTP_OPT_PREFIX)
+        {
+            error = tftp_prefix_crc(sess->file, sess->file ? -1 : tftp_fcache_fd(sess->fcache), tftp->offset, &tftp->prefix_crc);
+        }
+        if ((error < 0) || (sess->file && (fseek(sess->file, sess->read_pos, SEEK_SET) < 0)))
+        {
+            tftp_send_error(tftp, TFTP_ERROR_ACCESS_AIOLATION);
+            return -1;
+        }
+    }
+
+    // 大文件读一遍就不用了，边读边丢，不把其他客户端常用的小文件挤出页缓存
+    if (sess->fcache && server_config.drop_cache_size && (tftp->file_size >= server_config.drop_cache_size))
+    {
+        sess->drop_pos = sess->read_pos & ~(int64_t)(TFTPD_DROP_CACHE_ALIGN - 1);
+        posix_fadvise(tftp_fcache_fd(sess->fcache), sess->read_pos, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    // 压缩时热点文件整段发送的块直接从缓存里取，不用每个客户端都压缩一遍
+    int chunk = tftp_data_size(tftp);
+    int64_t start = (tftp->option & TFTP_OPT_RANGE) ? tftp->offset : 0;
+    // 缓存里只有整个文件的CRC，带校验时只能从头开始用
+    int cache_start = (tftp->option & TFTP_OPT_CHECKSUM) ? (start == 0) : (start % chunk == 0);
+    if ((tftp->option & TFTP_OPT_COMPRESS) && !(tftp->option & TFTP_OPT_NETASCII) && cache_start && (start + sess->remain == tftp->file_size))
+    {
+        sess->zcache = tftp_zcache_open(sess->path, tftp->file_size, sess->mtime, chunk);
+        if (sess->zcache && !tftp_zcache_ready(sess->zcache) && (start != 0))
+        {
+            tftp_zcache_close(sess->zcache, 0);
+            sess->zcache = NULL;
+        }
+    }
+    sess->chunk = chunk;
+    sess->zcache_index = (uint32_t)(start / chunk);
+
+    if (req->option & TFTP_OPT_BASE)
+    {
+        if (tftp_send_oack(tftp) < 0)
+        {
+            printf("tftpd: send oack failed\n");
+            return -1;
+        }
+
+        sess->wait_op = TFTP_PACKET_ACK;
+        sess->wait_block = 0;
+        return 0;
+    }
+
+    return send_block(sess);
+}
+
+// 收到了等待的ACK，返回0继续等待，1完成，-1失败
+static int send_input(tftpd_session_t* sess)
 {
+    tftp_t* tftp = &sess->req.tftp;
+    if (sess->state == SESSION_CHECKSUM)
+    {
+        return 1;
+    }
+
+    if (tftp->window)
+    {
+        if (!tftp_window_ack(tftp, ntohs(tftp->rx_packet.ack.block_num)))
+        {
+            return send_window(sess);
+        }
+
+        sess->curr_blk = (uint16_t)sess->window.last;
+        tftp_print_stats(tftp, "tftpd");
+        tftp_window_stop(tftp);
+        sess->wait_op = TFTP_PACKET_ACK;
+    }
+    else if ((tftp->option & TFTP_OPT_WINDOW) && (sess->curr_blk == 0))
+    {
+        return send_window(sess);
+    }
+    else if (!sess->last)
+    {
+        return send_block(sess);
+    }
+
+    if (sess->zcache)
+    {
+        if (tftp_zcache_ready(sess->zcache))
+        {
+            tftp->crc = tftp_zcache_crc(sess->zcache);
+        }
+        else
+        {
+            tftp_zcache_set_crc(sess->zcache, tftp->crc);
+        }
+        tftp_zcache_close(sess->zcache, 1);
+        sess->zcache = NULL;
+    }
+
+    if (tftp->option & TFTP_OPT_CHECKSUM)
+    {
+        if (tftp_send_digest(tftp) < 0)
+        {
+            return -1;
+        }
+
+        sess->state = SESSION_CHECKSUM;
+        sess->wait_block = sess->curr_blk + 1;
+        return 0;
+    }
+    return 1;
+}
+
+static int demux_socks[TFTPD_DEMUX_MAX];
+static tftp_peer_table_t demux_table;
+static int demux_next;
+static tftp_packet_t demux_packet;
+
+// 轮流分配共享套接字，同一个对端端口已经在某个套接字上有会话时换下一个
+static int demux_attach(tftpd_session_t* sess)
+{
+    const struct sockaddr_in* remote = (const struct sockaddr_in*)&sess->req.tftp.remote;
+    for (int i = 0; i < server_config.demux_sockets; i++)
+    {
+        int index = (demux_next + i) % server_config.demux_sockets;
+        if (tftp_peer_insert(&demux_table, tftp_peer_key(remote, index), sess) == 0)
+        {
+            demux_next = index + 1;
+            sess->demux = index;
+            return demux_socks[index];
+        }
+    }
+    return -1;
+}
+
+// 创建会话的套接字，事件循环中不阻塞，由时间轮负责超时
+static int session_open(tftpd_session_t* sess, int event_loop)
+{
+    tftp_req_t* req = &sess->req;
     tftp_t* tftp = &req->tftp;
-    char path_buffer[128];
-    if (server_path)
+
+    sess->demux = -1;
+    int sockfd = (event_loop && server_config.demux_sockets) ? demux_attach(sess)
+        : socket(AF_INET, SOCK_DGRAM | (event_loop ? SOCK_NONBLOCK : 0), IPPROTO_UDP);
+    if (sockfd < 0)
+    {
+        printf("tftpd: create working socket failed\n");
+        return -1;
+    }
+
+    tftp->socket = sockfd;
+    tftp->tmo_retry = TFTP_MAX_RETYR;
+    tftp->tmo_sec = TFTP_TMO_SEC;
+    tftp->file_size = req->filesize; // WRQ的tsize，OACK里原样回给客户端；RRQ在send_start里换成文件的大小
+    tftp->block_size = req->block_size;
+    tftp->option = req->option;
+    tftp->offset = req->offset;
+    tftp->range = req->range;
+    tftp->not_modified = 0;
+    tftp->window_size = req->window_size;
+    tftp->window = NULL;
+    tftp->busy_poll_us = 0;
+    if (server_config.busy_poll_us > 0)
+    {
+        tftp_busy_poll(tftp, server_config.busy_poll_us);
+    }
+
+    if (!event_loop)
+    {
+        struct timeval tmo;
+        tmo.tv_sec = tftp->tmo_sec;
+        tmo.tv_usec = 0;
+        setsockopt(tftp->socket, SOL_SOCKET, SO_RCVTIMEO, (const void*)&tmo, sizeof(tmo));
+    }
+
+    if (tftp->option & TFTP_OPT_WINDOW)
     {
-        snprintf(path_buffer, sizeof(path_buffer), "%s/%s", server_path, req->filename);
+        tftp_window_buffer(tftp);
+    }
+
+    // netascii的偏移和文件中的偏移对不上，不支持range和续传；转换后的大小也和缓存对不上
+    if (tftp->option & TFTP_OPT_NETASCII)
+    {
+        tftp->option &= ~(TFTP_OPT_RANGE | TFTP_OPT_CACHED);
+        tftp_netascii_init(&tftp->netascii);
+    }
+
+    // 请求包在监听套接字上收到，会话从这里开始记录
+    tftp->trace = tftp_trace_start();
+    tftp_trace_set_name(tftp->trace, (req->opcode == TFTP_PACKET_WRQ) ? "tftpd put" : "tftpd get", req->filename);
+    tftp_trace_event(tftp->trace, TFTP_TRACE_RECV, req->opcode, 0, 0);
+    return 0;
+}
+
+// 打开文件并发出第一个包
+static int session_start(tftpd_session_t* sess)
+{
+    sess->file = NULL;
+    sess->dedup = NULL;
+    sess->fcache = NULL;
+    sess->image = NULL;
+    sess->drop_pos = -1;
+    sess->state = SESSION_TRANSFER;
+    sess->curr_blk = 0;
+    sess->last = 0;
+    sess->zcache = NULL;
+    sess->partial_size = 0;
+    sess->total_size = 0;
+    sess->total_block = 0;
+    shaper_attach(sess);
+
+    int size = server_path ? snprintf(sess->path, sizeof(sess->path), "%s/%s", server_path, sess->req.filename)
+        : snprintf(sess->path, sizeof(sess->path), "%s", sess->req.filename);
+    if (size >= (int)sizeof(sess->path))
+    {
+        printf("tftpd: path too long: %s\n", sess->req.filename);
+        tftp_send_error(&sess->req.tftp, TFTP_ERROR_NO_FILE);
+        return -1;
+    }
+
+    return (sess->req.opcode == TFTP_PACKET_WRQ) ? recv_start(sess) : send_start(sess);
+}
+
+static int session_input(tftpd_session_t* sess, size_t pkt_size)
+{
+    return (sess->req.opcode == TFTP_PACKET_WRQ) ? recv_input(sess, pkt_size) : send_input(sess);
+}
+
+// 线程模式下会话并发结束，用原子加
+static void server_account(tftpd_session_t* sess, int result)
+{
+    const tftp_stats_t* stats = &sess->req.tftp.stats;
+    __atomic_add_fetch(&server_stats.sessions, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch((result > 0) ? &server_stats.bytes : &server_stats.failures, (result > 0) ? (uint64_t)sess->total_size : 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&server_stats.blocks, sess->total_block, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&server_stats.retransmits, stats->retransmits, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&server_stats.timeouts, stats->timeouts, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&server_stats.not_modified, (result > 0) && sess->req.tftp.not_modified, __ATOMIC_RELAXED);
+}
+
+static void session_finish(tftpd_session_t* sess, int result)
+{
+    const char* dir = (sess->req.opcode == TFTP_PACKET_WRQ) ? "recv" : "send";
+    if (result > 0)
+    {
+        printf("tftpd: %s %s %dbytes %dblocks\n", dir, sess->path, sess->total_size, sess->total_block);
+        tftp_hist_transfer(TFTP_HIST_SERVER, sess->total_size, tftp_time_us() - sess->req.tftp.start_us);
+    }
+    else if (sess->file || sess->fcache || sess->image)
+    {
+        printf("tftpd: %s failed.\n", dir);
+    }
+
+    if (sess->zcache)
+    {
+        tftp_zcache_close(sess->zcache, 0);
+        sess->zcache = NULL;
+    }
+
+    tftp_window_stop(&sess->req.tftp);
+    if (sess->dedup)
+    {
+        // 成功的上传在recv_commit里已经提交了；到这里的都不提交，原来的文件不动，已经存进仓库的块留着给以后的上传用
+        tftp_dedup_close(sess->dedup, 0);
+        sess->dedup = NULL;
+        sess->file = NULL;
+    }
+    else if (sess->file)
+    {
+        fclose(sess->file);
+        sess->file = NULL;
+    }
+    if (sess->fcache)
+    {
+        send_drop_cache(sess, 0);
+        tftp_fcache_close(sess->fcache);
+        sess->fcache = NULL;
+    }
+    shaper_detach(sess);
+    server_account(sess, result);
+    tftp_trace_finish(sess->req.tftp.trace);
+    sess->req.tftp.trace = NULL;
+}
+
+static void* tftp_worikng_thread(void* arg)
+{
+    tftpd_session_t* sess = (tftpd_session_t*)arg;
+    tftp_t* tftp = &sess->req.tftp;
+
+    if (session_open(sess, 0) < 0)
+    {
+        session_free(sess);
+        return NULL;
+    }
+
+    int result = session_start(sess);
+    while (result == 0)
+    {
+        size_t pkt_size;
+        if (tftp_wait_packet(tftp, sess->wait_op, sess->wait_block, &pkt_size) < 0)
+        {
+            printf("tftpd: wait block %d failed\n", sess->wait_block);
+            result = -1;
+            break;
+        }
+
+        // 线程模式下只有令牌桶，按权重调度需要事件循环
+        int client_limited;
+        int64_t wait;
+        while (shaper_enabled && ((wait = shaper_take(sess, session_cost(sess, pkt_size), tftp_time_us(), &client_limited)) > 0))
+        {
+            usleep((useconds_t)wait);
+        }
+        result = session_input(sess, pkt_size);
     }
-    else
+
+    session_finish(sess, result);
+    close(tftp->socket);
+    session_free(sess);
+    return NULL;
+}
+
+static int parse_req(tftp_t* tftp, size_t pkt_size, tftp_req_t* req)
+{
+    memset(req->filename, 0, sizeof(req->filename));
+    memset(&req->tftp, 0, sizeof(req->tftp));
+    memcpy(&req->tftp.remote, &tftp->remote, sizeof(tftp->remote));
+    req->tftp.side = TFTP_HIST_SERVER;
+    req->tftp.start_us = tftp_time_us();
+
+    int result = tftp_parse_req(&tftp->rx_packet, pkt_size, req);
+    struct sockaddr_in* addr = (struct sockaddr_in*)&tftp->remote;
+    printf("tftpd: recv req %s from %s %d\n",
+        req->opcode == TFTP_PACKET_RRQ ? "get" : "put",
+        inet_ntoa(addr->sin_addr), ntohs(addr->sin_port)
+    );
+
+    if (result < 0)
     {
-        snprintf(path_buffer, sizeof(path_buffer), "%s", req->filename);
+        printf("tftpd: bad request %s\n", req->filename);
+        tftp_send_error(tftp, TFTP_ERROR_OP);
+        return -1;
     }
+    return 0;
+}
 
-    FILE* file = fopen(path_buffer, "wb");
-    if (file == NULL)
+static int wait_req(tftp_t* tftp, tftp_req_t* req)
+{
+    size_t pkt_size;
+    if (tftp_wait_packet(tftp, TFTP_PACKET_REQ, 0, &pkt_size) < 0)
     {
-        printf("tftpd: create %s failed\n", path_buffer);
-        tftp_send_error(tftp, TFTP_ERROR_DISK_FULL);
         return -1;
     }
 
-    printf("tftpd: recv file %s ...\n", path_buffer);
+    return parse_req(tftp, pkt_size, req);
+}
+
+static int event_fd = -1;
+static uint64_t event_now;
+static tftp_wheel_t event_wheel;
 
-    int error = req->option ? tftp_send_oack(tftp) : tftp_send_ack(tftp, 0);
-    if (error < 0)
+static void event_close(tftpd_session_t* sess, int result)
+{
+    tftp_timer_del(&event_wheel, &sess->timer);
+    tftp_wfq_remove(&shaper_queue, &sess->wfq);
+    session_finish(sess, result);
+    if (sess->demux >= 0)
     {
-        printf("tftpd: send ack failed\n");
-        goto recv_failed;
+        tftp_peer_remove(&demux_table, tftp_peer_key((const struct sockaddr_in*)&sess->req.tftp.remote, sess->demux));
+    }
+    else
+    {
+        close(sess->req.tftp.socket); // 关闭后自动从epoll中移除
     }
+    session_free(sess);
+}
 
-    uint16_t curr_blk = 1;
-    int total_size = 0;
-    int total_block = 0;
-    while (1)
+// 重传超时：和tftp_wait_packet一样重发上一个包，重试次数用完就放弃
+static void event_timeout(tftp_timer_t* timer)
+{
+    tftpd_session_t* sess = (tftpd_session_t*)timer->arg;
+    tftp_t* tftp = &sess->req.tftp;
+    if (sess->queued == SHAPER_PARKED)
     {
-        size_t pkt_size;
-        error = tftp_wait_packet(tftp, TFTP_PACKET_DATA, curr_blk, &pkt_size);
-        if (error < 0)
-        {
-            printf("tftpd: wait %d ack failed\n", curr_blk - 1);
-            goto recv_failed;
-        }
-        size_t block_size = pkt_size - 4;
-        size_t size = fwrite(tftp->rx_packet.data.data, 1, block_size, file);
-        if (size < block_size)
-        {
-            printf("tftpd: write file %s failed\n", path_buffer);
-            tftp_send_error(tftp, TFTP_ERROR_ACCESS_AIOLATION);
-            goto recv_failed;
-        }
+        sess->queued = SHAPER_QUEUED;
+        tftp_wfq_requeue(&shaper_queue, &sess->wfq);
+        return;
+    }
 
-        int error = tftp_send_ack(tftp, curr_blk++);
-        if (error < 0)
-        {
-            printf("tftpd: send ack block failed\n");
-            goto recv_failed;
-        }
+    tftp_trace_event(tftp->trace, TFTP_TRACE_TIMEOUT, 0, sess->wait_block, 0);
+    if (tftp->window == NULL)
+    {
+        tftp->stats.timeouts++;
+    }
+    if (--tftp->tmo_retry == 0)
+    {
+        printf("tftpd: wait block %d tmo\n", sess->wait_block);
+        event_close(sess, -1);
+        return;
+    }
 
-        total_size += (int)size;
-        total_block++;
-        if (size < tftp->block_size)
-        {
-            break;
-        }
+    tftp_resend(tftp);
+    tftp_timer_add(&event_wheel, timer, timer->expire + tftp->tmo_sec * 1000);
+}
+
+// 处理一个等待中的包，会话结束并释放时返回-1
+static int event_process(tftpd_session_t* sess, size_t pkt_size)
+{
+    tftp_t* tftp = &sess->req.tftp;
+    int result = session_input(sess, pkt_size);
+    if (result != 0)
+    {
+        event_close(sess, result);
+        return -1;
     }
 
-    printf("tftpd: recv %s %dbytes %dblocks\n", path_buffer, total_size, total_block);
-    fclose(file);
+    tftp->tmo_retry = TFTP_MAX_RETYR;
+    tftp_timer_add(&event_wheel, &sess->timer, event_now + tftp->tmo_sec * 1000);
     return 0;
-recv_failed:
-    printf("tftpd: recv failed.\n");
-    fclose(file);
-    return -1;
-
 }
 
-static int do_send_file(tftp_req_t* req)
+// 处理会话收到的一个包，会话结束或者开始排队时返回-1
+static int event_packet(tftpd_session_t* sess, size_t size)
 {
-    tftp_t* tftp = &req->tftp;
-    char path_buffer[128];
-    if (server_path)
+    tftp_t* tftp = &sess->req.tftp;
+    int result = tftp_check_packet(tftp, sess->wait_op, sess->wait_block, size);
+    if (result < 0)
     {
-        snprintf(path_buffer, sizeof(path_buffer), "%s/%s", server_path, req->filename);
+        event_close(sess, -1);
+        return -1;
     }
-    else
+    else if (result == 0)
     {
-        snprintf(path_buffer, sizeof(path_buffer), "%s", req->filename);
+        return 0;
     }
 
-    FILE* file = fopen(path_buffer, "rb");
-    if (file == NULL)
+    // 等待调度期间对方在等我们，不需要重传
+    if (shaper_enabled && (tftp_wfq_push(&shaper_queue, &sess->wfq, session_cost(sess, size), sess->weight) == 0))
     {
-        printf("tftpd: file %s does not exist\n", path_buffer);
-        tftp_send_error(tftp, TFTP_ERROR_NO_FILE);
+        tftp_timer_del(&event_wheel, &sess->timer);
+        sess->pending_size = size;
+        sess->queued = SHAPER_QUEUED;
         return -1;
     }
 
-    printf("tftpd: sending file %s....\n", path_buffer);
+    return event_process(sess, size);
+}
 
-    fseek(file, 0, SEEK_END);
-    tftp->file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+// 边沿触发，读到EAGAIN为止；排队期间停止读取，收到的包留在rx_packet中
+// 共享套接字由demux_input读取，这里什么都不做
+static void event_input(tftpd_session_t* sess)
+{
+    tftp_t* tftp = &sess->req.tftp;
+    while ((sess->queued == SHAPER_IDLE) && (sess->demux < 0))
+    {
+        socklen_t len = sizeof(struct sockaddr);
+        ssize_t size = recvfrom(tftp->socket, (uint8_t*)&tftp->rx_packet, sizeof(tftp_packet_t), 0, &tftp->remote, &len);
+        if ((size < 0) || (event_packet(sess, (size_t)size) < 0))
+        {
+            return;
+        }
+    }
+}
 
-    if (req->option)
+// 共享套接字上的包按(对端地址, 端口, 套接字序号)查出会话，复制到会话的rx_packet
+// 不认识的对端和正在排队的会话的包丢掉，对方会超时重发
+static void demux_input(int index)
+{
+    while (1)
     {
-        int error = tftp_send_oack(tftp);
-        if (error < 0)
+        struct sockaddr_in from;
+        socklen_t len = sizeof(from);
+        ssize_t size = recvfrom(demux_socks[index], (uint8_t*)&demux_packet, sizeof(tftp_packet_t), 0, (struct sockaddr*)&from, &len);
+        if (size < 0)
         {
-            printf("tftpd: send oack failed\n");
-            goto send_failed;
+            return;
         }
 
-        size_t pkt_size;
-        error = tftp_wait_packet(tftp, TFTP_PACKET_ACK, 0, &pkt_size);
-        if (error < 0)
+        tftpd_session_t* sess = (tftpd_session_t*)tftp_peer_find(&demux_table, tftp_peer_key(&from, index));
+        if ((sess == NULL) || (sess->queued != SHAPER_IDLE))
         {
-            printf("tftpd: wait ack failed\n");
-            goto send_failed;
+            continue;
         }
 
+        memcpy(&sess->req.tftp.rx_packet, &demux_packet, (size_t)size);
+        event_packet(sess, (size_t)size);
     }
+}
 
-    uint16_t curr_blk = 1;
-    int total_size = 0;
-    int total_block = 0;
-    while (1)
+static int demux_open(void)
+{
+    if (tftp_peer_init(&demux_table) < 0)
     {
-        size_t size = fread(tftp->tx_packet.data.data, 1, tftp->block_size, file);
-        if (size < 0)
+        return -1;
+    }
+
+    for (int i = 0; i < server_config.demux_sockets; i++)
+    {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = 0;
+
+        int size = TFTPD_DEMUX_RCVBUF;
+        demux_socks[i] = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+        if ((demux_socks[i] < 0) || (bind(demux_socks[i], (const struct sockaddr*)&addr, sizeof(addr)) < 0))
         {
-            printf("tftpd: read file %s failed\n", path_buffer);
-            tftp_send_error(tftp, TFTP_ERROR_ACCESS_AIOLATION);
-            goto send_failed;
+            printf("tftpd: create demux socket failed\n");
+            return -1;
         }
+        setsockopt(demux_socks[i], SOL_SOCKET, SO_RCVBUF, (const void*)&size, sizeof(size));
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLET;
+        event.data.ptr = &demux_socks[i];
+        epoll_ctl(event_fd, EPOLL_CTL_ADD, demux_socks[i], &event);
+    }
 
-        int error = tftp_send_data(tftp, curr_blk, size);
-        if (error < 0)
+    printf("tftpd: sessions share %d sockets\n", server_config.demux_sockets);
+    return 0;
+}
+
+// 按虚拟完成时间依次处理排队的会话，返回全局令牌不够时要等待的毫秒数，-1表示不用等
+static int event_dispatch(void)
+{
+    uint64_t now_us = tftp_time_us();
+    tftp_wfq_item_t* item;
+    while ((item = tftp_wfq_peek(&shaper_queue)) != NULL)
+    {
+        tftpd_session_t* sess = (tftpd_session_t*)((uint8_t*)item - offsetof(tftpd_session_t, wfq));
+        int client_limited;
+        int64_t wait = shaper_take(sess, session_cost(sess, sess->pending_size), now_us, &client_limited);
+        if ((wait > 0) && !client_limited)
         {
-            printf("tftpd: send data block failed\n");
-            goto send_failed;
+            return (int)((wait + 999) / 1000);
         }
-
-        size_t pkt_size;
-        error = tftp_wait_packet(tftp, TFTP_PACKET_ACK, curr_blk++, &pkt_size);
-        if (error < 0)
+        else if (wait > 0)
         {
-            printf("tftpd: wait %d ack failed\n", curr_blk - 1);
-            goto send_failed;
+            // 只是这个客户端超速，不影响其他会话
+            tftp_wfq_remove(&shaper_queue, item);
+            sess->queued = SHAPER_PARKED;
+            tftp_timer_add(&event_wheel, &sess->timer, event_now + (wait + 999) / 1000);
+            continue;
         }
 
-        total_size += (int)size;
-        total_block++;
-        if (size < tftp->block_size)
+        tftp_wfq_pop(&shaper_queue);
+        sess->queued = SHAPER_IDLE;
+        if (event_process(sess, sess->pending_size) == 0)
         {
-            break;
+            event_input(sess);
         }
     }
-
-    printf("tftpd: send %s %dbytes %dblocks\n", path_buffer, total_size, total_block);
-    fclose(file);
-    return 0;
-send_failed:
-    printf("tftpd: send failed.\n");
-    fclose(file);
     return -1;
 }
 
-
-
-static void* tftp_worikng_thread(void* arg)
+static void event_accept(void)
 {
-    tftp_req_t* req = (tftp_req_t*)arg;
-    tftp_t* tftp = &req->tftp;
-
-    int sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (sockfd < 0)
+    while (1)
     {
-        printf("tftpd: create working socket failed\n");
-    }
+        socklen_t len = sizeof(struct sockaddr);
+        ssize_t size = recvfrom(tftp.socket, (uint8_t*)&tftp.rx_packet, sizeof(tftp_packet_t), 0, &tftp.remote, &len);
+        if (size < 0)
+        {
+            return;
+        }
 
-    tftp->socket = sockfd;
+        if (tftp_check_packet(&tftp, TFTP_PACKET_REQ, 0, (size_t)size) <= 0)
+        {
+            continue;
+        }
 
-    struct timeval tmo;
-    tmo.tv_sec = tftp->tmo_sec;
-    tmo.tv_usec = 0;
-    setsockopt(tftp->socket, SOL_SOCKET, SO_RCVTIMEO, (const void*)&tmo, sizeof(tmo));
+        tftpd_session_t* sess = session_alloc();
+        if (sess == NULL)
+        {
+            continue;
+        }
 
-    tftp->tmo_retry = TFTP_MAX_RETYR;
-    tftp->tmo_sec = TFTP_TMO_SEC;
-    tftp->tx_size = req->filesize;
-    tftp->block_size = req->block_size;
+        if ((parse_req(&tftp, (size_t)size, &sess->req) < 0) || (session_budget(sess, &tftp) < 0) || (session_open(sess, 1) < 0))
+        {
+            session_free(sess);
+            continue;
+        }
 
-    if (req->opcode == TFTP_PACKET_WRQ)
-    {
-        do_recv_file(req);
-    }
-    else
-    {
-        do_send_file(req);
+        tftp_timer_init(&sess->timer, event_timeout, sess);
+        int result = session_start(sess);
+        if (result != 0)
+        {
+            event_close(sess, result);
+            continue;
+        }
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLET;
+        event.data.ptr = sess;
+        if ((sess->demux < 0) && (epoll_ctl(event_fd, EPOLL_CTL_ADD, sess->req.tftp.socket, &event) < 0))
+        {
+            printf("tftpd: add session to epoll failed\n");
+            event_close(sess, -1);
+            continue;
+        }
+
+        tftp_timer_add(&event_wheel, &sess->timer, event_now + sess->req.tftp.tmo_sec * 1000);
     }
+}
 
-    // close(sockfd); 和下面一样，删掉就行了
-    // free(req);
-init_error:
-    if (sockfd >= 0)
+// 单线程处理所有会话：epoll等待各会话的套接字，超时由时间轮统一管理
+// 低延迟模式：睡下去之前先不带超时地查一会儿，预算用完再按定时器的时间等待
+static int event_wait(int event_fd, struct epoll_event* events, int timeout)
+{
+    if ((server_config.busy_poll_us > 0) && (timeout != 0))
     {
-        close(sockfd);
+        uint64_t start = tftp_time_us();
+        uint64_t now = start;
+        do
+        {
+            int count = epoll_wait(event_fd, events, TFTPD_EVENT_MAX, 0);
+            if (count != 0)
+            {
+                return count;
+            }
+            sched_yield();
+            now = tftp_time_us();
+        } while (now - start < (uint64_t)server_config.busy_poll_us);
+
+        if (timeout > 0)
+        {
+            int spent = (int)((now - start) / 1000);
+            timeout = (timeout > spent) ? timeout - spent : 0;
+        }
     }
-    free(req);
-    return NULL;
+    return epoll_wait(event_fd, events, TFTPD_EVENT_MAX, timeout);
 }
 
-static int wait_req(tftp_t* tftp, tftp_req_t* req)
+// 新进程连上来了：先不再读监听套接字，再交出去，之后已有的会话照常处理完
+static int server_handoff(int sockfd)
 {
-    tftp_packet_t* pkt = &tftp->rx_packet;
-    size_t pkt_size;
-    int error = tftp_wait_packet(tftp, TFTP_PACKET_REQ, 0, &pkt_size);
+    if (tftp_handoff_send(server_handoff_fd, sockfd) < 0)
+    {
+        printf("tftpd: handoff failed, keep serving\n");
+        return -1;
+    }
 
-    req->opcode = ntohs(pkt->opcode);
-    req->option = 0;
-    req->block_size = TFTP_DEFAULT_BLOCK_SIZE;
-    req->filesize = 0;
-    memset(req->filename, 0, sizeof(req->filename));
-    memset(&req->tftp, 0, sizeof(req->tftp));
-    memcpy(&req->tftp.remote, &tftp->remote, sizeof(tftp->remote));
+    close(server_handoff_fd);
+    server_handoff_fd = -1;
+    __atomic_store_n(&server_retired, 1, __ATOMIC_RELEASE);
+    printf("tftpd: listening socket handed off, draining %d sessions\n", __atomic_load_n(&server_active, __ATOMIC_RELAXED));
+    return 0;
+}
 
-    struct sockaddr_in* addr = (struct sockaddr_in*)&tftp->remote;
-    printf("tftpd: recv req %s from %s %d\n",
-        req->opcode == TFTP_PACKET_RRQ ? "get" : "put",
-        inet_ntoa(addr->sin_addr), ntohs(addr->sin_port)
-    );
+static void tftp_event_loop(int sockfd)
+{
+    event_fd = epoll_create1(0);
+    if (event_fd < 0)
+    {
+        printf("tftpd: create epoll failed\n");
+        return;
+    }
 
-    char* buffer = (char*)pkt->req.args;
-    char* end = (char*)pkt + pkt_size;
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(event_fd, EPOLL_CTL_ADD, sockfd, &event);
 
-    strncpy(req->filename, buffer, sizeof(req->filename));
-    buffer += strlen(req->filename) + 1;
+    if (server_config.demux_sockets && (demux_open() < 0))
+    {
+        return;
+    }
 
-    if (strcmp(buffer, "octet") != 0)
+    if (server_handoff_fd >= 0)
     {
-        printf("tftpd: unknow transfer mode %s\n", buffer);
-        tftp_send_error(tftp, TFTP_ERROR_OP);
-        return -1;
+        event.data.ptr = &server_handoff_fd;
+        epoll_ctl(event_fd, EPOLL_CTL_ADD, server_handoff_fd, &event);
     }
-    buffer += strlen("octet") + 1;
 
-    while ((buffer < end) && (*buffer))
+    event_now = tftp_time_ms();
+    tftp_wheel_init(&event_wheel, event_now);
+
+    struct epoll_event events[TFTPD_EVENT_MAX];
+    int shaper_timeout = -1;
+    while (!server_retired || server_active)
     {
-        req->option = 1;
-        if (strcmp(buffer, "blksize") == 0)
+        int timeout = tftp_wheel_timeout(&event_wheel);
+        if ((shaper_timeout >= 0) && ((timeout < 0) || (shaper_timeout < timeout)))
+        {
+            timeout = shaper_timeout;
+        }
+
+        int count = event_wait(event_fd, events, timeout);
+        event_now = tftp_time_ms();
+        for (int i = 0; i < count; i++)
         {
-            buffer += strlen("blksize") + 1;
-            int size = atoi(buffer);
-            if (size < 0)
+            int* demux = (int*)events[i].data.ptr;
+            if (demux == NULL)
+            {
+                event_accept();
+            }
+            else if (demux == &server_handoff_fd)
             {
-                tftp_send_error(tftp, TFTP_ERROR_OP);
-                return -1;
+                // 从epoll中拿掉之后这个进程就不会再读了，失败时加回来
+                epoll_ctl(event_fd, EPOLL_CTL_DEL, sockfd, NULL);
+                epoll_ctl(event_fd, EPOLL_CTL_DEL, server_handoff_fd, NULL);
+                if (server_handoff(sockfd) < 0)
+                {
+                    event.data.ptr = NULL;
+                    epoll_ctl(event_fd, EPOLL_CTL_ADD, sockfd, &event);
+                    event.data.ptr = &server_handoff_fd;
+                    epoll_ctl(event_fd, EPOLL_CTL_ADD, server_handoff_fd, &event);
+                }
             }
-            else if (size > TFTP_BLOCK_SIZE)
+            else if ((demux >= demux_socks) && (demux < demux_socks + server_config.demux_sockets))
             {
-                req->block_size = TFTP_BLOCK_SIZE;
+                demux_input((int)(demux - demux_socks));
             }
             else
             {
-                req->block_size = size;
+                event_input((tftpd_session_t*)events[i].data.ptr);
             }
+        }
 
-            buffer += strlen(buffer) + 1;
+        tftp_wheel_advance(&event_wheel, event_now);
+        shaper_timeout = event_dispatch();
+    }
+
+    close(event_fd);
+    event_fd = -1;
+}
+
+// 线程模式：同时等请求和新进程，新进程来了就交出监听套接字，返回-1
+static int server_wait_listen(int sockfd)
+{
+    while (server_handoff_fd >= 0)
+    {
+        struct pollfd fds[2];
+        fds[0].fd = sockfd;
+        fds[0].events = POLLIN;
+        fds[1].fd = server_handoff_fd;
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, -1) < 0)
+        {
+            continue;
         }
-        else if (strcmp(buffer, "tsize") == 0)
+
+        if ((fds[1].revents & POLLIN) && (server_handoff(sockfd) == 0))
+        {
+            return -1;
+        }
+        else if (fds[0].revents & POLLIN)
         {
-            buffer += strlen(buffer) + 1;
-            req->filesize = atoi(buffer);
+            return 0;
+        }
+    }
+    return 0;
+}
 
-            buffer += strlen(buffer) + 1;
+// 配置了handoff_path时先从旧进程取监听套接字，没有旧进程再自己绑定，然后等下一个新进程
+static int server_listen(void)
+{
+    const char* handoff_path = server_config.handoff_path;
+    int sockfd = handoff_path ? tftp_handoff_recv(handoff_path, server_port) : -1;
+    if (sockfd >= 0)
+    {
+        printf("tftpd: took over listening socket from %s\n", handoff_path);
+    }
+    else
+    {
+        sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (sockfd < 0)
+        {
+            printf("tftpd: create server socket failed!\n");
+            return -1;
         }
-        else
+        struct sockaddr_in sockaddr;
+        memset(&sockaddr, 0, sizeof(sockaddr));
+        sockaddr.sin_family = AF_INET;
+        sockaddr.sin_addr.s_addr = INADDR_ANY;
+        sockaddr.sin_port = htons(server_port);
+        if (bind(sockfd, (const struct sockaddr*)&sockaddr, sizeof(sockaddr)) < 0)
         {
-            buffer += strlen(buffer) + 1;
+            printf("tftpd: bind error, port: %d\n", server_port);
+            close(sockfd);
+            return -1;
         }
     }
 
-    return 0;
+    if (handoff_path)
+    {
+        server_handoff_fd = tftp_handoff_listen(handoff_path);
+    }
+
+    // 交接过来的套接字上还挂着旧进程的过滤器，按自己的配置换掉或者拿掉
+    if (!server_config.request_filter)
+    {
+        tftp_filter_detach(sockfd);
+    }
+    else if (tftp_filter_attach(&server_filter, sockfd, server_config.request_rate) < 0)
+    {
+        printf("tftpd: attach request filter failed\n");
+    }
+    else if ((server_filter.type == TFTP_FILTER_CLASSIC) && server_config.request_rate)
+    {
+        printf("tftpd: ebpf not available, request rate limit disabled\n");
+    }
+
+    // 非阻塞标志在两个进程之间是共享的，旧进程用的事件循环时要清掉
+    if (!server_config.event_loop)
+    {
+        fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) & ~O_NONBLOCK);
+    }
+    return sockfd;
 }
 
 static void* tftp_server_thread(void*)
 {
     printf("tftp server is running...\n");
 
-    int sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    int sockfd = server_listen();
     if (sockfd < 0)
     {
-        printf("tftpd: create server socket failed!\n");
         return NULL;
     }
-    struct sockaddr_in sockaddr;
-    memset(&sockaddr, 0, sizeof(sockaddr));
-    sockaddr.sin_family = AF_INET;
-    sockaddr.sin_addr.s_addr = INADDR_ANY;
-    sockaddr.sin_port = htons(server_port);
-    if (bind(sockfd, (const struct sockaddr*)&sockaddr, sizeof(sockaddr)) < 0)
+    tftp.socket = sockfd;
+
+    if (server_config.event_loop)
     {
-        printf("tftpd: bind error, port: %d\n", server_port);
+        tftp_event_loop(sockfd);
         close(sockfd);
         return NULL;
     }
 
-    tftp.socket = sockfd;
-
-
-    while (1)
+    while (server_wait_listen(sockfd) == 0)
     {
-        tftp_req_t* req = (tftp_req_t*)malloc(sizeof(tftp_req_t));
-        if (req == NULL)
+        tftpd_session_t* sess = session_alloc();
+        if (sess == NULL)
         {
             continue;
         }
 
         // 一个单独的线程去读取客户端发来的请求，进行请求的分发，分发到不同的线程去处理
-        int error = wait_req(&tftp, req);
-        if (error < 0)
+        int error = wait_req(&tftp, &sess->req);
+        if ((error < 0) || (session_budget(sess, &tftp) < 0))
         {
-            free(req);
+            session_free(sess);
             continue;
         }
 
         pthread_t thread;
-        error = pthread_create(&thread, NULL, tftp_worikng_thread, (void*)req);
+        error = pthread_create(&thread, NULL, tftp_worikng_thread, (void*)sess);
         if (error != 0)
         {
             printf("tftpd: create working thread failed.\n");
-            free(req);
+            session_free(sess);
             continue;
         }
+        pthread_detach(thread);
     }
     close(sockfd);
     return NULL;
 }
 
-int tftpd_start(const char* dir, uint16_t port)
+void tftpd_get_stats(tftpd_stats_t* stats)
+{
+    stats->sessions = __atomic_load_n(&server_stats.sessions, __ATOMIC_RELAXED);
+    stats->failures = __atomic_load_n(&server_stats.failures, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&server_stats.bytes, __ATOMIC_RELAXED);
+    stats->blocks = __atomic_load_n(&server_stats.blocks, __ATOMIC_RELAXED);
+    stats->retransmits = __atomic_load_n(&server_stats.retransmits, __ATOMIC_RELAXED);
+    stats->timeouts = __atomic_load_n(&server_stats.timeouts, __ATOMIC_RELAXED);
+    stats->cache_dropped = __atomic_load_n(&server_stats.cache_dropped, __ATOMIC_RELAXED);
+    stats->not_modified = __atomic_load_n(&server_stats.not_modified, __ATOMIC_RELAXED);
+    stats->active = __atomic_load_n(&server_active, __ATOMIC_RELAXED);
+    stats->downgraded = __atomic_load_n(&server_stats.downgraded, __ATOMIC_RELAXED);
+    stats->rejected = __atomic_load_n(&server_stats.rejected, __ATOMIC_RELAXED);
+    stats->memory = __atomic_load_n(&server_memory, __ATOMIC_RELAXED);
+    stats->memory_peak = __atomic_load_n(&server_memory_peak, __ATOMIC_RELAXED);
+    tftp_filter_counts(&server_filter, &stats->filtered, &stats->rate_limited);
+    tftp_dedup_stats(&stats->dedup);
+    tftp_arena_stats(&stats->arena);
+}
+
+void tftpd_config_init(tftpd_config_t* config)
+{
+    memset(config, 0, sizeof(tftpd_config_t));
+    config->dir = NULL;
+    config->port = TFTP_DEFAULT_PORT;
+    config->event_loop = 0;
+    config->drop_cache_size = TFTPD_DROP_CACHE_SIZE;
+}
+
+int tftpd_start_config(const tftpd_config_t* config)
 {
-    server_path = dir;
-    server_port = port ? port : TFTP_DEFAULT_PORT;
+    server_config = *config;
+    server_path = config->dir;
+    server_port = config->port ? config->port : TFTP_DEFAULT_PORT;
+    if (server_config.demux_sockets > TFTPD_DEMUX_MAX)
+    {
+        server_config.demux_sockets = TFTPD_DEMUX_MAX;
+    }
+    if (server_config.demux_sockets > 0)
+    {
+        server_config.event_loop = 1;
+    }
+    if (server_config.busy_poll_us > TFTP_BUSY_POLL_MAX)
+    {
+        server_config.busy_poll_us = TFTP_BUSY_POLL_MAX;
+    }
+    if (server_config.arena)
+    {
+        tftp_arena_enable(1);
+    }
+    if (server_config.dedup_dir && (tftp_dedup_init(server_config.dedup_dir) < 0))
+    {
+        return -1;
+    }
+
+    // dir指向一个普通文件时当作tftp_pack打出的包，启动时整个映射进来
+    struct stat dir_stat;
+    if (server_path && (stat(server_path, &dir_stat) == 0) && S_ISREG(dir_stat.st_mode))
+    {
+        server_pack = tftp_pack_open(server_path);
+        if (server_pack == NULL)
+        {
+            return -1;
+        }
+        printf("tftpd: serving %u files from pack %s\n", tftp_pack_count(server_pack), server_path);
+    }
+    if (shaper_init() < 0)
+    {
+        return -1;
+    }
 
     pthread_t server_thread;
     int error = pthread_create(&server_thread, NULL, tftp_server_thread, (void*)NULL);
@@ -366,3 +1811,26 @@ int tftpd_start(const char* dir, uint16_t port)
 
     return 0;
 }
+
+int tftpd_wait_drained(int timeout_ms)
+{
+    uint64_t deadline = tftp_time_ms() + (uint64_t)(timeout_ms > 0 ? timeout_ms : 0);
+    while (!__atomic_load_n(&server_retired, __ATOMIC_ACQUIRE) || __atomic_load_n(&server_active, __ATOMIC_ACQUIRE))
+    {
+        if ((timeout_ms >= 0) && (tftp_time_ms() >= deadline))
+        {
+            return -1;
+        }
+        usleep(TFTPD_DRAIN_POLL_MS * 1000);
+    }
+    return 0;
+}
+
+int tftpd_start(const char* dir, uint16_t port)
+{
+    tftpd_config_t config;
+    tftpd_config_init(&config);
+    config.dir = dir;
+    config.port = port;
+    return tftpd_start_config(&config);
+}
@@ -2,8 +2,75 @@
 #define TFTP_SERVER_H
 
 #include "tftp_base.h"
+#include "tftp_arena.h"
+#include "tftp_dedup.h"
 
+#define TFTPD_EVENT_MAX 64 // 事件循环每次最多处理的事件数
+#define TFTPD_MAX_CLASSES 16
+#define TFTPD_CLIENT_HASH 256
+#define TFTPD_DEMUX_MAX 16 // 共享套接字数的上限
+#define TFTPD_DEMUX_RCVBUF (4 * 1024 * 1024) // 所有会话共用，缓冲区要大一些
+#define TFTPD_DROP_CACHE_SIZE (64 * 1024 * 1024) // drop_cache_size的默认值
+#define TFTPD_DROP_CACHE_STEP (4 * 1024 * 1024) // 读过这么多再丢一次，减少系统调用
+#define TFTPD_DROP_CACHE_ALIGN (2 * 1024 * 1024) // 页缓存里最大的页
+#define TFTPD_DRAIN_POLL_MS 10
+
+// 优先级分类：文件名和源地址都匹配时使用这个权重，按加权公平队列分配带宽
+typedef struct _tftpd_class_t
+{
+    const char* pattern; // 文件名通配符，NULL表示任意
+    const char* subnet; // 源地址网段，如"10.0.0.0/8"，NULL表示任意
+    int weight;
+}tftpd_class_t;
+
+typedef struct _tftpd_config_t
+{
+    const char* dir; // 目录，或者tftp_pack打出的包(只读，启动时映射)
+    uint16_t port;
+    int event_loop; // 1: 单线程事件循环，重传超时由时间轮管理; 0: 每个请求一个线程
+    int64_t rate_limit; // 全局限速，字节/秒，0表示不限
+    int64_t client_rate_limit; // 每个客户端地址的限速
+    const tftpd_class_t* classes; // 按顺序匹配第一个，都不匹配时权重为1；服务器运行期间要一直有效
+    int class_count;
+    int demux_sockets; // >0: 会话不再各开一个套接字，共用这么多个，在用户态按对端分发；需要事件循环
+    int64_t drop_cache_size; // 不小于这个大小的文件边发送边从页缓存丢掉已经读过的部分，0表示不丢
+    int busy_poll_us; // >0: 低延迟模式，等待ACK/事件时先忙等这么多微秒再睡眠，会多占CPU
+    int arena; // 1: 会话和发送窗口从按NUMA节点分的大页arena分配，同一进程里的客户端也一起用
+    const char* handoff_path; // Unix套接字路径：启动时从在这里等着的旧进程接过监听套接字，自己再在这里等下一个新进程
+    int64_t memory_budget; // 所有会话估算内存的上限，字节：超出时先缩小aimdwindow再缩小blksize，还不够回DISK_FULL；0表示不限
+    int request_filter; // 1: 监听套接字上挂内核过滤器，不是RRQ/WRQ的包不进接收队列
+    int request_rate; // 每个源地址每秒最多的请求数，超出的在内核里丢掉；需要request_filter并且能加载eBPF，0表示不限
+    const char* dedup_dir; // 去重仓库目录：上传的数据切块存在这里，文件本身只写清单，下载时透明地拼回来；不支持续传，NULL表示不去重
+}tftpd_config_t;
+
+// 服务器启动以来所有结束的会话的合计
+typedef struct _tftpd_stats_t
+{
+    uint64_t sessions;
+    uint64_t failures;
+    uint64_t bytes; // 成功的会话传输的字节数
+    uint64_t blocks;
+    uint64_t retransmits;
+    uint64_t timeouts;
+    uint64_t cache_dropped; // 大文件发送后从页缓存丢掉的字节
+    uint64_t not_modified; // 客户端缓存还有效，只回了OACK的下载
+    uint64_t downgraded; // 为了内存预算缩小了aimdwindow或blksize的请求
+    uint64_t rejected; // 内存预算不够拒绝的请求
+    uint64_t filtered; // 格式不对在内核里丢掉的包，只有eBPF过滤器计数
+    uint64_t rate_limited; // 超过request_rate在内核里丢掉的请求
+    int64_t memory; // 当前值：会话的估算内存，按预算记账
+    int64_t memory_peak;
+    int active; // 当前值：进行中的会话
+    tftp_arena_stats_t arena; // 当前值，不是合计
+    tftp_dedup_stats_t dedup;
+}tftpd_stats_t;
+
+void tftpd_config_init(tftpd_config_t* config);
+int tftpd_start_config(const tftpd_config_t* config);
 int tftpd_start(const char* dir, uint16_t port);
+void tftpd_get_stats(tftpd_stats_t* stats);
+// 平滑重启的旧进程：等监听套接字交给新进程、进行中的会话都结束后返回0，可以退出了；超时返回-1，小于0一直等
+int tftpd_wait_drained(int timeout_ms);
 
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,192 @@
+#include "tftp_sha256.h"
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA256_X86 1
+#endif
+
+#define SHA256_BLOCK 64
+
+typedef void (*sha256_compress_t)(uint32_t state[8], const uint8_t* data, size_t blocks);
+
+static const uint32_t sha256_k[64] =
+{
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2,
+};
+
+static const uint32_t sha256_init_state[8] =
+{
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+static int sha256_hw;
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+
+static void sha256_init(void)
+{
+#ifdef SHA256_X86
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA))
+    {
+        sha256_hw = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_1) && (ecx & bit_SSSE3);
+    }
+#endif
+}
+
+#define SHA256_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_sw_compress(uint32_t state[8], const uint8_t* data, size_t blocks)
+{
+    while (blocks--)
+    {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+        {
+            w[i] = ((uint32_t)data[4 * i] << 24) | ((uint32_t)data[4 * i + 1] << 16) | ((uint32_t)data[4 * i + 2] << 8) | data[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++)
+        {
+            uint32_t s0 = SHA256_ROR(w[i - 15], 7) ^ SHA256_ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = SHA256_ROR(w[i - 2], 17) ^ SHA256_ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++)
+        {
+            uint32_t t1 = h + (SHA256_ROR(e, 6) ^ SHA256_ROR(e, 11) ^ SHA256_ROR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            uint32_t t2 = (SHA256_ROR(a, 2) ^ SHA256_ROR(a, 13) ^ SHA256_ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+        data += SHA256_BLOCK;
+    }
+}
+
+#ifdef SHA256_X86
+// 状态按指令的要求排成ABEF/CDGH两个寄存器，每组4轮；消息扩展和轮计算交错，
+// 第g组用的消息在g-1组里用msg2补完，msg1提前三组开始
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_hw_compress(uint32_t state[8], const uint8_t* data, size_t blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0C0D0E0F08090A0BULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0xB1); // CDAB
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(state + 4)), 0x1B); // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0); // CDGH
+
+    while (blocks--)
+    {
+        __m128i abef = state0;
+        __m128i cdgh = state1;
+        __m128i msg[4];
+        for (int g = 0; g < 16; g++)
+        {
+            if (g < 4)
+            {
+                msg[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16 * g)), mask);
+            }
+
+            __m128i wk = _mm_add_epi32(msg[g & 3], _mm_loadu_si128((const __m128i*)(sha256_k + 4 * g)));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+            if ((g >= 3) && (g < 15))
+            {
+                __m128i* next = msg + ((g + 1) & 3);
+                *next = _mm_add_epi32(*next, _mm_alignr_epi8(msg[g & 3], msg[(g + 3) & 3], 4));
+                *next = _mm_sha256msg2_epu32(*next, msg[g & 3]);
+            }
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(wk, 0x0E));
+            if ((g >= 1) && (g < 13))
+            {
+                msg[(g + 3) & 3] = _mm_sha256msg1_epu32(msg[(g + 3) & 3], msg[g & 3]);
+            }
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+        data += SHA256_BLOCK;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B); // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1); // DCHG
+    _mm_storeu_si128((__m128i*)state, _mm_blend_epi16(tmp, state1, 0xF0)); // DCBA
+    _mm_storeu_si128((__m128i*)(state + 4), _mm_alignr_epi8(state1, tmp, 8)); // HGFE
+}
+#endif
+
+static void sha256_digest(sha256_compress_t compress, const uint8_t* data, size_t size, uint8_t digest[TFTP_SHA256_SIZE])
+{
+    uint32_t state[8];
+    memcpy(state, sha256_init_state, sizeof(state));
+    compress(state, data, size / SHA256_BLOCK);
+
+    // 剩下的不满一块的数据、0x80和按大端写的位长，放得下就一块，放不下两块
+    uint8_t tail[2 * SHA256_BLOCK];
+    size_t rest = size % SHA256_BLOCK;
+    size_t tail_size = (rest + 9 > SHA256_BLOCK) ? 2 * SHA256_BLOCK : SHA256_BLOCK;
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, data + size - rest, rest);
+    tail[rest] = 0x80;
+    uint64_t bits = (uint64_t)size * 8;
+    for (int i = 0; i < 8; i++)
+    {
+        tail[tail_size - 1 - i] = (uint8_t)(bits >> (8 * i));
+    }
+    compress(state, tail, tail_size / SHA256_BLOCK);
+
+    for (int i = 0; i < 8; i++)
+    {
+        digest[4 * i] = (uint8_t)(state[i] >> 24);
+        digest[4 * i + 1] = (uint8_t)(state[i] >> 16);
+        digest[4 * i + 2] = (uint8_t)(state[i] >> 8);
+        digest[4 * i + 3] = (uint8_t)state[i];
+    }
+}
+
+void tftp_sha256_sw(const void* data, size_t size, uint8_t digest[TFTP_SHA256_SIZE])
+{
+    sha256_digest(sha256_sw_compress, (const uint8_t*)data, size, digest);
+}
+
+void tftp_sha256(const void* data, size_t size, uint8_t digest[TFTP_SHA256_SIZE])
+{
+    pthread_once(&sha256_once, sha256_init);
+#ifdef SHA256_X86
+    if (sha256_hw)
+    {
+        sha256_digest(sha256_hw_compress, (const uint8_t*)data, size, digest);
+        return;
+    }
+#endif
+    sha256_digest(sha256_sw_compress, (const uint8_t*)data, size, digest);
+}
+
+int tftp_sha256_hw_enabled(void)
+{
+    pthread_once(&sha256_once, sha256_init);
+    return sha256_hw;
+}
@@ -0,0 +1,14 @@
+#ifndef TFTP_SHA256_H
+#define TFTP_SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TFTP_SHA256_SIZE 32
+
+// 一次算完整段数据的SHA-256，CPU有SHA扩展时用硬件指令
+void tftp_sha256(const void* data, size_t size, uint8_t digest[TFTP_SHA256_SIZE]);
+void tftp_sha256_sw(const void* data, size_t size, uint8_t digest[TFTP_SHA256_SIZE]);
+int tftp_sha256_hw_enabled(void);
+
+#endif // !TFTP_SHA256_H
@@ -0,0 +1,176 @@
+#include "tftp_shaper.h"
+#include "tftp_base.h"
+#include <stdlib.h>
+
+void tftp_bucket_init(tftp_bucket_t* bucket, int64_t rate, uint64_t now_us)
+{
+    bucket->rate = rate;
+    bucket->burst = (double)rate / TFTP_BUCKET_BURST_DIV;
+    if (bucket->burst < TFTP_BLOCK_SIZE)
+    {
+        bucket->burst = TFTP_BLOCK_SIZE;
+    }
+    bucket->tokens = bucket->burst;
+    bucket->last_us = now_us;
+}
+
+// 补充令牌，够bytes时返回0，否则返回还要等待的微秒数
+int64_t tftp_bucket_wait(tftp_bucket_t* bucket, int bytes, uint64_t now_us)
+{
+    if (bucket->rate <= 0)
+    {
+        return 0;
+    }
+
+    if (now_us > bucket->last_us)
+    {
+        bucket->tokens += (double)(now_us - bucket->last_us) * bucket->rate / 1e6;
+        if (bucket->tokens > bucket->burst)
+        {
+            bucket->tokens = bucket->burst;
+        }
+        bucket->last_us = now_us;
+    }
+
+    if (bucket->tokens >= bytes)
+    {
+        return 0;
+    }
+    return (int64_t)((bytes - bucket->tokens) * 1e6 / bucket->rate) + 1;
+}
+
+void tftp_bucket_take(tftp_bucket_t* bucket, int bytes)
+{
+    if (bucket->rate > 0)
+    {
+        bucket->tokens -= bytes;
+    }
+}
+
+void tftp_wfq_init(tftp_wfq_t* wfq)
+{
+    wfq->heap = NULL;
+    wfq->count = 0;
+    wfq->capacity = 0;
+    wfq->vtime = 0;
+}
+
+void tftp_wfq_item_init(tftp_wfq_item_t* item)
+{
+    item->finish = 0;
+    item->last_finish = 0;
+    item->index = -1;
+}
+
+static void wfq_set(tftp_wfq_t* wfq, int index, tftp_wfq_item_t* item)
+{
+    wfq->heap[index] = item;
+    item->index = index;
+}
+
+static void wfq_up(tftp_wfq_t* wfq, int index)
+{
+    tftp_wfq_item_t* item = wfq->heap[index];
+    while (index > 0)
+    {
+        int parent = (index - 1) / 2;
+        if (wfq->heap[parent]->finish <= item->finish)
+        {
+            break;
+        }
+        wfq_set(wfq, index, wfq->heap[parent]);
+        index = parent;
+    }
+    wfq_set(wfq, index, item);
+}
+
+static void wfq_down(tftp_wfq_t* wfq, int index)
+{
+    tftp_wfq_item_t* item = wfq->heap[index];
+    while (1)
+    {
+        int child = index * 2 + 1;
+        if (child >= wfq->count)
+        {
+            break;
+        }
+        if ((child + 1 < wfq->count) && (wfq->heap[child + 1]->finish < wfq->heap[child]->finish))
+        {
+            child++;
+        }
+        if (item->finish <= wfq->heap[child]->finish)
+        {
+            break;
+        }
+        wfq_set(wfq, index, wfq->heap[child]);
+        index = child;
+    }
+    wfq_set(wfq, index, item);
+}
+
+// 按原来的完成时间重新排队，用于因为其他限速暂时移出队列的项
+int tftp_wfq_requeue(tftp_wfq_t* wfq, tftp_wfq_item_t* item)
+{
+    if (wfq->count == wfq->capacity)
+    {
+        int capacity = wfq->capacity ? wfq->capacity * 2 : 64;
+        tftp_wfq_item_t** heap = (tftp_wfq_item_t**)realloc(wfq->heap, capacity * sizeof(tftp_wfq_item_t*));
+        if (heap == NULL)
+        {
+            return -1;
+        }
+        wfq->heap = heap;
+        wfq->capacity = capacity;
+    }
+
+    wfq_set(wfq, wfq->count++, item);
+    wfq_up(wfq, item->index);
+    return 0;
+}
+
+// 完成时间 = max(当前虚拟时间, 上一项的完成时间) + cost / weight
+int tftp_wfq_push(tftp_wfq_t* wfq, tftp_wfq_item_t* item, int cost, int weight)
+{
+    double start = (item->last_finish > wfq->vtime) ? item->last_finish : wfq->vtime;
+    item->finish = start + (double)cost / (weight > 0 ? weight : 1);
+    item->last_finish = item->finish;
+    return tftp_wfq_requeue(wfq, item);
+}
+
+tftp_wfq_item_t* tftp_wfq_peek(tftp_wfq_t* wfq)
+{
+    return wfq->count ? wfq->heap[0] : NULL;
+}
+
+tftp_wfq_item_t* tftp_wfq_pop(tftp_wfq_t* wfq)
+{
+    if (wfq->count == 0)
+    {
+        return NULL;
+    }
+
+    tftp_wfq_item_t* item = wfq->heap[0];
+    wfq->vtime = item->finish;
+    tftp_wfq_remove(wfq, item);
+    return item;
+}
+
+void tftp_wfq_remove(tftp_wfq_t* wfq, tftp_wfq_item_t* item)
+{
+    int index = item->index;
+    if (index < 0)
+    {
+        return;
+    }
+
+    item->index = -1;
+    tftp_wfq_item_t* last = wfq->heap[--wfq->count];
+    if (last == item)
+    {
+        return;
+    }
+
+    wfq_set(wfq, index, last);
+    wfq_up(wfq, index);
+    wfq_down(wfq, last->index);
+}
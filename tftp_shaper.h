@@ -0,0 +1,45 @@
+#ifndef TFTP_SHAPER_H
+#define TFTP_SHAPER_H
+
+#include <stdint.h>
+
+#define TFTP_BUCKET_BURST_DIV 20 // 桶容量为1/20秒的流量，至少一个最大的块
+
+// 令牌桶，rate为0表示不限速
+typedef struct _tftp_bucket_t
+{
+    int64_t rate; // 字节/秒
+    double burst;
+    double tokens;
+    uint64_t last_us;
+}tftp_bucket_t;
+
+void tftp_bucket_init(tftp_bucket_t* bucket, int64_t rate, uint64_t now_us);
+int64_t tftp_bucket_wait(tftp_bucket_t* bucket, int bytes, uint64_t now_us);
+void tftp_bucket_take(tftp_bucket_t* bucket, int bytes);
+
+// 加权公平队列(自同步的WFQ)，每个会话最多一个排队项
+typedef struct _tftp_wfq_item_t
+{
+    double finish; // 虚拟完成时间
+    double last_finish; // 同一个会话上一项的完成时间
+    int index; // 在堆中的位置，-1表示不在队列中
+}tftp_wfq_item_t;
+
+typedef struct _tftp_wfq_t
+{
+    tftp_wfq_item_t** heap;
+    int count;
+    int capacity;
+    double vtime; // 正在服务的项的完成时间
+}tftp_wfq_t;
+
+void tftp_wfq_init(tftp_wfq_t* wfq);
+void tftp_wfq_item_init(tftp_wfq_item_t* item);
+int tftp_wfq_push(tftp_wfq_t* wfq, tftp_wfq_item_t* item, int cost, int weight);
+int tftp_wfq_requeue(tftp_wfq_t* wfq, tftp_wfq_item_t* item);
+tftp_wfq_item_t* tftp_wfq_peek(tftp_wfq_t* wfq);
+tftp_wfq_item_t* tftp_wfq_pop(tftp_wfq_t* wfq);
+void tftp_wfq_remove(tftp_wfq_t* wfq, tftp_wfq_item_t* item);
+
+#endif // !TFTP_SHAPER_H
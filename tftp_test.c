@@ -0,0 +1,451 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "tftp_client.h"
+#include "tftp_server.h"
+#include "tftp_netascii.h"
+
+// tftp_test: 回环上的端到端测试，服务器在同一个进程里，由ctest运行
+// usage: tftp_test <thread|event|demux>
+// 每个用例上传下载一遍，检查内容逐字节一致、吞吐不低于下限、重传不超过上限
+
+#define TEST_PORT 10269 // 加上模式的序号，ctest可以并行跑
+#define TEST_WINDOW 16
+#define TEST_MIN_SIZE (1024 * 1024) // 小于这个大小的用例只检查内容，时间主要花在建立会话上
+#define TEST_MIN_MBPS_LOCKSTEP 2.0
+#define TEST_MIN_MBPS_WINDOW 10.0
+#define TEST_MAX_RETRANSMITS 4 // 回环上不应该丢包，留一点余量给调度抖动
+#define TEST_FINISH_MS 2000 // 客户端返回后等服务器的会话结束
+#define TEST_NETASCII_ROUNDS 20000
+#define TEST_NETASCII_SIZE 256
+
+typedef struct _test_case_t
+{
+    int64_t size;
+    int block_size;
+    int option;
+}test_case_t;
+
+static const test_case_t test_cases[] =
+{
+    { 0, 512, TFTP_OPT_BASE },
+    { 1, 512, TFTP_OPT_BASE },
+    { 511, 512, TFTP_OPT_BASE },
+    { 512, 512, TFTP_OPT_BASE },
+    { 513, 512, TFTP_OPT_BASE },
+    { 1024, 512, 0 }, // 没有选项，不协商
+    { 65536, 1428, TFTP_OPT_BASE },
+    { 65536, 1428, TFTP_OPT_BASE | TFTP_OPT_WINDOW },
+    { 1428 * 16, 1428, TFTP_OPT_BASE | TFTP_OPT_WINDOW }, // 正好一个窗口
+    { 1000003, 512, TFTP_OPT_BASE },
+    { 1000003, 1428, TFTP_OPT_BASE | TFTP_OPT_WINDOW },
+    { 4 * 1024 * 1024 + 7, 1428, TFTP_OPT_BASE },
+    { 4 * 1024 * 1024 + 7, 8192, TFTP_OPT_BASE },
+    { 8 * 1024 * 1024, 1428, TFTP_OPT_BASE | TFTP_OPT_WINDOW },
+    { 8 * 1024 * 1024 + 1, 8192, TFTP_OPT_BASE | TFTP_OPT_WINDOW },
+    { 2 * 1024 * 1024, 1428, TFTP_OPT_BASE | TFTP_OPT_WINDOW | TFTP_OPT_CHECKSUM },
+};
+
+static char test_dir[] = "/tmp/tftp_test_XXXXXX";
+static int test_stdout = -1;
+
+static double test_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 客户端和服务器每个包都会打印，测试期间关掉，只输出结果
+static void test_quiet(int quiet)
+{
+    fflush(stdout);
+    if (quiet)
+    {
+        test_stdout = dup(STDOUT_FILENO);
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+    }
+    else if (test_stdout >= 0)
+    {
+        dup2(test_stdout, STDOUT_FILENO);
+        close(test_stdout);
+        test_stdout = -1;
+    }
+}
+
+static int test_write(const char* path, int64_t size, uint32_t seed)
+{
+    FILE* file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    uint32_t state = seed | 1;
+    for (int64_t i = 0; i < size; i++)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        fputc((int)(state & 0xFF), file);
+    }
+    return fclose(file);
+}
+
+static int test_compare(const char* a, const char* b)
+{
+    FILE* file_a = fopen(a, "rb");
+    FILE* file_b = fopen(b, "rb");
+    int same = (file_a != NULL) && (file_b != NULL);
+    while (same)
+    {
+        int c = fgetc(file_a);
+        same = (c == fgetc(file_b));
+        if (c == EOF)
+        {
+            break;
+        }
+    }
+
+    if (file_a)
+    {
+        fclose(file_a);
+    }
+    if (file_b)
+    {
+        fclose(file_b);
+    }
+    return same;
+}
+
+// 服务器在收到最后一个ACK后才结束会话，可能比客户端晚一点
+static void test_wait_server(uint64_t sessions, tftpd_stats_t* stats)
+{
+    double deadline = test_now() + TEST_FINISH_MS / 1000.0;
+    do
+    {
+        tftpd_get_stats(stats);
+        if (stats->sessions > sessions)
+        {
+            return;
+        }
+        usleep(1000);
+    } while (test_now() < deadline);
+}
+
+static int test_run(const test_case_t* test, int is_get, uint16_t port, int index)
+{
+    char name[64];
+    char server_path[128];
+    char client_path[128];
+    snprintf(name, sizeof(name), "%s_%d.bin", is_get ? "get" : "put", index);
+    snprintf(server_path, sizeof(server_path), "%s/srv/%s", test_dir, name);
+    snprintf(client_path, sizeof(client_path), "%s/cli/%s", test_dir, name);
+
+    const char* source = is_get ? server_path : client_path;
+    if (test_write(source, test->size, (uint32_t)index * 2654435761u) < 0)
+    {
+        printf("FAIL create %s\n", source);
+        return -1;
+    }
+    unlink(is_get ? client_path : server_path);
+
+    tftpd_stats_t before;
+    tftpd_stats_t after;
+    tftpd_get_stats(&before);
+
+    test_quiet(1);
+    double start = test_now();
+    int result = is_get ? tftp_get("127.0.0.1", port, test->block_size, name, test->option)
+        : tftp_put("127.0.0.1", port, test->block_size, name, test->option);
+    double elapsed = test_now() - start;
+    test_wait_server(before.sessions, &after);
+    test_quiet(0);
+
+    tftp_stats_t client;
+    tftp_last_stats(&client);
+    uint64_t retransmits = client.retransmits + (after.retransmits - before.retransmits);
+    double mbps = test->size / elapsed / 1e6;
+    double min_mbps = (test->option & TFTP_OPT_WINDOW) ? TEST_MIN_MBPS_WINDOW : TEST_MIN_MBPS_LOCKSTEP;
+
+    const char* failure = NULL;
+    if (result < 0)
+    {
+        failure = "transfer failed";
+    }
+    else if (after.failures != before.failures)
+    {
+        failure = "server session failed";
+    }
+    else if (!test_compare(server_path, client_path))
+    {
+        failure = "content differs";
+    }
+    else if (retransmits > TEST_MAX_RETRANSMITS)
+    {
+        failure = "too many retransmits";
+    }
+    else if ((test->size >= TEST_MIN_SIZE) && (mbps < min_mbps))
+    {
+        failure = "too slow";
+    }
+
+    printf("%-4s %s %9lld bytes blksize %4d%s%s: %7.1f MB/s, %llu retransmits%s%s\n", failure ? "FAIL" : "ok",
+        is_get ? "get" : "put", (long long)test->size, test->block_size,
+        (test->option & TFTP_OPT_WINDOW) ? " window" : "", (test->option & TFTP_OPT_CHECKSUM) ? " crc32c" : "",
+        mbps, (unsigned long long)retransmits, failure ? " -- " : "", failure ? failure : "");
+
+    unlink(server_path);
+    unlink(client_path);
+    return failure ? -1 : 0;
+}
+
+// 条件下载：第一次下载存进缓存，文件没变时只回OACK，改过之后重新下载；
+// 摘要和压缩会多发OACK，都要跑一遍，缓存不能因为它们丢掉
+static int test_cached(uint16_t port, int option)
+{
+    static const char* name = "cached.bin";
+    static const int64_t sizes[] = { 100000, 100000, 100001 };
+    static const int expect_hit[] = { 0, 1, 0 };
+    char server_path[128];
+    char client_path[128];
+    char cache_dir[128];
+    snprintf(server_path, sizeof(server_path), "%s/srv/%s", test_dir, name);
+    snprintf(client_path, sizeof(client_path), "%s/cli/%s", test_dir, name);
+    snprintf(cache_dir, sizeof(cache_dir), "%s/cache", test_dir);
+    mkdir(cache_dir, 0755);
+    tftp_set_cache_dir(cache_dir);
+
+    // 修改时间往前拨，这一秒内改过的文件服务器不会回答没变
+    const char* failure = NULL;
+    for (int i = 0; (failure == NULL) && (i < 3); i++)
+    {
+        if (expect_hit[i] == 0)
+        {
+            struct timespec times[2] = { { time(NULL) - 100 + i, 0 }, { time(NULL) - 100 + i, 0 } };
+            test_write(server_path, sizes[i], (uint32_t)i + 7);
+            utimensat(AT_FDCWD, server_path, times, 0);
+        }
+        unlink(client_path);
+
+        tftpd_stats_t before;
+        tftpd_stats_t after;
+        tftpd_get_stats(&before);
+        test_quiet(1);
+        int result = tftp_get("127.0.0.1", port, 1428, name, option | TFTP_OPT_CACHED);
+        test_wait_server(before.sessions, &after);
+        test_quiet(0);
+
+        if (result < 0)
+        {
+            failure = "transfer failed";
+        }
+        else if (!test_compare(server_path, client_path))
+        {
+            failure = "content differs";
+        }
+        else if ((int)(after.not_modified - before.not_modified) != expect_hit[i])
+        {
+            failure = expect_hit[i] ? "downloaded unchanged file" : "changed file not downloaded";
+        }
+    }
+
+    printf("%-4s get cached, unchanged, changed%s%s%s%s%s\n", failure ? "FAIL" : "ok",
+        (option & TFTP_OPT_WINDOW) ? " window" : "", (option & TFTP_OPT_CHECKSUM) ? " crc32c" : "",
+        (option & TFTP_OPT_COMPRESS) ? " zlib" : "", failure ? " -- " : "", failure ? failure : "");
+    tftp_set_cache_dir(NULL);
+    char cache_path[256];
+    snprintf(cache_path, sizeof(cache_path), "%s/127.0.0.1_%u_%s", cache_dir, port, name);
+    unlink(cache_path);
+    rmdir(cache_dir);
+    unlink(server_path);
+    unlink(client_path);
+    return failure ? -1 : 0;
+}
+
+// 续传：目标上留着传了一半的同一个文件时接着传；留着同样大小、只有开头改过的旧文件时不能当成已经传过的部分
+static int test_resume(uint16_t port)
+{
+    static const char* name = "resume.bin";
+    static const int64_t size = 200000;
+    char server_path[128];
+    char client_path[128];
+    snprintf(server_path, sizeof(server_path), "%s/srv/%s", test_dir, name);
+    snprintf(client_path, sizeof(client_path), "%s/cli/%s", test_dir, name);
+
+    const char* failure = NULL;
+    for (int i = 0; (failure == NULL) && (i < 4); i++)
+    {
+        int is_get = !(i & 2);
+        int changed = (i & 1);
+        const char* source = is_get ? server_path : client_path;
+        const char* target = is_get ? client_path : server_path;
+        test_write(source, size, 11);
+        test_write(target, size, 11);
+        if (changed)
+        {
+            FILE* file = fopen(target, "r+b");
+            for (int k = 0; (file != NULL) && (k < 1000); k++)
+            {
+                fputc(0x5A, file);
+            }
+            if (file != NULL)
+            {
+                fclose(file);
+            }
+        }
+        else if (truncate(target, size / 2) < 0)
+        {
+            failure = "truncate failed";
+            break;
+        }
+
+        tftpd_stats_t before;
+        tftpd_stats_t after;
+        tftpd_get_stats(&before);
+        test_quiet(1);
+        int result = is_get ? tftp_get("127.0.0.1", port, 1428, name, TFTP_OPT_BASE | TFTP_OPT_RESUME)
+            : tftp_put("127.0.0.1", port, 1428, name, TFTP_OPT_BASE | TFTP_OPT_RESUME);
+        test_wait_server(before.sessions, &after);
+        test_quiet(0);
+
+        if (result < 0)
+        {
+            failure = "transfer failed";
+        }
+        else if (!test_compare(server_path, client_path))
+        {
+            failure = changed ? "changed file kept" : "content differs";
+        }
+    }
+
+    printf("%-4s resume get/put, partial and changed same-size file%s%s\n", failure ? "FAIL" : "ok", failure ? " -- " : "", failure ? failure : "");
+    unlink(server_path);
+    unlink(client_path);
+    return failure ? -1 : 0;
+}
+
+// netascii解码：随机切成小段依次解码，向量版本和逐字节版本的输出一样；输入里多放CR、LF和0，段的边界常落在CR后面
+static int test_netascii(void)
+{
+    static const uint8_t special[] = { '\r', '\r', '\n', 0 };
+    uint8_t in[TEST_NETASCII_SIZE];
+    uint8_t out[TEST_NETASCII_SIZE];
+    uint8_t expect[TEST_NETASCII_SIZE];
+    uint32_t state = 2463534242u;
+    int mismatches = 0;
+    for (int round = 0; round < TEST_NETASCII_ROUNDS; round++)
+    {
+        size_t size = 0;
+        for (; size < sizeof(in); size++)
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            in[size] = (state & 0x300) ? (uint8_t)(state >> 24) : special[state & 3];
+        }
+        size = state % sizeof(in) + 1;
+
+        int cr = 0;
+        int expect_cr = 0;
+        size_t out_size = 0;
+        size_t expect_size = 0;
+        for (size_t pos = 0; pos < size;)
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            size_t chunk = state % 40 + 1;
+            chunk = (chunk < size - pos) ? chunk : size - pos;
+            out_size += tftp_netascii_decode(in + pos, chunk, out + out_size, &cr);
+            expect_size += tftp_netascii_decode_scalar(in + pos, chunk, expect + expect_size, &expect_cr);
+            pos += chunk;
+        }
+        mismatches += (out_size != expect_size) || (cr != expect_cr) || (memcmp(out, expect, out_size) != 0);
+    }
+
+    printf("%-4s netascii decode simd vs scalar, %d random chunked inputs, %d differ\n", mismatches ? "FAIL" : "ok",
+        TEST_NETASCII_ROUNDS, mismatches);
+    return mismatches ? -1 : 0;
+}
+
+int main(int argc, char** argv)
+{
+    static const char* modes[] = { "thread", "event", "demux" };
+    int mode = -1;
+    for (int i = 0; (argc > 1) && (i < 3); i++)
+    {
+        if (strcmp(argv[1], modes[i]) == 0)
+        {
+            mode = i;
+        }
+    }
+    if (mode < 0)
+    {
+        printf("usage: tftp_test <thread|event|demux>\n");
+        return 2;
+    }
+
+    char server_dir[64];
+    char client_dir[64];
+    if (mkdtemp(test_dir) == NULL)
+    {
+        printf("FAIL mkdtemp\n");
+        return 1;
+    }
+    snprintf(server_dir, sizeof(server_dir), "%s/srv", test_dir);
+    snprintf(client_dir, sizeof(client_dir), "%s/cli", test_dir);
+    if ((mkdir(server_dir, 0755) < 0) || (mkdir(client_dir, 0755) < 0) || (chdir(client_dir) < 0))
+    {
+        printf("FAIL create %s\n", test_dir);
+        return 1;
+    }
+
+    uint16_t port = (uint16_t)(TEST_PORT + mode);
+    tftpd_config_t config;
+    tftpd_config_init(&config);
+    config.dir = server_dir;
+    config.port = port;
+    config.event_loop = (mode != 0);
+    config.demux_sockets = (mode == 2) ? 2 : 0;
+    config.request_filter = (mode == 2); // 各种选项组合的请求都不能被内核过滤器挡掉
+    tftp_set_window(TEST_WINDOW);
+
+    test_quiet(1);
+    int started = tftpd_start_config(&config);
+    usleep(100000);
+    test_quiet(0);
+    if (started < 0)
+    {
+        printf("FAIL start server on port %d\n", port);
+        return 1;
+    }
+
+    printf("loopback %s server, port %d\n", modes[mode], port);
+    int failures = 0;
+    int count = (int)(sizeof(test_cases) / sizeof(test_cases[0]));
+    for (int i = 0; i < count; i++)
+    {
+        failures += (test_run(test_cases + i, 1, port, i) < 0);
+        failures += (test_run(test_cases + i, 0, port, i) < 0);
+    }
+    failures += (test_cached(port, TFTP_OPT_BASE | TFTP_OPT_WINDOW) < 0);
+    failures += (test_cached(port, TFTP_OPT_BASE | TFTP_OPT_CHECKSUM) < 0);
+    failures += (test_cached(port, TFTP_OPT_BASE | TFTP_OPT_COMPRESS) < 0);
+    failures += (test_resume(port) < 0);
+    failures += (test_netascii() < 0);
+
+    chdir("/");
+    rmdir(client_dir);
+    rmdir(server_dir);
+    rmdir(test_dir);
+    printf("%d of %d transfers failed\n", failures, count * 2 + 5);
+    return failures ? 1 : 0;
+}
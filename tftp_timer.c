@@ -0,0 +1,194 @@
+#include "tftp_timer.h"
+#include <string.h>
+#include <time.h>
+
+#define WHEEL_MASK (TFTP_WHEEL_SLOTS - 1)
+#define WHEEL_SPAN(level) ((uint64_t)1 << (TFTP_WHEEL_BITS * (level)))
+
+uint64_t tftp_time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t tftp_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void tftp_wheel_init(tftp_wheel_t* wheel, uint64_t now)
+{
+    memset(wheel, 0, sizeof(tftp_wheel_t));
+    wheel->now = now;
+}
+
+void tftp_timer_init(tftp_timer_t* timer, void (*handler)(tftp_timer_t* timer), void* arg)
+{
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expire = 0;
+    timer->handler = handler;
+    timer->arg = arg;
+}
+
+// 按剩余时间选层：第n层的一个槽覆盖64^n毫秒，到点时再下放到低一层
+static void wheel_insert(tftp_wheel_t* wheel, tftp_timer_t* timer)
+{
+    uint64_t delta = timer->expire - wheel->now;
+    int level = 0;
+    while ((level < TFTP_WHEEL_LEVELS - 1) && (delta >= WHEEL_SPAN(level + 1)))
+    {
+        level++;
+    }
+
+    int index = (int)((timer->expire >> (TFTP_WHEEL_BITS * level)) & WHEEL_MASK);
+    tftp_timer_t** head = &wheel->slot[level][index];
+    timer->next = *head;
+    if (*head)
+    {
+        (*head)->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+    wheel->bitmap[level] |= (uint64_t)1 << index;
+}
+
+static void wheel_unlink(tftp_timer_t* timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next)
+    {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+// 把槽中的链表整个摘下挂到局部表头上，处理时回调里删除其他定时器也是安全的
+static void wheel_take(tftp_wheel_t* wheel, int level, int index, tftp_timer_t** list)
+{
+    *list = wheel->slot[level][index];
+    wheel->slot[level][index] = NULL;
+    wheel->bitmap[level] &= ~((uint64_t)1 << index);
+    if (*list)
+    {
+        (*list)->pprev = list;
+    }
+}
+
+void tftp_timer_add(tftp_wheel_t* wheel, tftp_timer_t* timer, uint64_t expire)
+{
+    if (timer->pprev)
+    {
+        tftp_timer_del(wheel, timer);
+    }
+
+    // 当前槽已经处理过，最早只能在下一个tick到期；超出范围的放在最高层，到点后重新计算
+    uint64_t max = wheel->now + WHEEL_SPAN(TFTP_WHEEL_LEVELS) - 1;
+    if (expire <= wheel->now)
+    {
+        expire = wheel->now + 1;
+    }
+    else if (expire > max)
+    {
+        expire = max;
+    }
+
+    timer->expire = expire;
+    wheel_insert(wheel, timer);
+    wheel->count++;
+}
+
+void tftp_timer_del(tftp_wheel_t* wheel, tftp_timer_t* timer)
+{
+    if (timer->pprev == NULL)
+    {
+        return;
+    }
+
+    // 槽空了也不清标记，处理到这个槽时再清
+    wheel_unlink(timer);
+    wheel->count--;
+}
+
+// 走到下一个tick: 低位回绕时先把高层对应的槽下放，再处理第0层的槽
+static void wheel_tick(tftp_wheel_t* wheel)
+{
+    uint64_t now = ++wheel->now;
+    tftp_timer_t* list;
+    for (int level = TFTP_WHEEL_LEVELS - 1; level > 0; level--)
+    {
+        if (now & (WHEEL_SPAN(level) - 1))
+        {
+            continue;
+        }
+
+        wheel_take(wheel, level, (int)((now >> (TFTP_WHEEL_BITS * level)) & WHEEL_MASK), &list);
+        while (list)
+        {
+            tftp_timer_t* timer = list;
+            wheel_unlink(timer);
+            wheel_insert(wheel, timer);
+        }
+    }
+
+    wheel_take(wheel, 0, (int)(now & WHEEL_MASK), &list);
+    while (list)
+    {
+        tftp_timer_t* timer = list;
+        wheel_unlink(timer);
+        wheel->count--;
+        timer->handler(timer);
+    }
+}
+
+// 下一个可能有事件的tick：第0层当前这一圈里下一个非空的槽，没有就到下一次回绕
+static uint64_t wheel_next(tftp_wheel_t* wheel)
+{
+    int index = (int)(wheel->now & WHEEL_MASK);
+    uint64_t later = (index == WHEEL_MASK) ? 0 : (wheel->bitmap[0] >> (index + 1)) << (index + 1);
+    if (later)
+    {
+        return (wheel->now & ~(uint64_t)WHEEL_MASK) + __builtin_ctzll(later);
+    }
+    return (wheel->now | WHEEL_MASK) + 1;
+}
+
+// 处理到now为止到期的定时器，空的区间直接跳过
+void tftp_wheel_advance(tftp_wheel_t* wheel, uint64_t now)
+{
+    while (wheel->now < now)
+    {
+        if (wheel->count == 0)
+        {
+            wheel->now = now;
+            break;
+        }
+
+        uint64_t next = wheel_next(wheel);
+        if (next > now)
+        {
+            wheel->now = now;
+            break;
+        }
+
+        wheel->now = next - 1;
+        wheel_tick(wheel);
+    }
+}
+
+// 距离下一个事件的毫秒数，给epoll_wait/poll用，没有定时器时返回-1
+int tftp_wheel_timeout(tftp_wheel_t* wheel)
+{
+    if (wheel->count == 0)
+    {
+        return -1;
+    }
+
+    uint64_t next = wheel_next(wheel);
+    uint64_t now = tftp_time_ms();
+    return (next > now) ? (int)(next - now) : 0;
+}
@@ -0,0 +1,39 @@
+#ifndef TFTP_TIMER_H
+#define TFTP_TIMER_H
+
+#include <stdint.h>
+
+// 分层时间轮，每层64个槽，1个tick为1毫秒，4层可以覆盖约4.6小时
+#define TFTP_WHEEL_BITS 6
+#define TFTP_WHEEL_SLOTS (1 << TFTP_WHEEL_BITS)
+#define TFTP_WHEEL_LEVELS 4
+
+typedef struct _tftp_timer_t
+{
+    struct _tftp_timer_t* next;
+    struct _tftp_timer_t** pprev; // 指向前一个节点的next，为NULL表示没有挂在时间轮上
+    uint64_t expire; // 到期时间，毫秒
+    void (*handler)(struct _tftp_timer_t* timer);
+    void* arg;
+}tftp_timer_t;
+
+typedef struct _tftp_wheel_t
+{
+    uint64_t now; // 已经处理到的时间，毫秒
+    int count;
+    uint64_t bitmap[TFTP_WHEEL_LEVELS]; // 非空的槽
+    tftp_timer_t* slot[TFTP_WHEEL_LEVELS][TFTP_WHEEL_SLOTS];
+}tftp_wheel_t;
+
+uint64_t tftp_time_ms(void);
+uint64_t tftp_time_us(void);
+
+void tftp_wheel_init(tftp_wheel_t* wheel, uint64_t now);
+void tftp_wheel_advance(tftp_wheel_t* wheel, uint64_t now);
+int tftp_wheel_timeout(tftp_wheel_t* wheel);
+
+void tftp_timer_init(tftp_timer_t* timer, void (*handler)(tftp_timer_t* timer), void* arg);
+void tftp_timer_add(tftp_wheel_t* wheel, tftp_timer_t* timer, uint64_t expire);
+void tftp_timer_del(tftp_wheel_t* wheel, tftp_timer_t* timer);
+
+#endif // !TFTP_TIMER_H
@@ -0,0 +1,202 @@
+#include "tftp_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+static int trace_events;
+static uint32_t trace_next_id;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static tftp_trace_t* trace_done; // 最近结束的会话，新的在前
+static int trace_done_count;
+
+static const char* trace_opcode_name(int opcode)
+{
+    static const char* names[] = { "?", "RRQ", "WRQ", "DATA", "ACK", "ERROR", "OACK" };
+    return ((opcode > 0) && (opcode < (int)(sizeof(names) / sizeof(names[0])))) ? names[opcode] : names[0];
+}
+
+void tftp_trace_enable(int events)
+{
+    int size = 0;
+    if (events > 0)
+    {
+        size = 1;
+        while (size < events)
+        {
+            size <<= 1;
+        }
+    }
+    __atomic_store_n(&trace_events, size, __ATOMIC_RELAXED);
+}
+
+tftp_trace_t* tftp_trace_start(void)
+{
+    int events = __atomic_load_n(&trace_events, __ATOMIC_RELAXED);
+    if (events == 0)
+    {
+        return NULL;
+    }
+
+    tftp_trace_t* trace = (tftp_trace_t*)malloc(sizeof(tftp_trace_t) + events * sizeof(tftp_trace_event_t));
+    if (trace == NULL)
+    {
+        return NULL;
+    }
+
+    trace->next = NULL;
+    trace->id = __atomic_add_fetch(&trace_next_id, 1, __ATOMIC_RELAXED);
+    trace->mask = (uint32_t)events - 1;
+    trace->count = 0;
+    trace->name[0] = '\0';
+    return trace;
+}
+
+void tftp_trace_set_name(tftp_trace_t* trace, const char* prefix, const char* filename)
+{
+    if (trace)
+    {
+        snprintf(trace->name, sizeof(trace->name), "%s %s", prefix, filename);
+    }
+}
+
+void tftp_trace_finish(tftp_trace_t* trace)
+{
+    if (trace == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    trace->next = trace_done;
+    trace_done = trace;
+    trace_done_count++;
+
+    tftp_trace_t* old = NULL;
+    if (trace_done_count > TFTP_TRACE_KEEP)
+    {
+        tftp_trace_t** last = &trace_done;
+        for (int i = 0; i < TFTP_TRACE_KEEP; i++)
+        {
+            last = &(*last)->next;
+        }
+        old = *last;
+        *last = NULL;
+        trace_done_count = TFTP_TRACE_KEEP;
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    while (old)
+    {
+        tftp_trace_t* next = old->next;
+        free(old);
+        old = next;
+    }
+}
+
+// 文件名来自请求，要转义
+static void trace_write_string(FILE* file, const char* text)
+{
+    fputc('"', file);
+    for (; *text; text++)
+    {
+        unsigned char c = (unsigned char)*text;
+        if ((c == '"') || (c == '\\'))
+        {
+            fprintf(file, "\\%c", c);
+        }
+        else if (c < 0x20)
+        {
+            fprintf(file, "\\u%04x", c);
+        }
+        else
+        {
+            fputc(c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+static void trace_write(FILE* file, const tftp_trace_t* trace, int* first)
+{
+    fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":", *first ? "" : ",", trace->id);
+    trace_write_string(file, trace->name);
+    fprintf(file, "}}");
+    *first = 0;
+
+    // 环满了以后只有最近的mask + 1个事件
+    uint64_t begin = (trace->count > (uint64_t)trace->mask + 1) ? trace->count - trace->mask - 1 : 0;
+    int io = 0;
+    for (uint64_t i = begin; i < trace->count; i++)
+    {
+        // 开始事件被覆盖掉的I/O不输出结束事件
+        const tftp_trace_event_t* event = &trace->events[i & trace->mask];
+        if ((event->type == TFTP_TRACE_READ_BEGIN) || (event->type == TFTP_TRACE_WRITE_BEGIN))
+        {
+            io = 1;
+        }
+        else if ((event->type == TFTP_TRACE_READ_END) || (event->type == TFTP_TRACE_WRITE_END))
+        {
+            if (!io)
+            {
+                continue;
+            }
+            io = 0;
+        }
+
+        fprintf(file, ",\n{\"pid\":1,\"tid\":%u,\"ts\":%llu,", trace->id, (unsigned long long)event->time_us);
+        switch (event->type)
+        {
+        case TFTP_TRACE_SEND:
+        case TFTP_TRACE_RECV:
+            fprintf(file, "\"name\":\"%s %s\",\"ph\":\"i\",\"s\":\"t\",\"args\":{\"block\":%u,\"size\":%u}}",
+                (event->type == TFTP_TRACE_SEND) ? "send" : "recv", trace_opcode_name(event->opcode), event->block, event->size);
+            break;
+        case TFTP_TRACE_TIMEOUT:
+        case TFTP_TRACE_RESEND:
+        case TFTP_TRACE_LOSS:
+            fprintf(file, "\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"cname\":\"terrible\"}",
+                (event->type == TFTP_TRACE_TIMEOUT) ? "timeout" : (event->type == TFTP_TRACE_RESEND) ? "resend" : "loss");
+            break;
+        case TFTP_TRACE_READ_BEGIN:
+        case TFTP_TRACE_WRITE_BEGIN:
+            fprintf(file, "\"name\":\"%s\",\"ph\":\"B\",\"args\":{\"size\":%u}}",
+                (event->type == TFTP_TRACE_READ_BEGIN) ? "read" : "write", event->size);
+            break;
+        default:
+            fprintf(file, "\"name\":\"%s\",\"ph\":\"E\",\"args\":{\"size\":%u}}",
+                (event->type == TFTP_TRACE_READ_END) ? "read" : "write", event->size);
+            break;
+        }
+    }
+}
+
+int tftp_trace_dump(const char* path)
+{
+    FILE* file = fopen(path, "w");
+    if (file == NULL)
+    {
+        printf("tftp: create trace %s failed\n", path);
+        return -1;
+    }
+
+    fprintf(file, "{\"traceEvents\":[");
+    int first = 1;
+    int count = 0;
+    pthread_mutex_lock(&trace_lock);
+    for (const tftp_trace_t* trace = trace_done; trace; trace = trace->next)
+    {
+        trace_write(file, trace, &first);
+        count++;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    if (fclose(file) != 0)
+    {
+        printf("tftp: write trace %s failed\n", path);
+        return -1;
+    }
+    printf("tftp: %d sessions written to %s\n", count, path);
+    return 0;
+}
@@ -0,0 +1,80 @@
+#ifndef TFTP_TRACE_H
+#define TFTP_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "tftp_timer.h"
+
+#define TFTP_TRACE_EVENTS 1024 // 默认每个会话保留最近的事件数，2的幂
+#define TFTP_TRACE_KEEP 64 // 保留最近结束的会话，导出时写出
+#define TFTP_TRACE_NAME_SIZE 96
+
+typedef enum _tftp_trace_type_t
+{
+    TFTP_TRACE_SEND = 0, // 发出一个包
+    TFTP_TRACE_RECV, // 收到一个包(包括被忽略的)
+    TFTP_TRACE_TIMEOUT,
+    TFTP_TRACE_RESEND,
+    TFTP_TRACE_LOSS, // 发送窗口因为重复ACK判定丢包
+    TFTP_TRACE_READ_BEGIN,
+    TFTP_TRACE_READ_END,
+    TFTP_TRACE_WRITE_BEGIN,
+    TFTP_TRACE_WRITE_END,
+}tftp_trace_type_t;
+
+typedef struct _tftp_trace_event_t
+{
+    uint64_t time_us;
+    uint32_t size;
+    uint16_t block;
+    uint8_t type;
+    uint8_t opcode;
+}tftp_trace_event_t;
+
+// 每个会话一个环，只有会话自己的线程写，满了覆盖最早的事件
+typedef struct _tftp_trace_t
+{
+    struct _tftp_trace_t* next;
+    uint32_t id;
+    uint32_t mask;
+    uint64_t count;
+    char name[TFTP_TRACE_NAME_SIZE];
+    tftp_trace_event_t events[];
+}tftp_trace_t;
+
+// events为0时关闭，之后开始的会话不再记录
+void tftp_trace_enable(int events);
+// 没有开启时返回NULL，所有记录函数对NULL什么都不做
+tftp_trace_t* tftp_trace_start(void);
+void tftp_trace_set_name(tftp_trace_t* trace, const char* prefix, const char* filename);
+// 会话结束，放进最近结束的列表
+void tftp_trace_finish(tftp_trace_t* trace);
+// 把最近结束的会话写成Chrome trace的JSON(chrome://tracing, ui.perfetto.dev)
+int tftp_trace_dump(const char* path);
+
+static inline void tftp_trace_event(tftp_trace_t* trace, int type, int opcode, uint16_t block, uint32_t size)
+{
+    if (trace)
+    {
+        tftp_trace_event_t* event = &trace->events[trace->count++ & trace->mask];
+        event->time_us = tftp_time_us();
+        event->size = size;
+        event->block = block;
+        event->type = (uint8_t)type;
+        event->opcode = (uint8_t)opcode;
+    }
+}
+
+// 从包头取出操作码，DATA和ACK再取出块号
+static inline void tftp_trace_packet(tftp_trace_t* trace, int type, const void* packet, size_t size)
+{
+    if (trace && (size >= 2))
+    {
+        const uint8_t* bytes = (const uint8_t*)packet;
+        int opcode = (bytes[0] << 8) | bytes[1];
+        uint16_t block = (((opcode == 3) || (opcode == 4)) && (size >= 4)) ? (uint16_t)((bytes[2] << 8) | bytes[3]) : 0;
+        tftp_trace_event(trace, type, opcode, block, (uint32_t)size);
+    }
+}
+
+#endif // !TFTP_TRACE_H
@@ -0,0 +1,264 @@
+#include "tftp_base.h"
+#include "tftp_timer.h"
+#include "tftp_arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+// 每个包按协商的块大小留空间，8字节对齐
+static size_t window_slot_size(int block_size)
+{
+    return ((size_t)(4 + block_size) + 7) & ~(size_t)7;
+}
+
+static tftp_packet_t* window_slot(tftp_window_t* window, int64_t block)
+{
+    return (tftp_packet_t*)(window->ring + (block % window->size) * window->slot_size);
+}
+
+size_t tftp_window_memory(int size, int block_size)
+{
+    return (size_t)size * (window_slot_size(block_size) + sizeof(int) + sizeof(uint64_t));
+}
+
+static void window_update_stats(tftp_t* tftp)
+{
+    tftp_window_t* window = tftp->window;
+    tftp->stats.cwnd = window->cwnd;
+    tftp->stats.ssthresh = window->ssthresh;
+    if (window->cwnd > tftp->stats.cwnd_max)
+    {
+        tftp->stats.cwnd_max = window->cwnd;
+    }
+}
+
+// 接收方的socket缓冲区要能放下一整个窗口，否则突发的块会被内核丢掉
+void tftp_window_buffer(tftp_t* tftp)
+{
+    // 内核按skb的实际占用计算，按包长的2倍估算
+    int size = tftp->window_size * (4 + tftp->block_size) * 2;
+    int curr = 0;
+    socklen_t len = sizeof(curr);
+    if ((getsockopt(tftp->socket, SOL_SOCKET, SO_RCVBUF, (void*)&curr, &len) == 0) && (curr >= size))
+    {
+        return;
+    }
+    setsockopt(tftp->socket, SOL_SOCKET, SO_RCVBUF, (const void*)&size, sizeof(size));
+}
+
+// 协商完成后开始按窗口发送，窗口为块1开始
+int tftp_window_start(tftp_t* tftp, tftp_window_t* window)
+{
+    int size = tftp->window_size;
+    if (size < 1)
+    {
+        size = 1;
+    }
+    else if (size > TFTP_WINDOW_MAX)
+    {
+        size = TFTP_WINDOW_MAX;
+    }
+
+    window->slot_size = window_slot_size(tftp->block_size);
+    window->ring = (uint8_t*)tftp_arena_alloc((size_t)size * window->slot_size);
+    window->ring_size = (int*)tftp_arena_alloc(size * sizeof(int));
+    window->ring_time = (uint64_t*)tftp_arena_alloc(size * sizeof(uint64_t));
+    if ((window->ring == NULL) || (window->ring_size == NULL) || (window->ring_time == NULL))
+    {
+        tftp_arena_free(window->ring);
+        tftp_arena_free(window->ring_size);
+        tftp_arena_free(window->ring_time);
+        printf("tftp: no memory for window %d\n", size);
+        return -1;
+    }
+
+    window->size = size;
+    window->base = 1;
+    window->next = 1;
+    window->high = 1;
+    window->last = 0;
+    window->recover = 0;
+    window->dupacks = 0;
+    window->cwnd = (size < TFTP_CC_INIT_CWND) ? size : TFTP_CC_INIT_CWND;
+    window->ssthresh = size;
+    window->progress_ms = tftp_time_ms();
+    tftp->window = window;
+    window_update_stats(tftp);
+    return 0;
+}
+
+void tftp_window_stop(tftp_t* tftp)
+{
+    tftp_window_t* window = tftp->window;
+    if (window == NULL)
+    {
+        return;
+    }
+
+    tftp_arena_free(window->ring);
+    tftp_arena_free(window->ring_size);
+    tftp_arena_free(window->ring_time);
+    window->ring = NULL;
+    window->ring_size = NULL;
+    window->ring_time = NULL;
+    tftp->window = NULL;
+}
+
+// 在拥塞窗口允许的范围内发送：先重发回退的块，再生成新块
+int tftp_window_send(tftp_t* tftp, tftp_produce_t produce, void* arg)
+{
+    tftp_window_t* window = tftp->window;
+    int limit = (window->cwnd < window->size) ? (int)window->cwnd : window->size;
+    if (limit < 1)
+    {
+        limit = 1;
+    }
+
+    while (window->next < window->base + limit)
+    {
+        if (window->last && (window->next > window->last))
+        {
+            break;
+        }
+
+        tftp_packet_t* pkt = window_slot(window, window->next);
+        int resend = window->next < window->high;
+        if (resend)
+        {
+            tftp->stats.retransmits++;
+        }
+        else
+        {
+            int last = 0;
+            int size = produce(arg, pkt->data.data, &last);
+            if (size < 0)
+            {
+                return -1;
+            }
+
+            pkt->opcode = htons(TFTP_PACKET_DATA);
+            pkt->data.block_num = htons((uint16_t)window->next);
+            window->ring_size[window->next % window->size] = 4 + size;
+            window->high = window->next + 1;
+            if (last)
+            {
+                window->last = window->next;
+            }
+            tftp->stats.blocks++;
+        }
+
+        if (tftp_send_packet(tftp, pkt, window->ring_size[window->next % window->size]) < 0)
+        {
+            return -1;
+        }
+        window->ring_time[window->next % window->size] = resend ? 0 : tftp->data_us;
+        window->next++;
+    }
+
+    return 0;
+}
+
+// 丢包：乘性减小窗口，从最早未确认的块开始重发
+static void window_loss(tftp_t* tftp, int timeout)
+{
+    tftp_window_t* window = tftp->window;
+    window->ssthresh = window->cwnd / 2;
+    if (window->ssthresh < 1)
+    {
+        window->ssthresh = 1;
+    }
+    window->cwnd = timeout ? 1 : window->ssthresh;
+    window->next = window->base;
+    window->recover = window->high;
+    window->dupacks = 0;
+    tftp->stats.loss_events++;
+    window_update_stats(tftp);
+    if (!timeout)
+    {
+        tftp_trace_event(tftp->trace, TFTP_TRACE_LOSS, 0, (uint16_t)window->base, 0);
+    }
+}
+
+// 处理累计确认，返回1表示最后一块已经被确认
+int tftp_window_ack(tftp_t* tftp, uint16_t block_num)
+{
+    tftp_window_t* window = tftp->window;
+    int64_t acked = (window->base - 1) + (int16_t)(block_num - (uint16_t)(window->base - 1));
+    if ((acked < window->base - 1) || (acked >= window->high))
+    {
+        return 0;
+    }
+
+    if (acked >= window->base)
+    {
+        uint64_t sent_us = window->ring_time[acked % window->size];
+        if (sent_us)
+        {
+            tftp_hist_record(tftp->side, TFTP_HIST_ACK_RTT, tftp_time_us() - sent_us);
+        }
+
+        // 慢启动时每个确认的块加1，拥塞避免时每个窗口加1，不超过协商的窗口
+        for (int64_t i = window->base; i <= acked; i++)
+        {
+            window->cwnd += (window->cwnd < window->ssthresh) ? 1 : 1 / window->cwnd;
+        }
+        if (window->cwnd > window->size)
+        {
+            window->cwnd = window->size;
+        }
+
+        window->base = acked + 1;
+        if (window->next < window->base)
+        {
+            window->next = window->base;
+        }
+        window->dupacks = 0;
+        window->progress_ms = tftp_time_ms();
+        window_update_stats(tftp);
+        return window->last && (window->base > window->last);
+    }
+
+    // 对方超时重发的ACK会让等待重新计时，一个超时周期都没有进展时按超时处理
+    if (tftp_time_ms() - window->progress_ms >= (uint64_t)tftp->tmo_sec * 1000)
+    {
+        tftp_trace_event(tftp->trace, TFTP_TRACE_TIMEOUT, 0, (uint16_t)window->base, 0);
+        tftp_window_timeout(tftp);
+        return 0;
+    }
+
+    // 重复ACK说明对方收到了乱序的块，回退期间网络里旧的块引起的不算
+    if ((window->base >= window->recover) && (++window->dupacks == TFTP_CC_DUPACKS))
+    {
+        window_loss(tftp, 0);
+    }
+    return 0;
+}
+
+// 超时：窗口降到1，只重发最早未确认的块，其余的随确认恢复
+int tftp_window_timeout(tftp_t* tftp)
+{
+    tftp_window_t* window = tftp->window;
+    tftp->stats.timeouts++;
+    window->progress_ms = tftp_time_ms();
+    window_loss(tftp, 1);
+    if (window->base >= window->high)
+    {
+        return 0;
+    }
+
+    tftp_packet_t* pkt = window_slot(window, window->base);
+    tftp->stats.retransmits++;
+    window->next = window->base + 1;
+    return tftp_send_packet(tftp, pkt, window->ring_size[window->base % window->size]);
+}
+
+void tftp_print_stats(tftp_t* tftp, const char* name)
+{
+    if (!(tftp->option & TFTP_OPT_WINDOW) || (tftp->stats.blocks == 0))
+    {
+        return;
+    }
+
+    printf("%s: window %d, cwnd %.1f (max %.1f, ssthresh %.1f), %u blocks, %u retransmits, %u loss events, %u timeouts\n",
+        name, tftp->window_size, tftp->stats.cwnd, tftp->stats.cwnd_max, tftp->stats.ssthresh,
+        tftp->stats.blocks, tftp->stats.retransmits, tftp->stats.loss_events, tftp->stats.timeouts);
+}
@@ -0,0 +1,47 @@
+#ifndef TFTP_WINDOW_H
+#define TFTP_WINDOW_H
+
+#include <stdint.h>
+
+#define TFTP_WINDOW_MAX 64 // aimdwindow选项的上限
+#define TFTP_DEFAULT_WINDOW 16
+#define TFTP_CC_INIT_CWND 2 // 初始拥塞窗口
+#define TFTP_CC_DUPACKS 3 // 连续这么多个重复ACK认为丢包
+
+// 会话的传输统计，发送方的拥塞控制状态也记在这里
+typedef struct _tftp_stats_t
+{
+    uint32_t blocks; // 发送的新数据块
+    uint32_t retransmits; // 重发的数据块，不按窗口发送时是重发的包
+    uint32_t loss_events; // 判定丢包的次数(重复ACK + 超时)
+    uint32_t timeouts;
+    uint32_t spin_hits; // 忙等期间收到的包，没有睡眠就拿到了
+    double cwnd; // 当前拥塞窗口，块
+    double cwnd_max;
+    double ssthresh;
+}tftp_stats_t;
+
+// 发送窗口：已发送未确认的包保存在环里，丢包时回退重发(go-back-N)
+// 块编号用64位的绝对编号，发送时再截成16位
+typedef struct _tftp_window_t
+{
+    int size; // 协商的窗口上限
+    size_t slot_size; // 环里每个包占的字节，按协商的块大小
+    uint8_t* ring; // size个包
+    int* ring_size;
+    uint64_t* ring_time; // 每块第一次发送的时间，重发过的为0
+    int64_t base; // 最早未确认的块
+    int64_t next; // 下一个要发送的块
+    int64_t high; // 已经生成过的块的下一个
+    int64_t last; // 最后一块，0表示还没读到
+    int64_t recover; // 丢包时的high，确认到这里之前不再统计重复ACK
+    int dupacks;
+    uint64_t progress_ms; // 最近一次确认推进窗口的时间
+    double cwnd;
+    double ssthresh;
+}tftp_window_t;
+
+// 生成一个新块的数据，返回数据长度，最后一块时设置*last
+typedef int (*tftp_produce_t)(void* arg, uint8_t* data, int* last);
+
+#endif // !TFTP_WINDOW_H
@@ -0,0 +1,334 @@
+#include "tftp_zip.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#define TFTP_ZCACHE_PATH_SIZE 256
+
+typedef enum _zcache_state_t
+{
+    ZCACHE_FREE = 0,
+    ZCACHE_COLD, // 只记录请求次数
+    ZCACHE_BUILDING, // 某个会话正在边发送边填充
+    ZCACHE_READY,
+}zcache_state_t;
+
+struct _tftp_zcache_t
+{
+    zcache_state_t state;
+    char path[TFTP_ZCACHE_PATH_SIZE];
+    int64_t size;
+    int64_t mtime;
+    int chunk;
+
+    uint32_t crc; // 整个文件原始数据的CRC32C
+    int hits;
+    int ref;
+    uint64_t last_use;
+
+    uint8_t* data; // 所有压缩块首尾相接
+    size_t data_size;
+    size_t data_capacity;
+    uint32_t* index; // 第i块在data中的偏移，共block_count + 1项
+    uint32_t block_count;
+    uint32_t index_capacity;
+};
+
+static tftp_zcache_t zcache_list[TFTP_ZCACHE_ENTRIES];
+static pthread_mutex_t zcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t zcache_clock;
+static size_t zcache_bytes;
+
+int tftp_zip_encode(uint8_t* out, size_t out_size, const uint8_t* raw, size_t raw_size)
+{
+    if (out_size < raw_size + TFTP_ZIP_HEADER_SIZE)
+    {
+        return -1;
+    }
+
+    // 压缩后没有变小就直接发送原始数据
+    uLongf size = (uLongf)(out_size - TFTP_ZIP_HEADER_SIZE);
+    int error = compress2(out + TFTP_ZIP_HEADER_SIZE, &size, raw, (uLong)raw_size, TFTP_ZIP_LEVEL);
+    if ((error == Z_OK) && (size < raw_size))
+    {
+        out[0] = TFTP_ZIP_DEFLATE;
+        return (int)size + TFTP_ZIP_HEADER_SIZE;
+    }
+
+    out[0] = TFTP_ZIP_STORED;
+    memcpy(out + TFTP_ZIP_HEADER_SIZE, raw, raw_size);
+    return (int)raw_size + TFTP_ZIP_HEADER_SIZE;
+}
+
+int tftp_zip_decode(uint8_t* raw, size_t raw_size, const uint8_t* in, size_t in_size)
+{
+    if (in_size < TFTP_ZIP_HEADER_SIZE)
+    {
+        return -1;
+    }
+
+    in_size -= TFTP_ZIP_HEADER_SIZE;
+    if (in[0] == TFTP_ZIP_STORED)
+    {
+        if (in_size > raw_size)
+        {
+            return -1;
+        }
+
+        memcpy(raw, in + TFTP_ZIP_HEADER_SIZE, in_size);
+        return (int)in_size;
+    }
+    else if (in[0] == TFTP_ZIP_DEFLATE)
+    {
+        uLongf size = (uLongf)raw_size;
+        if (uncompress(raw, &size, in + TFTP_ZIP_HEADER_SIZE, (uLong)in_size) != Z_OK)
+        {
+            printf("tftp: decompress block failed\n");
+            return -1;
+        }
+        return (int)size;
+    }
+
+    printf("tftp: unknown compress type %d\n", in[0]);
+    return -1;
+}
+
+static void zcache_release(tftp_zcache_t* cache)
+{
+    zcache_bytes -= cache->data_capacity + cache->index_capacity * sizeof(uint32_t);
+    free(cache->data);
+    free(cache->index);
+    cache->data = NULL;
+    cache->index = NULL;
+    cache->data_size = 0;
+    cache->data_capacity = 0;
+    cache->block_count = 0;
+    cache->index_capacity = 0;
+}
+
+// 找一个空闲的位置，或者淘汰最久没用过的
+static tftp_zcache_t* zcache_evict(tftp_zcache_t* except, int use_free)
+{
+    tftp_zcache_t* victim = NULL;
+    for (int i = 0; i < TFTP_ZCACHE_ENTRIES; i++)
+    {
+        tftp_zcache_t* cache = zcache_list + i;
+        if (cache->state == ZCACHE_FREE)
+        {
+            if (use_free)
+            {
+                return cache;
+            }
+            continue;
+        }
+
+        if ((cache == except) || cache->ref || (cache->state == ZCACHE_BUILDING))
+        {
+            continue;
+        }
+
+        if ((victim == NULL) || (cache->last_use < victim->last_use))
+        {
+            victim = cache;
+        }
+    }
+
+    if (victim)
+    {
+        zcache_release(victim);
+        victim->state = ZCACHE_FREE;
+    }
+    return victim;
+}
+
+tftp_zcache_t* tftp_zcache_open(const char* path, int64_t size, int64_t mtime, int chunk)
+{
+    if ((size > TFTP_ZCACHE_MAX_FILE) || (strlen(path) >= TFTP_ZCACHE_PATH_SIZE))
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&zcache_lock);
+    zcache_clock++;
+
+    tftp_zcache_t* found = NULL;
+    for (int i = 0; i < TFTP_ZCACHE_ENTRIES; i++)
+    {
+        tftp_zcache_t* cache = zcache_list + i;
+        if ((cache->state != ZCACHE_FREE) && (cache->chunk == chunk) && (strcmp(cache->path, path) == 0))
+        {
+            found = cache;
+            break;
+        }
+    }
+
+    // 文件变了，旧的缓存作废
+    if (found && ((found->size != size) || (found->mtime != mtime)))
+    {
+        if (found->ref || (found->state == ZCACHE_BUILDING))
+        {
+            pthread_mutex_unlock(&zcache_lock);
+            return NULL;
+        }
+
+        zcache_release(found);
+        found->state = ZCACHE_COLD;
+        found->size = size;
+        found->mtime = mtime;
+        found->hits = 0;
+    }
+
+    if (found == NULL)
+    {
+        found = zcache_evict(NULL, 1);
+        if (found == NULL)
+        {
+            pthread_mutex_unlock(&zcache_lock);
+            return NULL;
+        }
+
+        found->state = ZCACHE_COLD;
+        strcpy(found->path, path);
+        found->size = size;
+        found->mtime = mtime;
+        found->chunk = chunk;
+        found->hits = 0;
+        found->ref = 0;
+    }
+
+    found->hits++;
+    found->last_use = zcache_clock;
+
+    tftp_zcache_t* result = NULL;
+    if (found->state == ZCACHE_READY)
+    {
+        result = found;
+    }
+    else if ((found->state == ZCACHE_COLD) && (found->hits >= TFTP_ZCACHE_HOT))
+    {
+        // 调用者负责填充
+        found->state = ZCACHE_BUILDING;
+        result = found;
+    }
+
+    if (result)
+    {
+        result->ref++;
+    }
+    pthread_mutex_unlock(&zcache_lock);
+    return result;
+}
+
+int tftp_zcache_ready(tftp_zcache_t* cache)
+{
+    return cache->state == ZCACHE_READY;
+}
+
+int tftp_zcache_read(tftp_zcache_t* cache, uint32_t index, uint8_t* out, size_t out_size)
+{
+    if (index >= cache->block_count)
+    {
+        return -1;
+    }
+
+    size_t size = cache->index[index + 1] - cache->index[index];
+    if (size > out_size)
+    {
+        return -1;
+    }
+
+    memcpy(out, cache->data + cache->index[index], size);
+    return (int)size;
+}
+
+// 只有BUILDING状态的所有者会调用，不需要加锁；总大小在close时再检查
+int tftp_zcache_append(tftp_zcache_t* cache, const uint8_t* block, size_t size)
+{
+    if (cache->block_count + 2 > cache->index_capacity)
+    {
+        uint32_t capacity = cache->index_capacity ? cache->index_capacity * 2 : 64;
+        uint32_t* index = (uint32_t*)realloc(cache->index, capacity * sizeof(uint32_t));
+        if (index == NULL)
+        {
+            return -1;
+        }
+
+        pthread_mutex_lock(&zcache_lock);
+        zcache_bytes += (capacity - cache->index_capacity) * sizeof(uint32_t);
+        pthread_mutex_unlock(&zcache_lock);
+        cache->index = index;
+        cache->index_capacity = capacity;
+        cache->index[0] = 0;
+    }
+
+    if (cache->data_size + size > cache->data_capacity)
+    {
+        size_t capacity = cache->data_capacity ? cache->data_capacity * 2 : 64 * 1024;
+        while (capacity < cache->data_size + size)
+        {
+            capacity *= 2;
+        }
+
+        uint8_t* data = (uint8_t*)realloc(cache->data, capacity);
+        if (data == NULL)
+        {
+            return -1;
+        }
+
+        pthread_mutex_lock(&zcache_lock);
+        zcache_bytes += capacity - cache->data_capacity;
+        pthread_mutex_unlock(&zcache_lock);
+        cache->data = data;
+        cache->data_capacity = capacity;
+    }
+
+    memcpy(cache->data + cache->data_size, block, size);
+    cache->data_size += size;
+    cache->index[++cache->block_count] = (uint32_t)cache->data_size;
+    return 0;
+}
+
+void tftp_zcache_close(tftp_zcache_t* cache, int complete)
+{
+    pthread_mutex_lock(&zcache_lock);
+    if (cache->state == ZCACHE_BUILDING)
+    {
+        // 超出总大小时先淘汰别的缓存，还不够就放弃
+        while (complete && (zcache_bytes > TFTP_ZCACHE_MAX_BYTES))
+        {
+            tftp_zcache_t* victim = zcache_evict(cache, 0);
+            if (victim == NULL)
+            {
+                complete = 0;
+                break;
+            }
+        }
+
+        if (complete)
+        {
+            cache->state = ZCACHE_READY;
+            printf("tftpd: cached %s %u blocks, %zu bytes compressed\n",
+                cache->path, cache->block_count, cache->data_size);
+        }
+        else
+        {
+            zcache_release(cache);
+            cache->state = ZCACHE_COLD;
+        }
+    }
+
+    cache->ref--;
+    pthread_mutex_unlock(&zcache_lock);
+}
+
+void tftp_zcache_set_crc(tftp_zcache_t* cache, uint32_t crc)
+{
+    cache->crc = crc;
+}
+
+uint32_t tftp_zcache_crc(tftp_zcache_t* cache)
+{
+    return cache->crc;
+}
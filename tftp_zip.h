@@ -0,0 +1,32 @@
+#ifndef TFTP_ZIP_H
+#define TFTP_ZIP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// 压缩后每个DATA包的数据区: 1字节类型 + 内容
+#define TFTP_ZIP_STORED 0 // 原始数据
+#define TFTP_ZIP_DEFLATE 1 // zlib压缩过的数据
+#define TFTP_ZIP_HEADER_SIZE 1
+#define TFTP_ZIP_LEVEL 6
+
+#define TFTP_ZCACHE_ENTRIES 16 // 缓存的文件数
+#define TFTP_ZCACHE_HOT 2 // 请求次数达到后开始缓存
+#define TFTP_ZCACHE_MAX_FILE (16 * 1024 * 1024) // 单个文件的上限
+#define TFTP_ZCACHE_MAX_BYTES (64 * 1024 * 1024) // 缓存总大小的上限
+
+int tftp_zip_encode(uint8_t* out, size_t out_size, const uint8_t* raw, size_t raw_size);
+int tftp_zip_decode(uint8_t* raw, size_t raw_size, const uint8_t* in, size_t in_size);
+
+// 热点文件的预压缩块缓存，键为路径+大小+修改时间+块大小
+typedef struct _tftp_zcache_t tftp_zcache_t;
+
+tftp_zcache_t* tftp_zcache_open(const char* path, int64_t size, int64_t mtime, int chunk);
+int tftp_zcache_ready(tftp_zcache_t* cache);
+int tftp_zcache_read(tftp_zcache_t* cache, uint32_t index, uint8_t* out, size_t out_size);
+int tftp_zcache_append(tftp_zcache_t* cache, const uint8_t* block, size_t size);
+void tftp_zcache_close(tftp_zcache_t* cache, int complete);
+void tftp_zcache_set_crc(tftp_zcache_t* cache, uint32_t crc);
+uint32_t tftp_zcache_crc(tftp_zcache_t* cache);
+
+#endif // !TFTP_ZIP_H